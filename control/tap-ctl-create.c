@@ -30,7 +30,8 @@
 
 int
 tap_ctl_create(const char *params, char **devname, int flags, int parent_minor,
-		char *secondary, int timeout)
+		char *secondary, int timeout, int queue_depth, int max_request_size,
+		int cache_size, int prealloc, int prealloc_low, int lcache_size)
 {
 	int err, id, minor;
 
@@ -49,7 +50,8 @@ tap_ctl_create(const char *params, char **devname, int flags, int parent_minor,
 		goto destroy;
 
 	err = tap_ctl_open(id, minor, params, flags, parent_minor, secondary,
-			timeout);
+			timeout, queue_depth, max_request_size, cache_size,
+			prealloc, prealloc_low, lcache_size);
 	if (err)
 		goto detach;
 
@@ -28,9 +28,52 @@
 
 #include "tap-ctl.h"
 
+static int
+tap_ctl_tune(const int id, const int minor,
+	     int queue_depth, int max_request_size, int cache_size,
+	     int prealloc, int prealloc_low, int lcache_size)
+{
+	int err;
+	tapdisk_message_t message;
+
+	memset(&message, 0, sizeof(message));
+	message.type = TAPDISK_MESSAGE_TUNE;
+	message.cookie = minor;
+	message.u.tune.queue_depth = queue_depth;
+	message.u.tune.max_request_size = max_request_size;
+	message.u.tune.cache_size = cache_size;
+	message.u.tune.prealloc = prealloc;
+	message.u.tune.prealloc_low = prealloc_low;
+	message.u.tune.lcache_size = lcache_size;
+
+	err = tap_ctl_connect_send_and_receive(id, &message, NULL);
+	if (err)
+		return err;
+
+	switch (message.type) {
+	case TAPDISK_MESSAGE_TUNE_RSP:
+		err = -message.u.response.error;
+		if (err)
+			EPRINTF("tune failed, err %d\n", err);
+		break;
+	case TAPDISK_MESSAGE_ERROR:
+		err = -message.u.response.error;
+		EPRINTF("tune failed, err %d\n", err);
+		break;
+	default:
+		EPRINTF("got unexpected result '%s' from %d\n",
+			tapdisk_message_name(message.type), id);
+		err = EINVAL;
+	}
+
+	return err;
+}
+
 int
 tap_ctl_open(const int id, const int minor, const char *params, int flags,
-		const int prt_minor, const char *secondary, int timeout)
+		const int prt_minor, const char *secondary, int timeout,
+		int queue_depth, int max_request_size, int cache_size,
+		int prealloc, int prealloc_low, int lcache_size)
 {
 	int err;
 	tapdisk_message_t message;
@@ -60,6 +103,16 @@ tap_ctl_open(const int id, const int minor, const char *params, int flags,
 		}
 	}
 
+	/* NB. only when needed, default opens work with older tapdisks */
+	if (queue_depth || max_request_size || cache_size ||
+	    prealloc || prealloc_low || lcache_size) {
+		err = tap_ctl_tune(id, minor, queue_depth, max_request_size,
+				   cache_size, prealloc, prealloc_low,
+				   lcache_size);
+		if (err)
+			return err;
+	}
+
 	err = tap_ctl_connect_send_and_receive(id, &message, NULL);
 	if (err)
 		return err;
@@ -246,16 +246,24 @@ tap_cli_create_usage(FILE *stream)
 {
 	fprintf(stream, "usage: create <-a args> [-d device name] [-R readonly] "
 		"[-e <minor> stack on existing tapdisk for the parent chain] "
-		"[-r turn on read caching into leaf node] [-2 <path> "
+		"[-r turn on read caching into leaf node] "
+		"[-c read cache capacity in the leaf in MiB] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
-		"[-t request timeout in seconds]\n");
+		"[-t request timeout in seconds] [-q queue depth] "
+		"[-b max request size in KiB] "
+		"[-C cache size per image in KiB] "
+		"[-L load parent BATs on demand] "
+		"[-P <blocks>[,<low>] keep blocks preallocated in the leaf] "
+		"[-J journal leaf metadata updates] "
+		"[-W write back from the local leaf cache (llp)]\n");
 }
 
 static int
 tap_cli_create(int argc, char **argv)
 {
-	int c, err, flags, prt_minor, timeout;
+	int c, err, flags, prt_minor, timeout, depth, max_kb, cache_kb;
+	int pool, pool_low, lcache_mb;
 	char *args, *devname, *secondary;
 
 	args      = NULL;
@@ -264,9 +272,15 @@ tap_cli_create(int argc, char **argv)
 	prt_minor = -1;
 	flags     = 0;
 	timeout   = 0;
+	depth     = 0;
+	max_kb    = 0;
+	cache_kb  = 0;
+	pool      = 0;
+	pool_low  = 0;
+	lcache_mb = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:Rd:e:r2:st:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:Rd:e:rc:2:st:q:b:C:LP:JWh")) != -1) {
 		switch (c) {
 		case 'a':
 			args = optarg;
@@ -280,6 +294,9 @@ tap_cli_create(int argc, char **argv)
 		case 'r':
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
 			break;
+		case 'c':
+			lcache_mb = atoi(optarg);
+			break;
 		case 'e':
 			flags |= TAPDISK_MESSAGE_FLAG_REUSE_PRT;
 			prt_minor = atoi(optarg);
@@ -291,9 +308,31 @@ tap_cli_create(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'L':
+			flags |= TAPDISK_MESSAGE_FLAG_LAZY_BAT;
+			break;
+		case 'J':
+			flags |= TAPDISK_MESSAGE_FLAG_META_LOG;
+			break;
+		case 'W':
+			flags |= TAPDISK_MESSAGE_FLAG_WRITE_BACK;
+			break;
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			max_kb = atoi(optarg);
+			break;
+		case 'C':
+			cache_kb = atoi(optarg);
+			break;
+		case 'P':
+			if (sscanf(optarg, "%d,%d", &pool, &pool_low) < 1)
+				goto usage;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -306,7 +345,8 @@ tap_cli_create(int argc, char **argv)
 		goto usage;
 
 	err = tap_ctl_create(args, &devname, flags, prt_minor, secondary,
-			timeout);
+			timeout, depth, max_kb << 10, cache_kb << 10,
+			pool, pool_low, lcache_mb);
 	if (!err)
 		printf("%s\n", devname);
 
@@ -708,28 +748,42 @@ tap_cli_open_usage(FILE *stream)
 {
 	fprintf(stream, "usage: open <-p pid> <-m minor> <-a args> [-R readonly] "
 		"[-e <minor> stack on existing tapdisk for the parent chain] "
-		"[-r turn on read caching into leaf node] [-2 <path> "
+		"[-r turn on read caching into leaf node] "
+		"[-c read cache capacity in the leaf in MiB] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
-		"[-t request timeout in seconds]\n");
+		"[-t request timeout in seconds] [-q queue depth] "
+		"[-b max request size in KiB] "
+		"[-C cache size per image in KiB] "
+		"[-L load parent BATs on demand] "
+		"[-P <blocks>[,<low>] keep blocks preallocated in the leaf] "
+		"[-J journal leaf metadata updates] "
+		"[-W write back from the local leaf cache (llp)]\n");
 }
 
 static int
 tap_cli_open(int argc, char **argv)
 {
 	const char *args, *secondary;
-	int c, pid, minor, flags, prt_minor, timeout;
+	int c, pid, minor, flags, prt_minor, timeout, depth, max_kb, cache_kb;
+	int pool, pool_low, lcache_mb;
 
 	flags     = 0;
 	pid       = -1;
 	minor     = -1;
 	prt_minor = -1;
 	timeout   = 0;
+	depth     = 0;
+	max_kb    = 0;
+	cache_kb  = 0;
+	pool      = 0;
+	pool_low  = 0;
+	lcache_mb = 0;
 	args      = NULL;
 	secondary = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:Rm:p:e:r2:st:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:Rm:p:e:rc:2:st:q:b:C:LP:JWh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -746,6 +800,9 @@ tap_cli_open(int argc, char **argv)
 		case 'r':
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LCACHE;
 			break;
+		case 'c':
+			lcache_mb = atoi(optarg);
+			break;
 		case 'e':
 			flags |= TAPDISK_MESSAGE_FLAG_REUSE_PRT;
 			prt_minor = atoi(optarg);
@@ -757,9 +814,31 @@ tap_cli_open(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'L':
+			flags |= TAPDISK_MESSAGE_FLAG_LAZY_BAT;
+			break;
+		case 'J':
+			flags |= TAPDISK_MESSAGE_FLAG_META_LOG;
+			break;
+		case 'W':
+			flags |= TAPDISK_MESSAGE_FLAG_WRITE_BACK;
+			break;
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			max_kb = atoi(optarg);
+			break;
+		case 'C':
+			cache_kb = atoi(optarg);
+			break;
+		case 'P':
+			if (sscanf(optarg, "%d,%d", &pool, &pool_low) < 1)
+				goto usage;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -772,7 +851,8 @@ tap_cli_open(int argc, char **argv)
 		goto usage;
 
 	return tap_ctl_open(pid, minor, args, flags, prt_minor, secondary,
-			timeout);
+			timeout, depth, max_kb << 10, cache_kb << 10,
+			pool, pool_low, lcache_mb);
 
 usage:
 	tap_cli_open_usage(stderr);
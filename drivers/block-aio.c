@@ -33,8 +33,6 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 
-#define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
-
 struct tdaio_state;
 
 struct aio_request {
@@ -47,9 +45,10 @@ struct tdaio_state {
 	int                  fd;
 	td_driver_t         *driver;
 
+	int                  aio_max_count;
 	int                  aio_free_count;	
-	struct aio_request   aio_requests[MAX_AIO_REQS];
-	struct aio_request  *aio_free_list[MAX_AIO_REQS];
+	struct aio_request  *aio_requests;
+	struct aio_request **aio_free_list;
 };
 
 /*Get Image size, secsize*/
@@ -126,8 +125,19 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	memset(prv, 0, sizeof(struct tdaio_state));
 
-	prv->aio_free_count = MAX_AIO_REQS;
-	for (i = 0; i < MAX_AIO_REQS; i++)
+	prv->aio_max_count = tapdisk_driver_data_requests(driver);
+
+	prv->aio_requests  = calloc(prv->aio_max_count,
+				    sizeof(struct aio_request));
+	prv->aio_free_list = calloc(prv->aio_max_count,
+				    sizeof(struct aio_request *));
+	if (!prv->aio_requests || !prv->aio_free_list) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	prv->aio_free_count = prv->aio_max_count;
+	for (i = 0; i < prv->aio_max_count; i++)
 		prv->aio_free_list[i] = &prv->aio_requests[i];
 
 	/* Open the file */
@@ -158,8 +168,13 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
         prv->fd = fd;
+	td_register_file(fd);
 
 done:
+	if (ret) {
+		free(prv->aio_requests);
+		free(prv->aio_free_list);
+	}
 	return ret;	
 }
 
@@ -228,12 +243,65 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	uint64_t size, offset;
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv    = (struct tdaio_state *)driver->data;
+	size   = treq.secs * (uint64_t)driver->info.sector_size;
+	offset = treq.sec  * (uint64_t)driver->info.sector_size;
+
+	if (prv->aio_free_count == 0)
+		goto fail;
+
+	aio        = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq  = treq;
+	aio->state = prv;
+
+	td_prep_discard(&aio->tiocb, prv->fd, offset, size, tdaio_complete, aio);
+	td_queue_tiocb(driver, &aio->tiocb);
+
+	return;
+
+fail:
+	td_complete_request(treq, -EBUSY);
+}
+
+void tdaio_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv = (struct tdaio_state *)driver->data;
+
+	if (prv->aio_free_count == 0)
+		goto fail;
+
+	aio        = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq  = treq;
+	aio->state = prv;
+
+	td_prep_flush(&aio->tiocb, prv->fd, tdaio_complete, aio);
+	td_queue_tiocb(driver, &aio->tiocb);
+
+	return;
+
+fail:
+	td_complete_request(treq, -EBUSY);
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
+	td_unregister_file(prv->fd);
 	close(prv->fd);
 
+	free(prv->aio_requests);
+	free(prv->aio_free_list);
+
 	return 0;
 }
 
@@ -253,10 +321,10 @@ void tdaio_stats(td_driver_t *driver, td_stats_t *st)
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	int n_pending;
 
-	n_pending = MAX_AIO_REQS - prv->aio_free_count;
+	n_pending = prv->aio_max_count - prv->aio_free_count;
 
 	tapdisk_stats_field(st, "reqs", "{");
-	tapdisk_stats_field(st, "max", "lu", MAX_AIO_REQS);
+	tapdisk_stats_field(st, "max", "d", prv->aio_max_count);
 	tapdisk_stats_field(st, "pending", "d", n_pending);
 	tapdisk_stats_leave(st, '}');
 }
@@ -269,6 +337,8 @@ struct tap_disk tapdisk_aio = {
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_discard   = tdaio_queue_discard,
+	.td_queue_flush     = tdaio_queue_flush,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
@@ -19,17 +19,25 @@
 #include "config.h"
 #endif
 
+#include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
-#include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-server.h"
+
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -39,57 +47,174 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
-#define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
-#define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
-
-#define RADIX_TREE_NODE_SHIFT           9 /* 512B nodes */
+#define RADIX_TREE_NODE_SHIFT           9 /* 512 links per node */
 #define RADIX_TREE_NODE_SIZE            (1 << RADIX_TREE_NODE_SHIFT)
 #define RADIX_TREE_NODE_MASK            (RADIX_TREE_NODE_SIZE - 1)
 
-#define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
-
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
-#define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
+/*
+ * The cache works in pages of BLOCK_CACHE_PAGE_SIZE, which may be
+ * raised but not lowered below 4K. Misses are widened to whole pages.
+ */
+#define BLOCK_CACHE_PAGE_SHIFT          12 /* 4K pages */
+#define BLOCK_CACHE_PAGE_SIZE           (1 << BLOCK_CACHE_PAGE_SHIFT)
+#define BLOCK_CACHE_PAGE_SECS_SHIFT     (BLOCK_CACHE_PAGE_SHIFT - SECTOR_SHIFT)
+#define BLOCK_CACHE_PAGE_SECS           (1 << BLOCK_CACHE_PAGE_SECS_SHIFT)
+
+#define BLOCK_CACHE_DEFAULT_SIZE        (10 << 20) /* 10MB cache */
+#define BLOCK_CACHE_MIN_PAGES           64
+
+#define BLOCK_CACHE_SHM_MAGIC           0x6d68736568636474ULL /* tdcheshm */
+#define BLOCK_CACHE_SHM_VERSION         2
+#define BLOCK_CACHE_SHM_WAYS            8
+#define BLOCK_CACHE_SHM_ALIGN           (2 << 20)
+#define BLOCK_CACHE_SHM_HUGE_DIR        "/dev/hugepages"
+#define BLOCK_CACHE_SHM_DIR             "/dev/shm"
+#define BLOCK_CACHE_SHM_PREFIX          "tapdisk-cache-"
+#define BLOCK_CACHE_SHM_RETRIES         3
 
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
-typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
 
 typedef struct block_cache              block_cache_t;
+typedef struct block_cache_page         block_cache_page_t;
+typedef struct block_cache_leaf         block_cache_leaf_t;
+typedef struct block_cache_segment      block_cache_segment_t;
+typedef struct block_cache_store        block_cache_store_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
+typedef struct block_cache_shm          block_cache_shm_t;
+typedef struct block_cache_shm_header   block_cache_shm_header_t;
+typedef struct block_cache_shm_set      block_cache_shm_set_t;
 
-struct radix_tree_page {
+/*
+ * Page data is kept once per process, in a store keyed by content.
+ * Each cache indexes its image by page, the leaves of its radix tree
+ * pointing into the store, so identical pages read through different
+ * images, or different parts of one, share a single copy.
+ *
+ * A store page is free while no leaf points to it. Evicting a page
+ * unlinks every leaf sharing it.
+ */
+struct block_cache_page {
+	uint64_t                        hash[2];
 	char                           *buf;
-	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
+	int                             referenced;
+	int                             refs;
+	block_cache_leaf_t             *leaves;
+	block_cache_page_t             *hnext;
 };
 
-struct radix_tree_leaf {
-	radix_tree_page_t              *page;
-	char                           *buf;
+struct block_cache_leaf {
+	block_cache_page_t             *page;
+	block_cache_leaf_t             *next;
+	radix_tree_t                   *tree;
+	radix_tree_node_t              *node;
+	uint64_t                        key;
+};
+
+/*
+ * Every open cache adds a segment of pages, sized by its memory
+ * budget, to the store. Eviction sweeps all segments.
+ */
+struct block_cache_segment {
+	block_cache_t                  *cache;
+	char                           *pool;
+	block_cache_page_t             *pages;
+	uint32_t                        n_pages;
+	uint32_t                        used;
+	struct list_head                next;
+};
+
+struct block_cache_store {
+	pthread_mutex_t                 lock;
+	struct list_head                segments;
+
+	block_cache_segment_t          *hand_segment;
+	uint32_t                        hand;
+
+	block_cache_page_t            **buckets;
+	uint32_t                        n_buckets;
+
+	uint64_t                        pages;
+	uint64_t                        used;
+	uint64_t                        logical;
+	uint64_t                        evictions;
+};
+
+/*
+ * A segment shared by every tapdisk on the host caching the same
+ * parent, found by a name derived from the parent's identity, which
+ * the header repeats. It is set associative: a page can only live in
+ * the ways of the set its number hashes to, and each set evicts by
+ * CLOCK on its own.
+ *
+ * Lookups take no lock. Each way has a sequence count, odd while an
+ * insert rewrites it; readers copy the page out and retry nothing,
+ * treating any change of the count as a miss.
+ *
+ * Every tapdisk attached holds a shared flock on the segment file, so
+ * whoever gets it exclusively is alone, also after others crashed.
+ */
+struct block_cache_shm_header {
+	uint64_t                        magic;
+	uint32_t                        version;
+	uint32_t                        page_size;
+	uint64_t                        sectors;
+	uint64_t                        size;
+	uint32_t                        n_sets;
+	uint32_t                        ways;
+	uuid_t                          uuid;
+	uint32_t                        timestamp;
+	uint32_t                        pad;
+	uint64_t                        inserts;
+	uint64_t                        evictions;
+};
+
+struct block_cache_shm_way {
+	uint64_t                        seq;
+	uint64_t                        key;  /* page + 1, 0 if empty */
+	uint32_t                        ref;
+	uint32_t                        pad;
+};
+
+struct block_cache_shm_set {
+	uint32_t                        hand;
+	uint32_t                        pad;
+	struct block_cache_shm_way      ways[BLOCK_CACHE_SHM_WAYS];
+};
+
+struct block_cache_shm {
+	char                           *path;
+	int                             fd;
+	void                           *map;
+	size_t                          size;
+	block_cache_shm_header_t       *header;
+	block_cache_shm_set_t          *sets;
+	char                           *data;
+
+	uint64_t                        hits;
+	uint64_t                        misses;
+	uint64_t                        inserts;
 };
 
 struct radix_tree_link {
-	uint32_t                        time;
 	union {
 		radix_tree_node_t      *next;
-		radix_tree_leaf_t       leaf;
+		block_cache_leaf_t     *leaf;
 	} u;
 };
 
 struct radix_tree_node {
 	int                             height;
+	int                             count;
+	int                             idx;
+	radix_tree_node_t              *parent;
 	radix_tree_link_t               links[RADIX_TREE_NODE_SIZE];
 };
 
 struct radix_tree {
 	int                             height;
-	uint64_t                        size;
 	uint32_t                        nodes;
 	radix_tree_node_t              *root;
 
@@ -99,7 +224,9 @@ struct radix_tree {
 struct block_cache_request {
 	int                             err;
 	char                           *buf;
+	uint64_t                        sec;
 	uint64_t                        secs;
+	uint64_t                        pages;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
 };
@@ -108,7 +235,12 @@ struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
-	uint64_t                        prunes;
+	uint64_t                        uncached;
+	uint64_t                        inserts;
+	uint64_t                        dedups;
+	uint64_t                        copies;
+	uint64_t                        direct;
+	uint64_t                        staged;
 };
 
 struct block_cache {
@@ -117,17 +249,30 @@ struct block_cache {
 
 	uint64_t                        sectors;
 
-	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
-	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
+	block_cache_request_t          *requests;
+	block_cache_request_t         **request_free_list;
 	int                             requests_free;
 
-	event_id_t                      timeout_id;
-
 	radix_tree_t                    tree;
+	block_cache_segment_t          *segment;
+	block_cache_shm_t               shm;
+
+	/* staging buffers for unaligned misses, a fixed I/O buffer */
+	char                           *stage;
+	size_t                          stage_size;
+	char                          **stage_free_list;
+	int                             stage_free;
+	int                             stage_slots;
+	int                             stage_registered;
 
 	block_cache_stats_t             stats;
 };
 
+static block_cache_store_t block_cache_store = {
+	.lock     = PTHREAD_MUTEX_INITIALIZER,
+	.segments = LIST_HEAD_INIT(block_cache_store.segments),
+};
+
 static inline uint64_t
 radix_tree_calculate_size(int height)
 {
@@ -136,23 +281,23 @@ radix_tree_calculate_size(int height)
 }
 
 static inline int
-radix_tree_calculate_height(uint64_t sectors)
+radix_tree_calculate_height(uint64_t keys)
 {
 	int height;
 	uint64_t tree_size;
 
-	height = 1;  /* always allocate root node */
+	height = 0;  /* the root alone holds RADIX_TREE_NODE_SIZE leaves */
 	tree_size = radix_tree_calculate_size(height);
-	while (sectors > tree_size)
+	while (keys > tree_size)
 		tree_size = radix_tree_calculate_size(++height);
 
 	return height;
 }
 
 static inline int
-radix_tree_index(radix_tree_node_t *node, uint64_t sector)
+radix_tree_index(radix_tree_node_t *node, uint64_t key)
 {
-	return ((sector >> (node->height * RADIX_TREE_NODE_SHIFT)) &
+	return ((key >> (node->height * RADIX_TREE_NODE_SHIFT)) &
 		RADIX_TREE_NODE_MASK);
 }
 
@@ -168,19 +313,6 @@ radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
 	return (node->height == tree->height);
 }
 
-static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
-{
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
-}
-
-static inline void
-radix_tree_clear_link(radix_tree_link_t *link)
-{
-	if (link)
-		memset(link, 0, sizeof(radix_tree_link_t));
-}
-
 static inline radix_tree_node_t *
 radix_tree_allocate_node(radix_tree_t *tree, int height)
 {
@@ -197,9 +329,21 @@ radix_tree_allocate_node(radix_tree_t *tree, int height)
 }
 
 static inline radix_tree_node_t *
-radix_tree_allocate_child_node(radix_tree_t *tree, radix_tree_node_t *parent)
+radix_tree_allocate_child_node(radix_tree_t *tree,
+			       radix_tree_node_t *parent, int idx)
 {
-	return radix_tree_allocate_node(tree, parent->height - 1);
+	radix_tree_node_t *node;
+
+	node = radix_tree_allocate_node(tree, parent->height - 1);
+	if (!node)
+		return NULL;
+
+	node->parent = parent;
+	node->idx    = idx;
+	parent->links[idx].u.next = node;
+	parent->count++;
+
+	return node;
 }
 
 void
@@ -212,168 +356,473 @@ radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
 	tree->nodes--;
 }
 
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+static radix_tree_node_t *
+radix_tree_find_leaf_node(radix_tree_t *tree, uint64_t key)
+{
+	radix_tree_node_t *node;
+
+	node = tree->root;
+
+	while (!radix_tree_node_contains_leaves(tree, node)) {
+		node = node->links[radix_tree_index(node, key)].u.next;
+		if (!node)
+			return NULL;
+	}
+
+	return node;
+}
+
+static block_cache_leaf_t *
+radix_tree_find_leaf(radix_tree_t *tree, uint64_t key)
 {
-	radix_tree_page_t *page;
+	radix_tree_node_t *node;
 
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
+	node = radix_tree_find_leaf_node(tree, key);
+	if (!node)
 		return NULL;
 
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
+	return node->links[radix_tree_index(node, key)].u.leaf;
+}
 
-	return page;
+static int
+radix_tree_add_leaf(radix_tree_t *tree, block_cache_leaf_t *leaf)
+{
+	int idx;
+	radix_tree_link_t *link;
+	radix_tree_node_t *node;
+
+	node = tree->root;
+
+	do {
+		idx  = radix_tree_index(node, leaf->key);
+		link = node->links + idx;
+
+		if (radix_tree_node_contains_leaves(tree, node)) {
+			if (link->u.leaf)
+				return -EEXIST;
+
+			link->u.leaf = leaf;
+			node->count++;
+
+			leaf->tree = tree;
+			leaf->node = node;
+			return 0;
+		}
+
+		if (!link->u.next &&
+		    !radix_tree_allocate_child_node(tree, node, idx))
+			return -ENOMEM;
+
+		node = link->u.next;
+	} while (1);
 }
 
-static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
+/*
+ * unlink a leaf, and free any node left empty on the way up.
+ */
+static void
+radix_tree_remove_leaf(radix_tree_t *tree, block_cache_leaf_t *leaf)
 {
-	int i;
+	radix_tree_node_t *node, *parent;
+
+	node = leaf->node;
+	node->links[radix_tree_index(node, leaf->key)].u.leaf = NULL;
+	node->count--;
+
+	while (!node->count && !radix_tree_node_is_root(tree, node)) {
+		parent = node->parent;
+		parent->links[node->idx].u.next = NULL;
+		parent->count--;
+
+		radix_tree_free_node(tree, node);
+		node = parent;
+	}
+}
 
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
+static inline int
+radix_tree_initialize(radix_tree_t *tree, uint64_t keys)
+{
+	tree->height = radix_tree_calculate_height(keys);
+	tree->root   = radix_tree_allocate_node(tree, tree->height);
+	if (!tree->root)
+		return -ENOMEM;
 
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	return 0;
 }
 
 /*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
+ * 128-bit MurmurHash3 of a page. Pages with equal hashes are still
+ * compared before they are shared.
  */
+static inline uint64_t
+block_cache_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+block_cache_fmix(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
 static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
+block_cache_hash(const char *buf, uint64_t hash[2])
 {
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	const uint64_t *data = (const uint64_t *)buf;
+	uint64_t h1, h2, k1, k2;
 	int i;
 
-	if (!page)
+	h1 = h2 = 0;
+
+	for (i = 0; i < BLOCK_CACHE_PAGE_SIZE / sizeof(uint64_t); i += 2) {
+		k1 = data[i];
+		k2 = data[i + 1];
+
+		k1 *= c1; k1 = block_cache_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = block_cache_rotl(h1, 27); h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2; k2 = block_cache_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = block_cache_rotl(h2, 31); h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	h1 ^= BLOCK_CACHE_PAGE_SIZE;
+	h2 ^= BLOCK_CACHE_PAGE_SIZE;
+
+	h1 += h2;
+	h2 += h1;
+
+	h1 = block_cache_fmix(h1);
+	h2 = block_cache_fmix(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	hash[0] = h1;
+	hash[1] = h2;
+}
+
+/*
+ * store. everything below runs with the store locked.
+ */
+
+static inline block_cache_page_t **
+block_cache_store_bucket(block_cache_store_t *store, const uint64_t hash[2])
+{
+	return &store->buckets[hash[0] & (store->n_buckets - 1)];
+}
+
+static block_cache_page_t *
+block_cache_store_find(block_cache_store_t *store,
+		       const uint64_t hash[2], const char *buf)
+{
+	block_cache_page_t *page;
+
+	if (!store->buckets)
+		return NULL;
+
+	for (page = *block_cache_store_bucket(store, hash);
+	     page; page = page->hnext)
+		if (page->hash[0] == hash[0] && page->hash[1] == hash[1] &&
+		    !memcmp(page->buf, buf, BLOCK_CACHE_PAGE_SIZE))
+			return page;
+
+	return NULL;
+}
+
+static void
+block_cache_store_hash_page(block_cache_store_t *store,
+			    block_cache_page_t *page)
+{
+	block_cache_page_t **bucket;
+
+	if (!store->buckets)
+		return;
+
+	bucket      = block_cache_store_bucket(store, page->hash);
+	page->hnext = *bucket;
+	*bucket     = page;
+}
+
+static void
+block_cache_store_unhash_page(block_cache_store_t *store,
+			      block_cache_page_t *page)
+{
+	block_cache_page_t **p;
+
+	if (!store->buckets)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
+	for (p = block_cache_store_bucket(store, page->hash);
+	     *p; p = &(*p)->hnext)
+		if (*p == page) {
+			*p = page->hnext;
+			break;
+		}
 
-	radix_tree_free_page(tree, page);
+	page->hnext = NULL;
 }
 
+/*
+ * keep about one bucket per page as segments come and go.
+ */
 static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
+block_cache_store_rehash(block_cache_store_t *store)
 {
-	int i;
+	block_cache_page_t **buckets, **old;
+	block_cache_segment_t *segment;
+	uint32_t i, n;
 
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
+	for (n = 1; n < store->pages; n <<= 1)
+		;
+
+	if (n == store->n_buckets)
 		return;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
-			continue;
+	buckets = calloc(n, sizeof(block_cache_page_t *));
+	if (!buckets)
+		return;
+
+	old              = store->buckets;
+	store->buckets   = buckets;
+	store->n_buckets = n;
+	free(old);
+
+	list_for_each_entry(segment, &store->segments, next)
+		for (i = 0; i < segment->used; i++)
+			if (segment->pages[i].leaves)
+				block_cache_store_hash_page(store,
+							    &segment->pages[i]);
+}
+
+static void
+block_cache_store_free_page(block_cache_store_t *store,
+			    block_cache_page_t *page)
+{
+	block_cache_store_unhash_page(store, page);
+	page->leaves     = NULL;
+	page->refs       = 0;
+	page->referenced = 0;
+	store->used--;
+}
 
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
+static void
+block_cache_store_evict_page(block_cache_store_t *store,
+			     block_cache_page_t *page)
+{
+	block_cache_leaf_t *leaf, *next;
 
-		break;
+	for (leaf = page->leaves; leaf; leaf = next) {
+		next = leaf->next;
+		radix_tree_remove_leaf(leaf->tree, leaf);
+		free(leaf);
 	}
+
+	store->logical -= page->refs;
+	store->evictions++;
+	block_cache_store_free_page(store, page);
 }
 
-static char *
-radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
+static void
+block_cache_store_advance_hand(block_cache_store_t *store)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
+	block_cache_segment_t *segment = store->hand_segment;
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	if (++store->hand < segment->n_pages)
+		return;
 
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+	store->hand = 0;
+	if (segment->next.next == &store->segments)
+		store->hand_segment = list_entry(store->segments.next,
+						 block_cache_segment_t, next);
+	else
+		store->hand_segment = list_entry(segment->next.next,
+						 block_cache_segment_t, next);
+}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+/*
+ * Fresh slots first, in order, then CLOCK over all segments: pages
+ * hit since the hand last passed get a second chance.
+ */
+static block_cache_page_t *
+block_cache_store_get_page(block_cache_store_t *store)
+{
+	block_cache_segment_t *segment;
+	block_cache_page_t *page;
 
-		if (!link->u.next)
-			return NULL;
+	list_for_each_entry(segment, &store->segments, next)
+		if (segment->used < segment->n_pages)
+			return &segment->pages[segment->used++];
 
-		node = link->u.next;
+	if (!store->hand_segment)
+		return NULL;
+
+	do {
+		page = &store->hand_segment->pages[store->hand];
+		block_cache_store_advance_hand(store);
+
+		if (!page->leaves)
+			return page;
+
+		if (page->referenced)
+			page->referenced = 0;
+		else
+			break;
 	} while (1);
+
+	block_cache_store_evict_page(store, page);
+
+	return page;
 }
 
-static char *
-radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
+static int
+block_cache_store_link(block_cache_store_t *store, block_cache_t *cache,
+		       uint64_t key, block_cache_page_t *page)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
+	block_cache_leaf_t *leaf;
+	int err;
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	leaf = calloc(1, sizeof(*leaf));
+	if (!leaf)
+		return -ENOMEM;
 
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+	leaf->key  = key;
+	leaf->page = page;
 
-		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
-		}
+	err = radix_tree_add_leaf(&cache->tree, leaf);
+	if (err) {
+		free(leaf);
+		return err;
+	}
+
+	leaf->next   = page->leaves;
+	page->leaves = leaf;
+	page->refs++;
+	store->logical++;
+
+	return 0;
+}
+
+static void
+block_cache_store_unlink(block_cache_store_t *store, block_cache_leaf_t *leaf)
+{
+	block_cache_page_t *page = leaf->page;
+	block_cache_leaf_t **p;
 
-		if (!link->u.next) {
-			link->u.next = radix_tree_allocate_child_node(tree,
-								      node);
-			if (!link->u.next)
-				return NULL;
+	for (p = &page->leaves; *p; p = &(*p)->next)
+		if (*p == leaf) {
+			*p = leaf->next;
+			break;
 		}
 
-		node = link->u.next;
-	} while (1);
+	page->refs--;
+	store->logical--;
+
+	if (!page->leaves)
+		block_cache_store_free_page(store, page);
 }
 
 static int
-radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
+block_cache_store_add_segment(block_cache_store_t *store,
+			      block_cache_t *cache, size_t budget)
 {
-	int i;
-	radix_tree_page_t *page;
+	block_cache_segment_t *segment;
+	uint32_t i, n;
+	void *pool;
+	int err;
 
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
+	if (!budget)
+		budget = BLOCK_CACHE_DEFAULT_SIZE;
+
+	n = MAX(budget >> BLOCK_CACHE_PAGE_SHIFT, BLOCK_CACHE_MIN_PAGES);
+
+	segment = calloc(1, sizeof(*segment));
+	if (!segment)
 		return -ENOMEM;
 
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, (i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
+	segment->pages = calloc(n, sizeof(block_cache_page_t));
+	if (!segment->pages) {
+		free(segment);
+		return -ENOMEM;
+	}
+
+	err = posix_memalign(&pool, BLOCK_CACHE_PAGE_SIZE,
+			     (size_t)n << BLOCK_CACHE_PAGE_SHIFT);
+	if (err) {
+		free(segment->pages);
+		free(segment);
+		return -err;
+	}
+
+	segment->cache   = cache;
+	segment->pool    = pool;
+	segment->n_pages = n;
+
+	for (i = 0; i < n; i++)
+		segment->pages[i].buf = segment->pool +
+			((size_t)i << BLOCK_CACHE_PAGE_SHIFT);
+
+	list_add_tail(&segment->next, &store->segments);
+	store->pages += n;
+
+	if (!store->hand_segment) {
+		store->hand_segment = segment;
+		store->hand         = 0;
+	}
+
+	block_cache_store_rehash(store);
+	cache->segment = segment;
 
 	return 0;
+}
 
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
+/*
+ * pages of the segment still shared with other caches go with it.
+ */
+static void
+block_cache_store_remove_segment(block_cache_store_t *store,
+				 block_cache_segment_t *segment)
+{
+	uint32_t i;
+
+	for (i = 0; i < segment->used; i++)
+		if (segment->pages[i].leaves)
+			block_cache_store_evict_page(store,
+						     &segment->pages[i]);
+
+	if (store->hand_segment == segment) {
+		store->hand = segment->n_pages - 1;
+		block_cache_store_advance_hand(store);
+	}
+
+	list_del(&segment->next);
+	store->pages -= segment->n_pages;
+
+	if (store->hand_segment == segment)
+		store->hand_segment = NULL;
+
+	block_cache_store_rehash(store);
+
+	free(segment->pages);
+	free(segment->pool);
+	free(segment);
 }
 
 static void
-radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
+block_cache_delete_branch(block_cache_t *cache, radix_tree_node_t *node)
 {
-	int i;
+	radix_tree_t *tree = &cache->tree;
 	radix_tree_link_t *link;
+	int i;
 
 	if (!node)
 		return;
@@ -381,117 +830,521 @@ radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
 	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
 		link = node->links + i;
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		if (radix_tree_node_contains_leaves(tree, node)) {
+			if (link->u.leaf) {
+				block_cache_store_unlink(&block_cache_store,
+							 link->u.leaf);
+				free(link->u.leaf);
+			}
+		} else
+			block_cache_delete_branch(cache, link->u.next);
 
-		radix_tree_clear_link(link);
+		link->u.next = NULL;
 	}
 
 	radix_tree_free_node(tree, node);
 }
 
-static inline void
-radix_tree_destroy(radix_tree_t *tree)
+static void
+block_cache_free_tree(block_cache_t *cache)
 {
-	radix_tree_delete_branch(tree, tree->root);
-	tree->root = NULL;
+	block_cache_delete_branch(cache, cache->tree.root);
+	cache->tree.root = NULL;
 }
 
 /*
- * returns 1 if @node is empty after pruning, 0 otherwise
+ * Look up pages in ascending order, descending the tree only once
+ * per leaf node. @node carries the leaf node between calls, and must
+ * not be kept across anything which may evict.
  */
-static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+static inline block_cache_leaf_t *
+block_cache_lookup(block_cache_t *cache, radix_tree_node_t **node,
+		   uint64_t idx)
 {
-	int i, empty;
-	radix_tree_link_t *link;
+	if (!*node || !(idx & RADIX_TREE_NODE_MASK))
+		*node = radix_tree_find_leaf_node(&cache->tree, idx);
 
-	empty = 1;
-	if (!node)
-		return empty;
+	if (!*node)
+		return NULL;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	return (*node)->links[idx & RADIX_TREE_NODE_MASK].u.leaf;
+}
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
-			}
+/*
+ * Index @n pages read into @buf, storing those the store does not
+ * hold yet.
+ */
+static void
+block_cache_insert(block_cache_t *cache, uint64_t idx,
+		   const char *buf, uint64_t n)
+{
+	block_cache_store_t *store = &block_cache_store;
+	block_cache_page_t *page;
+	uint64_t i, hash[2];
+	int new;
+
+	for (i = 0; i < n; i++, buf += BLOCK_CACHE_PAGE_SIZE) {
+		if (radix_tree_find_leaf(&cache->tree, idx + i))
+			continue;
+
+		block_cache_hash(buf, hash);
+
+		page = block_cache_store_find(store, hash, buf);
+		new  = !page;
+
+		if (new) {
+			page = block_cache_store_get_page(store);
+			if (!page)
+				break;
+
+			memcpy(page->buf, buf, BLOCK_CACHE_PAGE_SIZE);
+			page->hash[0]    = hash[0];
+			page->hash[1]    = hash[1];
+			page->referenced = 0;
+		}
+
+		if (block_cache_store_link(store, cache, idx + i, page))
+			continue;
+
+		DBG("%s: populating page 0x%08"PRIx64", hash: 0x%016"PRIx64
+		    "%016"PRIx64"%s\n", cache->name, idx + i,
+		    hash[0], hash[1], new ? "" : " (shared)");
+
+		if (new) {
+			block_cache_store_hash_page(store, page);
+			store->used++;
+		} else
+			cache->stats.dedups++;
+
+		cache->stats.inserts++;
+	}
+}
+
+/*
+ * shared segment
+ */
+
+static inline block_cache_shm_set_t *
+block_cache_shm_set(block_cache_shm_t *shm, uint64_t idx)
+{
+	uint64_t h = block_cache_fmix(idx + 1);
+
+	return &shm->sets[h & (shm->header->n_sets - 1)];
+}
+
+static inline char *
+block_cache_shm_page(block_cache_shm_t *shm,
+		     block_cache_shm_set_t *set, int way)
+{
+	size_t slot = (size_t)(set - shm->sets) * BLOCK_CACHE_SHM_WAYS + way;
+
+	return shm->data + (slot << BLOCK_CACHE_PAGE_SHIFT);
+}
 
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
-				empty = 0;
+/*
+ * copy @secs sectors at @off of page @idx to @dst, if the segment
+ * holds it.
+ */
+static int
+block_cache_shm_read_page(block_cache_shm_t *shm, uint64_t idx,
+			  int off, int secs, char *dst)
+{
+	block_cache_shm_set_t *set;
+	struct block_cache_shm_way *way;
+	uint64_t seq;
+	int i;
+
+	set = block_cache_shm_set(shm, idx);
+
+	for (i = 0; i < BLOCK_CACHE_SHM_WAYS; i++) {
+		way = &set->ways[i];
+
+		seq = __atomic_load_n(&way->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
 
+		if (__atomic_load_n(&way->key, __ATOMIC_RELAXED) != idx + 1)
 			continue;
+
+		memcpy(dst, block_cache_shm_page(shm, set, i) +
+		       (off << SECTOR_SHIFT), secs << SECTOR_SHIFT);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&way->seq, __ATOMIC_RELAXED) != seq)
+			return 0;
+
+		__atomic_store_n(&way->ref, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+block_cache_shm_read(block_cache_t *cache, td_request_t treq)
+{
+	block_cache_shm_t *shm = &cache->shm;
+	uint64_t sec, end;
+	int off, secs;
+	char *dst;
+
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+	dst = treq.buf;
+
+	while (sec < end) {
+		off  = sec & (BLOCK_CACHE_PAGE_SECS - 1);
+		secs = MIN(BLOCK_CACHE_PAGE_SECS - off, end - sec);
+
+		if (!block_cache_shm_read_page(shm,
+					       sec >> BLOCK_CACHE_PAGE_SECS_SHIFT,
+					       off, secs, dst)) {
+			shm->misses += treq.secs;
+			return 0;
 		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		dst += secs << SECTOR_SHIFT;
+		sec += secs;
+	}
+
+	shm->hits += treq.secs;
+	return 1;
+}
+
+/*
+ * Claim a way of the page's set by CLOCK, skipping ways another
+ * process is rewriting. Gives up rather than wait.
+ */
+static void
+block_cache_shm_insert(block_cache_shm_t *shm, uint64_t idx, const char *buf)
+{
+	block_cache_shm_set_t *set;
+	struct block_cache_shm_way *way;
+	uint64_t seq, key;
+	int i, n;
+
+	set = block_cache_shm_set(shm, idx);
+
+	for (i = 0; i < BLOCK_CACHE_SHM_WAYS; i++)
+		if (__atomic_load_n(&set->ways[i].key,
+				    __ATOMIC_RELAXED) == idx + 1)
+			return;
+
+	for (n = 0; n < 2 * BLOCK_CACHE_SHM_WAYS; n++) {
+		i   = __atomic_fetch_add(&set->hand, 1, __ATOMIC_RELAXED) %
+			BLOCK_CACHE_SHM_WAYS;
+		way = &set->ways[i];
 
-		radix_tree_clear_link(link);
+		if (__atomic_exchange_n(&way->ref, 0, __ATOMIC_RELAXED))
+			continue;
+
+		seq = __atomic_load_n(&way->seq, __ATOMIC_RELAXED);
+		if (seq & 1)
+			continue;
+
+		if (!__atomic_compare_exchange_n(&way->seq, &seq, seq + 1, 0,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED))
+			continue;
+
+		key = __atomic_load_n(&way->key, __ATOMIC_RELAXED);
+		__atomic_store_n(&way->key, idx + 1, __ATOMIC_RELAXED);
+		memcpy(block_cache_shm_page(shm, set, i), buf,
+		       BLOCK_CACHE_PAGE_SIZE);
+		__atomic_store_n(&way->seq, seq + 2, __ATOMIC_RELEASE);
+
+		if (key)
+			__atomic_add_fetch(&shm->header->evictions, 1,
+					   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&shm->header->inserts, 1, __ATOMIC_RELAXED);
+		shm->inserts++;
+		return;
+	}
+}
+
+/*
+ * the segment is keyed on what identifies the parent's contents: the
+ * uuid and timestamp of a vhd footer, or else where the file lives
+ * and when it last changed. Only tapdisks reading the same parent meet.
+ */
+static int
+block_cache_shm_id(block_cache_t *cache, uuid_t uuid, uint32_t *timestamp)
+{
+	vhd_context_t vhd;
+	struct stat st;
+	uint64_t id[2];
+
+	if (!vhd_open(&vhd, cache->name,
+		      VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED)) {
+		uuid_copy(uuid, vhd.footer.uuid);
+		*timestamp = vhd.footer.timestamp;
+		vhd_close(&vhd);
+		return 0;
 	}
 
-	if (empty && !radix_tree_node_is_root(tree, node))
-		radix_tree_free_node(tree, node);
+	if (stat(cache->name, &st))
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		id[0]      = block_cache_fmix(st.st_rdev);
+		*timestamp = 0;
+	} else {
+		id[0]      = block_cache_fmix(st.st_ino ^
+					  block_cache_rotl(st.st_dev, 32));
+		*timestamp = st.st_mtime;
+	}
+	id[1] = block_cache_fmix(cache->sectors);
 
-	return empty;
+	memcpy(uuid, id, sizeof(uuid_t));
+	return 0;
 }
 
 /*
- * walk tree and free any node that has been idle for too long
+ * Unlink segments in @dir no one is attached to. They are left
+ * behind by tapdisks which crashed, or were never set up completely.
  */
 static void
-radix_tree_prune(radix_tree_t *tree)
+block_cache_shm_reclaim(const char *dir)
 {
-	struct timeval now;
+	struct dirent *d;
+	char *path;
+	DIR *dp;
+	int fd;
 
-	if (!tree->root)
+	dp = opendir(dir);
+	if (!dp)
 		return;
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	while ((d = readdir(dp))) {
+		if (strncmp(d->d_name, BLOCK_CACHE_SHM_PREFIX,
+			    strlen(BLOCK_CACHE_SHM_PREFIX)))
+			continue;
+
+		if (asprintf(&path, "%s/%s", dir, d->d_name) == -1)
+			break;
+
+		fd = open(path, O_RDONLY);
+		if (fd != -1) {
+			if (!flock(fd, LOCK_EX | LOCK_NB)) {
+				DPRINTF("reclaiming shared cache %s\n", path);
+				unlink(path);
+			}
+			close(fd);
+		}
 
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
+		free(path);
+	}
 
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+	closedir(dp);
 }
 
-static inline int
-radix_tree_initialize(radix_tree_t *tree, uint64_t sectors)
+/*
+ * Returns 1 if the segment was created, 0 if it was found, still held
+ * exclusively or shared respectively. -EAGAIN means it was reclaimed
+ * under our feet, and it is worth another go.
+ */
+static int
+block_cache_shm_map(block_cache_shm_t *shm, const char *dir,
+		    const char *name, size_t size)
 {
-	tree->height = radix_tree_calculate_height(sectors);
-	tree->root   = radix_tree_allocate_node(tree, tree->height);
-	if (!tree->root)
+	int fd, err, created;
+	struct stat st;
+	void *map;
+
+	if (asprintf(&shm->path, "%s/%s", dir, name) == -1) {
+		shm->path = NULL;
 		return -ENOMEM;
+	}
 
-	return 0;
+	created = 1;
+	fd = open(shm->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		created = 0;
+		fd = open(shm->path, O_RDWR);
+	}
+	if (fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* the creator sets the segment up before anyone looks at it */
+	if (flock(fd, created ? LOCK_EX : LOCK_SH) || fstat(fd, &st)) {
+		err = -errno;
+		goto fail_fd;
+	}
+
+	if (!st.st_nlink) {
+		err = -EAGAIN;
+		goto fail_fd;
+	}
+
+	if (created && ftruncate(fd, size)) {
+		err = -errno;
+		goto fail_fd;
+	}
+
+	if (!created)
+		size = st.st_size;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		err = -errno;
+		goto fail_fd;
+	}
+
+	shm->fd     = fd;
+	shm->map    = map;
+	shm->size   = size;
+	shm->header = map;
+	return created;
+
+fail_fd:
+	if (created && err != -EAGAIN)
+		unlink(shm->path);
+	close(fd);
+fail:
+	free(shm->path);
+	shm->path = NULL;
+	return err;
 }
 
-static inline void
-radix_tree_free(radix_tree_t *tree)
+static void
+block_cache_shm_unmap(block_cache_shm_t *shm)
 {
-	radix_tree_destroy(tree);
+	munmap(shm->map, shm->size);
+	close(shm->fd);
+	free(shm->path);
+	memset(shm, 0, sizeof(*shm));
 }
 
 static void
-block_cache_prune_event(event_id_t id, char mode, void *private)
+block_cache_shm_detach(block_cache_t *cache)
 {
-	radix_tree_t *tree;
-	block_cache_t *cache;
+	block_cache_shm_t *shm = &cache->shm;
+
+	if (!shm->map)
+		return;
+
+	/* the last one out removes it */
+	if (!flock(shm->fd, LOCK_EX | LOCK_NB))
+		unlink(shm->path);
+
+	block_cache_shm_unmap(shm);
+}
+
+static int
+block_cache_shm_valid(block_cache_t *cache, block_cache_shm_header_t *header,
+		      size_t size, uuid_t uuid, uint32_t timestamp)
+{
+	return (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) ==
+		BLOCK_CACHE_SHM_MAGIC &&
+		header->version == BLOCK_CACHE_SHM_VERSION &&
+		header->page_size == BLOCK_CACHE_PAGE_SIZE &&
+		header->sectors == cache->sectors &&
+		header->ways == BLOCK_CACHE_SHM_WAYS &&
+		header->size == size &&
+		!uuid_compare(header->uuid, uuid) &&
+		header->timestamp == timestamp);
+}
 
-	cache = (block_cache_t *)private;
-	tree  = &cache->tree;
+/*
+ * Attach to the host-wide segment for this parent, creating it if no
+ * one has, hugetlbfs backed where mounted. The first tapdisk sizes
+ * it by its budget. A segment that does not check out is replaced
+ * if no one else uses it. Failing any of this only costs the sharing.
+ */
+static void
+block_cache_shm_attach(block_cache_t *cache, size_t budget)
+{
+	block_cache_shm_t *shm = &cache->shm;
+	block_cache_shm_header_t *header;
+	uint32_t n_sets, timestamp;
+	size_t sets, size;
+	char name[80], id[37];
+	int err, tries, reclaimed;
+	uuid_t uuid;
+
+	if (!budget)
+		budget = BLOCK_CACHE_DEFAULT_SIZE;
+
+	for (n_sets = 1;
+	     ((size_t)n_sets << 1) * BLOCK_CACHE_SHM_WAYS <=
+		     budget >> BLOCK_CACHE_PAGE_SHIFT;
+	     n_sets <<= 1)
+		;
+
+	sets = (n_sets * sizeof(block_cache_shm_set_t) +
+		BLOCK_CACHE_PAGE_SIZE - 1) & ~(BLOCK_CACHE_PAGE_SIZE - 1);
+	size = BLOCK_CACHE_PAGE_SIZE + sets +
+		((size_t)n_sets * BLOCK_CACHE_SHM_WAYS << BLOCK_CACHE_PAGE_SHIFT);
+	size = (size + BLOCK_CACHE_SHM_ALIGN - 1) & ~(BLOCK_CACHE_SHM_ALIGN - 1);
+
+	err = block_cache_shm_id(cache, uuid, &timestamp);
+	if (err)
+		goto fail;
+
+	uuid_unparse_lower(uuid, id);
+	snprintf(name, sizeof(name), BLOCK_CACHE_SHM_PREFIX "%s-%08x",
+		 id, timestamp);
+
+	block_cache_shm_reclaim(BLOCK_CACHE_SHM_HUGE_DIR);
+	block_cache_shm_reclaim(BLOCK_CACHE_SHM_DIR);
+
+	for (tries = 0; ; tries++) {
+		err = block_cache_shm_map(shm, BLOCK_CACHE_SHM_HUGE_DIR,
+					  name, size);
+		if (err < 0 && err != -EAGAIN)
+			err = block_cache_shm_map(shm, BLOCK_CACHE_SHM_DIR,
+						  name, size);
+		if (err == -EAGAIN && tries < BLOCK_CACHE_SHM_RETRIES)
+			continue;
+		if (err < 0)
+			goto fail;
+
+		header = shm->header;
+
+		if (err) {
+			header->version   = BLOCK_CACHE_SHM_VERSION;
+			header->page_size = BLOCK_CACHE_PAGE_SIZE;
+			header->sectors   = cache->sectors;
+			header->size      = size;
+			header->n_sets    = n_sets;
+			header->ways      = BLOCK_CACHE_SHM_WAYS;
+			header->timestamp = timestamp;
+			uuid_copy(header->uuid, uuid);
+			__atomic_store_n(&header->magic, BLOCK_CACHE_SHM_MAGIC,
+					 __ATOMIC_RELEASE);
+			flock(shm->fd, LOCK_SH);
+		}
+
+		if (block_cache_shm_valid(cache, header, shm->size,
+					  uuid, timestamp))
+			break;
+
+		reclaimed = !flock(shm->fd, LOCK_EX | LOCK_NB);
+		if (reclaimed)
+			unlink(shm->path);
+
+		DPRINTF("%s: shared cache %s incompatible%s\n", cache->name,
+			shm->path, reclaimed ? ", replacing it" : "");
+		block_cache_shm_unmap(shm);
 
-	radix_tree_prune(tree);
+		if (!reclaimed || tries >= BLOCK_CACHE_SHM_RETRIES)
+			return;
+	}
+
+	n_sets    = header->n_sets;
+	shm->sets = (void *)((char *)shm->map + BLOCK_CACHE_PAGE_SIZE);
+	shm->data = (char *)shm->map + BLOCK_CACHE_PAGE_SIZE +
+		((n_sets * sizeof(block_cache_shm_set_t) +
+		  BLOCK_CACHE_PAGE_SIZE - 1) & ~(BLOCK_CACHE_PAGE_SIZE - 1));
+
+	DPRINTF("%s: attached shared cache %s, %u sets, %zu bytes\n",
+		cache->name, shm->path, n_sets, shm->size);
+	return;
+
+fail:
+	DPRINTF("%s: no shared cache: %d\n", cache->name, err);
 }
 
 static inline block_cache_request_t *
@@ -510,17 +1363,96 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+/*
+ * Unaligned misses read whole pages around the request. One staging
+ * slot per request in flight, each covering a maximum sized request
+ * plus a page on either side. The pool is registered with the I/O
+ * backend once, so reads into it may go out as fixed-buffer I/O.
+ */
 static int
-block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
+block_cache_stage_init(block_cache_t *cache, td_driver_t *driver)
 {
 	int i, err;
+
+	cache->stage_slots = driver->queue_depth;
+	cache->stage_size  = driver->max_segments * sysconf(_SC_PAGE_SIZE) +
+		2 * BLOCK_CACHE_PAGE_SIZE;
+
+	err = posix_memalign((void **)&cache->stage, BLOCK_CACHE_PAGE_SIZE,
+			     cache->stage_slots * cache->stage_size);
+	if (err) {
+		cache->stage = NULL;
+		return -err;
+	}
+
+	cache->stage_free_list = calloc(cache->stage_slots, sizeof(char *));
+	if (!cache->stage_free_list)
+		return -ENOMEM;
+
+	for (i = 0; i < cache->stage_slots; i++)
+		cache->stage_free_list[i] = cache->stage + i * cache->stage_size;
+	cache->stage_free = cache->stage_slots;
+
+	err = tapdisk_server_register_buffer(cache->stage,
+					     cache->stage_slots *
+					     cache->stage_size);
+	if (err)
+		DPRINTF("%s: staging buffers not registered: %d\n",
+			cache->name, err);
+	cache->stage_registered = !err;
+
+	return 0;
+}
+
+static void
+block_cache_stage_free(block_cache_t *cache)
+{
+	if (cache->stage_registered)
+		tapdisk_server_unregister_buffer(cache->stage);
+	cache->stage_registered = 0;
+
+	free(cache->stage);
+	cache->stage = NULL;
+
+	free(cache->stage_free_list);
+	cache->stage_free_list = NULL;
+}
+
+static char *
+block_cache_get_stage(block_cache_t *cache, size_t size)
+{
+	void *buf;
+
+	if (size <= cache->stage_size && cache->stage_free)
+		return cache->stage_free_list[--cache->stage_free];
+
+	if (posix_memalign(&buf, BLOCK_CACHE_PAGE_SIZE, size))
+		return NULL;
+
+	return buf;
+}
+
+static void
+block_cache_put_stage(block_cache_t *cache, char *buf)
+{
+	if (buf >= cache->stage &&
+	    buf < cache->stage + cache->stage_slots * cache->stage_size)
+		cache->stage_free_list[cache->stage_free++] = buf;
+	else
+		free(buf);
+}
+
+static int
+block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	int i, err, n_reqs;
 	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	if (!td_flag_test(flags, TD_OPEN_RDONLY))
 		return -EINVAL;
 
-	if (driver->info.sector_size != RADIX_TREE_NODE_SIZE)
+	if (driver->info.sector_size != DEFAULT_SECTOR_SIZE)
 		return -EINVAL;
 
 	cache = (block_cache_t *)driver->data;
@@ -531,26 +1463,45 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	cache->sectors = driver->info.size;
 
 	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
+	err  = radix_tree_initialize(tree, cache->sectors >>
+				     BLOCK_CACHE_PAGE_SECS_SHIFT);
 	if (err)
 		goto fail;
 
 	tree->cache = cache;
-	cache->requests_free = BLOCK_CACHE_REQUESTS;
-	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
+
+	/* a cache request per sector of every segment in flight */
+	n_reqs = tapdisk_driver_data_requests(driver) << 3;
+	cache->requests          = calloc(n_reqs,
+					  sizeof(block_cache_request_t));
+	cache->request_free_list = calloc(n_reqs,
+					  sizeof(block_cache_request_t *));
+	if (!cache->requests || !cache->request_free_list) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	cache->requests_free = n_reqs;
+	for (i = 0; i < n_reqs; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
-	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-							  -1, /* dummy fd */
-							  BLOCK_CACHE_PAGE_IDLETIME << 1,
-							  block_cache_prune_event,
-							  cache);
-	if (cache->timeout_id < 0)
+	err = block_cache_stage_init(cache, driver);
+	if (err)
 		goto fail;
 
+	pthread_mutex_lock(&block_cache_store.lock);
+	err = block_cache_store_add_segment(&block_cache_store, cache,
+					    driver->cache_size);
+	pthread_mutex_unlock(&block_cache_store.lock);
+	if (err)
+		goto fail;
+
+	block_cache_shm_attach(cache, driver->cache_size);
+
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
+		"tree: %p, height: %d, pages: %u\n",
+		cache->name, cache->sectors, tree, tree->height,
+		cache->segment->n_pages);
 
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
@@ -558,171 +1509,240 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	return 0;
 
 fail:
+	block_cache_stage_free(cache);
+	free(cache->requests);
+	free(cache->request_free_list);
 	free(cache->name);
-	radix_tree_free(&cache->tree);
+	radix_tree_free_node(tree, tree->root);
 	return err;
 }
 
 static int
 block_cache_close(td_driver_t *driver)
 {
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	pthread_mutex_lock(&block_cache_store.lock);
+	block_cache_free_tree(cache);
+	block_cache_store_remove_segment(&block_cache_store, cache->segment);
+	pthread_mutex_unlock(&block_cache_store.lock);
+
+	block_cache_shm_detach(cache);
+	block_cache_stage_free(cache);
+
+	free(cache->requests);
+	free(cache->request_free_list);
 	free(cache->name);
 
 	return 0;
 }
 
-static inline uint64_t
-block_cache_hash(block_cache_t *cache, char *buf)
+/*
+ * copy out one contiguous extent of the store at a time.
+ */
+static void
+block_cache_hit(block_cache_t *cache, td_request_t treq)
 {
-	int i, n;
-	uint64_t cksm, *data;
+	radix_tree_node_t *node;
+	block_cache_leaf_t *leaf;
+	uint64_t sec, end;
+	int off, secs;
+	char *dst, *src, *buf;
+	size_t len;
 
-	return 0;
+	cache->stats.hits += treq.secs;
 
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
+	sec  = treq.sec;
+	end  = treq.sec + treq.secs;
+	dst  = treq.buf;
+	src  = NULL;
+	len  = 0;
+	node = NULL;
 
-	for (i = 0; i < n; i++)
-		cksm += data[i];
+	while (sec < end) {
+		leaf = block_cache_lookup(cache, &node,
+					  sec >> BLOCK_CACHE_PAGE_SECS_SHIFT);
+		off  = sec & (BLOCK_CACHE_PAGE_SECS - 1);
+		secs = MIN(BLOCK_CACHE_PAGE_SECS - off, end - sec);
+		buf  = leaf->page->buf + (off << SECTOR_SHIFT);
 
-	return ~cksm;
-}
+		DBG("%s: block cache hit: page 0x%08"PRIx64"\n",
+		    cache->name, leaf->key);
 
-static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
-{
-	int i;
-	off_t off;
+		leaf->page->referenced = 1;
+		sec += secs;
 
-	cache->stats.hits += treq.secs;
+		if (src + len == buf) {
+			len += secs << SECTOR_SHIFT;
+			continue;
+		}
 
-	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
+		if (len) {
+			memcpy(dst, src, len);
+			dst += len;
+			cache->stats.copies++;
+		}
 
-		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
+		src = buf;
+		len = secs << SECTOR_SHIFT;
 	}
 
-	td_complete_request(treq, 0);
+	memcpy(dst, src, len);
+	cache->stats.copies++;
 }
 
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
-	int i;
-	radix_tree_t *tree;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
+	char *buf;
 
 	breq        = (block_cache_request_t *)clone.cb_data;
 	cache       = breq->cache;
-	tree        = &cache->tree;
 	breq->secs -= clone.secs;
 	breq->err   = (breq->err ? breq->err : err);
 
 	if (breq->secs)
 		return;
 
-	if (breq->err) {
-		free(breq->buf);
+	if (breq->err)
 		goto out;
-	}
 
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
+	buf = breq->treq.buf;
+	if (breq->buf) {
+		buf = breq->buf;
+		memcpy(breq->treq.buf,
+		       buf + ((breq->treq.sec - breq->sec) << SECTOR_SHIFT),
+		       breq->treq.secs << SECTOR_SHIFT);
 	}
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+	pthread_mutex_lock(&block_cache_store.lock);
+	block_cache_insert(cache, breq->sec >> BLOCK_CACHE_PAGE_SECS_SHIFT,
+			   buf, breq->pages);
+	pthread_mutex_unlock(&block_cache_store.lock);
+
+	if (cache->shm.map) {
+		uint64_t i;
+
+		for (i = 0; i < breq->pages; i++)
+			block_cache_shm_insert(&cache->shm,
+					       (breq->sec >>
+						BLOCK_CACHE_PAGE_SECS_SHIFT) + i,
+					       buf + (i << BLOCK_CACHE_PAGE_SHIFT));
+	}
 
 out:
+	if (breq->buf)
+		block_cache_put_stage(cache, breq->buf);
 	td_complete_request(breq->treq, breq->err);
 	block_cache_put_request(cache, breq);
 }
 
+/*
+ * page aligned misses are read straight into the caller's buffer and
+ * copied into the cache from there. others read the whole pages
+ * covering @treq into a staging buffer, then hand the caller its
+ * part.
+ */
 static void
 block_cache_miss(block_cache_t *cache, td_request_t treq)
 {
 	void *buf;
-	size_t size;
+	uint64_t sec, end;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
+	int aligned;
 
-	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
+	DBG("%s: block cache miss: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
 
 	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
+	sec = treq.sec & ~((uint64_t)BLOCK_CACHE_PAGE_SECS - 1);
+	end = (treq.sec + treq.secs + BLOCK_CACHE_PAGE_SECS - 1) &
+		~((uint64_t)BLOCK_CACHE_PAGE_SECS - 1);
+	if (end > cache->sectors)
+		goto uncached;
 
 	breq = block_cache_get_request(cache);
 	if (!breq)
-		goto out;
+		goto uncached;
+
+	aligned = (sec == treq.sec && end == treq.sec + treq.secs);
 
-	if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
+	if (aligned) {
+		buf = NULL;
+		cache->stats.direct++;
+	} else if (!(buf = block_cache_get_stage(cache,
+						 (end - sec) << SECTOR_SHIFT))) {
 		block_cache_put_request(cache, breq);
-		goto out;
-	}
+		goto uncached;
+	} else
+		cache->stats.staged++;
 
 	breq->treq    = treq;
-	breq->secs    = treq.secs;
+	breq->sec     = sec;
+	breq->secs    = end - sec;
+	breq->pages   = (end - sec) >> BLOCK_CACHE_PAGE_SECS_SHIFT;
 	breq->err     = 0;
 	breq->buf     = buf;
 	breq->cache   = cache;
 
-	clone.buf     = buf;
+	clone.sec     = sec;
+	clone.secs    = end - sec;
+	clone.buf     = buf ? : treq.buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
-out:
+	td_forward_request(clone);
+	return;
+
+uncached:
+	cache->stats.uncached += treq.secs;
 	td_forward_request(clone);
 }
 
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int i;
-	radix_tree_t *tree;
+	uint64_t idx, last;
+	radix_tree_node_t *node;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	cache->stats.reads += treq.secs;
 
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
-		return td_forward_request(treq);
+	idx  = treq.sec >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+	last = (treq.sec + treq.secs - 1) >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+
+	pthread_mutex_lock(&block_cache_store.lock);
+
+	for (node = NULL; idx <= last; idx++)
+		if (!block_cache_lookup(cache, &node, idx)) {
+			pthread_mutex_unlock(&block_cache_store.lock);
+			goto shared;
+		}
+
+	block_cache_hit(cache, treq);
+	pthread_mutex_unlock(&block_cache_store.lock);
 
-	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
-			return block_cache_miss(cache, treq);
+	td_complete_request(treq, 0);
+	return;
+
+shared:
+	if (cache->shm.map && block_cache_shm_read(cache, treq)) {
+		td_complete_request(treq, 0);
+		return;
 	}
 
-	return block_cache_hit(cache, treq, iov);
+	block_cache_miss(cache, treq);
 }
 
 static void
@@ -753,6 +1773,7 @@ block_cache_validate_parent(td_driver_t *driver,
 static void
 block_cache_debug(td_driver_t *driver)
 {
+	block_cache_store_t *store = &block_cache_store;
 	block_cache_t *cache;
 	block_cache_stats_t *stats;
 
@@ -760,9 +1781,83 @@ block_cache_debug(td_driver_t *driver)
 	stats = &cache->stats;
 
 	WARN("BLOCK CACHE %s\n", cache->name);
-	WARN("reads: %"PRIu64", hits: %"PRIu64", "
-	     "misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	WARN("nodes: %u, reads: %"PRIu64", hits: %"PRIu64", "
+	     "misses: %"PRIu64", uncached: %"PRIu64", inserts: %"PRIu64", "
+	     "dedups: %"PRIu64", copies: %"PRIu64", direct: %"PRIu64", "
+	     "staged: %"PRIu64"\n", cache->tree.nodes, stats->reads,
+	     stats->hits, stats->misses, stats->uncached, stats->inserts,
+	     stats->dedups, stats->copies, stats->direct, stats->staged);
+
+	pthread_mutex_lock(&store->lock);
+	WARN("store: pages: %"PRIu64"/%"PRIu64", logical: %"PRIu64", "
+	     "evictions: %"PRIu64"\n", store->used, store->pages,
+	     store->logical, store->evictions);
+	pthread_mutex_unlock(&store->lock);
+}
+
+static void
+block_cache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	block_cache_store_t *store = &block_cache_store;
+	block_cache_t *cache;
+	block_cache_stats_t *stats;
+
+	cache = (block_cache_t *)driver->data;
+	stats = &cache->stats;
+
+	tapdisk_stats_field(st, "cache", "{");
+	tapdisk_stats_field(st, "page_size", "d", BLOCK_CACHE_PAGE_SIZE);
+	tapdisk_stats_field(st, "segment", "llu",
+			    (unsigned long long)cache->segment->n_pages <<
+			    BLOCK_CACHE_PAGE_SHIFT);
+	tapdisk_stats_field(st, "nodes", "u", cache->tree.nodes);
+	tapdisk_stats_field(st, "reads", "llu", stats->reads);
+	tapdisk_stats_field(st, "hits", "llu", stats->hits);
+	tapdisk_stats_field(st, "misses", "llu", stats->misses);
+	tapdisk_stats_field(st, "uncached", "llu", stats->uncached);
+	tapdisk_stats_field(st, "inserts", "llu", stats->inserts);
+	tapdisk_stats_field(st, "dedups", "llu", stats->dedups);
+	tapdisk_stats_field(st, "copies", "llu", stats->copies);
+	tapdisk_stats_field(st, "direct", "llu", stats->direct);
+	tapdisk_stats_field(st, "staged", "llu", stats->staged);
+
+	pthread_mutex_lock(&store->lock);
+	tapdisk_stats_field(st, "store", "{");
+	tapdisk_stats_field(st, "pages", "[");
+	tapdisk_stats_val(st, "llu", store->used);
+	tapdisk_stats_val(st, "llu", store->pages);
+	tapdisk_stats_leave(st, ']');
+	tapdisk_stats_field(st, "logical", "llu", store->logical);
+	tapdisk_stats_field(st, "ratio", ".2f", store->used ?
+			    (double)store->logical / store->used : 1.0);
+	tapdisk_stats_field(st, "saved", "llu",
+			    (store->logical - store->used) <<
+			    BLOCK_CACHE_PAGE_SHIFT);
+	tapdisk_stats_field(st, "evictions", "llu", store->evictions);
+	tapdisk_stats_leave(st, '}');
+	pthread_mutex_unlock(&store->lock);
+
+	if (cache->shm.map) {
+		block_cache_shm_t *shm = &cache->shm;
+
+		tapdisk_stats_field(st, "shared", "{");
+		tapdisk_stats_field(st, "path", "s", shm->path);
+		tapdisk_stats_field(st, "size", "zu", shm->size);
+		tapdisk_stats_field(st, "hits", "llu", shm->hits);
+		tapdisk_stats_field(st, "misses", "llu", shm->misses);
+		tapdisk_stats_field(st, "inserts", "llu", shm->inserts);
+		tapdisk_stats_field(st, "segment", "[");
+		tapdisk_stats_val(st, "llu",
+				  __atomic_load_n(&shm->header->inserts,
+						  __ATOMIC_RELAXED));
+		tapdisk_stats_val(st, "llu",
+				  __atomic_load_n(&shm->header->evictions,
+						  __ATOMIC_RELAXED));
+		tapdisk_stats_leave(st, ']');
+		tapdisk_stats_leave(st, '}');
+	}
+
+	tapdisk_stats_leave(st, '}');
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -776,4 +1871,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
@@ -20,20 +20,24 @@
 #include "config.h"
 #endif
 
+#include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <libgen.h>
 #include <sys/mman.h>
 #include <sys/vfs.h>
 
-#include "vhd.h"
+#include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-stats.h"
+#include "block-lcache.h"
 
 #define DEBUG 1
 
@@ -49,15 +53,57 @@
 #define BUG_ON(_cond)   if (unlikely(_cond)) { td_panic(); }
 #define WARN_ON(_p)     if (unlikely(_cond)) { WARN(_cond); }
 
-#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+/*
+ * The leaf is managed in units of its own block size: a unit the
+ * cache filled is released by discarding it, which hands the leaf
+ * block back once all of it is gone.
+ */
+#define LCACHE_UNIT_SECS_DEFAULT        (VHD_BLOCK_SIZE >> SECTOR_SHIFT)
+#define LCACHE_EVICT_SCAN               8
 
-#define TD_LCACHE_MAX_REQ               (MAX_REQUESTS*2)
-#define TD_LCACHE_BUFSZ                 (MAX_SEGMENTS_PER_REQ * \
-					 sysconf(_SC_PAGE_SIZE))
+#define LCACHE_INDEX_MAGIC              "tdlcache"
+#define LCACHE_INDEX_VERSION            1
 
+#define LCACHE_NIL                      ((uint32_t)-1)
+#define LCACHE_MERGE_SCAN               8
 
 typedef struct lcache                   td_lcache_t;
 typedef struct lcache_request           td_lcache_req_t;
+typedef struct lcache_unit              td_lcache_unit_t;
+
+enum {
+	LCACHE_UNIT_FREE = 0,
+	LCACHE_UNIT_GHOST,     /* missed once while full */
+	LCACHE_UNIT_CACHED,    /* filled by us, on the lru */
+	LCACHE_UNIT_EVICTING,  /* discard in flight */
+	LCACHE_UNIT_PINNED,    /* written by the guest, never evicted */
+};
+
+struct lcache_unit {
+	uint32_t                        prev;
+	uint32_t                        next;
+	uint16_t                        pending;  /* fills in flight */
+	uint16_t                        writes;   /* guest writes seen */
+	uint8_t                         state;
+};
+
+/*
+ * On-disk index, <leaf>.lcache, written on close. Followed by the
+ * cached units from coldest to hottest, then the pinned ones. It is
+ * removed again once loaded, so an unclean exit starts over instead
+ * of trusting a stale one, with every unit the leaf has a block for
+ * pinned.
+ */
+struct lcache_index_header {
+	char                            magic[8];
+	uint32_t                        version;
+	uint32_t                        unit_secs;
+	uuid_t                          uuid;
+	uint32_t                        n_units;
+	uint32_t                        n_cached;
+	uint32_t                        n_pinned;
+	uint32_t                        pad;
+};
 
 struct lcache_request {
 	char                           *buf;
@@ -65,18 +111,21 @@ struct lcache_request {
 
 	td_request_t                    treq;
 	int                             secs;
+	uint16_t                        writes[2];
 
 	td_vbd_request_t                vreq;
 	struct td_iovec                 iov;
 
 	td_lcache_t                    *cache;
+	struct list_head                next;
 };
 
 struct lcache {
 	char                           *name;
 
-	td_lcache_req_t                 reqv[TD_LCACHE_MAX_REQ];
-	td_lcache_req_t                *free[TD_LCACHE_MAX_REQ];
+	td_lcache_req_t                *reqv;
+	td_lcache_req_t               **free;
+	int                             n_reqs;
 	int                             n_free;
 
 	char                           *buf;
@@ -84,6 +133,44 @@ struct lcache {
 
 	int                             wr_en;
 	struct timeval                  ts;
+
+	/*
+	 * Fills wait here for the guest to leave room: only a few are
+	 * written at a time, and the oldest make way for reads when
+	 * requests run short.
+	 */
+	td_vbd_t                       *vbd;
+	struct list_head                fills;
+	int                             n_fills;
+	int                             max_fills;
+	int                             fills_pending;
+	int                             max_fills_pending;
+
+	char                           *index;
+	uuid_t                          uuid;
+
+	td_sector_t                     sectors;
+	uint32_t                        unit_secs;
+	uint32_t                        n_units;
+	td_lcache_unit_t               *units; /* + lru head */
+	uint32_t                        capacity;
+	uint32_t                        used;
+	uint32_t                        pinned;
+
+	uint32_t                       *ghost;
+	uint32_t                        n_ghost;
+	uint32_t                        ghost_pos;
+
+	struct {
+		uint64_t                admitted;
+		uint64_t                rejected;
+		uint64_t                evicted;
+		uint64_t                stale;
+		uint64_t                loaded;
+		uint64_t                merged;
+		uint64_t                dropped;
+		uint64_t                uncached;
+	} stats;
 };
 
 static td_lcache_req_t *
@@ -100,7 +187,7 @@ lcache_alloc_request(td_lcache_t *cache)
 static void
 lcache_free_request(td_lcache_t *cache, td_lcache_req_t *req)
 {
-	BUG_ON(cache->n_free >= TD_LCACHE_MAX_REQ);
+	BUG_ON(cache->n_free >= cache->n_reqs);
 	cache->free[cache->n_free++] = req;
 }
 
@@ -112,24 +199,49 @@ lcache_destroy_buffers(td_lcache_t *cache)
 	do {
 		req = lcache_alloc_request(cache);
 		if (req)
-			munmap(req->buf, TD_LCACHE_BUFSZ);
+			munmap(req->buf, cache->bufsz);
 	} while (req);
+
+	free(cache->reqv);
+	cache->reqv = NULL;
+
+	free(cache->free);
+	cache->free = NULL;
+
+	cache->n_reqs = 0;
 }
 
+/*
+ * Two requests per VBD queue slot, each buffering a full segment run
+ * of the largest request the VBD accepts. The pool grows with the
+ * queue depth, so it is left pageable.
+ */
 static int
-lcache_create_buffers(td_lcache_t *cache)
+lcache_create_buffers(td_lcache_t *cache, td_driver_t *driver)
 {
 	int prot, flags, i, err;
 
 	prot  = PROT_READ|PROT_WRITE;
-	flags = MAP_ANONYMOUS|MAP_PRIVATE|MAP_LOCKED;
+	flags = MAP_ANONYMOUS|MAP_PRIVATE;
 
 	cache->n_free = 0;
+	cache->n_reqs = driver->queue_depth * 2;
+	cache->bufsz  = driver->max_segments * sysconf(_SC_PAGE_SIZE);
 
-	for (i = 0; i < TD_LCACHE_MAX_REQ; i++) {
+	cache->max_fills         = driver->queue_depth;
+	cache->max_fills_pending = MAX(driver->queue_depth / 4, 1);
+
+	cache->reqv = calloc(cache->n_reqs, sizeof(td_lcache_req_t));
+	cache->free = calloc(cache->n_reqs, sizeof(td_lcache_req_t *));
+	if (!cache->reqv || !cache->free) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < cache->n_reqs; i++) {
 		td_lcache_req_t *req = &cache->reqv[i];
 
-		req->buf = mmap(NULL, TD_LCACHE_BUFSZ, prot, flags, -1, 0);
+		req->buf = mmap(NULL, cache->bufsz, prot, flags, -1, 0);
 		if (req->buf == MAP_FAILED) {
 			req->buf = NULL;
 			err = -errno;
@@ -147,11 +259,604 @@ fail:
 	return err;
 }
 
+/*
+ * Units the cache filled sit on an lru list, hottest first, threaded
+ * through the unit array by index. The extra unit past the end is
+ * the list head.
+ */
+#define lcache_lru_head(_cache)  ((_cache)->n_units)
+
+static void
+lcache_lru_del(td_lcache_t *cache, uint32_t u)
+{
+	td_lcache_unit_t *unit = &cache->units[u];
+
+	cache->units[unit->prev].next = unit->next;
+	cache->units[unit->next].prev = unit->prev;
+	unit->prev = unit->next = LCACHE_NIL;
+}
+
+static void
+lcache_lru_add(td_lcache_t *cache, uint32_t u, int hot)
+{
+	td_lcache_unit_t *unit = &cache->units[u];
+	uint32_t head = lcache_lru_head(cache);
+
+	if (hot) {
+		unit->prev = head;
+		unit->next = cache->units[head].next;
+	} else {
+		unit->next = head;
+		unit->prev = cache->units[head].prev;
+	}
+
+	cache->units[unit->prev].next = u;
+	cache->units[unit->next].prev = u;
+}
+
+static void
+lcache_set_cached(td_lcache_t *cache, uint32_t u, int hot)
+{
+	cache->units[u].state = LCACHE_UNIT_CACHED;
+	lcache_lru_add(cache, u, hot);
+	cache->used++;
+}
+
+static void
+lcache_set_pinned(td_lcache_t *cache, uint32_t u)
+{
+	td_lcache_unit_t *unit = &cache->units[u];
+
+	switch (unit->state) {
+	case LCACHE_UNIT_PINNED:
+		return;
+	case LCACHE_UNIT_CACHED:
+		lcache_lru_del(cache, u);
+		cache->used--;
+		break;
+	}
+
+	unit->state = LCACHE_UNIT_PINNED;
+	cache->pinned++;
+}
+
+/*
+ * Once full, a unit is only admitted on its second miss within the
+ * last capacity worth of rejected units, so a single sweep through
+ * the disk does not flush the hot set.
+ */
+static void
+lcache_ghost_add(td_lcache_t *cache, uint32_t u)
+{
+	uint32_t old;
+
+	if (!cache->ghost)
+		return;
+
+	old = cache->ghost[cache->ghost_pos];
+	if (old != LCACHE_NIL && cache->units[old].state == LCACHE_UNIT_GHOST)
+		cache->units[old].state = LCACHE_UNIT_FREE;
+
+	cache->ghost[cache->ghost_pos] = u;
+	cache->units[u].state = LCACHE_UNIT_GHOST;
+
+	cache->ghost_pos = (cache->ghost_pos + 1) % cache->n_ghost;
+}
+
+static void
+__lcache_discard_cb(td_vbd_request_t *vreq, int error,
+		    void *token, int final)
+{
+	td_lcache_req_t *req = containerof(vreq, td_lcache_req_t, vreq);
+	td_lcache_t *cache = token;
+	td_lcache_unit_t *unit;
+
+	unit = &cache->units[vreq->sec / cache->unit_secs];
+
+	if (unit->state == LCACHE_UNIT_EVICTING) {
+		if (!error)
+			unit->state = LCACHE_UNIT_FREE;
+		else {
+			/* whatever is left stays put for good */
+			WARN("%s: evicting sector %"PRIu64": %d\n",
+			     cache->name, vreq->sec, error);
+			unit->state = LCACHE_UNIT_FREE;
+			lcache_set_pinned(cache, vreq->sec / cache->unit_secs);
+		}
+	}
+
+	lcache_free_request(cache, req);
+}
+
+/*
+ * Discard the coldest unit with no fills in flight. The discard goes
+ * through the vbd queue like our fills do, and is cancelled at issue
+ * if the guest wrote to the unit meanwhile.
+ *
+ * Only units on the lru are candidates. Those had no leaf block when
+ * first admitted, or were saved as such by a clean close, and any
+ * guest write since pinned them: all they hold came from fills.
+ */
+static int
+lcache_evict(td_lcache_t *cache, td_vbd_t *vbd)
+{
+	td_lcache_req_t *req;
+	td_vbd_request_t *vreq;
+	td_sector_t sec;
+	uint32_t u;
+	int n, err;
+
+	u = cache->units[lcache_lru_head(cache)].prev;
+	for (n = 0; n < LCACHE_EVICT_SCAN; n++) {
+		if (u == lcache_lru_head(cache))
+			return -EBUSY;
+		if (!cache->units[u].pending)
+			break;
+		u = cache->units[u].prev;
+	}
+	if (n == LCACHE_EVICT_SCAN)
+		return -EBUSY;
+
+	req = lcache_alloc_request(cache);
+	if (!req)
+		return -EBUSY;
+
+	sec = (td_sector_t)u * cache->unit_secs;
+
+	req->iov.base = NULL;
+	req->iov.secs = MIN(cache->unit_secs, cache->sectors - sec);
+
+	vreq         = &req->vreq;
+	vreq->op     = TD_OP_DISCARD;
+	vreq->sec    = sec;
+	vreq->iov    = &req->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = __lcache_discard_cb;
+	vreq->token  = cache;
+
+	err = tapdisk_vbd_queue_request(vbd, vreq);
+	BUG_ON(err);
+
+	lcache_lru_del(cache, u);
+	cache->units[u].state = LCACHE_UNIT_EVICTING;
+	cache->used--;
+	cache->stats.evicted++;
+
+	return 0;
+}
+
+static int
+lcache_admit(td_lcache_t *cache, td_vbd_t *vbd, uint32_t u)
+{
+	td_lcache_unit_t *unit = &cache->units[u];
+	int err, n;
+
+	switch (unit->state) {
+	case LCACHE_UNIT_PINNED:
+		/* the guest already paid for the block */
+		return 0;
+
+	case LCACHE_UNIT_CACHED:
+		lcache_lru_del(cache, u);
+		lcache_lru_add(cache, u, 1);
+		return 0;
+
+	case LCACHE_UNIT_EVICTING:
+		return -EBUSY;
+
+	case LCACHE_UNIT_FREE:
+		if (cache->used < cache->capacity)
+			break;
+		lcache_ghost_add(cache, u);
+		cache->stats.rejected++;
+		return -ENOSPC;
+
+	case LCACHE_UNIT_GHOST:
+		break;
+	}
+
+	/* an index loaded under a smaller capacity shrinks two at a time */
+	for (n = 0; cache->used >= cache->capacity && n < 2; n++) {
+		err = lcache_evict(cache, vbd);
+		if (err)
+			break;
+	}
+
+	if (cache->used >= cache->capacity) {
+		cache->stats.rejected++;
+		return -ENOSPC;
+	}
+
+	lcache_set_cached(cache, u, 1);
+	cache->stats.admitted++;
+
+	return 0;
+}
+
+static void __lcache_write_cb(td_vbd_request_t *, int, void *, int);
+static void lcache_kick_fills(td_lcache_t *);
+static td_lcache_req_t *lcache_reclaim_fill(td_lcache_t *);
+
+static inline uint32_t
+lcache_first_unit(td_lcache_t *cache, td_sector_t sec)
+{
+	return sec / cache->unit_secs;
+}
+
+static inline uint32_t
+lcache_last_unit(td_lcache_t *cache, td_sector_t sec, int secs)
+{
+	return (sec + secs - 1) / cache->unit_secs;
+}
+
+/*
+ * Called for every write and discard the vbd issues. Guest writes pin
+ * the units they touch. Our own fills and evictions are failed with
+ * -ESTALE if a guest write to their units got in first.
+ */
+int
+tapdisk_lcache_invalidate(td_driver_t *driver, td_vbd_request_t *vreq,
+			  td_sector_t sec, int secs)
+{
+	td_lcache_t *cache = driver->data;
+	td_lcache_req_t *req;
+	uint32_t u, first, last;
+
+	if (!cache->units)
+		return 0;
+
+	first = lcache_first_unit(cache, sec);
+	last  = lcache_last_unit(cache, sec, secs);
+
+	if (vreq->cb == __lcache_discard_cb) {
+		if (cache->units[first].state != LCACHE_UNIT_EVICTING) {
+			cache->stats.stale++;
+			return -ESTALE;
+		}
+		return 0;
+	}
+
+	if (vreq->cb == __lcache_write_cb) {
+		req = containerof(vreq, td_lcache_req_t, vreq);
+
+		for (u = first; u <= last; u++)
+			if (cache->units[u].writes != req->writes[u - first]) {
+				cache->stats.stale++;
+				return -ESTALE;
+			}
+		return 0;
+	}
+
+	for (u = first; u <= last; u++) {
+		cache->units[u].writes++;
+		lcache_set_pinned(cache, u);
+	}
+
+	return 0;
+}
+
+static int
+lcache_fsync_dir(const char *path)
+{
+	char *tmp;
+	int fd, err;
+
+	tmp = strdup(path);
+	if (!tmp)
+		return -ENOMEM;
+
+	fd = open(dirname(tmp), O_RDONLY|O_DIRECTORY);
+	free(tmp);
+	if (fd == -1)
+		return -errno;
+
+	err = fsync(fd) ? -errno : 0;
+	close(fd);
+
+	return err;
+}
+
+static int
+lcache_load_index(td_lcache_t *cache)
+{
+	struct lcache_index_header hdr;
+	uint32_t *units = NULL, i, u, n;
+	ssize_t size;
+	int fd, err;
+
+	fd = open(cache->index, O_RDONLY);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -errno;
+
+	err = -EINVAL;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out;
+
+	if (memcmp(hdr.magic, LCACHE_INDEX_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != LCACHE_INDEX_VERSION ||
+	    hdr.unit_secs != cache->unit_secs ||
+	    hdr.n_units != cache->n_units ||
+	    uuid_compare(hdr.uuid, cache->uuid) ||
+	    hdr.n_cached > cache->n_units ||
+	    hdr.n_pinned > cache->n_units - hdr.n_cached)
+		goto out;
+
+	n    = hdr.n_cached + hdr.n_pinned;
+	size = (ssize_t)n * sizeof(uint32_t);
+
+	units = malloc(size ? : 1);
+	if (!units) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (read(fd, units, size) != size)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		u = units[i];
+		if (u >= cache->n_units ||
+		    cache->units[u].state != LCACHE_UNIT_FREE)
+			goto reset;
+
+		if (i < hdr.n_cached)
+			lcache_set_cached(cache, u, 1);
+		else
+			lcache_set_pinned(cache, u);
+	}
+
+	cache->stats.loaded = hdr.n_cached;
+	err = 0;
+
+out:
+	free(units);
+	close(fd);
+
+	/* from here on, only a clean close leaves an index behind */
+	if (unlink(cache->index) && errno != ENOENT)
+		err = err ? : -errno;
+	else
+		lcache_fsync_dir(cache->index);
+
+	return err;
+
+reset:
+	for (u = 0; u < cache->n_units; u++)
+		cache->units[u].state = LCACHE_UNIT_FREE;
+	cache->units[lcache_lru_head(cache)].prev = lcache_lru_head(cache);
+	cache->units[lcache_lru_head(cache)].next = lcache_lru_head(cache);
+	cache->used = cache->pinned = 0;
+	err = -EINVAL;
+	goto out;
+}
+
+static int
+lcache_save_index(td_lcache_t *cache)
+{
+	struct lcache_index_header hdr;
+	uint32_t *units, u, n;
+	char *tmp;
+	ssize_t size;
+	int fd, err;
+
+	units = calloc(cache->n_units ? : 1, sizeof(uint32_t));
+	if (!units)
+		return -ENOMEM;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LCACHE_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version   = LCACHE_INDEX_VERSION;
+	hdr.unit_secs = cache->unit_secs;
+	hdr.n_units   = cache->n_units;
+	uuid_copy(hdr.uuid, cache->uuid);
+
+	/* coldest first, so a reload rebuilds the same order */
+	n = 0;
+	for (u = cache->units[lcache_lru_head(cache)].prev;
+	     u != lcache_lru_head(cache); u = cache->units[u].prev)
+		units[n++] = u;
+
+	/* a discard still in flight leaves a unit we may evict again */
+	for (u = 0; u < cache->n_units; u++)
+		if (cache->units[u].state == LCACHE_UNIT_EVICTING)
+			units[n++] = u;
+	hdr.n_cached = n;
+
+	for (u = 0; u < cache->n_units; u++)
+		if (cache->units[u].state == LCACHE_UNIT_PINNED)
+			units[n++] = u;
+	hdr.n_pinned = n - hdr.n_cached;
+
+	err = asprintf(&tmp, "%s.tmp", cache->index);
+	if (err == -1) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1) {
+		err = -errno;
+		goto free;
+	}
+
+	size = (ssize_t)n * sizeof(uint32_t);
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, units, size) != size ||
+	    fsync(fd)) {
+		err = errno ? -errno : -EIO;
+		close(fd);
+		unlink(tmp);
+		goto free;
+	}
+	close(fd);
+
+	err = rename(tmp, cache->index) ? -errno : 0;
+	if (!err)
+		lcache_fsync_dir(cache->index);
+	else
+		unlink(tmp);
+
+free:
+	free(tmp);
+out:
+	free(units);
+	return err;
+}
+
+static void
+lcache_destroy_index(td_lcache_t *cache)
+{
+	free(cache->units);
+	cache->units = NULL;
+
+	free(cache->ghost);
+	cache->ghost = NULL;
+
+	free(cache->index);
+	cache->index = NULL;
+}
+
+/*
+ * Units the leaf has a block for, and the index does not account for,
+ * may hold guest data. Pin them, so they are never evicted.
+ */
+static int
+lcache_pin_allocated(td_lcache_t *cache, vhd_context_t *vhd)
+{
+	uint32_t u, n;
+	int err;
+
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
+
+	n = 0;
+	for (u = 0; u < cache->n_units && u < vhd->bat.entries; u++) {
+		if (vhd->bat.bat[u] == DD_BLK_UNUSED ||
+		    cache->units[u].state != LCACHE_UNIT_FREE)
+			continue;
+
+		lcache_set_pinned(cache, u);
+		n++;
+	}
+
+	if (n)
+		INFO("%s: pinned %u allocated units not in the index\n",
+		     cache->name, n);
+
+	return 0;
+}
+
+/*
+ * The leaf tells us the unit size and, by its uuid, whether a saved
+ * index still describes it. Its BAT tells us which units may hold
+ * guest data. Leaves we cannot read that way are managed with default
+ * units, not persisted, and never evicted from.
+ */
+static int
+lcache_create_index(td_lcache_t *cache, td_driver_t *driver)
+{
+	vhd_context_t vhd;
+	uint64_t capacity;
+	uint32_t u, head;
+	int err, persist, evict;
+
+	cache->unit_secs = LCACHE_UNIT_SECS_DEFAULT;
+	uuid_clear(cache->uuid);
+
+	err = vhd_open(&vhd, cache->name, VHD_OPEN_RDONLY | VHD_OPEN_META_LOG);
+	persist = !err;
+	evict   = persist && vhd_type_dynamic(&vhd);
+	if (persist) {
+		if (evict)
+			cache->unit_secs = vhd.header.block_size >> SECTOR_SHIFT;
+		uuid_copy(cache->uuid, vhd.footer.uuid);
+	}
+
+	cache->sectors = driver->info.size;
+	cache->n_units = (cache->sectors + cache->unit_secs - 1) /
+		cache->unit_secs;
+
+	err = -ENOMEM;
+	cache->units = calloc(cache->n_units + 1, sizeof(td_lcache_unit_t));
+	if (!cache->units)
+		goto out;
+
+	for (u = 0; u < cache->n_units; u++)
+		cache->units[u].prev = cache->units[u].next = LCACHE_NIL;
+
+	head = lcache_lru_head(cache);
+	cache->units[head].prev = cache->units[head].next = head;
+
+	if (persist) {
+		err = asprintf(&cache->index, "%s.lcache", cache->name);
+		if (err == -1) {
+			cache->index = NULL;
+			err = -ENOMEM;
+			goto out;
+		}
+
+		err = lcache_load_index(cache);
+		if (err)
+			WARN("%s: ignoring cache index: %d\n", cache->name, err);
+	}
+
+	if (evict) {
+		err = lcache_pin_allocated(cache, &vhd);
+		if (err) {
+			WARN("%s: reading BAT: %d, not evicting\n",
+			     cache->name, err);
+			evict = 0;
+		}
+	}
+
+	capacity = driver->lcache_size >> SECTOR_SHIFT;
+	capacity /= cache->unit_secs;
+	if (!evict || !driver->lcache_size || capacity > cache->n_units)
+		capacity = cache->n_units;
+	cache->capacity = capacity ? : 1;
+
+	if (cache->capacity < cache->n_units) {
+		cache->n_ghost = cache->capacity;
+		cache->ghost   = malloc(cache->n_ghost * sizeof(uint32_t));
+		if (!cache->ghost) {
+			err = -ENOMEM;
+			goto out;
+		}
+		memset(cache->ghost, 0xff, cache->n_ghost * sizeof(uint32_t));
+	}
+
+	INFO("%s: %u of %u units cached, %u pinned, capacity %u\n",
+	     cache->name, cache->used, cache->n_units, cache->pinned,
+	     cache->capacity);
+
+	err = 0;
+
+out:
+	if (persist)
+		vhd_close(&vhd);
+	return err;
+}
+
 static int
 lcache_close(td_driver_t *driver)
 {
 	td_lcache_t *cache = driver->data;
+	td_lcache_req_t *req;
+	int err;
 
+	while ((req = lcache_reclaim_fill(cache)))
+		lcache_free_request(cache, req);
+
+	if (cache->index && cache->units) {
+		err = lcache_save_index(cache);
+		if (err)
+			WARN("%s: saving cache index: %d\n", cache->name, err);
+	}
+
+	lcache_destroy_index(cache);
 	lcache_destroy_buffers(cache);
 
 	free(cache->name);
@@ -165,11 +870,17 @@ lcache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	td_lcache_t *cache = driver->data;
 	int err;
 
+	INIT_LIST_HEAD(&cache->fills);
+
 	err  = tapdisk_namedup(&cache->name, (char *)name);
 	if (err)
 		goto fail;
 
-	err = lcache_create_buffers(cache);
+	err = lcache_create_buffers(cache, driver);
+	if (err)
+		goto fail;
+
+	err = lcache_create_index(cache, driver);
 	if (err)
 		goto fail;
 
@@ -243,11 +954,49 @@ __lcache_write_cb(td_vbd_request_t *vreq, int error,
 {
 	td_lcache_req_t *req = containerof(vreq, td_lcache_req_t, vreq);
 	td_lcache_t *cache = token;
+	uint32_t u, last;
 
 	if (error == -ENOSPC)
 		cache->wr_en = 0;
 
+	last = lcache_last_unit(cache, vreq->sec, req->iov.secs);
+	for (u = lcache_first_unit(cache, vreq->sec); u <= last; u++)
+		cache->units[u].pending--;
+
+	cache->fills_pending--;
 	lcache_free_request(cache, req);
+
+	lcache_kick_fills(cache);
+}
+
+/*
+ * Fills only go to units we may spend capacity on, and that the
+ * guest has not written to since the parent was read.
+ */
+static int
+lcache_admit_request(td_lcache_t *cache, td_vbd_t *vbd, td_lcache_req_t *req)
+{
+	uint32_t u, first, last;
+	int err;
+
+	first = lcache_first_unit(cache, req->treq.sec);
+	last  = lcache_last_unit(cache, req->treq.sec, req->treq.secs);
+
+	for (u = first; u <= last; u++) {
+		if (cache->units[u].writes != req->writes[u - first]) {
+			cache->stats.stale++;
+			return -ESTALE;
+		}
+
+		err = lcache_admit(cache, vbd, u);
+		if (err)
+			return err;
+	}
+
+	for (u = first; u <= last; u++)
+		cache->units[u].pending++;
+
+	return 0;
 }
 
 static void
@@ -255,7 +1004,6 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 {
 	td_vbd_request_t *vreq;
 	struct td_iovec *iov;
-	td_vbd_t *vbd;
 	int err;
 
 	iov          = &req->iov;
@@ -270,15 +1018,140 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 	vreq->cb     = __lcache_write_cb;
 	vreq->token  = cache;
 
-	vbd = req->treq.vreq->vbd;
-
-	err = tapdisk_vbd_queue_request(vbd, vreq);
+	err = tapdisk_vbd_queue_request(cache->vbd, vreq);
 	BUG_ON(err);
+
+	cache->fills_pending++;
+}
+
+static void
+lcache_kick_fills(td_lcache_t *cache)
+{
+	td_lcache_req_t *req;
+
+	while (cache->fills_pending < cache->max_fills_pending &&
+	       !list_empty(&cache->fills)) {
+		req = list_entry(cache->fills.next, td_lcache_req_t, next);
+		list_del_init(&req->next);
+		cache->n_fills--;
+
+		lcache_store_read(cache, req);
+	}
+}
+
+static void
+lcache_drop_fill(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	uint32_t u, last;
+
+	last = lcache_last_unit(cache, req->treq.sec, req->treq.secs);
+	for (u = lcache_first_unit(cache, req->treq.sec); u <= last; u++)
+		cache->units[u].pending--;
+
+	list_del_init(&req->next);
+	cache->n_fills--;
+	cache->stats.dropped++;
+}
+
+/*
+ * Give up the oldest fill not yet written, for a read to use.
+ */
+static td_lcache_req_t *
+lcache_reclaim_fill(td_lcache_t *cache)
+{
+	td_lcache_req_t *req;
+
+	if (list_empty(&cache->fills))
+		return NULL;
+
+	req = list_entry(cache->fills.next, td_lcache_req_t, next);
+	lcache_drop_fill(cache, req);
+
+	return req;
+}
+
+/*
+ * Append @req to a queued fill ending where it starts, if the two fit
+ * one buffer and agree on the guest writes seen in the units they
+ * share.
+ */
+static int
+lcache_merge_fill(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	uint32_t u, first, last, qfirst, qlast, rfirst;
+	td_lcache_req_t *q;
+	uint16_t writes[2];
+	int n = 0;
+
+	rfirst = lcache_first_unit(cache, req->treq.sec);
+	last   = lcache_last_unit(cache, req->treq.sec, req->treq.secs);
+
+	list_for_each_entry_reverse(q, &cache->fills, next) {
+		if (n++ == LCACHE_MERGE_SCAN)
+			break;
+
+		if (q->treq.sec + q->treq.secs != req->treq.sec)
+			continue;
+
+		if ((size_t)(q->treq.secs + req->treq.secs) << SECTOR_SHIFT >
+		    cache->bufsz)
+			return 0;
+
+		first = qfirst = lcache_first_unit(cache, q->treq.sec);
+		qlast = lcache_last_unit(cache, q->treq.sec, q->treq.secs);
+		if (last - first > 1)
+			return 0;
+
+		for (u = first; u <= last; u++) {
+			if (u <= qlast)
+				writes[u - first] = q->writes[u - qfirst];
+			else
+				writes[u - first] = req->writes[u - rfirst];
+
+			if (u >= rfirst &&
+			    writes[u - first] != req->writes[u - rfirst])
+				return 0;
+		}
+
+		memcpy(q->buf + (q->treq.secs << SECTOR_SHIFT), req->buf,
+		       req->treq.secs << SECTOR_SHIFT);
+		q->treq.secs += req->treq.secs;
+		memcpy(q->writes, writes, sizeof(writes));
+
+		/* units both covered are written once now */
+		for (u = rfirst; u <= qlast; u++)
+			cache->units[u].pending--;
+
+		cache->stats.merged++;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+lcache_queue_fill(td_lcache_t *cache, td_lcache_req_t *req)
+{
+	if (lcache_merge_fill(cache, req)) {
+		lcache_free_request(cache, req);
+		goto kick;
+	}
+
+	if (cache->n_fills >= cache->max_fills)
+		lcache_free_request(cache, lcache_reclaim_fill(cache));
+
+	list_add_tail(&req->next, &cache->fills);
+	cache->n_fills++;
+
+kick:
+	lcache_kick_fills(cache);
 }
 
 static void
 lcache_complete_read(td_lcache_t *cache, td_lcache_req_t *req)
 {
+	td_vbd_t *vbd = req->treq.vreq->vbd;
+
 	if (likely(!req->err)) {
 		size_t sz = req->treq.secs << SECTOR_SHIFT;
 		memcpy(req->treq.buf, req->buf, sz);
@@ -286,12 +1159,14 @@ lcache_complete_read(td_lcache_t *cache, td_lcache_req_t *req)
 
 	td_complete_request(req->treq, req->err);
 
-	if (unlikely(req->err) || !lcache_wr_enabled(cache)) {
+	if (unlikely(req->err) || !lcache_wr_enabled(cache) ||
+	    lcache_admit_request(cache, vbd, req)) {
 		lcache_free_request(cache, req);
 		return;
 	}
 
-	lcache_store_read(cache, req);
+	cache->vbd = vbd;
+	lcache_queue_fill(cache, req);
 }
 
 static void
@@ -314,10 +1189,13 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	td_lcache_t *cache = driver->data;
 	td_request_t clone;
 	td_lcache_req_t *req;
+	uint32_t u, first, last;
 
-	req = lcache_alloc_request(cache);
+	req = lcache_alloc_request(cache) ? : lcache_reclaim_fill(cache);
 	if (!req) {
-		td_complete_request(treq, -EBUSY);
+		/* every buffer is busy: serve the read, but do not cache it */
+		cache->stats.uncached++;
+		td_forward_request(treq);
 		return;
 	}
 
@@ -327,6 +1205,12 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	req->secs    = req->treq.secs;
 	req->err     = 0;
 
+	first = lcache_first_unit(cache, treq.sec);
+	last  = lcache_last_unit(cache, treq.sec, treq.secs);
+	BUG_ON(last - first > 1);
+	for (u = first; u <= last; u++)
+		req->writes[u - first] = cache->units[u].writes;
+
 	clone         = treq;
 	clone.buf     = req->buf;
 	clone.cb      = __lcache_read_cb;
@@ -335,6 +1219,26 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	td_forward_request(clone);
 }
 
+/*
+ * The cache only ever sees requests the leaf passed down to its
+ * read-only parents, which are never discarded into. Any discard
+ * reaching it has nothing left to release.
+ */
+static void
+lcache_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	td_complete_request(treq, 0);
+}
+
+/*
+ * Nor does it hold anything dirty to flush.
+ */
+static void
+lcache_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	td_complete_request(treq, 0);
+}
+
 static int
 lcache_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
 {
@@ -351,6 +1255,35 @@ lcache_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static void
+lcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_lcache_t *cache = driver->data;
+
+	tapdisk_stats_field(st, "units", "{");
+	tapdisk_stats_field(st, "size", "llu",
+			    (unsigned long long)cache->unit_secs << SECTOR_SHIFT);
+	tapdisk_stats_field(st, "capacity", "u", cache->capacity);
+	tapdisk_stats_field(st, "cached", "u", cache->used);
+	tapdisk_stats_field(st, "pinned", "u", cache->pinned);
+	tapdisk_stats_field(st, "loaded", "llu", cache->stats.loaded);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "admitted", "llu", cache->stats.admitted);
+	tapdisk_stats_field(st, "rejected", "llu", cache->stats.rejected);
+	tapdisk_stats_field(st, "evicted", "llu", cache->stats.evicted);
+	tapdisk_stats_field(st, "stale", "llu", cache->stats.stale);
+	tapdisk_stats_field(st, "persistent", "d", !!cache->index);
+
+	tapdisk_stats_field(st, "fills", "{");
+	tapdisk_stats_field(st, "queued", "d", cache->n_fills);
+	tapdisk_stats_field(st, "pending", "d", cache->fills_pending);
+	tapdisk_stats_field(st, "merged", "llu", cache->stats.merged);
+	tapdisk_stats_field(st, "dropped", "llu", cache->stats.dropped);
+	tapdisk_stats_field(st, "uncached", "llu", cache->stats.uncached);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_lcache = {
 	.disk_type                  = "tapdisk_lcache",
 	.flags                      = 0,
@@ -358,6 +1291,9 @@ struct tap_disk tapdisk_lcache = {
 	.td_open                    = lcache_open,
 	.td_close                   = lcache_close,
 	.td_queue_read              = lcache_queue_read,
+	.td_queue_discard           = lcache_queue_discard,
+	.td_queue_flush             = lcache_queue_flush,
 	.td_get_parent_id           = lcache_get_parent_id,
 	.td_validate_parent         = lcache_validate_parent,
+	.td_stats                   = lcache_stats,
 };
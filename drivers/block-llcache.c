@@ -20,12 +20,21 @@
 #endif
 
 #include <errno.h>
-
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
+#include "tapdisk-server.h"
+#include "tapdisk-stats.h"
 
 #define DBG(_f, _a...)  tlog_syslog(TLOG_DBG, _f, ##_a)
 #define INFO(_f, _a...) tlog_syslog(TLOG_INFO, _f, ##_a)
@@ -102,18 +111,113 @@ enum {
 	 *
 	 * Failure to write SHARED is irrecoverable.
 	 */
+
+	LLP_WRITEBACK = 3,
+	/*
+	 * LLP_WRITEBACK:
+	 *
+	 * Writes complete once on LOCAL and recorded in an ordered
+	 * log next to it. A destager copies logged extents from LOCAL
+	 * to SHARED in the background, at a limited rate. Reads are
+	 * issued to LOCAL.
+	 *
+	 * Whenever the log is full, or draining, writes go to both
+	 * LOCAL and SHARED, as in LLP_MIRROR.
+	 *
+	 * Failure to write LOCAL for lack of space is recoverable,
+	 * the write is redirected to SHARED. The driver stays in
+	 * LLP_WRITEBACK, LOCAL still holds dirty extents.
+	 *
+	 * Failure to write SHARED is irrecoverable, and signaled to
+	 * the original issuer, or retried by the destager.
+	 */
 };
 
+#define LLP_LOG_SUFFIX          ".wblog"
+#define LLP_LOG_COOKIE          "tapllprc"
+#define LLP_LOG_HDR_COOKIE      "tapllphd"
+#define LLP_LOG_SLOTS           4096
+
+#define LLP_DESTAGE_MAX         4
+#define LLP_DESTAGE_RATE        (64 << 20)   /* bytes/s */
+#define LLP_DESTAGE_RETRY       1000         /* ms */
+
 typedef struct llpcache                 td_llpcache_t;
 typedef struct llpcache_request         td_llpcache_req_t;
-#define TD_LLPCACHE_MAX_REQ             (MAX_REQUESTS*2)
+
+/*
+ * On-disk write-back log, big-endian. The header is sector 0, followed
+ * by one record sector per slot. A record covers one write acknowledged
+ * from LOCAL, slot seqno % slots. Records before @clean are on SHARED.
+ */
+struct llp_log_header {
+	char                    cookie[8];
+	uuid_t                  uuid;        /* of LOCAL */
+	uint64_t                clean;
+	uint32_t                slots;
+	uint32_t                checksum;
+};
+
+struct llp_log_record {
+	char                    cookie[8];
+	uint64_t                seqno;
+	uint64_t                sec;
+	uint32_t                secs;
+	uint32_t                checksum;
+};
+
+enum {
+	LLP_EXT_CLEAN = 0,
+	LLP_EXT_LOGGING,
+	LLP_EXT_DIRTY,
+	LLP_EXT_DESTAGING,
+};
+
+struct llp_extent {
+	uint64_t                seqno;
+	td_sector_t             sec;
+	int                     secs;
+	int                     state;
+};
 
 struct llpcache_vreq {
 	enum { LOCAL = 0, SHARED = 1 }  target;
 	td_vbd_request_t                vreq;
 };
 
+/*
+ * Extents in seqno order: [tail, head) are logged, and not known to be
+ * on SHARED yet. The destager resumes at @cursor. The header on disk
+ * says @synced, a checkpoint in flight moves it to @ckpt.
+ */
+struct llp_log {
+	int                     fd;
+	char                   *path;
+	uuid_t                  uuid;
+	uint32_t                slots;
+
+	uint64_t                head;
+	uint64_t                tail;
+	uint64_t                cursor;
+	uint64_t                synced;
+
+	uint64_t                ckpt;
+	int                     ckpt_busy;
+	int                     ckpt_error;
+	int                     writing;     /* header write in flight */
+	struct llpcache_vreq    flush;
+	struct td_iovec         flush_iov;
+	struct tiocb            tiocb;
+
+	struct llp_extent      *exts;
+	char                   *hdr;
+	char                   *recs;        /* one sector per request */
+};
+
+#define LLP_LOG_PENDING         (1U << 2)
+
 struct llpcache_request {
+	td_llpcache_t          *s;
 	td_request_t            treq;
 
 	struct td_iovec         iov;
@@ -122,16 +226,51 @@ struct llpcache_request {
 	struct llpcache_vreq    lvr[2];
 
 	unsigned int            pending;
+	unsigned int            issued;
 	int                     mode;
+
+	struct llp_extent      *ext;
+	struct tiocb            tiocb;
+};
+
+struct llp_destage {
+	struct llp_extent      *ext;
+	struct td_iovec         iov;
+	struct llpcache_vreq    lvr;
+	int                     stale;
+	char                   *buf;
 };
 
 struct llpcache {
 	td_image_t             *local;
 	int                     mode;
 
-	td_llpcache_req_t       reqv[TD_LLPCACHE_MAX_REQ];
-	td_llpcache_req_t      *free[TD_LLPCACHE_MAX_REQ];
+	td_llpcache_req_t      *reqv;
+	td_llpcache_req_t     **free;
+	int                     n_reqs;
 	int                     n_free;
+
+	struct llp_log          log;
+	int                     write_back;
+	int                     draining;
+	int                     shared_dirty; /* written since flushed */
+	td_vbd_t               *vbd;
+
+	struct llp_destage      destage[LLP_DESTAGE_MAX];
+	int                     n_destaging;
+	int                     max_secs;
+	int64_t                 tokens;      /* bytes */
+	struct timeval          ts;
+	event_id_t              timer;
+
+	struct {
+		unsigned long long      destaged;
+		unsigned long long      destaged_secs;
+		unsigned long long      write_through;
+		unsigned long long      redirected;
+		unsigned long long      errors;
+		unsigned long long      replayed;
+	} stats;
 };
 
 static td_llpcache_req_t *
@@ -146,10 +285,551 @@ llpcache_alloc_request(td_llpcache_t *s)
 }
 
 static void
-llpcache_free_request(td_llpcache_t *s, td_llpcache_req_t *req)
+llpcache_free_request(td_llpcache_t *s, td_llpcache_req_t *req)
+{
+	BUG_ON(s->n_free >= s->n_reqs);
+	s->free[s->n_free++] = req;
+}
+
+static void llp_destage_kick(td_llpcache_t *);
+
+static uint32_t
+llp_log_checksum(const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint32_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		sum += p[i];
+
+	return ~sum;
+}
+
+static void
+llp_log_header_out(struct llp_log_header *h)
+{
+	BE64_OUT(&h->clean);
+	BE32_OUT(&h->slots);
+	h->checksum = 0;
+	h->checksum = llp_log_checksum(h, sizeof(*h));
+	BE32_OUT(&h->checksum);
+}
+
+static int
+llp_log_header_in(struct llp_log_header *h)
+{
+	uint32_t checksum;
+
+	if (memcmp(h->cookie, LLP_LOG_HDR_COOKIE, sizeof(h->cookie)))
+		return -EINVAL;
+
+	checksum    = h->checksum;
+	h->checksum = 0;
+	BE32_IN(&checksum);
+	if (checksum != llp_log_checksum(h, sizeof(*h)))
+		return -EINVAL;
+
+	BE64_IN(&h->clean);
+	BE32_IN(&h->slots);
+	return 0;
+}
+
+static void
+llp_log_record_out(struct llp_log_record *rec)
+{
+	BE64_OUT(&rec->seqno);
+	BE64_OUT(&rec->sec);
+	BE32_OUT(&rec->secs);
+	rec->checksum = 0;
+	rec->checksum = llp_log_checksum(rec, sizeof(*rec));
+	BE32_OUT(&rec->checksum);
+}
+
+static int
+llp_log_record_in(struct llp_log_record *rec)
+{
+	uint32_t checksum;
+
+	if (memcmp(rec->cookie, LLP_LOG_COOKIE, sizeof(rec->cookie)))
+		return -EINVAL;
+
+	checksum      = rec->checksum;
+	rec->checksum = 0;
+	BE32_IN(&checksum);
+	if (checksum != llp_log_checksum(rec, sizeof(*rec)))
+		return -EINVAL;
+
+	BE64_IN(&rec->seqno);
+	BE64_IN(&rec->sec);
+	BE32_IN(&rec->secs);
+	return 0;
+}
+
+static inline struct llp_extent *
+llp_log_extent(struct llp_log *l, uint64_t seqno)
+{
+	return &l->exts[seqno % l->slots];
+}
+
+static void
+llp_log_prep_header(td_llpcache_t *s, uint64_t clean)
+{
+	struct llp_log *l = &s->log;
+	struct llp_log_header *h = (struct llp_log_header *)l->hdr;
+
+	memset(l->hdr, 0, VHD_SECTOR_SIZE);
+	memcpy(h->cookie, LLP_LOG_HDR_COOKIE, sizeof(h->cookie));
+	uuid_copy(h->uuid, l->uuid);
+	h->clean = clean;
+	h->slots = l->slots;
+	llp_log_header_out(h);
+}
+
+/*
+ * Synchronous, for open and close only.
+ */
+static int
+llp_log_write_header(td_llpcache_t *s, uint64_t clean)
+{
+	struct llp_log *l = &s->log;
+
+	llp_log_prep_header(s, clean);
+
+	if (pwrite(l->fd, l->hdr, VHD_SECTOR_SIZE, 0) != VHD_SECTOR_SIZE) {
+		s->stats.errors++;
+		return (errno ? -errno : -EIO);
+	}
+
+	l->synced = clean;
+	return 0;
+}
+
+static int
+llp_log_read_header(td_llpcache_t *s)
+{
+	struct llp_log *l = &s->log;
+	struct llp_log_header *h = (struct llp_log_header *)l->hdr;
+	ssize_t ret;
+	int err;
+
+	ret = pread(l->fd, l->hdr, VHD_SECTOR_SIZE, 0);
+	if (ret == -1)
+		return -errno;
+	if (ret != VHD_SECTOR_SIZE)
+		return -EINVAL;
+
+	err = llp_log_header_in(h);
+	if (err)
+		return err;
+
+	if (uuid_compare(h->uuid, l->uuid) || h->slots != LLP_LOG_SLOTS)
+		return -EINVAL;
+
+	l->slots  = h->slots;
+	l->synced = h->clean;
+	return 0;
+}
+
+static void llp_log_advance(td_llpcache_t *);
+
+static void
+__llp_log_header_cb(void *arg, struct tiocb *tiocb, int err)
+{
+	td_llpcache_t *s = arg;
+	struct llp_log *l = &s->log;
+
+	l->writing   = 0;
+	l->ckpt_busy = 0;
+
+	if (err) {
+		s->stats.errors++;
+		l->ckpt_error = err;
+		WARN("%s: header write failed: %d\n", l->path, err);
+		return;
+	}
+
+	l->synced = l->ckpt;
+	llp_log_advance(s);
+}
+
+static void
+__llp_log_flush_cb(td_vbd_request_t *vreq, int error,
+		   void *token, int final)
+{
+	td_llpcache_t *s = token;
+	struct llp_log *l = &s->log;
+
+	if (error) {
+		s->stats.errors++;
+		l->ckpt_error = error;
+		l->ckpt_busy  = 0;
+		WARN("%s: flushing shared: %d\n", l->path, error);
+		return;
+	}
+
+	llp_log_prep_header(s, l->ckpt);
+
+	l->writing = 1;
+	td_prep_write(&l->tiocb, l->fd, l->hdr, VHD_SECTOR_SIZE, 0,
+		      __llp_log_header_cb, s);
+	td_queue_tiocb(s->local->driver, &l->tiocb);
+}
+
+/*
+ * Moves the clean mark on disk up to the tail. Destaged extents are
+ * only on SHARED for good once it flushed them, so SHARED is flushed
+ * first, then the header written, both off the event loop. One
+ * checkpoint is in flight at a time.
+ */
+static void
+llp_log_checkpoint(td_llpcache_t *s)
+{
+	struct llp_log *l = &s->log;
+	td_vbd_request_t *vreq = &l->flush.vreq;
+
+	if (l->ckpt_busy || l->synced == l->tail || !s->vbd)
+		return;
+
+	l->ckpt_busy  = 1;
+	l->ckpt_error = 0;
+	l->ckpt       = l->tail;
+
+	l->flush_iov.base = NULL;
+	l->flush_iov.secs = 1;
+
+	memset(vreq, 0, sizeof(*vreq));
+	l->flush.target = SHARED;
+	vreq->op        = TD_OP_FLUSH;
+	vreq->sec       = 0;
+	vreq->iov       = &l->flush_iov;
+	vreq->iovcnt    = 1;
+	vreq->cb        = __llp_log_flush_cb;
+	vreq->token     = s;
+
+	tapdisk_vbd_queue_request(s->vbd, vreq);
+}
+
+/*
+ * Moves the tail over extents on SHARED. The header follows lazily, a
+ * stale one only makes replay copy more than needed.
+ */
+static void
+llp_log_advance(td_llpcache_t *s)
+{
+	struct llp_log *l = &s->log;
+
+	while (l->tail < l->head &&
+	       llp_log_extent(l, l->tail)->state == LLP_EXT_CLEAN)
+		l->tail++;
+
+	l->cursor = MAX(l->cursor, l->tail);
+
+	if (l->tail - l->synced >= l->slots / 8)
+		llp_log_checkpoint(s);
+}
+
+/*
+ * Every record at or past the clean mark in the header was acknowledged
+ * from LOCAL, and may be missing on SHARED. Slots in between which hold
+ * no such record were never acknowledged.
+ */
+static int
+llp_log_replay(td_llpcache_t *s)
+{
+	struct llp_log *l = &s->log;
+	struct llp_log_record *rec;
+	struct llp_extent *ext;
+	uint64_t seqno, head;
+	size_t size;
+	ssize_t ret;
+	char *buf;
+	int i, err;
+
+	size = (size_t)l->slots << SECTOR_SHIFT;
+
+	err = posix_memalign((void **)&buf, VHD_SECTOR_SIZE, size);
+	if (err)
+		return -err;
+
+	ret = pread(l->fd, buf, size, VHD_SECTOR_SIZE);
+	if (ret != size) {
+		err = (ret == -1 ? -errno : -EINVAL);
+		goto out;
+	}
+
+	head = l->synced;
+
+	for (i = 0; i < l->slots; i++) {
+		rec = (struct llp_log_record *)(buf + (i << SECTOR_SHIFT));
+
+		if (llp_log_record_in(rec))
+			continue;
+
+		if (rec->seqno < l->synced ||
+		    rec->seqno % l->slots != i ||
+		    rec->sec + rec->secs > s->local->info.size)
+			continue;
+
+		ext        = &l->exts[i];
+		ext->seqno = rec->seqno;
+		ext->sec   = rec->sec;
+		ext->secs  = rec->secs;
+		ext->state = LLP_EXT_DIRTY;
+
+		head = MAX(head, rec->seqno + 1);
+		s->stats.replayed++;
+	}
+
+	for (seqno = l->synced; seqno < head; seqno++) {
+		ext = llp_log_extent(l, seqno);
+		if (ext->state == LLP_EXT_DIRTY && ext->seqno == seqno)
+			continue;
+
+		memset(ext, 0, sizeof(*ext));
+		ext->seqno = seqno;
+	}
+
+	l->head   = head;
+	l->tail   = l->synced;
+	l->cursor = l->synced;
+
+	if (s->stats.replayed)
+		INFO("%s: replaying %llu writes\n", l->path, s->stats.replayed);
+
+out:
+	free(buf);
+	return err;
+}
+
+/*
+ * Makes a fresh log, or clears one left behind for another image of
+ * the same name.
+ */
+static int
+llp_log_create(td_llpcache_t *s)
+{
+	struct llp_log *l = &s->log;
+	off64_t size = (off64_t)(1 + LLP_LOG_SLOTS) << SECTOR_SHIFT;
+
+	if (ftruncate(l->fd, 0) || ftruncate(l->fd, size))
+		return -errno;
+
+	memset(l->exts, 0, LLP_LOG_SLOTS * sizeof(struct llp_extent));
+	l->slots  = LLP_LOG_SLOTS;
+	l->head   = 0;
+	l->tail   = 0;
+	l->cursor = 0;
+
+	return llp_log_write_header(s, 0);
+}
+
+static void
+llp_log_close(td_llpcache_t *s)
+{
+	struct llp_log *l = &s->log;
+
+	if (l->fd >= 0) {
+		td_unregister_file(l->fd);
+		close(l->fd);
+	}
+
+	free(l->path);
+	free(l->exts);
+	free(l->hdr);
+	free(l->recs);
+	memset(l, 0, sizeof(*l));
+	l->fd = -1;
+}
+
+static int
+llp_log_open(td_llpcache_t *s, const char *name)
+{
+	struct llp_log *l = &s->log;
+	vhd_context_t vhd;
+	int err;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY | VHD_OPEN_META_LOG);
+	if (err)
+		return err;
+
+	uuid_copy(l->uuid, vhd.footer.uuid);
+	vhd_close(&vhd);
+
+	err = asprintf(&l->path, "%s%s", name, LLP_LOG_SUFFIX);
+	if (err == -1) {
+		l->path = NULL;
+		return -ENOMEM;
+	}
+
+	l->exts = calloc(LLP_LOG_SLOTS, sizeof(struct llp_extent));
+	if (!l->exts)
+		return -ENOMEM;
+
+	err = posix_memalign((void **)&l->hdr, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	if (err)
+		return -err;
+
+	err = posix_memalign((void **)&l->recs, VHD_SECTOR_SIZE,
+			     (size_t)s->n_reqs << SECTOR_SHIFT);
+	if (err)
+		return -err;
+
+	l->fd = open(l->path, O_RDWR | O_CREAT | O_DIRECT | O_DSYNC, 0644);
+	if (l->fd == -1 && errno == EINVAL)
+		l->fd = open(l->path, O_RDWR | O_CREAT | O_DSYNC, 0644);
+	if (l->fd == -1)
+		return -errno;
+
+	td_register_file(l->fd);
+
+	err = llp_log_read_header(s);
+	if (!err)
+		err = llp_log_replay(s);
+	if (err)
+		err = llp_log_create(s);
+	if (err)
+		return err;
+
+	llp_log_advance(s);
+
+	return 0;
+}
+
+/*
+ * Takes the next log slot for @treq, or NULL if it has to be written
+ * through to SHARED.
+ */
+static struct llp_extent *
+llp_log_reserve(td_llpcache_t *s, td_request_t *treq)
+{
+	struct llp_log *l = &s->log;
+	struct llp_extent *ext;
+
+	if (s->draining || treq->secs > s->max_secs)
+		return NULL;
+
+	if (l->head - l->tail >= l->slots)
+		return NULL;
+
+	ext        = llp_log_extent(l, l->head);
+	BUG_ON(ext->state != LLP_EXT_CLEAN);
+
+	ext->seqno = l->head++;
+	ext->sec   = treq->sec;
+	ext->secs  = treq->secs;
+	ext->state = LLP_EXT_LOGGING;
+
+	return ext;
+}
+
+/*
+ * A logged write completed. Unless it failed, or went to SHARED
+ * anyway, its extent awaits the destager.
+ */
+static void
+llp_log_commit(td_llpcache_t *s, struct llp_extent *ext, int clean)
+{
+	BUG_ON(ext->state != LLP_EXT_LOGGING);
+
+	if (clean) {
+		ext->state = LLP_EXT_CLEAN;
+		llp_log_advance(s);
+	} else
+		ext->state = LLP_EXT_DIRTY;
+
+	llp_destage_kick(s);
+}
+
+static void
+llpcache_complete_write(td_llpcache_t *s, td_llpcache_req_t *req)
+{
+	if (req->pending)
+		return;
+
+	if (req->ext)
+		llp_log_commit(s, req->ext,
+			       req->error || (req->issued & (1U << SHARED)));
+
+	/* FIXME: Make sure this won't retry. */
+	td_complete_request(req->treq, req->error);
+	llpcache_free_request(s, req);
+}
+
+static void
+__llpcache_write_cb(td_vbd_request_t *vreq, int error,
+		   void *token, int final);
+
+/*
+ * NB. Write mirroring. Lacking per-image queues, it's still a
+ * hack. But shall do for now:
+ *
+ *   1. Store the treq, thereby blocking the original vreq.
+ *   2. Reissue, as two clone vreqs. One local, one shared.
+ *   3. Clones seen again then get forwarded.
+ *   4. Treq completes after both vreqs.
+ *
+ * We can recognize clones by matching the vreq->token field.
+ */
+
+static int
+llpcache_requeue_treq(td_llpcache_t *s, td_llpcache_req_t *req, int target)
+{
+	struct llpcache_vreq *lvr;
+	td_vbd_request_t *vreq;
+	int err;
+
+	lvr           = &req->lvr[target];
+	lvr->target   = target;
+
+	vreq          = &lvr->vreq;
+	vreq->op      = TD_OP_WRITE;
+	vreq->sec     = req->treq.sec;
+	vreq->iov     = &req->iov;
+	vreq->iovcnt  = 1;
+	vreq->cb      = __llpcache_write_cb;
+	vreq->token   = s;
+
+	err = tapdisk_vbd_queue_request(req->treq.vreq->vbd, vreq);
+	if (err)
+		goto fail;
+
+	req->pending |= 1UL << target;
+	req->issued  |= 1UL << target;
+
+	if (target == SHARED)
+		s->shared_dirty = 1;
+
+	return 0;
+
+fail:
+	req->error   = req->error ? : err;
+	return err;
+}
+
+/*
+ * A write reaching SHARED directly overtakes whatever an overlapping
+ * destage read from LOCAL before. Such destages are redone.
+ */
+static void
+llp_destage_invalidate(td_llpcache_t *s, td_sector_t sec, int secs)
+{
+	struct llp_destage *d;
+	int i;
+
+	for (i = 0; i < LLP_DESTAGE_MAX; i++) {
+		d = &s->destage[i];
+		if (d->ext &&
+		    d->ext->sec < sec + secs && sec < d->ext->sec + d->ext->secs)
+			d->stale = 1;
+	}
+}
+
+static void
+llpcache_write_shared(td_llpcache_t *s, td_llpcache_req_t *req)
 {
-	BUG_ON(s->n_free >= TD_LLPCACHE_MAX_REQ);
-	s->free[s->n_free++] = req;
+	llp_destage_invalidate(s, req->treq.sec, req->treq.secs);
+	llpcache_requeue_treq(s, req, SHARED);
 }
 
 static void
@@ -171,62 +851,319 @@ __llpcache_write_cb(td_vbd_request_t *vreq, int error,
 		td_image_t *shared =
 			containerof(req->treq.image->next.next,
 				    td_image_t, next);
-		ll_log_switch(DISK_TYPE_LLPCACHE, error,
-			      s->local, shared);
-		s->mode = LLP_SHARED;
+
+		if (s->mode == LLP_WRITEBACK) {
+			if (!(req->issued & (1U << SHARED))) {
+				s->stats.redirected++;
+				llpcache_write_shared(s, req);
+			}
+		} else {
+			ll_log_switch(DISK_TYPE_LLPCACHE, error,
+				      s->local, shared);
+			s->mode = LLP_SHARED;
+		}
 		error = 0;
 	}
 
 	req->pending &= ~mask;
 	req->error    = ll_write_error(req->error, error);
 
-	if (!req->pending) {
-		/* FIXME: Make sure this won't retry. */
-		td_complete_request(req->treq, req->error);
-		llpcache_free_request(s, req);
+	llpcache_complete_write(s, req);
+}
+
+static void
+__llp_log_write_cb(void *arg, struct tiocb *tiocb, int err)
+{
+	td_llpcache_req_t *req = arg;
+	td_llpcache_t *s = req->s;
+
+	BUG_ON(!(req->pending & LLP_LOG_PENDING));
+	req->pending &= ~LLP_LOG_PENDING;
+
+	if (err) {
+		s->stats.errors++;
+		WARN("%s: log write failed: %d, writing through\n",
+		     s->log.path, err);
+		if (!(req->issued & (1U << SHARED)))
+			llpcache_write_shared(s, req);
 	}
+
+	llpcache_complete_write(s, req);
+}
+
+static void
+llp_log_write(td_llpcache_t *s, td_llpcache_req_t *req)
+{
+	struct llp_log *l = &s->log;
+	struct llp_log_record *rec;
+	char *buf;
+
+	buf = l->recs + ((req - s->reqv) << SECTOR_SHIFT);
+	rec = (struct llp_log_record *)buf;
+
+	memset(buf, 0, VHD_SECTOR_SIZE);
+	memcpy(rec->cookie, LLP_LOG_COOKIE, sizeof(rec->cookie));
+	rec->seqno = req->ext->seqno;
+	rec->sec   = req->ext->sec;
+	rec->secs  = req->ext->secs;
+	llp_log_record_out(rec);
+
+	req->pending |= LLP_LOG_PENDING;
+
+	td_prep_write(&req->tiocb, l->fd, buf, VHD_SECTOR_SIZE,
+		      (1 + req->ext->seqno % l->slots) << SECTOR_SHIFT,
+		      __llp_log_write_cb, req);
+	td_queue_tiocb(s->local->driver, &req->tiocb);
 }
 
 /*
- * NB. Write mirroring. Lacking per-image queues, it's still a
- * hack. But shall do for now:
- *
- *   1. Store the treq, thereby blocking the original vreq.
- *   2. Reissue, as two clone vreqs. One local, one shared.
- *   3. Clones seen again then get forwarded.
- *   4. Treq completes after both vreqs.
- *
- * We can recognize clones by matching the vreq->token field.
+ * Destaging. Dirty extents are read back from LOCAL and written to
+ * SHARED, oldest first, as vbd requests of our own. Like write clones,
+ * they carry our token and are routed by llpcache_forward_write.
+ */
+
+static void
+__llp_destage_timeout(event_id_t id, char mode, void *private)
+{
+	td_llpcache_t *s = private;
+
+	tapdisk_server_unregister_event(s->timer);
+	s->timer = -1;
+
+	llp_destage_kick(s);
+}
+
+static void
+llp_destage_arm(td_llpcache_t *s, int ms)
+{
+	event_id_t id;
+
+	if (s->timer >= 0)
+		return;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT, -1, ms,
+					   __llp_destage_timeout, s);
+	if (id < 0) {
+		WARN("%s: destage timer: %d\n", s->log.path, id);
+		return;
+	}
+
+	s->timer = id;
+}
+
+/*
+ * Token bucket, LLP_DESTAGE_RATE with a one second burst. Unlimited
+ * while draining.
  */
+static int
+llp_destage_throttle(td_llpcache_t *s, int secs)
+{
+	int64_t bytes = (int64_t)secs << SECTOR_SHIFT;
+	struct timeval now, delta;
+
+	if (s->draining)
+		return 0;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &s->ts, &delta);
+	s->ts = now;
+
+	s->tokens += (int64_t)delta.tv_sec * LLP_DESTAGE_RATE +
+		(int64_t)delta.tv_usec * LLP_DESTAGE_RATE / 1000000;
+	s->tokens  = MIN(s->tokens, LLP_DESTAGE_RATE);
+
+	if (s->tokens < bytes) {
+		llp_destage_arm(s, (bytes - s->tokens) * 1000 /
+				LLP_DESTAGE_RATE + 1);
+		return -EAGAIN;
+	}
+
+	s->tokens -= bytes;
+	return 0;
+}
 
 static int
-llpcache_requeue_treq(td_llpcache_t *s, td_llpcache_req_t *req, int target)
+llp_destage_busy(td_llpcache_t *s, struct llp_extent *ext)
+{
+	struct llp_destage *d;
+	int i;
+
+	for (i = 0; i < LLP_DESTAGE_MAX; i++) {
+		d = &s->destage[i];
+		if (d->ext &&
+		    d->ext->sec < ext->sec + ext->secs &&
+		    ext->sec < d->ext->sec + d->ext->secs)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The next extent to destage. In log order: we stop at one not logged
+ * yet, or overlapping one still in flight.
+ */
+static struct llp_extent *
+llp_destage_next(td_llpcache_t *s)
+{
+	struct llp_log *l = &s->log;
+	struct llp_extent *ext;
+
+	for (; l->cursor < l->head; l->cursor++) {
+		ext = llp_log_extent(l, l->cursor);
+
+		if (ext->state == LLP_EXT_LOGGING)
+			return NULL;
+
+		if (ext->state != LLP_EXT_DIRTY)
+			continue;
+
+		if (llp_destage_busy(s, ext))
+			return NULL;
+
+		return ext;
+	}
+
+	return NULL;
+}
+
+static void
+llp_destage_done(td_llpcache_t *s, struct llp_destage *d, int error)
+{
+	struct llp_log *l = &s->log;
+	struct llp_extent *ext = d->ext;
+
+	BUG_ON(ext->state != LLP_EXT_DESTAGING);
+
+	d->ext = NULL;
+	s->n_destaging--;
+
+	if (error || d->stale) {
+		ext->state = LLP_EXT_DIRTY;
+		l->cursor  = MIN(l->cursor, ext->seqno);
+	} else {
+		ext->state = LLP_EXT_CLEAN;
+		s->stats.destaged++;
+		s->stats.destaged_secs += ext->secs;
+		llp_log_advance(s);
+	}
+
+	if (error) {
+		s->stats.errors++;
+		WARN("%s: destaging %d sectors at %llu: %d, retrying\n",
+		     s->log.path, ext->secs,
+		     (unsigned long long)ext->sec, error);
+		llp_destage_arm(s, LLP_DESTAGE_RETRY);
+		return;
+	}
+
+	llp_destage_kick(s);
+}
+
+static void
+__llp_destage_write_cb(td_vbd_request_t *vreq, int error,
+		       void *token, int final)
 {
+	td_llpcache_t *s = token;
 	struct llpcache_vreq *lvr;
-	td_vbd_request_t *vreq;
-	int err;
+	struct llp_destage *d;
 
-	lvr           = &req->lvr[target];
-	lvr->target   = target;
+	lvr = containerof(vreq, struct llpcache_vreq, vreq);
+	d   = containerof(lvr, struct llp_destage, lvr);
 
-	vreq          = &lvr->vreq;
-	vreq->op      = TD_OP_WRITE;
-	vreq->sec     = req->treq.sec;
-	vreq->iov     = &req->iov;
+	llp_destage_done(s, d, error);
+}
+
+static void
+__llp_destage_read_cb(td_vbd_request_t *vreq, int error,
+		      void *token, int final)
+{
+	td_llpcache_t *s = token;
+	struct llpcache_vreq *lvr;
+	struct llp_destage *d;
+
+	lvr = containerof(vreq, struct llpcache_vreq, vreq);
+	d   = containerof(lvr, struct llp_destage, lvr);
+
+	if (error || d->stale) {
+		llp_destage_done(s, d, error);
+		return;
+	}
+
+	memset(vreq, 0, sizeof(*vreq));
+	lvr->target  = SHARED;
+	vreq->op     = TD_OP_WRITE;
+	vreq->sec    = d->ext->sec;
+	vreq->iov    = &d->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = __llp_destage_write_cb;
+	vreq->token  = s;
+
+	tapdisk_vbd_queue_request(s->vbd, vreq);
+}
+
+static void
+llp_destage_start(td_llpcache_t *s, struct llp_destage *d,
+		  struct llp_extent *ext)
+{
+	td_vbd_request_t *vreq = &d->lvr.vreq;
+
+	ext->state   = LLP_EXT_DESTAGING;
+	d->ext       = ext;
+	d->stale     = 0;
+	d->iov.base  = d->buf;
+	d->iov.secs  = ext->secs;
+	s->n_destaging++;
+
+	memset(vreq, 0, sizeof(*vreq));
+	d->lvr.target = LOCAL;
+	vreq->op      = TD_OP_READ;
+	vreq->sec     = ext->sec;
+	vreq->iov     = &d->iov;
 	vreq->iovcnt  = 1;
-	vreq->cb      = __llpcache_write_cb;
+	vreq->cb      = __llp_destage_read_cb;
 	vreq->token   = s;
 
-	err = tapdisk_vbd_queue_request(req->treq.vreq->vbd, vreq);
-	if (err)
-		goto fail;
+	tapdisk_vbd_queue_request(s->vbd, vreq);
+}
 
-	req->pending |= 1UL << target;
-	return 0;
+static void
+llp_destage_kick(td_llpcache_t *s)
+{
+	struct llp_extent *ext;
+	int i;
 
-fail:
-	req->error   = req->error ? : err;
-	return err;
+	if (s->mode != LLP_WRITEBACK || !s->vbd || s->timer >= 0)
+		return;
+
+	for (i = 0; i < LLP_DESTAGE_MAX; i++) {
+		if (s->destage[i].ext)
+			continue;
+
+		ext = llp_destage_next(s);
+		if (!ext)
+			break;
+
+		if (llp_destage_throttle(s, ext->secs))
+			break;
+
+		llp_destage_start(s, &s->destage[i], ext);
+		s->log.cursor++;
+	}
+}
+
+/*
+ * Destage requests need a vbd to go to. Extents replayed at open wait
+ * for the first request, or a drain.
+ */
+static void
+llp_destage_attach(td_llpcache_t *s, td_vbd_t *vbd)
+{
+	if (s->vbd)
+		return;
+
+	s->vbd = vbd;
+	llp_destage_kick(s);
 }
 
 static void
@@ -242,18 +1179,34 @@ llpcache_fork_write(td_llpcache_t *s, td_request_t treq)
 		return;
 	}
 
-	memset(req, 0, sizeof(req));
+	memset(req, 0, sizeof(*req));
 
+	req->s        = s;
 	req->treq     = treq;
 
 	iov           = &req->iov;
 	iov->base     = treq.buf;
 	iov->secs     = treq.secs;
 
+	if (s->mode == LLP_WRITEBACK) {
+		llp_destage_attach(s, treq.vreq->vbd);
+		req->ext = llp_log_reserve(s, &treq);
+	}
+
 	err = llpcache_requeue_treq(s, req, LOCAL);
 	if (err)
 		goto fail;
 
+	if (req->ext) {
+		llp_log_write(s, req);
+		return;
+	}
+
+	if (s->mode == LLP_WRITEBACK) {
+		s->stats.write_through++;
+		llp_destage_invalidate(s, treq.sec, treq.secs);
+	}
+
 	err = llpcache_requeue_treq(s, req, SHARED);
 	if (err)
 		goto fail;
@@ -262,6 +1215,8 @@ llpcache_fork_write(td_llpcache_t *s, td_request_t treq)
 
 fail:
 	if (!req->pending) {
+		if (req->ext)
+			llp_log_commit(s, req->ext, 1);
 		td_complete_request(treq, req->error);
 		llpcache_free_request(s, req);
 	}
@@ -298,32 +1253,215 @@ llpcache_queue_write(td_driver_t *driver, td_request_t treq)
 		llpcache_fork_write(s, treq);
 }
 
+static void
+__llpcache_flush_cb(td_request_t treq, int error)
+{
+	td_llpcache_req_t *req = treq.cb_data;
+	td_llpcache_t *s = req->s;
+
+	BUG_ON(!req->pending);
+
+	req->pending--;
+	req->error = req->error ? : error;
+
+	if (req->pending)
+		return;
+
+	if (req->error)
+		s->shared_dirty = 1;
+
+	td_complete_request(req->treq, req->error);
+	llpcache_free_request(s, req);
+}
+
+/*
+ * Acknowledged writes are on LOCAL, mirrored or logged, so LOCAL is
+ * flushed every time. SHARED is too once writes went through to it,
+ * which is all of them unless in write-back. Destaged extents are left
+ * to the log checkpoint.
+ */
+static void
+llpcache_fork_flush(td_llpcache_t *s, td_request_t treq)
+{
+	td_llpcache_req_t *req;
+	td_request_t clone;
+	int shared;
+
+	if (s->mode == LLP_SHARED) {
+		td_forward_request(treq);
+		return;
+	}
+
+	req = llpcache_alloc_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	memset(req, 0, sizeof(*req));
+
+	req->s    = s;
+	req->treq = treq;
+
+	shared = s->mode != LLP_WRITEBACK || s->shared_dirty;
+	s->shared_dirty = 0;
+
+	/* flushes count the clones out, either may complete right away */
+	req->pending  = 1 + shared;
+
+	clone         = treq;
+	clone.cb      = __llpcache_flush_cb;
+	clone.cb_data = req;
+
+	td_queue_flush(s->local, clone);
+	if (shared)
+		td_forward_request(clone);
+}
+
+static void
+llpcache_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	td_llpcache_t *s = driver->data;
+
+	/* checkpoints flush SHARED alone */
+	if (treq.vreq->token == s)
+		td_forward_request(treq);
+	else
+		llpcache_fork_flush(s, treq);
+}
+
 static void
 llpcache_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	td_llpcache_t *s = driver->data;
 
 	switch (s->mode) {
+	case LLP_WRITEBACK:
+		llp_destage_attach(s, treq.vreq->vbd);
+		/* fall through */
 	case LLP_MIRROR:
 		td_queue_read(s->local, treq);
 		break;
 	case LLP_SHARED:
 		td_forward_request(treq);
+		break;
 	default:
 		BUG();
 	}
 }
 
+/*
+ * Pause and snapshot wait for SHARED to be complete. New writes go
+ * through meanwhile, so the log only shrinks.
+ */
+static int
+llpcache_drain(td_driver_t *driver, td_vbd_t *vbd)
+{
+	td_llpcache_t *s = driver->data;
+	struct llp_log *l = &s->log;
+	int err;
+
+	if (s->mode != LLP_WRITEBACK)
+		return 0;
+
+	s->draining = 1;
+	llp_destage_attach(s, vbd);
+	llp_destage_kick(s);
+
+	if (l->tail < l->head)
+		return -EAGAIN;
+
+	if (l->ckpt_error) {
+		err = l->ckpt_error;
+		l->ckpt_error = 0;
+		return err;
+	}
+
+	if (l->synced != l->tail) {
+		llp_log_checkpoint(s);
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
 static int
 llpcache_close(td_driver_t *driver)
 {
 	td_llpcache_t *s = driver->data;
+	struct llp_log *l = &s->log;
+	int i;
+
+	if (s->timer >= 0) {
+		tapdisk_server_unregister_event(s->timer);
+		s->timer = -1;
+	}
+
+	while (l->writing)
+		tapdisk_server_iterate();
+
+	if (s->mode == LLP_WRITEBACK) {
+		if (l->synced != l->tail)
+			llp_log_write_header(s, l->tail);
+
+		if (!s->write_back && l->tail == l->head)
+			unlink(l->path);
+	}
+
+	llp_log_close(s);
+
+	for (i = 0; i < LLP_DESTAGE_MAX; i++) {
+		free(s->destage[i].buf);
+		s->destage[i].buf = NULL;
+	}
 
 	if (s->local) {
 		tapdisk_image_close(s->local);
 		s->local = NULL;
 	}
 
+	free(s->reqv);
+	s->reqv = NULL;
+
+	free(s->free);
+	s->free = NULL;
+
+	return 0;
+}
+
+/*
+ * A log left behind without write-back requested still gets
+ * destaged, with writes mirrored meanwhile.
+ */
+static int
+llpcache_open_log(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	td_llpcache_t *s = driver->data;
+	size_t size;
+	int i, err;
+
+	s->write_back = !!(flags & TD_OPEN_WRITE_BACK);
+
+	err = llp_log_open(s, name);
+	if (err)
+		return err;
+
+	size        = driver->max_segments * sysconf(_SC_PAGE_SIZE);
+	s->max_secs = size >> SECTOR_SHIFT;
+
+	for (i = 0; i < LLP_DESTAGE_MAX; i++) {
+		err = posix_memalign((void **)&s->destage[i].buf,
+				     sysconf(_SC_PAGE_SIZE), size);
+		if (err)
+			return -err;
+	}
+
+	s->tokens   = LLP_DESTAGE_RATE;
+	gettimeofday(&s->ts, NULL);
+
+	s->mode     = LLP_WRITEBACK;
+	s->draining = !s->write_back;
+
 	return 0;
 }
 
@@ -331,11 +1469,24 @@ static int
 llpcache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
 	td_llpcache_t *s = driver->data;
+	char *path;
 	int i, err;
 
-	s->mode = LLP_MIRROR;
+	s->mode   = LLP_MIRROR;
+	s->timer  = -1;
+	s->log.fd = -1;
 
-	for (i = 0; i < TD_LLPCACHE_MAX_REQ; i++)
+	s->n_reqs = driver->queue_depth * 2;
+	s->n_free = 0;
+
+	s->reqv = calloc(s->n_reqs, sizeof(td_llpcache_req_t));
+	s->free = calloc(s->n_reqs, sizeof(td_llpcache_req_t *));
+	if (!s->reqv || !s->free) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < s->n_reqs; i++)
 		llpcache_free_request(s, &s->reqv[i]);
 
 	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, &s->local);
@@ -344,6 +1495,23 @@ llpcache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	driver->info = s->local->driver->info;
 
+	err = asprintf(&path, "%s%s", name, LLP_LOG_SUFFIX);
+	if (err == -1) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if ((flags & TD_OPEN_WRITE_BACK) || !access(path, F_OK)) {
+		err = llpcache_open_log(driver, name, flags);
+		if (err) {
+			WARN("%s: no write-back log: %d, mirroring\n",
+			     path, err);
+			llp_log_close(s);
+		}
+	}
+
+	free(path);
+
 	return 0;
 
 fail:
@@ -371,6 +1539,36 @@ llcache_validate_parent(td_driver_t *driver,
 	return -ENOSYS;
 }
 
+static void
+llpcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_llpcache_t *s = driver->data;
+	struct llp_log *l = &s->log;
+
+	tapdisk_stats_field(st, "mode", "d", s->mode);
+
+	if (s->mode != LLP_WRITEBACK)
+		return;
+
+	tapdisk_stats_field(st, "log", "{");
+	tapdisk_stats_field(st, "slots", "u", l->slots);
+	tapdisk_stats_field(st, "dirty", "llu",
+			    (unsigned long long)(l->head - l->tail));
+	tapdisk_stats_field(st, "replayed", "llu", s->stats.replayed);
+	tapdisk_stats_field(st, "draining", "d", s->draining);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "destage", "{");
+	tapdisk_stats_field(st, "pending", "d", s->n_destaging);
+	tapdisk_stats_field(st, "extents", "llu", s->stats.destaged);
+	tapdisk_stats_field(st, "sectors", "llu", s->stats.destaged_secs);
+	tapdisk_stats_field(st, "errors", "llu", s->stats.errors);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "write_through", "llu",
+			    s->stats.write_through);
+	tapdisk_stats_field(st, "redirected", "llu", s->stats.redirected);
+}
 
 struct tap_disk tapdisk_llpcache = {
 	.disk_type                  = "tapdisk_llpcache",
@@ -380,8 +1578,11 @@ struct tap_disk tapdisk_llpcache = {
 	.td_close                   = llpcache_close,
 	.td_queue_read              = llpcache_queue_read,
 	.td_queue_write             = llpcache_queue_write,
+	.td_queue_flush             = llpcache_queue_flush,
 	.td_get_parent_id           = llcache_get_parent_id,
 	.td_validate_parent         = llcache_validate_parent,
+	.td_stats                   = llpcache_stats,
+	.td_drain                   = llpcache_drain,
 };
 
 /*
@@ -430,7 +1631,6 @@ enum {
 
 typedef struct llecache                 td_llecache_t;
 typedef struct llecache_request         td_llecache_req_t;
-#define TD_LLECACHE_MAX_REQ             (MAX_REQUESTS*2)
 
 struct llecache_request {
 	td_llecache_t          *s;
@@ -443,8 +1643,9 @@ struct llecache {
 	td_image_t             *shared;
 	int                     mode;
 
-	td_llecache_req_t       reqv[TD_LLECACHE_MAX_REQ];
-	td_llecache_req_t      *free[TD_LLECACHE_MAX_REQ];
+	td_llecache_req_t      *reqv;
+	td_llecache_req_t     **free;
+	int                     n_reqs;
 	int                     n_free;
 };
 
@@ -462,7 +1663,7 @@ llecache_alloc_request(td_llecache_t *s)
 static void
 llecache_free_request(td_llecache_t *s, td_llecache_req_t *req)
 {
-	BUG_ON(s->n_free >= TD_LLECACHE_MAX_REQ);
+	BUG_ON(s->n_free >= s->n_reqs);
 	s->free[s->n_free++] = req;
 }
 
@@ -476,6 +1677,12 @@ llecache_close(td_driver_t *driver)
 		s->shared = NULL;
 	}
 
+	free(s->reqv);
+	s->reqv = NULL;
+
+	free(s->free);
+	s->free = NULL;
+
 	return 0;
 }
 
@@ -487,7 +1694,17 @@ llecache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	s->mode = LLE_LOCAL;
 
-	for (i = 0; i < TD_LLECACHE_MAX_REQ; i++)
+	s->n_reqs = driver->queue_depth * 2;
+	s->n_free = 0;
+
+	s->reqv = calloc(s->n_reqs, sizeof(td_llecache_req_t));
+	s->free = calloc(s->n_reqs, sizeof(td_llecache_req_t *));
+	if (!s->reqv || !s->free) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < s->n_reqs; i++)
 		llecache_free_request(s, &s->reqv[i]);
 
 	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, &s->shared);
@@ -542,7 +1759,7 @@ llecache_forward_write(td_llecache_t *s, td_request_t treq)
 		return;
 	}
 
-	memset(req, 0, sizeof(req));
+	memset(req, 0, sizeof(*req));
 
 	req->treq       = treq;
 	req->pending    = treq.secs;
@@ -657,6 +657,20 @@ static void tdlog_queue_write(td_driver_t* driver, td_request_t treq)
   td_forward_request(treq);
 }
 
+static void tdlog_queue_discard(td_driver_t* driver, td_request_t treq)
+{
+  struct tdlog_state* s = (struct tdlog_state*)driver->data;
+
+  /* discarded sectors change content, copy them like writes */
+  writelog_set(s, treq.sec, treq.secs);
+  td_forward_request(treq);
+}
+
+static void tdlog_queue_flush(td_driver_t* driver, td_request_t treq)
+{
+  td_forward_request(treq);
+}
+
 static int tdlog_get_parent_id(td_driver_t* driver, td_disk_id_t* id)
 {
   return -EINVAL;
@@ -676,6 +690,8 @@ struct tap_disk tapdisk_log = {
   .td_close           = tdlog_close,
   .td_queue_read      = tdlog_queue_read,
   .td_queue_write     = tdlog_queue_write,
+  .td_queue_discard   = tdlog_queue_discard,
+  .td_queue_flush     = tdlog_queue_flush,
   .td_get_parent_id   = tdlog_get_parent_id,
   .td_validate_parent = tdlog_validate_parent,
 };
@@ -46,8 +46,7 @@
 #define N_PASSED_FDS 10
 #define TAPDISK_NBDCLIENT_MAX_PATH_LEN 256
 #define TAPDISK_NBDCLIENT_LISTEN_SOCK_PATH "/var/run/blktap-control/nbdclient"
-#define MAX_NBD_REQS TAPDISK_DATA_REQUESTS
-#define NBD_TIMEOUT 30
+#define NBD_TIMEOUT (30 * 1000) /* ms */
 
 /* 
  * We'll only ever have one nbdclient fd receiver per tapdisk process, so let's 
@@ -86,7 +85,7 @@ struct tdnbd_data
 	struct list_head        sent_reqs;
 	struct list_head        pending_reqs;
 	struct list_head        free_reqs;
-	struct td_nbd_request   requests[MAX_NBD_REQS];
+	struct td_nbd_request  *requests;
 	int                     nr_free_count;
 
 	int                     reader_event_id;
@@ -720,7 +719,7 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 	char peer_ip[256];
 	int port;
 	int rc;
-	int i;
+	int i, n_reqs;
 
 	driver->info.sector_size = 512;
 	driver->info.info = 0;
@@ -734,12 +733,6 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 	INIT_LIST_HEAD(&prv->sent_reqs);
 	INIT_LIST_HEAD(&prv->pending_reqs);
 	INIT_LIST_HEAD(&prv->free_reqs);
-	for (i = 0; i < MAX_NBD_REQS; i++) {
-		INIT_LIST_HEAD(&prv->requests[i].queue);
-		prv->requests[i].timeout_event = -1;
-		list_add(&prv->requests[i].queue, &prv->free_reqs);
-	}
-	prv->nr_free_count = MAX_NBD_REQS;
 	prv->cur_reply_qio.buffer = (char *)&prv->current_reply;
 	prv->cur_reply_qio.len = sizeof(struct nbd_reply);
 	rc = sscanf(name, "%255[^:]:%d", peer_ip, &port);
@@ -773,6 +766,19 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 		}
 	}
 
+	n_reqs = tapdisk_driver_data_requests(driver);
+	prv->requests = calloc(n_reqs, sizeof(struct td_nbd_request));
+	if (!prv->requests) {
+		ERROR("Failure to allocate %d NBD requests", n_reqs);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n_reqs; i++) {
+		INIT_LIST_HEAD(&prv->requests[i].queue);
+		prv->requests[i].timeout_event = -1;
+		list_add(&prv->requests[i].queue, &prv->free_reqs);
+	}
+	prv->nr_free_count = n_reqs;
+
 	prv->reader_event_id = 
 		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
 				prv->socket, 0,
@@ -803,7 +809,7 @@ tdnbd_close(td_driver_t* driver)
 		if (prv->socket >= 0) 
 			close(prv->socket);
 		prv->socket = -1;
-		return 0;
+		goto out;
 	}
 
 	/* Send a close packet */
@@ -819,6 +825,10 @@ tdnbd_close(td_driver_t* driver)
 
 	INFO("Written");
 
+	tapdisk_server_unregister_event(prv->reader_event_id);
+	prv->reader_event_id = -1;
+	disable_write_queue(prv);
+
 	if (prv->peer_ip) {
 		free(prv->peer_ip);
 		prv->peer_ip = NULL;
@@ -833,6 +843,10 @@ tdnbd_close(td_driver_t* driver)
 		prv->socket = -1;
 	}
 
+out:
+	free(prv->requests);
+	prv->requests = NULL;
+
 	return 0;
 }
 
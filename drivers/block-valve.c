@@ -67,8 +67,9 @@ struct td_valve {
 	struct list_head        stor;
 	struct list_head        forw;
 
-	td_valve_request_t      reqv[MAX_REQUESTS];
-	td_valve_request_t     *free[MAX_REQUESTS];
+	td_valve_request_t     *reqv;
+	td_valve_request_t    **free;
+	int                     n_reqs;
 	int                     n_free;
 
 	struct td_valve_stats   stats;
@@ -80,7 +81,7 @@ struct td_valve {
 #define td_valve_for_each_forwarded_request(_req, _next, _valve)	\
 	list_for_each_entry_safe(_req, _next, &(_valve)->forw, entry)
 
-#define TD_VALVE_CONNECT_INTERVAL 2 /* s */
+#define TD_VALVE_CONNECT_INTERVAL 2000 /* ms */
 
 #define TD_VALVE_RDLIMIT  (1<<0)
 #define TD_VALVE_WRLIMIT  (1<<1)
@@ -122,7 +123,6 @@ static void valve_kill(td_valve_t *);
 	__cond;						\
 })
 
-#define ARRAY_SIZE(_a)   (sizeof(_a)/sizeof((_a)[0]))
 #define TREQ_SIZE(_treq) ((unsigned int)(_treq.secs) << 9)
 
 static td_valve_request_t *
@@ -139,7 +139,7 @@ valve_alloc_request(td_valve_t *valve)
 static void
 valve_free_request(td_valve_t *valve, td_valve_request_t *req)
 {
-	BUG_ON(valve->n_free >= ARRAY_SIZE(valve->free));
+	BUG_ON(valve->n_free >= valve->n_reqs);
 	list_del_init(&req->entry);
 	valve->free[valve->n_free++] = req;
 }
@@ -181,11 +181,6 @@ __valve_sched_event(event_id_t id, char mode, void *private)
 static void
 valve_sock_close(td_valve_t *valve)
 {
-	if (valve->sock >= 0) {
-		close(valve->sock);
-		valve->sock = -1;
-	}
-
 	if (valve->sock_id >= 0) {
 		tapdisk_server_unregister_event(valve->sock_id);
 		valve->sock_id = -1;
@@ -195,6 +190,11 @@ valve_sock_close(td_valve_t *valve)
 		tapdisk_server_unregister_event(valve->sched_id);
 		valve->sched_id = -1;
 	}
+
+	if (valve->sock >= 0) {
+		close(valve->sock);
+		valve->sock = -1;
+	}
 }
 
 static int
@@ -509,7 +509,20 @@ valve_kill(td_valve_t *valve)
 }
 
 static void
-valve_init(td_valve_t *valve, unsigned long flags)
+valve_free_requests(td_valve_t *valve)
+{
+	free(valve->reqv);
+	valve->reqv = NULL;
+
+	free(valve->free);
+	valve->free = NULL;
+
+	valve->n_reqs = 0;
+	valve->n_free = 0;
+}
+
+static int
+valve_init(td_valve_t *valve, unsigned long flags, int n_reqs)
 {
 	int i;
 
@@ -526,7 +539,16 @@ valve_init(td_valve_t *valve, unsigned long flags)
 
 	valve->flags    = flags;
 
-	for (i = ARRAY_SIZE(valve->reqv) - 1; i >= 0; i--) {
+	valve->reqv = calloc(n_reqs, sizeof(td_valve_request_t));
+	valve->free = calloc(n_reqs, sizeof(td_valve_request_t *));
+	if (!valve->reqv || !valve->free) {
+		valve_free_requests(valve);
+		return -ENOMEM;
+	}
+
+	valve->n_reqs = n_reqs;
+
+	for (i = n_reqs - 1; i >= 0; i--) {
 		td_valve_request_t *req = &valve->reqv[i];
 
 		req->valve = valve;
@@ -534,6 +556,8 @@ valve_init(td_valve_t *valve, unsigned long flags)
 
 		valve_free_request(valve, req);
 	}
+
+	return 0;
 }
 
 static int
@@ -551,6 +575,8 @@ td_valve_close(td_driver_t *driver)
 		valve->brname = NULL;
 	}
 
+	valve_free_requests(valve);
+
 	return 0;
 }
 
@@ -561,7 +587,9 @@ td_valve_open(td_driver_t *driver,
 	td_valve_t *valve = driver->data;
 	int err;
 
-	valve_init(valve, TD_VALVE_WRLIMIT);
+	err = valve_init(valve, TD_VALVE_WRLIMIT, driver->queue_depth);
+	if (err)
+		goto fail;
 
 	valve->brname = strdup(name);
 	if (!valve->brname) {
@@ -598,6 +626,11 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 
 		goto forward;
 
+	case TD_OP_DISCARD:
+	case TD_OP_FLUSH:
+		/* moves no data, consumes no bandwidth */
+		goto forward;
+
 	default:
 		BUG();
 	}
@@ -679,6 +712,8 @@ struct tap_disk tapdisk_valve = {
 	.td_close                   = td_valve_close,
 	.td_queue_read              = td_valve_queue_request,
 	.td_queue_write             = td_valve_queue_request,
+	.td_queue_discard           = td_valve_queue_request,
+	.td_queue_flush             = td_valve_queue_request,
 	.td_get_parent_id           = td_valve_get_parent_id,
 	.td_validate_parent         = td_valve_validate_parent,
 	.td_stats                   = td_valve_stats,
@@ -34,6 +34,15 @@
  *     writes and the zero-bitmap write complete, the BAT and bitmap writes
  *     are started in parallel.  The transaction is completed only after both
  *     the BAT and bitmap writes successfully return.
+ *
+ * A note on block allocation:
+ * Up to VHD_ALLOC_MAX blocks may be in the process of being allocated at
+ * any time.  Each new block is reserved at the end of the file and tracked
+ * by its (locked) bitmap.  Once a block is ready for its BAT update (the
+ * zero-bitmap write completed, or the block was preallocated), it is queued
+ * for the next BAT write.  Only one BAT write is in flight at a time, but
+ * it carries the entries of all blocks which became ready in the meantime
+ * and fall within the same VHD_BAT_WRITE_SECS window of the table.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -53,6 +62,8 @@
 #include <libaio.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
 #include "libvhd.h"
 #include "tapdisk.h"
@@ -60,6 +71,7 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-server.h"
 
 unsigned int SPB;
 
@@ -73,10 +85,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%u, BBLK: 0x%04x\n",				\
+		    "%u, ALLOCATING: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
-		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->vreq_count - s->vreq_free_count,			\
+		    s->bat.alloc_count);				\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -110,10 +122,23 @@ unsigned int SPB;
 
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
+#define VHD_CACHE_MAX                (1U << 20)
 
-#define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
-#define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
+#define VHD_ALLOC_MAX                (VHD_CACHE_SIZE / 2)
+#define VHD_BAT_WRITE_SECS           8
+
+/* metadata log: a header sector, then a ring of one-sector records */
+#define VHD_WAL_SECS                 2048
+#define VHD_WAL_SUFFIX               ".wal"
+#define VHD_WAL_COOKIE               "tapwalrc"
+#define VHD_WAL_HDR_COOKIE           "tapwalhd"
+#define VHD_WAL_OP_SET               1
+#define VHD_WAL_OP_CLEAR             2
+
+/* BAT entries read at a time when loading the BAT on demand */
+#define VHD_BAT_PAGE_SHIFT           10
+#define VHD_BAT_PAGE_ENTRIES         (1U << VHD_BAT_PAGE_SHIFT)
 
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
@@ -122,6 +147,15 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
+#define VHD_OP_DATA_DISCARD          7
+#define VHD_OP_FLUSH                 8
+#define VHD_OP_PREALLOC              9
+#define VHD_OP_WAL_WRITE             10
+#define VHD_OP_WAL_HOME_WRITE        11
+#define VHD_OP_WAL_SYNC              12
+#define VHD_OP_WAL_HEADER            13
+#define VHD_OP_BLOCK_RELEASE         14
+#define VHD_OP_BAT_PAGE_READ         15
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -129,6 +163,12 @@ unsigned int SPB;
 #define VHD_BM_BIT_SET               3
 #define VHD_BM_NOT_CACHED            4
 #define VHD_BM_READ_PENDING          5
+#define VHD_BM_BAT_NOT_CACHED        6
+#define VHD_BM_BAT_READ_PENDING      7
+
+#define VHD_BAT_PAGE_ON_DISK         0
+#define VHD_BAT_PAGE_LOADED          1
+#define VHD_BAT_PAGE_LOADING         2
 
 #define VHD_FLAG_OPEN_RDONLY         1
 #define VHD_FLAG_OPEN_NO_CACHE       2
@@ -136,27 +176,36 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_STRICT         8
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
+#define VHD_FLAG_OPEN_LAZY_BAT       64
+#define VHD_FLAG_OPEN_META_LOG       128
 
-#define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_ALLOCATING       16
+#define VHD_FLAG_BM_BAT_READY        32
+#define VHD_FLAG_BM_BAT_WRITE        64
+#define VHD_FLAG_BM_DIRTY            128
+#define VHD_FLAG_BM_RELEASING        256
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_WAL_WAIT        16
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_BAT_WAIT         4
 
-typedef uint8_t vhd_flag_t;
+typedef uint16_t vhd_flag_t;
 
 struct vhd_state;
 struct vhd_request;
+struct vhd_wal_entry;
 
 struct vhd_req_list {
 	struct vhd_request       *head;
@@ -181,24 +230,132 @@ struct vhd_request {
 	struct vhd_state         *state;
 	struct vhd_request       *next;
 	struct vhd_transaction   *tx;
+	struct vhd_wal_entry     *wal;
 };
 
+struct vhd_bitmap;
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	uint32_t                  write_sec;   /* first bat sector written */
+	uint32_t                  write_secs;  /* bat sectors being written */
+	int                       alloc_count;
+	struct vhd_bitmap        *alloc[VHD_ALLOC_MAX]; /* blocks being
+							  * allocated */
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+
+	uint8_t                  *loaded;      /* VHD_BAT_PAGE_* of each bat
+						* page, if the bat is loaded
+						* on demand */
+	struct vhd_req_list      *waiting;     /* requests waiting for their
+						* bat page to be read */
+	uint32_t                  pages_loaded;
+	uint32_t                  pages_loading;
+	size_t                    map_size;    /* size of the bat mapping */
+};
+
+/*
+ * Blocks are always allocated at next_db, so the pool is simply the
+ * zeroed region of the file from next_db up to end.
+ */
+struct vhd_prealloc {
+	uint32_t                  size;        /* blocks to keep ready */
+	uint32_t                  low;         /* refill below this many */
+	uint64_t                  end;         /* zeroed up to, in sectors */
+	uint64_t                  start;       /* refill in flight, from */
+	uint64_t                  target;      /* ... to */
+	int                       busy;
+	struct vhd_request        req;
+
+	uint64_t                  hits;
+	uint64_t                  misses;
+	uint64_t                  refills;
+};
+
+/*
+ * On-disk metadata log format, big-endian like the rest of the vhd. A
+ * record stands for the bitmap update of one data request, and for the
+ * bat entry of the block if the request allocated it.
+ */
+struct vhd_wal_header {
+	char                      cookie[8];
+	uuid_t                    uuid;        /* of the vhd logged */
+	uint64_t                  ckpt;        /* records up to here are home */
+	uint32_t                  slots;       /* record sectors */
+	uint32_t                  checksum;
+};
+
+struct vhd_wal_record {
+	char                      cookie[8];
+	uint64_t                  seqno;
+	uint32_t                  blk;
+	uint32_t                  bat;         /* new bat entry, or
+						* DD_BLK_UNUSED */
+	uint32_t                  sec;         /* first sector in block */
+	uint32_t                  secs;
+	uint32_t                  op;
+	uint32_t                  checksum;
+};
+
+struct vhd_wal_entry {
+	struct vhd_request        req;         /* for writing the record */
+	struct vhd_request       *data;        /* the request logged */
+	uint64_t                  seqno;
+	int                       done;
+	struct list_head          next;        /* uncommitted, by seqno */
+	char                     *buf;
+};
+
+/*
+ * With the metadata log, bitmap and bat updates are acknowledged once
+ * their record is durable, and written to their home locations in the
+ * vhd by a later checkpoint. Bitmaps changed since the last checkpoint
+ * are dirty and stay cached until then.
+ */
+struct vhd_wal {
+	int                       fd;
+	char                     *path;
+	uint32_t                  slots;       /* zero if not logging */
+	uint64_t                  head;        /* next seqno */
+	uint64_t                  ckpt;        /* checkpointed up to */
+	struct list_head          pending;     /* uncommitted entries */
+
+	int                       free_count;
+	struct vhd_wal_entry    **free;
+	struct vhd_wal_entry     *entries;
+	char                     *bufs;
+
+	uint32_t                  dirty;       /* dirty bitmaps */
+	uint32_t                  bat_first;   /* dirty bat sectors */
+	uint32_t                  bat_last;
+
+	/* checkpoint in flight */
+	int                       busy;
+	int                       error;
+	int                       pending_io;
+	uint64_t                  target;
+	uint32_t                  write_first; /* bat sectors being written */
+	uint32_t                  write_last;
+	char                     *bat_buf;
+	char                     *hdr;
+	struct vhd_request        bat_req;
+	struct vhd_request        req;         /* for sync and header write */
+
+	uint64_t                  records;
+	uint64_t                  checkpoints;
+	uint64_t                  replayed;
 };
 
 struct vhd_bitmap {
 	uint32_t                  blk;
-	uint64_t                  seqno;       /* lru sequence number */
 	vhd_flag_t                status;
 
+	struct vhd_bitmap        *hnext;       /* next in hash bucket */
+	struct list_head          lru;         /* position in lru list */
+
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
 	char                     *shadow;      /* in-memory bitmap changes are 
@@ -214,6 +371,12 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+
+	uint64_t                  pbw_offset;  /* new bat entry, while the
+						* block is being allocated */
+	int                       alloc_error;
+	struct vhd_request        zero_req;    /* for initializing bitmap */
+	struct vhd_request        release_req; /* for freeing the data area */
 };
 
 struct vhd_state {
@@ -232,22 +395,39 @@ struct vhd_state {
 	uint64_t                  next_db;
 
 	struct vhd_bat_state      bat;
+	struct vhd_prealloc       prealloc;
+	struct vhd_wal            wal;
 
-	uint64_t                  bm_lru;      /* lru sequence number */
 	uint32_t                  bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	uint32_t                  bm_cache_size; /* number of cached bitmaps */
+	uint32_t                  bm_hash_mask;
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps, by block */
+	struct list_head          bm_lru;      /* cached bitmaps, oldest first */
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+	struct vhd_bitmap        *bitmap_list;
+	char                     *bm_buf;      /* maps and shadows */
+	int                       bm_releasing; /* data areas being freed */
+
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_evictions;
+
+	/* sectors of zero writes completed without writing data */
+	uint64_t                  zero_skipped;
+	uint64_t                  zero_discarded;
+	uint64_t                  zero_punched;
 
+	int                       vreq_count;
 	int                       vreq_free_count;
-	struct vhd_request       *vreq_free[VHD_REQS_DATA];
-	struct vhd_request        vreq_list[VHD_REQS_DATA];
+	struct vhd_request      **vreq_free;
+	struct vhd_request       *vreq_list;
 
 	/* for redundant bitmap writes */
 	int                       padbm_size;
 	char                     *padbm_buf;
+	int                       zeros_ref;
 	long int                  debug_skipped_redundant_writes;
 	long int                  debug_done_redundant_writes;
 
@@ -267,48 +447,70 @@ struct vhd_state {
 #define clear_vhd_flag(word, flag) ((word) &= ~(flag))
 
 #define bat_entry(s, blk)          ((s)->bat.bat.bat[(blk)])
+#define vhd_wal_enabled(s)         ((s)->wal.slots != 0)
 
 static void vhd_complete(void *, struct tiocb *, int);
+static void vhd_wal_checkpoint(struct vhd_state *);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void finish_data_write(struct vhd_request *);
 
-static struct vhd_state  *_vhd_master;
+/*
+ * One read-only zero mapping for all images, whichever worker thread
+ * they run on. Each open vhd holds a reference, the last one unmaps.
+ * It is sized for the largest user up front, anonymous zero pages
+ * cost nothing.
+ */
+static pthread_mutex_t    _vhd_zlock = PTHREAD_MUTEX_INITIALIZER;
+static int                _vhd_zusers;
 static unsigned long      _vhd_zsize;
 static char              *_vhd_zeros;
 
 static int
 vhd_initialize(struct vhd_state *s)
 {
-	if (_vhd_zeros)
-		return 0;
-
-	_vhd_zsize = 2 * getpagesize();
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-		_vhd_zsize += VHD_BLOCK_SIZE;
-
-	_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
-			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	if (_vhd_zeros == MAP_FAILED) {
-		EPRINTF("vhd_initialize failed: %d\n", -errno);
-		_vhd_zeros = NULL;
-		_vhd_zsize = 0;
-		return -errno;
+	int err = 0;
+
+	pthread_mutex_lock(&_vhd_zlock);
+
+	if (!_vhd_zeros) {
+		_vhd_zsize = 2 * getpagesize() + VHD_BLOCK_SIZE;
+		_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
+				  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (_vhd_zeros == MAP_FAILED) {
+			err = -errno;
+			EPRINTF("vhd_initialize failed: %d\n", err);
+			_vhd_zeros = NULL;
+			_vhd_zsize = 0;
+			goto out;
+		}
 	}
 
-	_vhd_master = s;
-	return 0;
+	_vhd_zusers++;
+	s->zeros_ref = 1;
+
+out:
+	pthread_mutex_unlock(&_vhd_zlock);
+	return err;
 }
 
 static void
 vhd_free(struct vhd_state *s)
 {
-	if (_vhd_master != s || !_vhd_zeros)
+	free(s->padbm_buf);
+	s->padbm_buf = NULL;
+
+	if (!s->zeros_ref)
 		return;
 
-	free(s->padbm_buf);
-	munmap(_vhd_zeros, _vhd_zsize);
-	_vhd_zsize  = 0;
-	_vhd_zeros  = NULL;
-	_vhd_master = NULL;
+	s->zeros_ref = 0;
+
+	pthread_mutex_lock(&_vhd_zlock);
+	if (!--_vhd_zusers) {
+		munmap(_vhd_zeros, _vhd_zsize);
+		_vhd_zsize = 0;
+		_vhd_zeros = NULL;
+	}
+	pthread_mutex_unlock(&_vhd_zlock);
 }
 
 static char *
@@ -334,6 +536,15 @@ set_batmap(struct vhd_state *s, uint32_t blk)
 	}
 }
 
+static inline void
+clear_batmap(struct vhd_state *s, uint32_t blk)
+{
+	if (s->bat.batmap.map) {
+		vhd_batmap_clear(&s->vhd, &s->bat.batmap, blk);
+		DBG(TLOG_DBG, "block 0x%x no longer full\n", blk);
+	}
+}
+
 static inline int
 test_batmap(struct vhd_state *s, uint32_t blk)
 {
@@ -408,12 +619,92 @@ find_next_free_block(struct vhd_state *s)
 static void
 vhd_free_bat(struct vhd_state *s)
 {
-	free(s->bat.bat.bat);
+	if (s->bat.loaded) {
+		munmap(s->bat.bat.bat, s->bat.map_size);
+		free(s->bat.loaded);
+		free(s->bat.waiting);
+	} else
+		free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
 	memset(&s->bat, 0, sizeof(struct vhd_bat));
 }
 
+/*
+ * Read-only images may leave their BAT on disk until a request first
+ * needs it. The table is mapped anonymously, so that only the pages
+ * read in by schedule_bat_page_read take memory.
+ */
+static int
+vhd_initialize_lazy_bat(struct vhd_state *s)
+{
+	vhd_bat_t *bat = &s->bat.bat;
+	uint32_t entries, pages;
+	size_t size;
+	void *map;
+	int err;
+
+	entries = s->vhd.footer.curr_size >> VHD_BLOCK_SHIFT;
+	if (!entries)
+		return vhd_read_bat(&s->vhd, bat);
+
+	pages = (entries + VHD_BAT_PAGE_ENTRIES - 1) >> VHD_BAT_PAGE_SHIFT;
+	size  = (size_t)pages * VHD_BAT_PAGE_ENTRIES * sizeof(uint32_t);
+
+	s->bat.loaded  = calloc(pages, sizeof(uint8_t));
+	s->bat.waiting = calloc(pages, sizeof(struct vhd_req_list));
+	if (!s->bat.loaded || !s->bat.waiting) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	map = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+
+	bat->spb        = s->vhd.header.block_size >> VHD_SECTOR_SHIFT;
+	bat->entries    = entries;
+	bat->bat        = map;
+	s->bat.map_size = size;
+
+	return 0;
+
+fail:
+	free(s->bat.loaded);
+	free(s->bat.waiting);
+	s->bat.loaded  = NULL;
+	s->bat.waiting = NULL;
+	return err;
+}
+
+/*
+ * Returns 0 if the bat entry of @blk is in memory, or the
+ * VHD_BM_BAT_* state of its page.
+ */
+static inline int
+vhd_bat_page_in(struct vhd_state *s, uint32_t blk)
+{
+	uint32_t page = blk >> VHD_BAT_PAGE_SHIFT;
+
+	if (likely(!s->bat.loaded))
+		return 0;
+
+	if (blk >= s->bat.bat.entries)
+		return -EINVAL;
+
+	switch (s->bat.loaded[page]) {
+	case VHD_BAT_PAGE_LOADED:
+		return 0;
+	case VHD_BAT_PAGE_LOADING:
+		return VHD_BM_BAT_READ_PENDING;
+	default:
+		return VHD_BM_BAT_NOT_CACHED;
+	}
+}
+
 static int
 vhd_initialize_bat(struct vhd_state *s)
 {
@@ -422,7 +713,11 @@ vhd_initialize_bat(struct vhd_state *s)
 
 	memset(&s->bat, 0, sizeof(struct vhd_bat));
 
-	err = vhd_read_bat(&s->vhd, &s->bat.bat);
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_LAZY_BAT) &&
+	    test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
+		err = vhd_initialize_lazy_bat(s);
+	else
+		err = vhd_read_bat(&s->vhd, &s->bat.bat);
 	if (err) {
 		EPRINTF("%s: reading bat: %d\n", s->vhd.file, err);
 		return err;
@@ -454,7 +749,8 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE,
+			     VHD_BAT_WRITE_SECS << VHD_SECTOR_SHIFT);
 	if (err)
 		goto fail;
 
@@ -470,52 +766,95 @@ fail:
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
-	int i;
-	struct vhd_bitmap *bm;
+	free(s->bm_buf);
+	s->bm_buf = NULL;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
-	}
+	free(s->bm_hash);
+	s->bm_hash = NULL;
+
+	free(s->bitmap_list);
+	s->bitmap_list = NULL;
+
+	free(s->bitmap_free);
+	s->bitmap_free = NULL;
+
+	s->bm_cache_size = 0;
+	s->bm_free_count = 0;
+}
+
+/*
+ * The number of bitmaps cached follows the memory budget given to the
+ * driver, if any. Never less than VHD_CACHE_SIZE, which the allocation
+ * limits below depend on, and never more than there are blocks.
+ */
+static uint32_t
+vhd_bitmap_cache_size(struct vhd_state *s)
+{
+	size_t budget, each;
+	uint64_t n;
+
+	budget = s->driver->cache_size;
+	if (!budget)
+		return VHD_CACHE_SIZE;
+
+	each = sizeof(struct vhd_bitmap) + 2 * vhd_sectors_to_bytes(s->bm_secs);
+	n    = budget / each;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	n = MIN(n, s->bat.bat.entries);
+	n = MIN(n, VHD_CACHE_MAX);
+	n = MAX(n, VHD_CACHE_SIZE);
+
+	return n;
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int err, map_size;
+	uint32_t i, n, buckets;
 	struct vhd_bitmap *bm;
-	void *map, *shadow;
+	void *buf;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
+	n        = vhd_bitmap_cache_size(s);
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	for (buckets = 1; buckets < n; buckets <<= 1)
+		;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	s->bitmap_list = calloc(n, sizeof(struct vhd_bitmap));
+	s->bitmap_free = calloc(n, sizeof(struct vhd_bitmap *));
+	s->bm_hash     = calloc(buckets, sizeof(struct vhd_bitmap *));
+	if (!s->bitmap_list || !s->bitmap_free || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
-		err = posix_memalign(&map, 512, map_size);
-		if (err)
-			goto fail;
+	err = posix_memalign(&buf, 512, (size_t)n * map_size * 2);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
 
-		bm->map = map;
+	s->bm_buf = buf;
+	memset(s->bm_buf, 0, (size_t)n * map_size * 2);
 
-		err = posix_memalign(&shadow, 512, map_size);
-		if (err)
-			goto fail;
+	s->bm_cache_size = n;
+	s->bm_hash_mask  = buckets - 1;
+	s->bm_free_count = n;
 
-		bm->shadow = shadow;
+	for (i = 0; i < n; i++) {
+		bm = s->bitmap_list + i;
+
+		bm->map    = s->bm_buf + (size_t)(2 * i) * map_size;
+		bm->shadow = s->bm_buf + (size_t)(2 * i + 1) * map_size;
+		INIT_LIST_HEAD(&bm->lru);
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
 		s->bitmap_free[i] = bm;
 	}
 
+	if (n != VHD_CACHE_SIZE)
+		DPRINTF("%s: caching %u bitmaps\n", s->vhd.file, n);
+
 	return 0;
 
 fail:
@@ -613,6 +952,13 @@ vhd_log_open(struct vhd_state *s)
 		return;
 	}
 
+	if (s->bat.loaded) {
+		DPRINTF("%s version: %s 0x%08x, b: %u, bat loaded on demand\n",
+			s->vhd.file, buf, s->vhd.footer.crtr_ver,
+			s->bat.bat.entries);
+		return;
+	}
+
 	allocated = 0;
 	full      = 0;
 
@@ -628,142 +974,869 @@ vhd_log_open(struct vhd_state *s)
 		allocated, full, s->next_db);
 }
 
-static int
-__vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
+static void
+vhd_free_requests(struct vhd_state *s)
 {
-        int i, o_flags, err;
-	struct vhd_state *s;
-
-        DBG(TLOG_INFO, "vhd_open: %s\n", name);
-	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT))
-		libvhd_set_log_level(1);
-
-	s = (struct vhd_state *)driver->data;
-	memset(s, 0, sizeof(struct vhd_state));
+	free(s->vreq_list);
+	s->vreq_list = NULL;
 
-	s->flags  = flags;
-	s->driver = driver;
+	free(s->vreq_free);
+	s->vreq_free = NULL;
 
-	err = vhd_initialize(s);
-	if (err)
-		return err;
+	s->vreq_count      = 0;
+	s->vreq_free_count = 0;
+}
 
-	o_flags = ((test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) ? 
-		   VHD_OPEN_RDONLY : VHD_OPEN_RDWR);
+/*
+ * One vhd_request per outstanding single-segment request, as bounded
+ * by the queue depth and request size of the VBD opening us.
+ */
+static int
+vhd_initialize_requests(struct vhd_state *s)
+{
+	int i, n;
 
-	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT))
-		set_vhd_flag(o_flags, VHD_OPEN_STRICT);
+	n = tapdisk_driver_data_requests(s->driver);
 
-	err = vhd_open(&s->vhd, name, o_flags);
-	if (err) {
-		libvhd_set_log_level(1);
-		err = vhd_open(&s->vhd, name, o_flags);
-		if (err) {
-			EPRINTF("Unable to open [%s] (%d)!\n", name, err);
-			return err;
-		}
+	s->vreq_list = calloc(n, sizeof(struct vhd_request));
+	s->vreq_free = calloc(n, sizeof(struct vhd_request *));
+	if (!s->vreq_list || !s->vreq_free) {
+		vhd_free_requests(s);
+		return -ENOMEM;
 	}
 
-	err = vhd_check_version(s);
-	if (err)
-		goto fail;
-
-	s->spb = s->spp = 1;
-
-	if (vhd_type_dynamic(&s->vhd)) {
-		err = vhd_initialize_dynamic_disk(s);
-		if (err)
-			goto fail;
-	}
+	s->vreq_count      = n;
+	s->vreq_free_count = n;
+	for (i = 0; i < n; i++)
+		s->vreq_free[i] = s->vreq_list + i;
 
-	vhd_log_open(s);
+	return 0;
+}
 
-	SPB = s->spb;
+/*
+ * Writable dynamic images in regular files may keep a pool of blocks
+ * allocated ahead of writes, as sized by the VBD. Without a low-water
+ * mark, the pool is refilled once half of it is used. Images logging
+ * their metadata write no empty bitmaps, and need no pool.
+ */
+static void
+vhd_initialize_prealloc(struct vhd_state *s)
+{
+	struct vhd_prealloc *p = &s->prealloc;
+	td_driver_t *driver = s->driver;
 
-	s->vreq_free_count = VHD_REQS_DATA;
-	for (i = 0; i < VHD_REQS_DATA; i++)
-		s->vreq_free[i] = s->vreq_list + i;
+	if (!driver->prealloc ||
+	    test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) ||
+	    !vhd_type_dynamic(&s->vhd) || s->vhd.is_block ||
+	    vhd_wal_enabled(s))
+		return;
 
-	driver->info.size        = s->vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
-	driver->info.sector_size = VHD_SECTOR_SIZE;
-	driver->info.info        = 0;
+	p->size = driver->prealloc;
+	p->low  = (driver->prealloc_low ?
+		   MIN(driver->prealloc_low, p->size) : (p->size + 1) / 2);
+}
 
-        DBG(TLOG_INFO, "vhd_open: done (sz:%"PRIu64", sct:%lu, inf:%u)\n",
-	    driver->info.size, driver->info.sector_size, driver->info.info);
+static uint32_t
+vhd_wal_checksum(const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint32_t sum = 0;
+	size_t i;
 
-	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT) && 
-	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) {
-		err = vhd_kill_footer(s);
-		if (err) {
-			DPRINTF("ERROR killing footer: %d\n", err);
-			goto fail;
-		}
-		s->writes++;
-	}
+	for (i = 0; i < size; i++)
+		sum += p[i];
 
-        return 0;
+	return ~sum;
+}
 
- fail:
-	vhd_free_bat(s);
-	vhd_free_bitmap_cache(s);
-	vhd_close(&s->vhd);
-	vhd_free(s);
-	return err;
+static void
+vhd_wal_header_out(struct vhd_wal_header *h)
+{
+	BE64_OUT(&h->ckpt);
+	BE32_OUT(&h->slots);
+	h->checksum = 0;
+	h->checksum = vhd_wal_checksum(h, sizeof(*h));
+	BE32_OUT(&h->checksum);
 }
 
 static int
-_vhd_open(td_driver_t *driver, const char *name, td_flag_t flags)
+vhd_wal_header_in(struct vhd_wal_header *h)
 {
-	vhd_flag_t vhd_flags = 0;
-
-	if (flags & TD_OPEN_RDONLY)
-		vhd_flags |= VHD_FLAG_OPEN_RDONLY;
-	if (flags & TD_OPEN_QUIET)
-		vhd_flags |= VHD_FLAG_OPEN_QUIET;
-	if (flags & TD_OPEN_STRICT)
-		vhd_flags |= VHD_FLAG_OPEN_STRICT;
-	if (flags & TD_OPEN_QUERY)
-		vhd_flags |= (VHD_FLAG_OPEN_QUERY  |
-			      VHD_FLAG_OPEN_QUIET  |
-			      VHD_FLAG_OPEN_RDONLY |
-			      VHD_FLAG_OPEN_NO_CACHE);
+	uint32_t checksum;
 
-	/* pre-allocate for all but NFS and LVM storage */
-	driver->storage = tapdisk_storage_type(name);
+	if (memcmp(h->cookie, VHD_WAL_HDR_COOKIE, sizeof(h->cookie)))
+		return -EINVAL;
 
-	if (driver->storage != TAPDISK_STORAGE_TYPE_NFS &&
-	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
-		vhd_flags |= VHD_FLAG_OPEN_PREALLOCATE;
+	checksum    = h->checksum;
+	h->checksum = 0;
+	BE32_IN(&checksum);
+	if (checksum != vhd_wal_checksum(h, sizeof(*h)))
+		return -EINVAL;
 
-	return __vhd_open(driver, name, vhd_flags);
+	BE64_IN(&h->ckpt);
+	BE32_IN(&h->slots);
+	return 0;
 }
 
 static void
-vhd_log_close(struct vhd_state *s)
+vhd_wal_record_out(struct vhd_wal_record *rec)
 {
-	uint32_t i, allocated, full;
+	BE64_OUT(&rec->seqno);
+	BE32_OUT(&rec->blk);
+	BE32_OUT(&rec->bat);
+	BE32_OUT(&rec->sec);
+	BE32_OUT(&rec->secs);
+	BE32_OUT(&rec->op);
+	rec->checksum = 0;
+	rec->checksum = vhd_wal_checksum(rec, sizeof(*rec));
+	BE32_OUT(&rec->checksum);
+}
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
-		return;
+static int
+vhd_wal_record_in(struct vhd_wal_record *rec)
+{
+	uint32_t checksum;
 
-	allocated = 0;
-	full      = 0;
+	if (memcmp(rec->cookie, VHD_WAL_COOKIE, sizeof(rec->cookie)))
+		return -EINVAL;
 
-	for (i = 0; i < s->bat.bat.entries; i++) {
-		if (bat_entry(s, i) != DD_BLK_UNUSED)
-			allocated++;
-		if (test_batmap(s, i))
-			full++;
-	}
+	checksum      = rec->checksum;
+	rec->checksum = 0;
+	BE32_IN(&checksum);
+	if (checksum != vhd_wal_checksum(rec, sizeof(*rec)))
+		return -EINVAL;
 
-	DPRINTF("%s: b: %u, a: %u, f: %u, n: %"PRIu64"\n",
-		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db);
+	BE64_IN(&rec->seqno);
+	BE32_IN(&rec->blk);
+	BE32_IN(&rec->bat);
+	BE32_IN(&rec->sec);
+	BE32_IN(&rec->secs);
+	BE32_IN(&rec->op);
+	return 0;
 }
 
-static int
-_vhd_close(td_driver_t *driver)
+static void
+vhd_wal_prep_header(struct vhd_state *s, uint64_t ckpt)
 {
-	int err;
+	struct vhd_wal *w = &s->wal;
+	struct vhd_wal_header *h = (struct vhd_wal_header *)w->hdr;
+
+	memset(w->hdr, 0, VHD_SECTOR_SIZE);
+	memcpy(h->cookie, VHD_WAL_HDR_COOKIE, sizeof(h->cookie));
+	uuid_copy(h->uuid, s->vhd.footer.uuid);
+	h->ckpt  = ckpt;
+	h->slots = w->slots;
+	vhd_wal_header_out(h);
+}
+
+static int
+vhd_wal_write_header(struct vhd_state *s, uint64_t ckpt)
+{
+	struct vhd_wal *w = &s->wal;
+
+	vhd_wal_prep_header(s, ckpt);
+
+	if (pwrite(w->fd, w->hdr, VHD_SECTOR_SIZE, 0) != VHD_SECTOR_SIZE)
+		return (errno ? -errno : -EIO);
+
+	return 0;
+}
+
+/*
+ * Reads the header of the log open at @w->fd. A log written for
+ * another vhd, or never initialized, is -EINVAL.
+ */
+static int
+vhd_wal_read_header(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_wal_header *h = (struct vhd_wal_header *)w->hdr;
+	ssize_t ret;
+	int err;
+
+	ret = pread(w->fd, w->hdr, VHD_SECTOR_SIZE, 0);
+	if (ret == -1)
+		return -errno;
+	if (ret != VHD_SECTOR_SIZE)
+		return -EINVAL;
+
+	err = vhd_wal_header_in(h);
+	if (err)
+		return err;
+
+	if (uuid_compare(h->uuid, s->vhd.footer.uuid) || !h->slots)
+		return -EINVAL;
+
+	w->slots = h->slots;
+	w->ckpt  = h->ckpt;
+	return 0;
+}
+
+static int
+vhd_wal_cmp(const void *a, const void *b)
+{
+	const struct vhd_wal_record *ra = *(struct vhd_wal_record **)a;
+	const struct vhd_wal_record *rb = *(struct vhd_wal_record **)b;
+
+	return (ra->seqno > rb->seqno) - (ra->seqno < rb->seqno);
+}
+
+/*
+ * Collects the records past the checkpoint, in seqno order. Records of
+ * earlier laps around the ring are at or below the checkpoint.
+ */
+static int
+vhd_wal_scan(struct vhd_state *s, char **bufp,
+	     struct vhd_wal_record ***recsp, uint32_t *np)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_wal_record *rec, **recs;
+	size_t size;
+	uint32_t i, n;
+	void *buf;
+	int err;
+
+	size = vhd_sectors_to_bytes(w->slots);
+
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
+	if (err)
+		return -err;
+
+	recs = calloc(w->slots, sizeof(*recs));
+	if (!recs) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	if (pread(w->fd, buf, size, VHD_SECTOR_SIZE) != (ssize_t)size) {
+		err = (errno ? -errno : -EIO);
+		free(recs);
+		free(buf);
+		return err;
+	}
+
+	for (i = 0, n = 0; i < w->slots; i++) {
+		rec = (struct vhd_wal_record *)
+			((char *)buf + vhd_sectors_to_bytes(i));
+		if (vhd_wal_record_in(rec))
+			continue;
+		if (rec->seqno <= w->ckpt || rec->seqno > w->ckpt + w->slots)
+			continue;
+		recs[n++] = rec;
+	}
+
+	qsort(recs, n, sizeof(*recs), vhd_wal_cmp);
+
+	*bufp  = buf;
+	*recsp = recs;
+	*np    = n;
+	return 0;
+}
+
+static int
+vhd_wal_write_bat(struct vhd_state *s, uint32_t first, uint32_t last)
+{
+	uint32_t i, nsecs;
+	void *buf;
+	int err;
+
+	nsecs = last - first + 1;
+
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE,
+			     vhd_sectors_to_bytes(nsecs));
+	if (err)
+		return -err;
+
+	memcpy(buf, &bat_entry(s, first * 128), vhd_sectors_to_bytes(nsecs));
+	for (i = 0; i < nsecs * 128; i++)
+		BE32_OUT(&((uint32_t *)buf)[i]);
+
+	err = vhd_seek(&s->vhd, s->vhd.header.table_offset +
+		       vhd_sectors_to_bytes(first), SEEK_SET);
+	if (!err)
+		err = vhd_write(&s->vhd, buf, vhd_sectors_to_bytes(nsecs));
+
+	free(buf);
+	return err;
+}
+
+/*
+ * Applies the records past the checkpoint to the bitmaps and bat on
+ * disk. A record carrying a bat entry other than the current one
+ * allocated the block anew, which starts out with an empty bitmap.
+ */
+static int
+vhd_wal_replay(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_wal_record *rec, **recs;
+	uint32_t i, j, n, nmaps, *blks, first, last;
+	size_t map_size;
+	char *buf, *maps, *map;
+	void *p;
+	int err;
+
+	err = vhd_wal_scan(s, &buf, &recs, &n);
+	if (err)
+		return err;
+
+	if (!n)
+		goto out;
+
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
+
+	blks = calloc(n, sizeof(*blks));
+	if (!blks) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = posix_memalign(&p, VHD_SECTOR_SIZE, (size_t)n * map_size);
+	if (err) {
+		err = -err;
+		free(blks);
+		goto out;
+	}
+
+	maps  = p;
+	nmaps = 0;
+	first = UINT_MAX;
+	last  = 0;
+
+	for (i = 0; i < n; i++) {
+		rec = recs[i];
+
+		if (rec->blk >= s->bat.bat.entries ||
+		    rec->sec + rec->secs > s->spb) {
+			EPRINTF("%s: ignoring bad log record %"PRIu64"\n",
+				s->vhd.file, rec->seqno);
+			continue;
+		}
+
+		for (j = 0; j < nmaps; j++)
+			if (blks[j] == rec->blk)
+				break;
+		map = maps + j * map_size;
+
+		if (rec->bat != DD_BLK_UNUSED &&
+		    rec->bat != bat_entry(s, rec->blk)) {
+			bat_entry(s, rec->blk) = rec->bat;
+			first = MIN(first, rec->blk / 128);
+			last  = MAX(last, rec->blk / 128);
+			memset(map, 0, map_size);
+		} else if (j == nmaps) {
+			if (bat_entry(s, rec->blk) == DD_BLK_UNUSED)
+				continue;
+
+			err = vhd_seek(&s->vhd, vhd_sectors_to_bytes(
+					       bat_entry(s, rec->blk)), SEEK_SET);
+			if (!err)
+				err = vhd_read(&s->vhd, map, map_size);
+			if (err)
+				goto fail;
+		}
+
+		if (j == nmaps)
+			blks[nmaps++] = rec->blk;
+
+		for (j = rec->sec; j < rec->sec + rec->secs; j++)
+			if (rec->op == VHD_WAL_OP_CLEAR)
+				vhd_bitmap_clear(&s->vhd, map, j);
+			else
+				vhd_bitmap_set(&s->vhd, map, j);
+	}
+
+	for (i = 0; i < nmaps; i++) {
+		err = vhd_seek(&s->vhd, vhd_sectors_to_bytes(
+				       bat_entry(s, blks[i])), SEEK_SET);
+		if (!err)
+			err = vhd_write(&s->vhd, maps + i * map_size, map_size);
+		if (err)
+			goto fail;
+
+		/* fullness is found out again as blocks are written */
+		clear_batmap(s, blks[i]);
+	}
+
+	if (first <= last) {
+		err = vhd_wal_write_bat(s, first, last);
+		if (err)
+			goto fail;
+	}
+
+	if (fdatasync(s->vhd.fd)) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = find_next_free_block(s);
+	if (err)
+		goto fail;
+
+	w->ckpt     = recs[n - 1]->seqno;
+	w->replayed = n;
+	s->writes++;
+
+	DPRINTF("%s: replayed %u log records to %u blocks\n",
+		s->vhd.file, n, nmaps);
+
+ fail:
+	free(maps);
+	free(blks);
+ out:
+	if (err)
+		EPRINTF("%s: replaying metadata log: %d\n", s->vhd.file, err);
+	free(recs);
+	free(buf);
+	return err;
+}
+
+static int
+vhd_wal_open_file(const char *path, int flags)
+{
+	int fd;
+
+	fd = open(path, flags | O_DIRECT | O_DSYNC, 0644);
+	if (fd == -1 && errno == EINVAL)
+		fd = open(path, flags | O_DSYNC, 0644);
+
+	return fd;
+}
+
+/*
+ * Flags the image header while a log may hold updates not yet written
+ * home, so that libvhd keeps others off stale metadata.
+ */
+static int
+vhd_wal_mark(struct vhd_state *s, int pending)
+{
+	int err;
+
+	if (s->vhd.header.meta_log == pending)
+		return 0;
+
+	s->vhd.header.meta_log = pending;
+
+	err = vhd_write_header(&s->vhd, &s->vhd.header);
+	if (!err && fdatasync(s->vhd.fd))
+		err = -errno;
+	if (err) {
+		s->vhd.header.meta_log = !pending;
+		EPRINTF("%s: %s metadata log flag: %d\n", s->vhd.file,
+			pending ? "setting" : "clearing", err);
+	}
+
+	return err;
+}
+
+/*
+ * Makes a fresh log, or clears one left behind for an older image of
+ * the same name.
+ */
+static int
+vhd_wal_create(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	off64_t size = vhd_sectors_to_bytes(VHD_WAL_SECS);
+
+	if (ftruncate(w->fd, 0) || ftruncate(w->fd, size))
+		return -errno;
+
+	w->slots = VHD_WAL_SECS - 1;
+	w->ckpt  = 0;
+
+	return vhd_wal_write_header(s, 0);
+}
+
+static void
+vhd_free_wal(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+
+	if (w->entries)
+		td_unregister_file(w->fd);
+	if (w->path)
+		close(w->fd);
+
+	free(w->path);
+	free(w->hdr);
+	free(w->entries);
+	free(w->free);
+	free(w->bufs);
+	memset(w, 0, sizeof(*w));
+}
+
+static int
+vhd_wal_initialize_entries(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_wal_entry *e;
+	int i, n, err;
+	void *buf;
+
+	n = MIN(s->vreq_count, w->slots / 2);
+
+	w->free = calloc(n, sizeof(struct vhd_wal_entry *));
+	if (!w->free)
+		return -ENOMEM;
+
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE, vhd_sectors_to_bytes(n));
+	if (err)
+		return -err;
+
+	/* entries are set last, they tell vhd_free_wal to unregister */
+	w->entries = calloc(n, sizeof(struct vhd_wal_entry));
+	if (!w->entries) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	w->bufs = buf;
+	for (i = 0; i < n; i++) {
+		e = w->entries + i;
+		e->buf = w->bufs + vhd_sectors_to_bytes(i);
+		INIT_LIST_HEAD(&e->next);
+		w->free[i] = e;
+	}
+
+	w->free_count = n;
+	w->head       = w->ckpt + 1;
+	w->bat_first  = UINT_MAX;
+	w->bat_last   = 0;
+	INIT_LIST_HEAD(&w->pending);
+
+	return 0;
+}
+
+/*
+ * A metadata log left next to a dynamic vhd in a file is replayed by
+ * the next writable open, whether or not that open logs itself. Opened
+ * read-only, an image with records pending would read stale metadata,
+ * so the open fails instead. The header stays flagged for as long as
+ * the log is in use, and a flagged image must come with its log.
+ */
+static int
+vhd_initialize_wal(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_wal_record **recs;
+	uint32_t n;
+	char *buf;
+	void *hdr;
+	int err, rdonly;
+
+	if (!vhd_type_dynamic(&s->vhd) || s->vhd.is_block)
+		return 0;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_NO_CACHE)) {
+		if (!s->vhd.header.meta_log)
+			return 0;
+
+		EPRINTF("%s: metadata log pending\n", s->vhd.file);
+		return -EBUSY;
+	}
+
+	rdonly = test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY);
+
+	if (asprintf(&w->path, "%s%s", s->vhd.file, VHD_WAL_SUFFIX) == -1) {
+		w->path = NULL;
+		return -ENOMEM;
+	}
+
+	w->fd = vhd_wal_open_file(w->path, rdonly ? O_RDONLY : O_RDWR);
+	if (w->fd == -1 && errno == ENOENT && !rdonly &&
+	    test_vhd_flag(s->flags, VHD_FLAG_OPEN_META_LOG))
+		w->fd = vhd_wal_open_file(w->path, O_RDWR | O_CREAT | O_EXCL);
+	if (w->fd == -1) {
+		err = -errno;
+		if (err != -ENOENT || s->vhd.header.meta_log)
+			EPRINTF("%s: opening %s: %d\n",
+				s->vhd.file, w->path, err);
+		free(w->path);
+		w->path = NULL;
+		return (err == -ENOENT && !s->vhd.header.meta_log ? 0 : err);
+	}
+
+	err = posix_memalign(&hdr, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+	w->hdr = hdr;
+
+	err = vhd_wal_read_header(s);
+	if (err == -EINVAL) {
+		if (rdonly)
+			goto close;
+		err = vhd_wal_create(s);
+	} else if (!err && rdonly) {
+		err = vhd_wal_scan(s, &buf, &recs, &n);
+		if (err)
+			goto fail;
+
+		free(recs);
+		free(buf);
+		if (!n)
+			goto close;
+
+		EPRINTF("%s: %u metadata log records pending, "
+			"open it writable first\n", s->vhd.file, n);
+		err = -EBUSY;
+		goto fail;
+	} else if (!err) {
+		err = vhd_wal_replay(s);
+		if (!err)
+			err = vhd_wal_write_header(s, w->ckpt);
+	}
+	if (err)
+		goto fail;
+
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_META_LOG)) {
+		err = vhd_wal_mark(s, 0);
+		if (err)
+			goto fail;
+
+		unlink(w->path);
+		goto close;
+	}
+
+	err = vhd_wal_mark(s, 1);
+	if (err)
+		goto fail;
+
+	err = vhd_wal_initialize_entries(s);
+	if (err)
+		goto fail;
+
+	td_register_file(w->fd);
+	DPRINTF("%s: logging metadata to %s, %u records\n",
+		s->vhd.file, w->path, w->slots);
+
+	return 0;
+
+ close:
+	vhd_free_wal(s);
+	return 0;
+
+ fail:
+	EPRINTF("%s: metadata log %s: %d\n", s->vhd.file, w->path, err);
+	vhd_free_wal(s);
+	return err;
+}
+
+static int
+__vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
+{
+        int o_flags, err;
+	struct vhd_state *s;
+
+        DBG(TLOG_INFO, "vhd_open: %s\n", name);
+	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT))
+		libvhd_set_log_level(1);
+
+	s = (struct vhd_state *)driver->data;
+	memset(s, 0, sizeof(struct vhd_state));
+
+	s->flags  = flags;
+	s->driver = driver;
+	INIT_LIST_HEAD(&s->bm_lru);
+
+	err = vhd_initialize(s);
+	if (err)
+		return err;
+
+	o_flags = ((test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) ? 
+		   VHD_OPEN_RDONLY : VHD_OPEN_RDWR);
+
+	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT))
+		set_vhd_flag(o_flags, VHD_OPEN_STRICT);
+
+	/* vhd_initialize_wal deals with a pending metadata log */
+	set_vhd_flag(o_flags, VHD_OPEN_META_LOG);
+
+	err = vhd_open(&s->vhd, name, o_flags);
+	if (err) {
+		libvhd_set_log_level(1);
+		err = vhd_open(&s->vhd, name, o_flags);
+		if (err) {
+			EPRINTF("Unable to open [%s] (%d)!\n", name, err);
+			return err;
+		}
+	}
+
+	err = vhd_check_version(s);
+	if (err)
+		goto fail;
+
+	s->spb = s->spp = 1;
+
+	if (vhd_type_dynamic(&s->vhd)) {
+		err = vhd_initialize_dynamic_disk(s);
+		if (err)
+			goto fail;
+	}
+
+	vhd_log_open(s);
+	td_register_file(s->vhd.fd);
+
+	SPB = s->spb;
+
+	err = vhd_initialize_requests(s);
+	if (err)
+		goto fail;
+
+	err = vhd_initialize_wal(s);
+	if (err)
+		goto fail;
+
+	vhd_initialize_prealloc(s);
+
+	driver->info.size        = s->vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
+	driver->info.sector_size = VHD_SECTOR_SIZE;
+	driver->info.info        = 0;
+
+        DBG(TLOG_INFO, "vhd_open: done (sz:%"PRIu64", sct:%lu, inf:%u)\n",
+	    driver->info.size, driver->info.sector_size, driver->info.info);
+
+	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT) && 
+	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) {
+		err = vhd_kill_footer(s);
+		if (err) {
+			DPRINTF("ERROR killing footer: %d\n", err);
+			goto fail;
+		}
+		s->writes++;
+	}
+
+        return 0;
+
+ fail:
+	vhd_free_wal(s);
+	td_unregister_file(s->vhd.fd);
+	vhd_free_requests(s);
+	vhd_free_bat(s);
+	vhd_free_bitmap_cache(s);
+	vhd_close(&s->vhd);
+	vhd_free(s);
+	return err;
+}
+
+static int
+_vhd_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	vhd_flag_t vhd_flags = 0;
+
+	if (flags & TD_OPEN_RDONLY)
+		vhd_flags |= VHD_FLAG_OPEN_RDONLY;
+	if (flags & TD_OPEN_QUIET)
+		vhd_flags |= VHD_FLAG_OPEN_QUIET;
+	if (flags & TD_OPEN_STRICT)
+		vhd_flags |= VHD_FLAG_OPEN_STRICT;
+	if (flags & TD_OPEN_LAZY_BAT)
+		vhd_flags |= VHD_FLAG_OPEN_LAZY_BAT;
+	if (flags & TD_OPEN_META_LOG)
+		vhd_flags |= VHD_FLAG_OPEN_META_LOG;
+	if (flags & TD_OPEN_QUERY)
+		vhd_flags |= (VHD_FLAG_OPEN_QUERY  |
+			      VHD_FLAG_OPEN_QUIET  |
+			      VHD_FLAG_OPEN_RDONLY |
+			      VHD_FLAG_OPEN_NO_CACHE);
+
+	/* pre-allocate for all but NFS and LVM storage */
+	driver->storage = tapdisk_storage_type(name);
+
+	if (driver->storage != TAPDISK_STORAGE_TYPE_NFS &&
+	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
+		vhd_flags |= VHD_FLAG_OPEN_PREALLOCATE;
+
+	return __vhd_open(driver, name, vhd_flags);
+}
+
+static void
+vhd_log_close(struct vhd_state *s)
+{
+	uint32_t i, allocated, full;
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
+		return;
+
+	if (s->bat.loaded) {
+		DPRINTF("%s: b: %u, bat pages loaded: %u\n",
+			s->vhd.file, s->bat.bat.entries, s->bat.pages_loaded);
+		return;
+	}
+
+	allocated = 0;
+	full      = 0;
+
+	for (i = 0; i < s->bat.bat.entries; i++) {
+		if (bat_entry(s, i) != DD_BLK_UNUSED)
+			allocated++;
+		if (test_batmap(s, i))
+			full++;
+	}
+
+	DPRINTF("%s: b: %u, a: %u, f: %u, n: %"PRIu64"\n",
+		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db);
+}
+
+/*
+ * Writes everything logged home, after which the log is no longer
+ * needed. Should that fail, the log stays for the next open to replay.
+ */
+static void
+vhd_close_wal(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_bitmap *bm;
+	int err;
+
+	if (!vhd_wal_enabled(s))
+		return;
+
+	ASSERT(list_empty(&w->pending));
+
+	err = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (!test_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY))
+			continue;
+
+		err = vhd_seek(&s->vhd, vhd_sectors_to_bytes(
+				       bat_entry(s, bm->blk)), SEEK_SET);
+		if (!err)
+			err = vhd_write(&s->vhd, bm->map,
+					vhd_sectors_to_bytes(s->bm_secs));
+		if (err)
+			goto fail;
+	}
+
+	if (w->bat_first <= w->bat_last) {
+		err = vhd_wal_write_bat(s, w->bat_first, w->bat_last);
+		if (err)
+			goto fail;
+	}
+
+	if (fdatasync(s->vhd.fd)) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = vhd_wal_mark(s, 0);
+	if (err)
+		goto fail;
+
+	unlink(w->path);
+	return;
+
+ fail:
+	EPRINTF("%s: checkpointing metadata log: %d, keeping %s\n",
+		s->vhd.file, err, w->path);
+}
+
+static int
+_vhd_close(td_driver_t *driver)
+{
+	int err;
 	struct vhd_state *s;
 	
 	DBG(TLOG_WARN, "vhd_close\n");
@@ -773,16 +1846,35 @@ _vhd_close(td_driver_t *driver)
 			s->debug_done_redundant_writes,
 			s->debug_skipped_redundant_writes);
 
+	/* reads of a lazy bat land in the table */
+	while (s->bat.pages_loading)
+		tapdisk_server_iterate();
+
 	/* don't write footer if tapdisk is read-only */
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
 		goto free;
+
+	/* a refill still in flight would zero past the new footer */
+	while (s->prealloc.busy)
+		tapdisk_server_iterate();
+
+	while (s->wal.busy)
+		tapdisk_server_iterate();
+
+	/* releases complete into the bitmaps */
+	while (s->bm_releasing)
+		tapdisk_server_iterate();
+
+	vhd_close_wal(s);
 	
 	/* 
 	 * write footer if:
 	 *   - we killed it on open (opened with strict) 
 	 *   - we've written data since opening
+	 *   - the pool extended the file past the footer
 	 */
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes) {
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes ||
+	    s->prealloc.refills) {
 		memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
 		err = vhd_write_footer(&s->vhd, &s->vhd.footer);
 		memset(&s->vhd.bat, 0, sizeof(vhd_bat_t));
@@ -800,6 +1892,9 @@ _vhd_close(td_driver_t *driver)
 
  free:
 	vhd_log_close(s);
+	vhd_free_wal(s);
+	td_unregister_file(s->vhd.fd);
+	vhd_free_requests(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
 	vhd_close(&s->vhd);
@@ -963,64 +2058,57 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
-{
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
-
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline void
-unlock_bat(struct vhd_state *s)
-{
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline int
-bat_locked(struct vhd_state *s)
-{
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
+	bm->hnext  = NULL;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
 	memset(bm->shadow, 0, vhd_sectors_to_bytes(s->bm_secs));
 	init_vhd_request(s, &bm->req);
+	init_vhd_request(s, &bm->zero_req);
+	init_vhd_request(s, &bm->release_req);
+	bm->pbw_offset  = 0;
+	bm->alloc_error = 0;
+}
+
+static inline struct vhd_bitmap **
+__bitmap_bucket(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[block & s->bm_hash_mask];
 }
 
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = *__bitmap_bucket(s, block); bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static inline void
+__unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = __bitmap_bucket(s, bm->blk); *pp; pp = &(*pp)->hnext)
+		if (*pp == bm) {
+			*pp = bm->hnext;
+			break;
+		}
+
+	bm->hnext = NULL;
+	list_del_init(&bm->lru);
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1042,7 +2130,20 @@ bitmap_locked(struct vhd_bitmap *bm)
 static inline int
 bitmap_valid(struct vhd_bitmap *bm)
 {
-	return !test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
+	return (!test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING) &&
+		!test_vhd_flag(bm->status, VHD_FLAG_BM_RELEASING));
+}
+
+static inline int
+bitmap_allocating(struct vhd_bitmap *bm)
+{
+	return test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING);
+}
+
+static inline int
+bitmap_dirty(struct vhd_bitmap *bm)
+{
+	return test_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY);
 }
 
 static inline int
@@ -1050,46 +2151,71 @@ bitmap_in_use(struct vhd_bitmap *bm)
 {
 	return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)  ||
 		test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
+		test_vhd_flag(bm->status, VHD_FLAG_BM_RELEASING)     ||
 		test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT) ||
+		bitmap_allocating(bm) ||
 		bm->waiting.head || bm->tx.requests.head || bm->queue.head);
 }
 
 static inline int
 bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i, n;
-
-	n = s->spb >> 3;
-	for (i = 0; i < n; i++)
-		if (bm->map[i] != (char)0xFF)
-			return 0;
+	if (vhd_bitmap_run(&s->vhd, bm->map, 0, s->spb, 1) != s->spb)
+		return 0;
 
 	DBG(TLOG_DBG, "bitmap 0x%04x full\n", bm->blk);
 	return 1;
 }
 
+static inline int
+bitmap_empty(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	if (vhd_bitmap_run(&s->vhd, bm->map, 0, s->spb, 0) != s->spb)
+		return 0;
+
+	DBG(TLOG_DBG, "bitmap 0x%04x empty\n", bm->blk);
+	return 1;
+}
+
+/*
+ * Applies a finished data request to the shadow bitmap: writes mark
+ * their sectors present, discards clear them.
+ */
+static inline void
+update_bitmap_shadow(struct vhd_state *s,
+		     struct vhd_bitmap *bm, struct vhd_request *r)
+{
+	int i;
+	uint32_t sec = r->treq.sec % s->spb;
+
+	for (i = 0; i < r->treq.secs; i++)
+		if (r->op == VHD_OP_DATA_DISCARD)
+			vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+		else
+			vhd_bitmap_set(&s->vhd, bm->shadow, sec + i);
+}
+
+/*
+ * Evict the least recently used bitmap not locked by pending I/O, nor
+ * dirty with logged changes. Locked bitmaps are in use and were touched
+ * recently, so the scan rarely goes far.
+ */
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	uint64_t seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (bitmap_locked(bm) || bitmap_dirty(bm))
+			continue;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		ASSERT(!bitmap_in_use(bm));
+		__unhash_bitmap(s, bm);
+		s->bm_evictions++;
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1114,68 +2240,39 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_move_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **bucket = __bitmap_bucket(s, bm->blk);
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	bm->hnext = *bucket;
+	*bucket   = bm;
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
+	__unhash_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
 static int
 read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 {
+	int err;
 	uint32_t blk, sec;
 	struct vhd_bitmap *bm;
 
@@ -1195,10 +2292,17 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 		return -EINVAL;
 	}
 
+	err = vhd_bat_page_in(s, blk);
+	if (err)
+		return err;
+
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
-			return VHD_BM_BAT_LOCKED;
+		    s->bat.alloc_count >= VHD_ALLOC_MAX) {
+			bm = get_bitmap(s, blk);
+			if (!bm || !bitmap_allocating(bm))
+				return VHD_BM_BAT_LOCKED;
+		}
 
 		return VHD_BM_BAT_CLEAR;
 	}
@@ -1215,9 +2319,12 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	/* bump lru count */
 	touch_bitmap(s, bm);
 
-	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
+	/* being read, or its data area being released */
+	if (!bitmap_valid(bm))
 		return VHD_BM_READ_PENDING;
 
+	s->bm_hits++;
+
 	return ((vhd_bitmap_test(&s->vhd, bm->map, sec)) ? 
 		VHD_BM_BIT_SET : VHD_BM_BIT_CLEAR);
 }
@@ -1226,7 +2333,6 @@ static int
 read_bitmap_cache_span(struct vhd_state *s, 
 		       uint64_t sector, int nr_secs, int value)
 {
-	int ret;
 	uint32_t blk, sec;
 	struct vhd_bitmap *bm;
 
@@ -1244,11 +2350,8 @@ read_bitmap_cache_span(struct vhd_state *s,
 	
 	ASSERT(bm && bitmap_valid(bm));
 
-	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++)
-		if (vhd_bitmap_test(&s->vhd, bm->map, sec) != value)
-			break;
-
-	return ret;
+	return vhd_bitmap_run(&s->vhd, bm->map, sec,
+			      MIN(s->spb, sec + nr_secs), value);
 }
 
 static inline struct vhd_request *
@@ -1299,76 +2402,520 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 		      offset, vhd_complete, req);
 	td_queue_tiocb(s->driver, tiocb);
 
-	s->queued++;
-	s->writes++;
-	s->write_size += req->treq.secs;
-	TRACE(s);
+	s->queued++;
+	s->writes++;
+	s->write_size += req->treq.secs;
+	TRACE(s);
+}
+
+static inline void
+aio_discard(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
+{
+	struct tiocb *tiocb = &req->tiocb;
+
+	td_prep_discard(tiocb, s->vhd.fd, offset,
+			vhd_sectors_to_bytes(req->treq.secs),
+			vhd_complete, req);
+	td_queue_tiocb(s->driver, tiocb);
+
+	s->queued++;
+	TRACE(s);
+}
+
+/*
+ * Takes a log entry for a bitmap update. None is to be had while the
+ * ring is full up to the last checkpoint, which is then started.
+ */
+static struct vhd_wal_entry *
+vhd_wal_get(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_wal_entry *e;
+
+	if (!w->free_count || w->head - w->ckpt > w->slots) {
+		vhd_wal_checkpoint(s);
+		return NULL;
+	}
+
+	e        = w->free[--w->free_count];
+	e->seqno = w->head++;
+	e->done  = 0;
+	e->data  = NULL;
+	list_add_tail(&e->next, &w->pending);
+
+	return e;
+}
+
+static void
+vhd_wal_put(struct vhd_state *s, struct vhd_wal_entry *e)
+{
+	struct vhd_wal *w = &s->wal;
+
+	list_del_init(&e->next);
+	e->data = NULL;
+	w->free[w->free_count++] = e;
+}
+
+/*
+ * Writes the record of @req, alongside its data. The request finishes
+ * once both are done.
+ */
+static void
+vhd_wal_log(struct vhd_state *s, struct vhd_wal_entry *e,
+	    struct vhd_request *req)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_wal_record *rec = (struct vhd_wal_record *)e->buf;
+	struct vhd_bitmap *bm;
+	uint32_t blk;
+	uint64_t offset;
+
+	blk = req->treq.sec / s->spb;
+	bm  = get_bitmap(s, blk);
+
+	memset(e->buf, 0, VHD_SECTOR_SIZE);
+	memcpy(rec->cookie, VHD_WAL_COOKIE, sizeof(rec->cookie));
+	rec->seqno = e->seqno;
+	rec->blk   = blk;
+	rec->bat   = DD_BLK_UNUSED;
+	rec->sec   = req->treq.sec % s->spb;
+	rec->secs  = req->treq.secs;
+	rec->op    = (req->op == VHD_OP_DATA_DISCARD ?
+		      VHD_WAL_OP_CLEAR : VHD_WAL_OP_SET);
+
+	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
+		ASSERT(bm && bitmap_allocating(bm));
+		rec->bat = bm->pbw_offset;
+	}
+
+	vhd_wal_record_out(rec);
+
+	init_vhd_request(s, &e->req);
+	e->req.op        = VHD_OP_WAL_WRITE;
+	e->req.treq.sec  = req->treq.sec;
+	e->req.treq.secs = 1;
+	e->req.treq.buf  = e->buf;
+	e->data          = req;
+	req->wal         = e;
+
+	offset = vhd_sectors_to_bytes(1 + e->seqno % w->slots);
+
+	td_prep_write(&e->req.tiocb, w->fd, e->buf, VHD_SECTOR_SIZE,
+		      offset, vhd_complete, &e->req);
+	td_queue_tiocb(s->driver, &e->req.tiocb);
+
+	s->queued++;
+	w->records++;
+	TRACE(s);
+}
+
+static inline void
+vhd_wal_dirty_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	if (bitmap_dirty(bm))
+		return;
+
+	set_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY);
+	s->wal.dirty++;
+}
+
+static inline void
+vhd_wal_dirty_bat(struct vhd_state *s, uint32_t blk)
+{
+	s->wal.bat_first = MIN(s->wal.bat_first, blk / 128);
+	s->wal.bat_last  = MAX(s->wal.bat_last, blk / 128);
+}
+
+/*
+ * Called as each home write of a checkpoint completes. Once all are
+ * done, the vhd is synced before the checkpoint may move.
+ */
+static void
+vhd_wal_sync(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_request *req = &w->req;
+
+	if (--w->pending_io)
+		return;
+
+	if (w->error) {
+		ERR(s, w->error, "%s: checkpoint failed", s->vhd.file);
+		w->busy = 0;
+		return;
+	}
+
+	init_vhd_request(s, req);
+	req->op = VHD_OP_WAL_SYNC;
+
+	td_prep_flush(&req->tiocb, s->vhd.fd, vhd_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+
+	s->queued++;
+	TRACE(s);
+}
+
+/*
+ * Writes the dirty bitmaps and bat sectors home, syncs the vhd, and
+ * then moves the checkpoint in the log header past every committed
+ * record. Records of transactions still in flight stay in the ring.
+ *
+ * Bitmaps are written from their committed maps, which later commits
+ * may change under the write. Any bit changed that way is covered by a
+ * record past the checkpoint.
+ */
+static void
+vhd_wal_checkpoint(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+	struct vhd_bitmap *bm;
+	struct vhd_request *req;
+	struct vhd_wal_entry *e;
+	uint32_t i, nsecs;
+	uint64_t target;
+	void *buf;
+	int err;
+
+	if (w->busy)
+		return;
+
+	target = w->head - 1;
+	if (!list_empty(&w->pending)) {
+		e      = list_entry(w->pending.next, struct vhd_wal_entry, next);
+		target = e->seqno - 1;
+	}
+
+	if (target == w->ckpt)
+		return;
+
+	DBG(TLOG_DBG, "%s: ckpt: %"PRIu64" -> %"PRIu64", dirty: %u\n",
+	    s->vhd.file, w->ckpt, target, w->dirty);
+
+	w->busy       = 1;
+	w->error      = 0;
+	w->target     = target;
+	w->pending_io = 1;
+
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (!bitmap_dirty(bm))
+			continue;
+
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY);
+		w->dirty--;
+
+		req = &bm->req;
+		init_vhd_request(s, req);
+		req->op        = VHD_OP_WAL_HOME_WRITE;
+		req->treq.sec  = bm->blk * s->spb;
+		req->treq.secs = s->bm_secs;
+		req->treq.buf  = bm->map;
+
+		aio_write(s, req, vhd_sectors_to_bytes(bat_entry(s, bm->blk)));
+		lock_bitmap(bm);
+		set_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
+		w->pending_io++;
+	}
+
+	if (w->bat_first <= w->bat_last) {
+		nsecs = w->bat_last - w->bat_first + 1;
+
+		err = posix_memalign(&buf, VHD_SECTOR_SIZE,
+				     vhd_sectors_to_bytes(nsecs));
+		if (err) {
+			w->error = -err;
+			goto out;
+		}
+
+		w->bat_buf     = buf;
+		w->write_first = w->bat_first;
+		w->write_last  = w->bat_last;
+		w->bat_first   = UINT_MAX;
+		w->bat_last    = 0;
+
+		memcpy(buf, &bat_entry(s, w->write_first * 128),
+		       vhd_sectors_to_bytes(nsecs));
+		for (i = 0; i < nsecs * 128; i++)
+			BE32_OUT(&((uint32_t *)buf)[i]);
+
+		req = &w->bat_req;
+		init_vhd_request(s, req);
+		req->op        = VHD_OP_WAL_HOME_WRITE;
+		req->treq.secs = nsecs;
+		req->treq.buf  = buf;
+
+		aio_write(s, req, s->vhd.header.table_offset +
+			  vhd_sectors_to_bytes(w->write_first));
+		w->pending_io++;
+	}
+
+ out:
+	vhd_wal_sync(s);
+}
+
+/*
+ * Checkpoints are taken lazily, once half the ring is used or half the
+ * bitmap cache is pinned dirty.
+ */
+static inline void
+vhd_wal_kick(struct vhd_state *s)
+{
+	struct vhd_wal *w = &s->wal;
+
+	if (!vhd_wal_enabled(s) || w->busy)
+		return;
+
+	if (w->head - 1 - w->ckpt >= w->slots / 2 ||
+	    w->dirty >= s->bm_cache_size / 2)
+		vhd_wal_checkpoint(s);
 }
 
 /**
- * Reserves a new extent.
+ * Reserves a new extent at the end of the file for block @bm->blk.
  *
- * @returns a 64-bit unsigned integer where the error code is stored in the
- * upper 32 bits and the reserved block number is stored in the lower 32 bits.
- * If an error is returned (the upper 32 bits are not zero), the lower 32 bits
- * are undefined.
+ * On success, @bm->pbw_offset holds the bat entry of the new block and
+ * @lb_end the previous end of allocated data, i.e. the start of any gap
+ * preceding the new bitmap.
  */
-static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+static int
+reserve_new_block(struct vhd_state *s, struct vhd_bitmap *bm, uint64_t *lb_end)
 {
 	int gap = 0;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(!bitmap_allocating(bm));
+	ASSERT(s->bat.alloc_count < VHD_ALLOC_MAX);
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
 	if (s->next_db + gap > UINT_MAX)
-		return (uint64_t)EIO << 32;
+		return -EIO;
+
+	/* wait for a refill which would zero the new block */
+	if (s->prealloc.busy &&
+	    s->next_db + gap + s->spb + s->bm_secs > s->prealloc.end)
+		return -EBUSY;
+
+	*lb_end         = s->next_db;
+	bm->pbw_offset  = s->next_db + gap;
+	bm->alloc_error = 0;
+	s->next_db      = bm->pbw_offset + s->spb + s->bm_secs;
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING);
+	s->bat.alloc[s->bat.alloc_count++] = bm;
 
-	return s->next_db;
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", allocating: %d\n",
+	    bm->blk, bm->pbw_offset, s->bat.alloc_count);
+
+	return 0;
 }
 
-static int
+/*
+ * Drops the reservation of a block whose allocation completed or failed.
+ * Space reserved by a failed allocation is reclaimed only if no other
+ * block has been reserved after it, and the allocation was not logged:
+ * a replayed record would hand the space to its block again.
+ */
+static void
+release_new_block(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	int i;
+
+	ASSERT(bitmap_allocating(bm));
+
+	for (i = 0; i < s->bat.alloc_count; i++)
+		if (s->bat.alloc[i] == bm)
+			break;
+
+	ASSERT(i < s->bat.alloc_count);
+	s->bat.alloc[i] = s->bat.alloc[--s->bat.alloc_count];
+
+	if (bm->alloc_error && !vhd_wal_enabled(s) &&
+	    s->next_db == bm->pbw_offset + s->spb + s->bm_secs) {
+		s->next_db = bm->pbw_offset;
+		/* the bitmap may have been written; zero it again */
+		if (s->prealloc.end > s->next_db)
+			s->prealloc.end = s->next_db;
+	}
+
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d, allocating: %d\n",
+	    bm->blk, bm->alloc_error, s->bat.alloc_count);
+
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING);
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
+	bm->pbw_offset  = 0;
+	bm->alloc_error = 0;
+}
+
+/*
+ * Writes the bat entries of all blocks ready for their bat update
+ * which fall into the same VHD_BAT_WRITE_SECS window of the table.
+ */
+static void
 schedule_bat_write(struct vhd_state *s)
 {
 	int i;
-	uint32_t blk;
 	char *buf;
+	uint32_t blk, sec, first, last, nsecs;
 	uint64_t offset;
+	struct vhd_bitmap *bm;
 	struct vhd_request *req;
 
-	ASSERT(bat_locked(s));
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		return;
+
+	first = UINT_MAX;
+	for (i = 0; i < s->bat.alloc_count; i++) {
+		bm = s->bat.alloc[i];
+		if (test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY))
+			first = MIN(first, bm->blk / 128);
+	}
+
+	if (first == UINT_MAX)
+		return;
+
+	nsecs = secs_round_up_no_zero(s->bat.bat.entries * sizeof(uint32_t));
+	nsecs = MIN(nsecs - first, VHD_BAT_WRITE_SECS);
+	last  = first;
+
+	for (i = 0; i < s->bat.alloc_count; i++) {
+		bm  = s->bat.alloc[i];
+		sec = bm->blk / 128;
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+		if (!test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY) ||
+		    sec >= first + nsecs)
+			continue;
+
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE);
+		last = MAX(last, sec);
+	}
+
+	nsecs = last - first + 1;
+	req   = &s->bat.req;
+	buf   = s->bat.bat_buf;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first * 128), vhd_sectors_to_bytes(nsecs));
 
-	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (i = 0; i < s->bat.alloc_count; i++) {
+		bm = s->bat.alloc[i];
+		if (test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE)) {
+			blk = bm->blk - first * 128;
+			((uint32_t *)buf)[blk] = bm->pbw_offset;
+		}
+	}
 
-	for (i = 0; i < 128; i++)
+	for (i = 0; i < nsecs * 128; i++)
 		BE32_OUT(&((uint32_t *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
+	offset         = s->vhd.header.table_offset + first * 512;
+	req->treq.secs = nsecs;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
+	s->bat.write_sec  = first;
+	s->bat.write_secs = nsecs;
+
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	DBG(TLOG_DBG, "bat sec: 0x%04x, nr_secs: %u, "
+	    "table_offset: 0x%08"PRIx64"\n", first, nsecs, offset);
+}
+
+static inline void
+queue_bat_write(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	ASSERT(bitmap_allocating(bm));
+	set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
+	schedule_bat_write(s);
+}
 
-	return 0;
+static inline uint32_t
+vhd_prealloc_ready(struct vhd_state *s)
+{
+	if (s->prealloc.end <= s->next_db)
+		return 0;
+
+	return (s->prealloc.end - s->next_db) / (s->spb + s->bm_secs);
+}
+
+/*
+ * Zeroes the file from the end of the pool to size blocks past next_db
+ * (plus alignment), once fewer than low blocks are left. The zeroes
+ * double as the empty bitmaps of the new blocks, and FALLOC_FL_ZERO_RANGE
+ * also clears whatever was past next_db before, such as the footer.
+ */
+static void
+vhd_prealloc_refill(struct vhd_state *s)
+{
+	struct vhd_prealloc *p = &s->prealloc;
+	struct vhd_request *req = &p->req;
+	uint64_t target;
+
+	if (!p->size || p->busy || vhd_prealloc_ready(s) >= p->low)
+		return;
+
+	if (p->end < s->next_db)
+		p->end = s->next_db;
+
+	target = s->next_db + s->spp + (uint64_t)p->size * (s->spb + s->bm_secs);
+	target = MIN(target, (uint64_t)UINT_MAX);
+	if (p->end >= target)
+		return;
+
+	init_vhd_request(s, req);
+	req->op   = VHD_OP_PREALLOC;
+	req->next = NULL;
+
+	p->start  = p->end;
+	p->target = target;
+	p->busy   = 1;
+
+	td_prep_fallocate(&req->tiocb, s->vhd.fd, FALLOC_FL_ZERO_RANGE,
+			  vhd_sectors_to_bytes(p->start),
+			  vhd_sectors_to_bytes(p->target - p->start),
+			  vhd_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+
+	s->queued++;
+	TRACE(s);
+
+	DBG(TLOG_DBG, "zeroing 0x%08"PRIx64" - 0x%08"PRIx64"\n",
+	    p->start, p->target);
+}
+
+/*
+ * A block reserved inside the pool has its empty bitmap on disk
+ * already, so it goes straight to the bat update.
+ */
+static int
+use_prealloc_block(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_prealloc *p = &s->prealloc;
+
+	if (!p->size)
+		return 0;
+
+	if (s->next_db > p->end) {
+		p->misses++;
+		vhd_prealloc_refill(s);
+		return 0;
+	}
+
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64" from pool\n",
+	    bm->blk, bm->pbw_offset);
+
+	p->hits++;
+	lock_bitmap(bm);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	queue_bat_write(s, bm);
+
+	vhd_prealloc_refill(s);
+
+	return 1;
 }
 
 static void
@@ -1376,19 +2923,19 @@ schedule_zero_bm_write(struct vhd_state *s,
 		       struct vhd_bitmap *bm, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &bm->zero_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = bm->blk * s->spb;
+	req->treq.secs = (bm->pbw_offset - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    bm->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1452,15 +2999,13 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
+	if (bm && bitmap_allocating(bm))
+		return bm->alloc_error ? -EBUSY : 0;
+
 	if (!bm) {
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
@@ -1470,12 +3015,17 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	if (lb_end >> 32) {
-		unlock_bat(s);
-		return -(lb_end >> 32);
-	}
+	err = reserve_new_block(s, bm, &lb_end);
+	if (err)
+		return err;
+
+	/* the new bat entry goes out with the log records of the block */
+	if (vhd_wal_enabled(s))
+		return 0;
+
+	if (use_prealloc_block(s, bm))
+		return 0;
+
 	schedule_zero_bm_write(s, bm, lb_end);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
@@ -1485,72 +3035,57 @@ update_bat(struct vhd_state *s, uint32_t blk)
 static int
 allocate_block(struct vhd_state *s, uint32_t blk)
 {
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t offset, size, lb_end;
 	struct vhd_bitmap *bm;
 	ssize_t count;
-	uint64_t next_db;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
-		return 0;
-	}
+	/* empty bitmap could already be in
+	 * cache if earlier bat update failed */
+	bm = get_bitmap(s, blk);
+	if (bm && bitmap_allocating(bm))
+		return bm->alloc_error ? -EBUSY : 0;
 
-	gap     = 0;
-	offset  = vhd_sectors_to_bytes(s->next_db);
-	next_db = s->next_db;
+	if (!bm) {
+		/* install empty bitmap in cache */
+		err = alloc_vhd_bitmap(s, &bm, blk);
+		if (err) 
+			return err;
 
-	/* data region of segment should begin on page boundary */
-	if ((next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((next_db + s->bm_secs) % s->spp));
-		next_db += gap;
+		install_bitmap(s, bm);
 	}
 
-	if (next_db > UINT_MAX)
-		return -EIO;
+	err = reserve_new_block(s, bm, &lb_end);
+	if (err)
+		return err;
 
-	s->next_db = next_db;
+	if (!vhd_wal_enabled(s) && use_prealloc_block(s, bm))
+		return 0;
 
-	s->bat.pbw_blk = blk;
-	s->bat.pbw_offset = s->next_db;
+	offset = vhd_sectors_to_bytes(lb_end);
+	size   = vhd_sectors_to_bytes(s->next_db - lb_end);
 
 	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
-
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(s, -errno, "lseek failed\n");
-		return -errno;
-	}
+	    blk, bm->pbw_offset);
 
-	size  = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	count = write(s->vhd.fd, vhd_zeros(size), size);
+	count = pwrite(s->vhd.fd, vhd_zeros(size), size, offset);
 	if (count != size) {
 		err = count < 0 ? -errno : -ENOSPC;
-		ERR(s, -errno,
+		ERR(s, err,
 		    "write failed (%zd, offset %"PRIu64")\n", count, offset);
+		bm->alloc_error = err;
+		release_new_block(s, bm);
 		return err;
 	}
 
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
-
-		install_bitmap(s, bm);
-	}
+	if (vhd_wal_enabled(s))
+		return 0;
 
-	lock_bat(s);
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	queue_bat_write(s, bm);
 
 	return 0;
 }
@@ -1579,90 +3114,352 @@ schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	offset += s->bm_secs + sec;
 	offset  = vhd_sectors_to_bytes(offset);
 
- make_request:
+ make_request:
+	req = alloc_vhd_request(s);
+	if (!req) 
+		return -EBUSY;
+
+	req->treq  = treq;
+	req->flags = flags;
+	req->op    = VHD_OP_DATA_READ;
+	req->next  = NULL;
+
+	aio_read(s, req, offset);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
+	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x, buf: %p\n",
+	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset, req->flags,
+	    treq.buf);
+
+	return 0;
+}
+
+static int
+schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
+{
+	int err;
+	uint64_t offset;
+	uint32_t blk = 0, sec = 0;
+	struct vhd_bitmap  *bm = NULL;
+	struct vhd_request *req;
+	struct vhd_wal_entry *wal = NULL;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		offset = vhd_sectors_to_bytes(treq.sec);
+		goto make_request;
+	}
+
+	blk    = treq.sec / s->spb;
+	sec    = treq.sec % s->spb;
+	offset = bat_entry(s, blk);
+
+	if (vhd_wal_enabled(s) &&
+	    test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BITMAP)) {
+		wal = vhd_wal_get(s);
+		if (!wal)
+			return -EBUSY;
+	}
+
+	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BAT)) {
+		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+			err = allocate_block(s, blk);
+		else
+			err = update_bat(s, blk);
+
+		if (err)
+			goto fail;
+
+		bm     = get_bitmap(s, blk);
+		offset = bm->pbw_offset;
+	}
+
+	offset += s->bm_secs + sec;
+	offset  = vhd_sectors_to_bytes(offset);
+
+ make_request:
+	req = alloc_vhd_request(s);
+	if (!req) {
+		err = -EBUSY;
+		goto fail;
+	}
+
+	req->treq  = treq;
+	req->flags = flags;
+	req->op    = VHD_OP_DATA_WRITE;
+	req->next  = NULL;
+
+	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BITMAP)) {
+		bm = get_bitmap(s, blk);
+		ASSERT(bm && bitmap_valid(bm));
+		lock_bitmap(bm);
+
+		if (bm->tx.closed) {
+			add_to_tail(&bm->queue, req);
+			set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+		} else
+			add_to_transaction(&bm->tx, req);
+
+		if (wal)
+			vhd_wal_log(s, wal, req);
+	} else if (sec == 0 && 	/* first sector inside data block */
+		   s->vhd.footer.type != HD_TYPE_FIXED && 
+		   bat_entry(s, blk) != s->first_db &&
+		   test_batmap(s, blk))
+		schedule_redundant_bm_write(s, blk);
+
+	aio_write(s, req, offset);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
+	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x\n",
+	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset, req->flags);
+
+	return 0;
+
+ fail:
+	if (wal)
+		vhd_wal_put(s, wal);
+	return err;
+}
+
+/*
+ * Discards join the bitmap transaction like a write would, clearing
+ * bits instead of setting them. Freeing the backing storage of their
+ * sectors takes the place of the data I/O.
+ */
+static int
+schedule_data_discard(struct vhd_state *s, td_request_t treq)
+{
+	uint64_t offset;
+	uint32_t blk, sec;
+	struct vhd_bitmap  *bm;
+	struct vhd_request *req;
+	struct vhd_wal_entry *wal = NULL;
+
+	blk    = treq.sec / s->spb;
+	sec    = treq.sec % s->spb;
+	bm     = get_bitmap(s, blk);
+	offset = bat_entry(s, blk);
+
+	ASSERT(offset != DD_BLK_UNUSED);
+	ASSERT(bm && bitmap_valid(bm));
+
+	offset += s->bm_secs + sec;
+	offset  = vhd_sectors_to_bytes(offset);
+
 	req = alloc_vhd_request(s);
-	if (!req) 
+	if (!req)
 		return -EBUSY;
 
+	if (vhd_wal_enabled(s)) {
+		wal = vhd_wal_get(s);
+		if (!wal) {
+			free_vhd_request(s, req);
+			return -EBUSY;
+		}
+	}
+
 	req->treq  = treq;
-	req->flags = flags;
-	req->op    = VHD_OP_DATA_READ;
+	req->op    = VHD_OP_DATA_DISCARD;
 	req->next  = NULL;
 
-	aio_read(s, req, offset);
+	lock_bitmap(bm);
+
+	if (bm->tx.closed) {
+		add_to_tail(&bm->queue, req);
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+	} else
+		add_to_transaction(&bm->tx, req);
+
+	if (wal)
+		vhd_wal_log(s, wal, req);
+
+	aio_discard(s, req, offset);
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
-	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x, buf: %p\n",
-	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset, req->flags,
-	    treq.buf);
+	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64"\n",
+	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset);
 
 	return 0;
 }
 
+/*
+ * Zero writes need no data I/O wherever the image reads zeros anyway.
+ * Unallocated sectors of an image without a parent already do, so the
+ * write is dropped. Allocated sectors are discarded, which clears
+ * their bits, unless a parent would show through; then the data is
+ * punched out of the file instead, leaving the bits set. Images opened
+ * to preallocate keep their space, so neither is done there.
+ *
+ * Returns 1 if @treq was dealt with, 0 if it should be written out as
+ * usual.
+ */
 static int
-schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
+schedule_zero_write(struct vhd_state *s, td_request_t treq, int bm_state)
 {
 	int err;
 	uint64_t offset;
 	uint32_t blk = 0, sec = 0;
-	struct vhd_bitmap  *bm = NULL;
-	struct vhd_request *req;
+	struct vhd_bitmap *bm;
+
+	if (!tapdisk_buffer_is_zero(treq.buf, vhd_sectors_to_bytes(treq.secs)))
+		return 0;
+
+	switch (bm_state) {
+	case VHD_BM_BAT_CLEAR:
+	case VHD_BM_BIT_CLEAR:
+		if (s->vhd.footer.type == HD_TYPE_DIFF)
+			return 0;
+
+		s->zero_skipped += treq.secs;
+		td_complete_request(treq, 0);
+		return 1;
+
+	case VHD_BM_BIT_SET:
+		break;
+
+	default:
+		return 0;
+	}
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+		return 0;
 
 	if (s->vhd.footer.type == HD_TYPE_FIXED) {
 		offset = vhd_sectors_to_bytes(treq.sec);
-		goto make_request;
+		goto punch;
 	}
 
-	blk    = treq.sec / s->spb;
-	sec    = treq.sec % s->spb;
-	offset = bat_entry(s, blk);
+	blk = treq.sec / s->spb;
+	sec = treq.sec % s->spb;
 
-	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BAT)) {
-		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-			err = allocate_block(s, blk);
-		else
-			err = update_bat(s, blk);
+	if (s->vhd.footer.type == HD_TYPE_DYNAMIC) {
+		bm = get_bitmap(s, blk);
+		if (!bm || !bitmap_valid(bm))
+			return 0;
 
-		if (err)
-			return err;
+		if (schedule_data_discard(s, treq))
+			return 0;
 
-		offset = s->bat.pbw_offset;
+		s->zero_discarded += treq.secs;
+		return 1;
 	}
 
-	offset += s->bm_secs + sec;
-	offset  = vhd_sectors_to_bytes(offset);
+	offset = vhd_sectors_to_bytes(bat_entry(s, blk) + s->bm_secs + sec);
+
+ punch:
+	err = tapdisk_zero_range(s->vhd.fd, offset,
+				 vhd_sectors_to_bytes(treq.secs));
+	if (err)
+		return 0;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
+	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64"\n",
+	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset);
+
+	s->zero_punched += treq.secs;
+	td_complete_request(treq, 0);
+	return 1;
+}
+
+/*
+ * Writes complete only once their bitmap transaction hit the disk, so
+ * syncing the file covers data and metadata of everything the guest
+ * saw completed.
+ */
+static int
+schedule_flush(struct vhd_state *s, td_request_t treq)
+{
+	struct vhd_request *req;
 
- make_request:
 	req = alloc_vhd_request(s);
 	if (!req)
 		return -EBUSY;
 
 	req->treq  = treq;
-	req->flags = flags;
-	req->op    = VHD_OP_DATA_WRITE;
+	req->op    = VHD_OP_FLUSH;
 	req->next  = NULL;
 
-	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BITMAP)) {
-		bm = get_bitmap(s, blk);
-		ASSERT(bm && bitmap_valid(bm));
-		lock_bitmap(bm);
+	td_prep_flush(&req->tiocb, s->vhd.fd, vhd_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
 
-		if (bm->tx.closed) {
-			add_to_tail(&bm->queue, req);
-			set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
-		} else
-			add_to_transaction(&bm->tx, req);
-	} else if (sec == 0 && 	/* first sector inside data block */
-		   s->vhd.footer.type != HD_TYPE_FIXED && 
-		   bat_entry(s, blk) != s->first_db &&
-		   test_batmap(s, blk))
-		schedule_redundant_bm_write(s, blk);
+	s->queued++;
+	TRACE(s);
 
-	aio_write(s, req, offset);
+	return 0;
+}
 
-	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
-	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x\n",
-	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset, req->flags);
+/*
+ * Once discards have cleared every bit of a block, its data area is no
+ * longer referenced. New blocks are only ever allocated at the end of
+ * the file, so the bat entry is kept for reuse by later writes, but
+ * the backing storage is handed back. Until that is done, requests
+ * for the block wait on the bitmap as if it was being read, so no
+ * write lands in the range being freed.
+ */
+static void
+release_block_data(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	uint64_t offset;
+	struct vhd_request *req = &bm->release_req;
+
+	offset = bat_entry(s, bm->blk);
+	ASSERT(offset != DD_BLK_UNUSED);
+
+	offset = vhd_sectors_to_bytes(offset + s->bm_secs);
+
+	init_vhd_request(s, req);
+	req->op        = VHD_OP_BLOCK_RELEASE;
+	req->treq.sec  = bm->blk * s->spb;
+	req->treq.secs = s->spb;
+	req->next      = NULL;
+
+	aio_discard(s, req, offset);
+	lock_bitmap(bm);
+	set_vhd_flag(bm->status, VHD_FLAG_BM_RELEASING);
+	s->bm_releasing++;
+
+	DBG(TLOG_DBG, "%s: blk: 0x%04x, offset: 0x%08"PRIx64"\n",
+	    s->vhd.file, bm->blk, offset);
+}
+
+/*
+ * Reads the bat page holding @blk straight into the table. Requests
+ * wait on the page until it is in.
+ */
+static int
+schedule_bat_page_read(struct vhd_state *s, uint32_t blk)
+{
+	vhd_bat_t *bat = &s->bat.bat;
+	struct vhd_request *req;
+	uint32_t page, first, n;
+	uint64_t offset;
+
+	page  = blk >> VHD_BAT_PAGE_SHIFT;
+	first = page << VHD_BAT_PAGE_SHIFT;
+	n     = MIN(VHD_BAT_PAGE_ENTRIES, bat->entries - first);
+
+	ASSERT(s->bat.loaded[page] == VHD_BAT_PAGE_ON_DISK);
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq.sec  = (uint64_t)first * s->spb;
+	req->treq.secs = vhd_bytes_padded(n * sizeof(uint32_t)) >>
+		VHD_SECTOR_SHIFT;
+	req->treq.buf  = (char *)(bat->bat + first);
+	req->treq.cb   = NULL;
+	req->op        = VHD_OP_BAT_PAGE_READ;
+	req->next      = NULL;
+
+	offset = s->vhd.header.table_offset + (uint64_t)first * sizeof(uint32_t);
+
+	aio_read(s, req, offset);
+	s->bat.loaded[page] = VHD_BAT_PAGE_LOADING;
+	s->bat.pages_loading++;
+
+	DBG(TLOG_DBG, "%s: bat page: %u, offset: 0x%08"PRIx64"\n",
+	    s->vhd.file, page, offset);
 
 	return 0;
 }
@@ -1701,6 +3498,7 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	aio_read(s, req, offset);
 	lock_bitmap(bm);
 	install_bitmap(s, bm);
+	s->bm_misses++;
 	set_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, nr_secs: 0x%04x, "
@@ -1725,8 +3523,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(bitmap_allocating(bm));
+		offset = bm->pbw_offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1751,6 +3549,33 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	    req->treq.secs, offset);
 }
 
+static int
+__vhd_queue_bat_request(struct vhd_state *s, uint8_t op, td_request_t treq)
+{
+	uint32_t page;
+	struct vhd_request *req;
+
+	page = (treq.sec / s->spb) >> VHD_BAT_PAGE_SHIFT;
+	ASSERT(s->bat.loaded[page] == VHD_BAT_PAGE_LOADING);
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq = treq;
+	req->op   = op;
+	req->next = NULL;
+
+	add_to_tail(&s->bat.waiting[page], req);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", bat page: %u, "
+	    "nr_secs: 0x%04x, op: %u\n", s->vhd.file, treq.sec, page,
+	    treq.secs, op);
+
+	TRACE(s);
+	return 0;
+}
+
 /* 
  * queued requests will be submitted once the bitmap
  * describing them is read and the requests are validated. 
@@ -1767,7 +3592,7 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	blk = treq.sec / s->spb;
 	bm  = get_bitmap(s, blk);
 
-	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
+	ASSERT(bm && !bitmap_valid(bm));
 
 	req = alloc_vhd_request(s);
 	if (!req)
@@ -1807,6 +3632,10 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 			err = -EINVAL;
 			goto fail;
 
+		case -EIO:
+			err = -EIO;
+			goto fail;
+
 		case VHD_BM_BAT_CLEAR:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
 			td_forward_request(clone);
@@ -1842,6 +3671,19 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 				goto fail;
 			break;
 
+		/* lazy bats are read-only, so only reads get here */
+		case VHD_BM_BAT_NOT_CACHED:
+			err = schedule_bat_page_read(s, clone.sec / s->spb);
+			if (err)
+				goto fail;
+			/* fall through */
+		case VHD_BM_BAT_READ_PENDING:
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = __vhd_queue_bat_request(s, VHD_OP_DATA_READ, clone);
+			if (err)
+				goto fail;
+			break;
+
 		case VHD_BM_BAT_LOCKED:
 		default:
 			ASSERT(0);
@@ -1869,65 +3711,179 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
 	while (treq.secs) {
-		int err;
-		uint8_t flags;
+		int err;
+		uint8_t flags;
+		td_request_t clone;
+
+		err   = 0;
+		flags = 0;
+		clone = treq;
+
+		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_WRITE)) {
+		case -EINVAL:
+			err = -EINVAL;
+			goto fail;
+
+		case -EIO:
+			err = -EIO;
+			goto fail;
+
+		case VHD_BM_BAT_LOCKED:
+			err = -EBUSY;
+			goto fail;
+
+		case VHD_BM_BAT_CLEAR:
+			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
+				      VHD_FLAG_REQ_UPDATE_BITMAP);
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (schedule_zero_write(s, clone, VHD_BM_BAT_CLEAR))
+				break;
+			err        = schedule_data_write(s, clone, flags);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_BIT_CLEAR:
+			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
+			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
+			if (schedule_zero_write(s, clone, VHD_BM_BIT_CLEAR))
+				break;
+			err        = schedule_data_write(s, clone, flags);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_BIT_SET:
+			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
+			if (schedule_zero_write(s, clone, VHD_BM_BIT_SET))
+				break;
+			err = schedule_data_write(s, clone, 0);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_NOT_CACHED:
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			if (err)
+				goto fail;
+
+			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
+			if (err)
+				goto fail;
+			break;
+
+		case VHD_BM_READ_PENDING:
+			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
+			if (err)
+				goto fail;
+			break;
+
+		default:
+			ASSERT(0);
+			break;
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += vhd_sectors_to_bytes(clone.secs);
+		continue;
+
+	fail:
+		clone.secs = treq.secs;
+		td_complete_request(clone, err);
+		break;
+	}
+}
+
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		struct vhd_request *req;
+
+		req = alloc_vhd_request(s);
+		if (!req) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+
+		req->treq = treq;
+		req->op   = VHD_OP_DATA_DISCARD;
+		req->next = NULL;
+
+		aio_discard(s, req, vhd_sectors_to_bytes(treq.sec));
+		return;
+	}
+
+	while (treq.secs) {
+		uint32_t blk;
 		td_request_t clone;
+		struct vhd_bitmap *bm;
 
 		err   = 0;
-		flags = 0;
 		clone = treq;
+		blk   = clone.sec / s->spb;
 
-		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_WRITE)) {
+		clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+
+		switch (read_bitmap_cache(s, clone.sec, VHD_OP_DATA_DISCARD)) {
 		case -EINVAL:
 			err = -EINVAL;
 			goto fail;
 
-		case VHD_BM_BAT_LOCKED:
-			err = -EBUSY;
+		case -EIO:
+			err = -EIO;
 			goto fail;
 
 		case VHD_BM_BAT_CLEAR:
-			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
-				      VHD_FLAG_REQ_UPDATE_BITMAP);
-			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err        = schedule_data_write(s, clone, flags);
-			if (err)
-				goto fail;
+			/* nothing allocated, nothing to release */
+			td_complete_request(clone, 0);
 			break;
 
 		case VHD_BM_BIT_CLEAR:
-			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
-			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
-			err        = schedule_data_write(s, clone, flags);
-			if (err)
-				goto fail;
-			break;
-
 		case VHD_BM_BIT_SET:
-			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
-			err = schedule_data_write(s, clone, 0);
+			/* full blocks may be known from the batmap alone */
+			bm = get_bitmap(s, blk);
+			if (!bm) {
+				err = schedule_bitmap_read(s, blk);
+				if (err)
+					goto fail;
+			}
+
+			if (!bm || !bitmap_valid(bm))
+				err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD,
+							  clone);
+			else
+				err = schedule_data_discard(s, clone);
 			if (err)
 				goto fail;
 			break;
 
 		case VHD_BM_NOT_CACHED:
-			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			err = schedule_bitmap_read(s, blk);
 			if (err)
 				goto fail;
 
-			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
+			err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, clone);
 			if (err)
 				goto fail;
 			break;
 
 		case VHD_BM_READ_PENDING:
-			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
+			err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, clone);
 			if (err)
 				goto fail;
 			break;
 
+		case VHD_BM_BAT_LOCKED:
 		default:
 			ASSERT(0);
 			break;
@@ -1935,7 +3891,6 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 
 		treq.sec  += clone.secs;
 		treq.secs -= clone.secs;
-		treq.buf  += vhd_sectors_to_bytes(clone.secs);
 		continue;
 
 	fail:
@@ -1945,6 +3900,17 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static void
+vhd_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	err = schedule_flush(s, treq);
+	if (err)
+		td_complete_request(treq, err);
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -1965,6 +3931,8 @@ signal_completion(struct vhd_request *list, int error)
 		td_complete_request(r->treq, err);
 		DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
 		    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
+		if (r->wal)
+			vhd_wal_put(s, r->wal);
 		free_vhd_request(s, r);
 		r    = next;
 
@@ -1978,7 +3946,6 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx;
 	struct vhd_request *r, *next;
-	int i;
 
 	if (!bm->queue.head)
 		return;
@@ -2000,12 +3967,8 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		add_to_transaction(tx, r);
 		if (test_vhd_flag(r->flags, VHD_FLAG_REQ_FINISHED)) {
 			tx->finished++;
-			if (!r->error) {
-				uint32_t sec = r->treq.sec % s->spb;
-				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
-			}
+			if (!r->error)
+				update_bitmap_shadow(s, bm, r);
 		}
 		r = next;
 	}
@@ -2020,13 +3983,13 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx = &bm->tx;
 
-	if (!bat_locked(s))
+	if (!bitmap_allocating(bm))
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT))
 		return;
 
-	if (!s->bat.req.error)
+	if (!bm->alloc_error)
 		goto release;
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
@@ -2037,8 +4000,10 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
  release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	release_new_block(s, bm);
+
+	if (!bitmap_in_use(bm))
+		unlock_bitmap(bm);
 }
 
 static void
@@ -2052,25 +4017,38 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		ASSERT(bitmap_allocating(bm));
+		set_vhd_flag(tx->status, VHD_FLAG_TX_BAT_WAIT);
+		return;
 	}
 
 	if (tx->error) {
 		/* undo changes to shadow */
 		memcpy(bm->shadow, bm->map, map_size);
+		if (vhd_wal_enabled(s) && bitmap_allocating(bm))
+			bm->alloc_error = tx->error;
 	} else {
+		if (vhd_wal_enabled(s)) {
+			/* logged; written home by a checkpoint */
+			if (bitmap_allocating(bm)) {
+				bat_entry(s, bm->blk) = bm->pbw_offset;
+				vhd_wal_dirty_bat(s, bm->blk);
+			}
+			vhd_wal_dirty_bitmap(s, bm);
+		}
+
 		/* complete atomic write */
 		memcpy(bm->map, bm->shadow, map_size);
 		if (!test_batmap(s, bm->blk) && bitmap_full(s, bm))
 			set_batmap(s, bm->blk);
+		else if (test_batmap(s, bm->blk) && !bitmap_full(s, bm))
+			clear_batmap(s, bm->blk);
+
+		/* writes queued for the next transaction may be in flight */
+		if (!bm->queue.head && bitmap_empty(s, bm))
+			release_block_data(s, bm);
 	}
 
 	/* transaction done; signal completions */
@@ -2082,6 +4060,7 @@ finish_bitmap_transaction(struct vhd_state *s,
 		unlock_bitmap(bm);
 
 	finish_bat_transaction(s, bm);
+	vhd_wal_kick(s);
 }
 
 static void
@@ -2093,7 +4072,7 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
 	tx->closed = 1;
 
-	if (!tx->error)
+	if (!tx->error && !vhd_wal_enabled(s))
 		return schedule_bitmap_write(s, bm->blk);
 
 	return finish_bitmap_transaction(s, bm, 0);
@@ -2102,42 +4081,51 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_write(struct vhd_request *req)
 {
-	struct vhd_bitmap *bm;
+	int i, n;
+	struct vhd_bitmap *bm, *batch[VHD_ALLOC_MAX];
 	struct vhd_transaction *tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	DBG(TLOG_DBG, "bat sec: 0x%04x, nr_secs: %u, err %d\n",
+	    s->bat.write_sec, s->bat.write_secs, req->error);
+	ASSERT(test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	for (i = 0, n = 0; i < s->bat.alloc_count; i++) {
+		bm = s->bat.alloc[i];
+		if (!test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE))
+			continue;
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE);
+		batch[n++] = bm;
+	}
+
+	for (i = 0; i < n; i++) {
+		bm = batch[i];
+		tx = &bm->tx;
+
+		ASSERT(bitmap_valid(bm) && bitmap_allocating(bm));
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT));
+
+		if (!req->error)
+			bat_entry(s, bm->blk) = bm->pbw_offset;
+		else {
+			bm->alloc_error = req->error;
+			tx->error = req->error;
+		}
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
+		if (test_vhd_flag(tx->status, VHD_FLAG_TX_BAT_WAIT))
 			finish_bitmap_transaction(s, bm, req->error);
+
+		finish_bat_transaction(s, bm);
 	}
 
-	finish_bat_transaction(s, bm);
+	schedule_bat_write(s);
 }
 
 static void
@@ -2155,25 +4143,156 @@ finish_zero_bm_write(struct vhd_request *req)
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
+	ASSERT(bitmap_allocating(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		bm->alloc_error = req->error;
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
+		finish_bat_transaction(s, bm);
 	} else
-		schedule_bat_write(s);
+		queue_bat_write(s, bm);
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
 }
 
+static void
+finish_prealloc(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+	struct vhd_prealloc *p = &s->prealloc;
+
+	s->returned++;
+	TRACE(s);
+
+	p->busy = 0;
+
+	if (req->error) {
+		if (req->error == -EOPNOTSUPP) {
+			DPRINTF("%s: no zeroing fallocate, preallocation "
+				"disabled\n", s->vhd.file);
+			p->size = 0;
+		}
+		return;
+	}
+
+	/* unless a failed allocation rolled next_db back into it */
+	if (p->end == p->start)
+		p->end = p->target;
+
+	p->refills++;
+}
+
+static void
+finish_wal_write(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+	struct vhd_wal_entry *e;
+	struct vhd_request *data;
+
+	s->returned++;
+	TRACE(s);
+
+	e    = containerof(req, struct vhd_wal_entry, req);
+	data = e->data;
+
+	e->done = 1;
+	if (test_vhd_flag(data->flags, VHD_FLAG_REQ_WAL_WAIT)) {
+		clear_vhd_flag(data->flags, VHD_FLAG_REQ_WAL_WAIT);
+		finish_data_write(data);
+	}
+}
+
+static void
+finish_wal_home_write(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+	struct vhd_wal *w = &s->wal;
+	struct vhd_bitmap *bm;
+
+	s->returned++;
+	TRACE(s);
+
+	if (req == &w->bat_req) {
+		free(w->bat_buf);
+		w->bat_buf = NULL;
+
+		if (req->error) {
+			w->bat_first = MIN(w->bat_first, w->write_first);
+			w->bat_last  = MAX(w->bat_last, w->write_last);
+		}
+	} else {
+		bm = get_bitmap(s, req->treq.sec / s->spb);
+		ASSERT(bm && test_vhd_flag(bm->status,
+					   VHD_FLAG_BM_WRITE_PENDING));
+
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
+		if (req->error)
+			vhd_wal_dirty_bitmap(s, bm);
+
+		if (!bitmap_in_use(bm))
+			unlock_bitmap(bm);
+	}
+
+	if (req->error)
+		w->error = req->error;
+
+	vhd_wal_sync(s);
+}
+
+static void
+finish_wal_sync(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+	struct vhd_wal *w = &s->wal;
+
+	s->returned++;
+	TRACE(s);
+
+	if (req->error) {
+		w->busy = 0;
+		return;
+	}
+
+	vhd_wal_prep_header(s, w->target);
+
+	init_vhd_request(s, req);
+	req->op = VHD_OP_WAL_HEADER;
+
+	td_prep_write(&req->tiocb, w->fd, w->hdr, VHD_SECTOR_SIZE, 0,
+		      vhd_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+
+	s->queued++;
+	TRACE(s);
+}
+
+static void
+finish_wal_header(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+	struct vhd_wal *w = &s->wal;
+
+	s->returned++;
+	TRACE(s);
+
+	w->busy = 0;
+	if (req->error)
+		return;
+
+	w->ckpt = w->target;
+	w->checkpoints++;
+
+	DBG(TLOG_DBG, "%s: ckpt: %"PRIu64"\n", s->vhd.file, w->ckpt);
+
+	vhd_wal_kick(s);
+}
+
 static int
 finish_redundant_bm_write(struct vhd_request *req)
 {
@@ -2194,12 +4313,42 @@ finish_redundant_bm_write(struct vhd_request *req)
 }
 
 
+/*
+ * Resubmits requests that waited for a bitmap to become usable.
+ */
+static void
+resume_waiting_requests(struct vhd_state *s, struct vhd_request *r)
+{
+	struct vhd_request *next;
+
+	while (r) {
+		struct vhd_request tmp;
+
+		tmp  = *r;
+		next =  r->next;
+		free_vhd_request(s, r);
+
+		ASSERT(tmp.op == VHD_OP_DATA_READ || 
+		       tmp.op == VHD_OP_DATA_WRITE ||
+		       tmp.op == VHD_OP_DATA_DISCARD);
+
+		if (tmp.op == VHD_OP_DATA_READ)
+			vhd_queue_read(s->driver, tmp.treq);
+		else if (tmp.op == VHD_OP_DATA_WRITE)
+			vhd_queue_write(s->driver, tmp.treq);
+		else
+			vhd_queue_discard(s->driver, tmp.treq);
+
+		r = next;
+	}
+}
+
 static void
 finish_bitmap_read(struct vhd_request *req)
 {
 	uint32_t blk;
 	struct vhd_bitmap  *bm;
-	struct vhd_request *r, *next;
+	struct vhd_request *r;
 	struct vhd_state   *s = req->state;
 
 	s->returned++;
@@ -2217,24 +4366,7 @@ finish_bitmap_read(struct vhd_request *req)
 
 	if (!req->error) {
 		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
-
-		while (r) {
-			struct vhd_request tmp;
-
-			tmp  = *r;
-			next =  r->next;
-			free_vhd_request(s, r);
-
-			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
-
-			if (tmp.op == VHD_OP_DATA_READ)
-				vhd_queue_read(s->driver, tmp.treq);
-			else if (tmp.op == VHD_OP_DATA_WRITE)
-				vhd_queue_write(s->driver, tmp.treq);
-
-			r = next;
-		}
+		resume_waiting_requests(s, r);
 	} else {
 		int err = req->error;
 		unlock_bitmap(bm);
@@ -2246,6 +4378,74 @@ finish_bitmap_read(struct vhd_request *req)
 		unlock_bitmap(bm);
 }
 
+static void
+finish_bat_page_read(struct vhd_request *req)
+{
+	vhd_bat_t *bat;
+	uint32_t i, page, first, n;
+	struct vhd_request *r;
+	struct vhd_state *s = req->state;
+	int err;
+
+	s->returned++;
+	TRACE(s);
+
+	bat   = &s->bat.bat;
+	first = req->treq.sec / s->spb;
+	page  = first >> VHD_BAT_PAGE_SHIFT;
+	n     = MIN(VHD_BAT_PAGE_ENTRIES, bat->entries - first);
+	err   = req->error;
+
+	free_vhd_request(s, req);
+
+	DBG(TLOG_DBG, "bat page: %u, err: %d\n", page, err);
+	ASSERT(s->bat.loaded[page] == VHD_BAT_PAGE_LOADING);
+
+	r = s->bat.waiting[page].head;
+	clear_req_list(&s->bat.waiting[page]);
+	s->bat.pages_loading--;
+
+	if (err) {
+		s->bat.loaded[page] = VHD_BAT_PAGE_ON_DISK;
+		return signal_completion(r, -EIO);
+	}
+
+	for (i = first; i < first + n; i++)
+		BE32_IN(&bat->bat[i]);
+
+	s->bat.loaded[page] = VHD_BAT_PAGE_LOADED;
+	s->bat.pages_loaded++;
+
+	resume_waiting_requests(s, r);
+}
+
+static void
+finish_block_release(struct vhd_request *req)
+{
+	struct vhd_bitmap  *bm;
+	struct vhd_request *r;
+	struct vhd_state   *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	bm = get_bitmap(s, req->treq.sec / s->spb);
+
+	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_RELEASING));
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", bm->blk, req->error);
+
+	r = bm->waiting.head;
+	clear_req_list(&bm->waiting);
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_RELEASING);
+	s->bm_releasing--;
+
+	/* the bitmap is on disk already; a failure only wastes space */
+	resume_waiting_requests(s, r);
+
+	if (!bitmap_in_use(bm))
+		unlock_bitmap(bm);
+}
+
 static void
 finish_bitmap_write(struct vhd_request *req)
 {
@@ -2285,18 +4485,24 @@ finish_data_read(struct vhd_request *req)
 static void
 finish_data_write(struct vhd_request *req)
 {
-	int i;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = (struct vhd_state *)req->state;
 
+	if (req->wal) {
+		if (!req->wal->done) {
+			set_vhd_flag(req->flags, VHD_FLAG_REQ_WAL_WAIT);
+			return;
+		}
+		req->error = (req->error ? req->error : req->wal->req.error);
+	}
+
 	set_vhd_flag(req->flags, VHD_FLAG_REQ_FINISHED);
 
 	if (tx) {
-		uint32_t blk, sec;
+		uint32_t blk;
 		struct vhd_bitmap *bm;
 
 		blk = req->treq.sec / s->spb;
-		sec = req->treq.sec % s->spb;
 		bm  = get_bitmap(s, blk);
 
 		ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
@@ -2308,8 +4514,7 @@ finish_data_write(struct vhd_request *req)
 		    req->treq.sec / s->spb, tx->started, tx->finished);
 
 		if (!req->error)
-			for (i = 0; i < req->treq.secs; i++)
-				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
+			update_bitmap_shadow(s, bm, req);
 
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
@@ -2332,6 +4537,13 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 	s->completed++;
 	TRACE(s);
 
+	/* dynamic disks drop the sectors from the bitmap all the same */
+	if (err == -EOPNOTSUPP &&
+	    (req->op == VHD_OP_BLOCK_RELEASE ||
+	     (req->op == VHD_OP_DATA_DISCARD &&
+	      s->vhd.footer.type != HD_TYPE_FIXED)))
+		err = 0;
+
 	req->error = err;
 
 	if (req->error)
@@ -2347,6 +4559,7 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		break;
 
 	case VHD_OP_DATA_WRITE:
+	case VHD_OP_DATA_DISCARD:
 		finish_data_write(req);
 		break;
 
@@ -2358,6 +4571,14 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bitmap_write(req);
 		break;
 
+	case VHD_OP_BLOCK_RELEASE:
+		finish_block_release(req);
+		break;
+
+	case VHD_OP_BAT_PAGE_READ:
+		finish_bat_page_read(req);
+		break;
+
 	case VHD_OP_ZERO_BM_WRITE:
 		finish_zero_bm_write(req);
 		break;
@@ -2370,6 +4591,30 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_FLUSH:
+		signal_completion(req, 0);
+		break;
+
+	case VHD_OP_PREALLOC:
+		finish_prealloc(req);
+		break;
+
+	case VHD_OP_WAL_WRITE:
+		finish_wal_write(req);
+		break;
+
+	case VHD_OP_WAL_HOME_WRITE:
+		finish_wal_home_write(req);
+		break;
+
+	case VHD_OP_WAL_SYNC:
+		finish_wal_sync(req);
+		break;
+
+	case VHD_OP_WAL_HEADER:
+		finish_wal_header(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
@@ -2380,6 +4625,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2390,8 +4636,8 @@ vhd_debug(td_driver_t *driver)
 	DBG(TLOG_WARN, "READS: 0x%08"PRIx64", AVG_READ_SIZE: %f\n",
 	    s->reads, (s->reads ? ((float)s->read_size / s->reads) : 0.0));
 
-	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%u total)\n", VHD_REQS_DATA);
-	for (i = 0; i < VHD_REQS_DATA; i++) {
+	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%d total)\n", s->vreq_count);
+	for (i = 0; i < s->vreq_count; i++) {
 		struct vhd_request *r = &s->vreq_list[i];
 		td_request_t *t       = &r->treq;
 		const char *vname     = t->vreq ? t->vreq->name: NULL;
@@ -2402,16 +4648,15 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%u total, hits: %"PRIu64", "
+	    "misses: %"PRIu64", evictions: %"PRIu64")\n", s->bm_cache_size,
+	    s->bm_hits, s->bm_misses, s->bm_evictions);
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2437,11 +4682,18 @@ vhd_debug(td_driver_t *driver)
 		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
+		i++;
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, write_sec: 0x%04x, "
+	    "write_secs: %u, allocating: %d\n", s->bat.status,
+	    s->bat.write_sec, s->bat.write_secs, s->bat.alloc_count);
+	for (i = 0; i < s->bat.alloc_count; i++) {
+		struct vhd_bitmap *bm = s->bat.alloc[i];
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, "
+		    "pbw_off: 0x%08"PRIx64", err: %d\n", i, bm->blk,
+		    bm->status, bm->pbw_offset, bm->alloc_error);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2449,6 +4701,60 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "bitmaps", "{");
+	tapdisk_stats_field(st, "size", "u", s->bm_cache_size);
+	tapdisk_stats_field(st, "used", "u",
+			    s->bm_cache_size - s->bm_free_count);
+	tapdisk_stats_field(st, "hits", "llu", s->bm_hits);
+	tapdisk_stats_field(st, "misses", "llu", s->bm_misses);
+	tapdisk_stats_field(st, "evictions", "llu", s->bm_evictions);
+	tapdisk_stats_leave(st, '}');
+
+	if (s->bat.loaded) {
+		tapdisk_stats_field(st, "bat_pages", "[");
+		tapdisk_stats_val(st, "u", s->bat.pages_loaded);
+		tapdisk_stats_val(st, "u", (s->bat.bat.entries +
+					    VHD_BAT_PAGE_ENTRIES - 1) >>
+				  VHD_BAT_PAGE_SHIFT);
+		tapdisk_stats_leave(st, ']');
+	}
+
+	if (s->prealloc.size) {
+		tapdisk_stats_field(st, "prealloc", "{");
+		tapdisk_stats_field(st, "size", "u", s->prealloc.size);
+		tapdisk_stats_field(st, "low", "u", s->prealloc.low);
+		tapdisk_stats_field(st, "ready", "u", vhd_prealloc_ready(s));
+		tapdisk_stats_field(st, "hits", "llu", s->prealloc.hits);
+		tapdisk_stats_field(st, "misses", "llu", s->prealloc.misses);
+		tapdisk_stats_field(st, "refills", "llu", s->prealloc.refills);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vhd_wal_enabled(s)) {
+		tapdisk_stats_field(st, "meta_log", "{");
+		tapdisk_stats_field(st, "slots", "u", s->wal.slots);
+		tapdisk_stats_field(st, "used", "llu",
+				    s->wal.head - 1 - s->wal.ckpt);
+		tapdisk_stats_field(st, "dirty", "u", s->wal.dirty);
+		tapdisk_stats_field(st, "records", "llu", s->wal.records);
+		tapdisk_stats_field(st, "checkpoints", "llu",
+				    s->wal.checkpoints);
+		tapdisk_stats_field(st, "replayed", "llu", s->wal.replayed);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	tapdisk_stats_field(st, "zero_writes", "{");
+	tapdisk_stats_field(st, "skipped", "llu", s->zero_skipped);
+	tapdisk_stats_field(st, "discarded", "llu", s->zero_discarded);
+	tapdisk_stats_field(st, "punched", "llu", s->zero_punched);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2457,7 +4763,10 @@ struct tap_disk tapdisk_vhd = {
 	.td_close           = _vhd_close,
 	.td_queue_read      = vhd_queue_read,
 	.td_queue_write     = vhd_queue_write,
+	.td_queue_discard   = vhd_queue_discard,
+	.td_queue_flush     = vhd_queue_flush,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
 };
@@ -45,7 +45,6 @@
 
 #define VHD_INDEX_FILE_POOL_SIZE     12
 #define VHD_INDEX_CACHE_SIZE         4
-#define VHD_INDEX_REQUESTS           (TAPDISK_DATA_REQUESTS + VHD_INDEX_CACHE_SIZE)
 
 #define VHD_INDEX_BLOCK_READ_PENDING 0x0001
 #define VHD_INDEX_BLOCK_VALID        0x0002
@@ -102,9 +101,10 @@ struct vhd_index {
 	vhd_index_block_t           *cache_free_list[VHD_INDEX_CACHE_SIZE];
 	vhd_index_block_t            cache_list[VHD_INDEX_CACHE_SIZE];
 
+	int                          requests_cnt;
 	int                          requests_free_cnt;
-	vhd_index_request_t         *requests_free_list[VHD_INDEX_REQUESTS];
-	vhd_index_request_t          requests_list[VHD_INDEX_REQUESTS];
+	vhd_index_request_t        **requests_free_list;
+	vhd_index_request_t         *requests_list;
 
 	td_driver_t                 *driver;
 };
@@ -133,26 +133,51 @@ vhd_index_initialize_block(vhd_index_block_t *block)
 }
 
 static void
-vhd_index_init(vhd_index_t *index)
+vhd_index_free_requests(vhd_index_t *index)
+{
+	free(index->requests_list);
+	index->requests_list = NULL;
+
+	free(index->requests_free_list);
+	index->requests_free_list = NULL;
+
+	index->requests_cnt      = 0;
+	index->requests_free_cnt = 0;
+}
+
+static int
+vhd_index_init(vhd_index_t *index, int n_reqs)
 {
 	int i;
 
 	memset(index, 0, sizeof(vhd_index_t));
 
+	index->requests_list      = calloc(n_reqs,
+					   sizeof(vhd_index_request_t));
+	index->requests_free_list = calloc(n_reqs,
+					   sizeof(vhd_index_request_t *));
+	if (!index->requests_list || !index->requests_free_list) {
+		vhd_index_free_requests(index);
+		return -ENOMEM;
+	}
+
 	index->cache_free_cnt = VHD_INDEX_CACHE_SIZE;
 	for (i = 0; i < VHD_INDEX_CACHE_SIZE; i++) {
 		index->cache_free_list[i] = index->cache_list + i;
 		vhd_index_initialize_block(index->cache_free_list[i]);
 	}
 
-	index->requests_free_cnt = VHD_INDEX_REQUESTS;
-	for (i = 0; i < VHD_INDEX_REQUESTS; i++) {
+	index->requests_cnt      = n_reqs;
+	index->requests_free_cnt = n_reqs;
+	for (i = 0; i < n_reqs; i++) {
 		index->requests_free_list[i] = index->requests_list + i;
 		vhd_index_initialize_request(index->requests_free_list[i]);
 	}
 
 	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
 		index->fds[i].fd = -1;
+
+	return 0;
 }
 
 static int
@@ -195,12 +220,15 @@ vhd_index_free(vhd_index_t *index)
 		free(index->cache_list[i].vhdi_block.table);
 
 	for (i = 0; i < VHD_INDEX_FILE_POOL_SIZE; i++)
-		if (index->fds[i].fd != -1)
+		if (index->fds[i].fd != -1) {
+			td_unregister_file(index->fds[i].fd);
 			close(index->fds[i].fd);
+		}
 
 	vhdi_file_table_free(&index->files);
 	free(index->bat.table);
 	free(index->name);
+	vhd_index_free_requests(index);
 }
 
 static int
@@ -242,15 +270,21 @@ vhd_index_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	index = (vhd_index_t *)driver->data;
 
-	vhd_index_init(index);
+	err = vhd_index_init(index, tapdisk_driver_data_requests(driver) +
+			     VHD_INDEX_CACHE_SIZE);
+	if (err)
+		return err;
 
 	index->name = strdup(name);
-	if (!index->name)
+	if (!index->name) {
+		vhd_index_free_requests(index);
 		return -ENOMEM;
+	}
 
 	err = vhd_index_load(index);
 	if (err) {
 		free(index->name);
+		vhd_index_free_requests(index);
 		return err;
 	}
 
@@ -265,6 +299,7 @@ vhd_index_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	driver->info.info = 0;
 
 	index->driver = driver;
+	td_register_file(index->vhdi.fd);
 
 	DPRINTF("opened vhd index %s\n", name);
 
@@ -277,6 +312,7 @@ vhd_index_close(td_driver_t *driver)
 	vhd_index_t *index;
 
 	index = (vhd_index_t *)driver->data;
+	td_unregister_file(index->vhdi.fd);
 	vhdi_close(&index->vhdi);
 
 	DPRINTF("closed vhd index %s\n", index->name);
@@ -353,6 +389,8 @@ vhd_index_open_file(vhd_index_t *index,
 	if (ref->fd == -1)
 		return -errno;
 
+	td_register_file(ref->fd);
+
 	ref->fid    = id;
 	ref->refcnt = 0;
 
@@ -380,8 +418,10 @@ vhd_index_get_file(vhd_index_t *index,
 	if (!lru)
 		return -EBUSY;
 
-	if (lru->fd != -1)
+	if (lru->fd != -1) {
+		td_unregister_file(lru->fd);
 		close(lru->fd);
+	}
 
 	err = vhd_index_open_file(index, id, lru);
 	if (err)
@@ -863,7 +903,7 @@ vhd_index_debug(td_driver_t *driver)
 	}
 
 	WARN("REQUESTS:\n");
-	for (i = 0; i < VHD_INDEX_REQUESTS; i++) {
+	for (i = 0; i < index->requests_cnt; i++) {
 		vhd_index_request_t *req;
 
 		req = index->requests_list + i;
@@ -20,10 +20,12 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include "tapdisk.h"
 #include "scheduler.h"
@@ -32,11 +34,16 @@
 #define DBG(_f, _a...)               if (0) { tlog_syslog(TLOG_DBG, _f, ##_a); }
 #define BUG_ON(_cond)                if (_cond) td_panic()
 
-#define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_TIMEOUT        (600 * 1000)
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
 
+#define SCHEDULER_EPOLL_EVENTS       64
+
+#define scheduler_event_bucket(s, id)	\
+	(&(s)->buckets[(unsigned int)(id) % SCHEDULER_EVENT_BUCKETS])
+
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
@@ -54,30 +61,227 @@ typedef struct event {
 	event_id_t                   id;
 
 	int                          fd;
-	int                          timeout;
-	int                          deadline;
+	int                          timeout;    /* in milliseconds */
+	struct timeval               deadline;
+	int                          heap_idx;   /* -1 if not armed */
 
 	event_cb_t                   cb;
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             id_next;
+	struct list_head             fd_next;
+	struct list_head             pending_next;
 } event_t;
 
+/*
+ * All events registered on one descriptor. The epoll registration is
+ * the union of the modes of all live, unmasked events on the fd, and
+ * is only updated when that union changes.
+ */
+struct scheduler_fd {
+	int                          fd;
+	int                          mode;
+	struct list_head             events;
+	struct list_head             stale;
+};
+
+struct scheduler_backend {
+	const char                  *name;
+
+	int  (*init)                 (scheduler_t *);
+	int  (*update)               (scheduler_t *, event_t *);
+	int  (*wait)                 (scheduler_t *);
+};
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_set_pending(scheduler_t *s, event_t *event, char mode)
 {
-	int diff;
-	struct timeval now;
+	if (!event->pending)
+		list_add_tail(&event->pending_next, &s->pending);
+
+	event->pending |= mode;
+}
+
+static inline int
+scheduler_timer_before(event_t *a, event_t *b)
+{
+	return timercmp(&a->deadline, &b->deadline, <);
+}
+
+static inline void
+scheduler_timer_set(scheduler_t *s, int idx, event_t *event)
+{
+	s->timers[idx]  = event;
+	event->heap_idx = idx;
+}
+
+static void
+scheduler_timer_sift_up(scheduler_t *s, int idx)
+{
+	event_t *event = s->timers[idx];
+
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+
+		if (!scheduler_timer_before(event, s->timers[parent]))
+			break;
+
+		scheduler_timer_set(s, idx, s->timers[parent]);
+		idx = parent;
+	}
+
+	scheduler_timer_set(s, idx, event);
+}
+
+static void
+scheduler_timer_sift_down(scheduler_t *s, int idx)
+{
+	event_t *event = s->timers[idx];
+
+	for (;;) {
+		int child = 2 * idx + 1;
+
+		if (child >= s->n_timers)
+			break;
+
+		if (child + 1 < s->n_timers &&
+		    scheduler_timer_before(s->timers[child + 1],
+					   s->timers[child]))
+			child++;
+
+		if (!scheduler_timer_before(s->timers[child], event))
+			break;
+
+		scheduler_timer_set(s, idx, s->timers[child]);
+		idx = child;
+	}
+
+	scheduler_timer_set(s, idx, event);
+}
+
+static void
+scheduler_timer_remove(scheduler_t *s, event_t *event)
+{
+	int idx = event->heap_idx;
+	event_t *last;
+
+	if (idx < 0)
+		return;
+
+	event->heap_idx = -1;
+
+	last = s->timers[--s->n_timers];
+	if (last == event)
+		return;
+
+	scheduler_timer_set(s, idx, last);
+	scheduler_timer_sift_up(s, idx);
+	scheduler_timer_sift_down(s, last->heap_idx);
+}
+
+/*
+ * Makes room for one more registered timer. Masked and expired timers
+ * are out of the heap, but may go back in at any time, so capacity is
+ * kept for every timer registered, not just the armed ones.
+ */
+static int
+scheduler_timer_reserve(scheduler_t *s)
+{
+	event_t **timers;
+	int max;
+
+	if (s->reg_timers < s->max_timers)
+		return 0;
+
+	max    = s->max_timers ? 2 * s->max_timers : 16;
+	timers = realloc(s->timers, max * sizeof(event_t *));
+	if (!timers)
+		return -ENOMEM;
+
+	s->timers     = timers;
+	s->max_timers = max;
+
+	return 0;
+}
+
+/*
+ * (Re)arms the timer of @event, @timeout ms from now. Storage must have
+ * been reserved when the event was registered.
+ */
+static void
+scheduler_timer_arm(scheduler_t *s, event_t *event)
+{
+	struct timeval now, tv;
+
+	scheduler_timer_remove(s, event);
+
+	gettimeofday(&now, NULL);
+	tv.tv_sec  = event->timeout / 1000;
+	tv.tv_usec = (event->timeout % 1000) * 1000;
+	timeradd(&now, &tv, &event->deadline);
+
+	BUG_ON(s->n_timers >= s->max_timers);
+	scheduler_timer_set(s, s->n_timers++, event);
+	scheduler_timer_sift_up(s, event->heap_idx);
+}
+
+static void
+scheduler_prepare_timeout(scheduler_t *s)
+{
+	struct timeval now, delta;
 	event_t *event;
 
+	s->timeout = SCHEDULER_MAX_TIMEOUT;
+
+	if (s->n_timers) {
+		event = s->timers[0];
+
+		gettimeofday(&now, NULL);
+
+		if (timercmp(&event->deadline, &now, >)) {
+			timersub(&event->deadline, &now, &delta);
+			/* round up, rather than spin until the deadline */
+			s->timeout = MIN((long)s->timeout,
+					 delta.tv_sec * 1000 +
+					 (delta.tv_usec + 999) / 1000);
+		} else
+			s->timeout = 0;
+	}
+
+	s->timeout = MIN(s->timeout, s->max_timeout);
+}
+
+static int
+scheduler_select_init(scheduler_t *s)
+{
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
 	FD_ZERO(&s->except_fds);
 
-	s->max_fd  = -1;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	return 0;
+}
 
-	gettimeofday(&now, NULL);
+static int
+scheduler_select_update(scheduler_t *s, event_t *event)
+{
+	if ((event->mode & SCHEDULER_POLL_FD) &&
+	    (event->fd < 0 || event->fd >= FD_SETSIZE))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void
+scheduler_prepare_fd_events(scheduler_t *s)
+{
+	event_t *event;
+
+	FD_ZERO(&s->read_fds);
+	FD_ZERO(&s->write_fds);
+	FD_ZERO(&s->except_fds);
+
+	s->max_fd = -1;
 
 	scheduler_for_each_event(s, event) {
 		if (event->masked || event->dead)
@@ -97,17 +301,7 @@ scheduler_prepare_events(scheduler_t *s)
 			FD_SET(event->fd, &s->except_fds);
 			s->max_fd = MAX(event->fd, s->max_fd);
 		}
-
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
 	}
-
-	s->timeout = MIN(s->timeout, s->max_timeout);
 }
 
 static int
@@ -125,21 +319,21 @@ scheduler_check_fd_events(scheduler_t *s, int nfds)
 		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
 		    FD_ISSET(event->fd, &s->read_fds)) {
 			FD_CLR(event->fd, &s->read_fds);
-			event->pending |= SCHEDULER_POLL_READ_FD;
+			scheduler_set_pending(s, event, SCHEDULER_POLL_READ_FD);
 			--nfds;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
 		    FD_ISSET(event->fd, &s->write_fds)) {
 			FD_CLR(event->fd, &s->write_fds);
-			event->pending |= SCHEDULER_POLL_WRITE_FD;
+			scheduler_set_pending(s, event, SCHEDULER_POLL_WRITE_FD);
 			--nfds;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
 		    FD_ISSET(event->fd, &s->except_fds)) {
 			FD_CLR(event->fd, &s->except_fds);
-			event->pending |= SCHEDULER_POLL_EXCEPT_FD;
+			scheduler_set_pending(s, event, SCHEDULER_POLL_EXCEPT_FD);
 			--nfds;
 		}
 	}
@@ -147,52 +341,261 @@ scheduler_check_fd_events(scheduler_t *s, int nfds)
 	return nfds;
 }
 
-static void
-scheduler_check_timeouts(scheduler_t *s)
+static int
+scheduler_select_wait(scheduler_t *s)
 {
-	struct timeval now;
-	event_t *event;
+	int ret;
+	struct timeval tv;
 
-	gettimeofday(&now, NULL);
+	scheduler_prepare_fd_events(s);
 
-	scheduler_for_each_event(s, event) {
-		BUG_ON(event->pending && event->masked);
+	tv.tv_sec  = s->timeout / 1000;
+	tv.tv_usec = (s->timeout % 1000) * 1000;
 
-		if (event->dead)
-			continue;
+	ret = select(s->max_fd + 1, &s->read_fds,
+		     &s->write_fds, &s->except_fds, &tv);
+	if (ret <= 0)
+		return ret;
 
-		if (event->pending)
-			continue;
+	ret = scheduler_check_fd_events(s, ret);
+	BUG_ON(ret);
 
-		if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-			continue;
+	return 0;
+}
 
-		if (event->deadline > now.tv_sec)
-			continue;
+static const struct scheduler_backend scheduler_select = {
+	.name   = "select",
+	.init   = scheduler_select_init,
+	.update = scheduler_select_update,
+	.wait   = scheduler_select_wait,
+};
 
-		event->pending = SCHEDULER_POLL_TIMEOUT;
+static int
+scheduler_epoll_init(scheduler_t *s)
+{
+	s->epoll_events = calloc(SCHEDULER_EPOLL_EVENTS,
+				 sizeof(struct epoll_event));
+	if (!s->epoll_events)
+		return -ENOMEM;
+
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epoll_fd < 0) {
+		free(s->epoll_events);
+		s->epoll_events = NULL;
+		return -errno;
 	}
+
+	return 0;
+}
+
+static struct scheduler_fd *
+scheduler_epoll_get_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd;
+
+	if (fd >= s->n_fds) {
+		struct scheduler_fd **fds;
+		int i, n = MAX(fd + 1, 2 * s->n_fds);
+
+		fds = realloc(s->fds, n * sizeof(struct scheduler_fd *));
+		if (!fds)
+			return NULL;
+
+		for (i = s->n_fds; i < n; i++)
+			fds[i] = NULL;
+
+		s->fds   = fds;
+		s->n_fds = n;
+	}
+
+	sfd = s->fds[fd];
+	if (!sfd) {
+		sfd = calloc(1, sizeof(struct scheduler_fd));
+		if (!sfd)
+			return NULL;
+
+		sfd->fd = fd;
+		INIT_LIST_HEAD(&sfd->events);
+		INIT_LIST_HEAD(&sfd->stale);
+		s->fds[fd] = sfd;
+	}
+
+	return sfd;
+}
+
+/*
+ * An sfd whose registration could not be removed stays allocated,
+ * with no events, because epoll may still report it. That happens
+ * when the fd was closed before its last event was unregistered, and
+ * another descriptor still refers to the same file.
+ */
+static void
+scheduler_epoll_put_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+	s->fds[sfd->fd] = NULL;
+
+	if (sfd->mode) {
+		tlog_syslog(TLOG_WARN, "fd %d closed before its events "
+			    "were unregistered\n", sfd->fd);
+		list_add_tail(&sfd->stale, &s->stale_fds);
+		return;
+	}
+
+	free(sfd);
 }
 
 static int
-scheduler_check_events(scheduler_t *s, int nfds)
+scheduler_epoll_ctl(scheduler_t *s, struct scheduler_fd *sfd, int mode)
 {
-	if (nfds)
-		nfds = scheduler_check_fd_events(s, nfds);
+	int err, op;
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = sfd;
+
+	if (mode & SCHEDULER_POLL_READ_FD)
+		ev.events |= EPOLLIN;
+	if (mode & SCHEDULER_POLL_WRITE_FD)
+		ev.events |= EPOLLOUT;
+	if (mode & SCHEDULER_POLL_EXCEPT_FD)
+		ev.events |= EPOLLPRI;
+
+	if (!mode) {
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, sfd->fd, &ev);
+		if (err)
+			return -errno;
+		goto out;
+	}
 
-	scheduler_check_timeouts(s);
+	op  = sfd->mode ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+	if (err && errno == ENOENT)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, sfd->fd, &ev);
+	else if (err && errno == EEXIST)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, sfd->fd, &ev);
+	if (err)
+		return -errno;
 
-	return nfds;
+out:
+	sfd->mode = mode;
+	return 0;
+}
+
+static int
+scheduler_epoll_update(scheduler_t *s, event_t *event)
+{
+	int err = 0, mode;
+	event_t *e;
+	struct scheduler_fd *sfd;
+
+	if (!(event->mode & SCHEDULER_POLL_FD))
+		return 0;
+
+	if (event->fd < 0)
+		return -EINVAL;
+
+	sfd = scheduler_epoll_get_fd(s, event->fd);
+	if (!sfd)
+		return -ENOMEM;
+
+	if (event->dead)
+		list_del_init(&event->fd_next);
+	else if (list_empty(&event->fd_next))
+		list_add_tail(&event->fd_next, &sfd->events);
+
+	mode = 0;
+	list_for_each_entry(e, &sfd->events, fd_next)
+		if (!e->masked)
+			mode |= e->mode & SCHEDULER_POLL_FD;
+
+	if (mode == sfd->mode)
+		goto out;
+
+	err = scheduler_epoll_ctl(s, sfd, mode);
+	if (err && !event->dead)
+		list_del_init(&event->fd_next);
+
+out:
+	if (list_empty(&sfd->events))
+		scheduler_epoll_put_fd(s, sfd);
+
+	return err;
+}
+
+static int
+scheduler_epoll_wait(scheduler_t *s)
+{
+	int i, n;
+	event_t *event;
+
+	n = epoll_wait(s->epoll_fd, s->epoll_events,
+		       SCHEDULER_EPOLL_EVENTS, s->timeout);
+	if (n <= 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		struct epoll_event *ev = &s->epoll_events[i];
+		struct scheduler_fd *sfd = ev->data.ptr;
+		char ready = 0;
+
+		/* report errors and hangups to readers and writers,
+		 * just like select() does */
+		if (ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			ready |= SCHEDULER_POLL_READ_FD;
+		if (ev->events & (EPOLLOUT | EPOLLERR))
+			ready |= SCHEDULER_POLL_WRITE_FD;
+		if (ev->events & EPOLLPRI)
+			ready |= SCHEDULER_POLL_EXCEPT_FD;
+
+		list_for_each_entry(event, &sfd->events, fd_next) {
+			char mode = event->mode & ready;
+
+			if (event->dead || event->masked || !mode)
+				continue;
+
+			scheduler_set_pending(s, event, mode);
+		}
+	}
+
+	return 0;
 }
 
+static const struct scheduler_backend scheduler_epoll = {
+	.name   = "epoll",
+	.init   = scheduler_epoll_init,
+	.update = scheduler_epoll_update,
+	.wait   = scheduler_epoll_wait,
+};
+
+/*
+ * Expired timers leave the heap until their callback re-arms them.
+ */
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_check_timeouts(scheduler_t *s)
 {
-	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		event->deadline = now.tv_sec + event->timeout;
+	struct timeval now;
+	event_t *event;
+
+	gettimeofday(&now, NULL);
+
+	while (s->n_timers) {
+		event = s->timers[0];
+
+		if (timercmp(&event->deadline, &now, >))
+			break;
+
+		BUG_ON(event->masked);
+
+		scheduler_timer_remove(s, event);
+		scheduler_set_pending(s, event, SCHEDULER_POLL_TIMEOUT);
 	}
+}
+
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
+{
+	if ((event->mode & SCHEDULER_POLL_TIMEOUT) && !event->masked)
+		scheduler_timer_arm(s, event);
 
 	if (!event->masked)
 		event->cb(event->id, mode, event->private);
@@ -204,30 +607,44 @@ scheduler_run_events(scheduler_t *s)
 	event_t *event;
 	int n_dispatched = 0;
 
-	scheduler_for_each_event(s, event) {
+	while (!list_empty(&s->pending)) {
 		char pending;
 
+		event = list_entry(s->pending.next, event_t, pending_next);
+		list_del_init(&event->pending_next);
+
+		pending = event->pending;
+		event->pending = 0;
+
 		if (event->dead)
 			continue;
 
-		pending = event->pending;
-		if (pending) {
-			event->pending = 0;
-			/* NB. must clear before cb */
-			scheduler_event_callback(event, pending);
-			n_dispatched++;
-		}
+		/* NB. must clear before cb */
+		scheduler_event_callback(s, event, pending);
+		n_dispatched++;
 	}
 
 	return n_dispatched;
 }
 
+static event_t *
+scheduler_get_event(scheduler_t *s, event_id_t id)
+{
+	event_t *event;
+
+	list_for_each_entry(event, scheduler_event_bucket(s, id), id_next)
+		if (event->id == id)
+			return event;
+
+	return NULL;
+}
+
 int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
+	int err;
 	event_t *event;
-	struct timeval now;
 
 	if (!cb)
 		return -EINVAL;
@@ -239,23 +656,43 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!event)
 		return -ENOMEM;
 
-	gettimeofday(&now, NULL);
-
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->id_next);
+	INIT_LIST_HEAD(&event->fd_next);
+	INIT_LIST_HEAD(&event->pending_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
 	event->timeout  = timeout;
-	event->deadline = now.tv_sec + timeout;
+	event->heap_idx = -1;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
 	event->masked   = 0;
 
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		err = scheduler_timer_reserve(s);
+		if (err) {
+			free(event);
+			return err;
+		}
+	}
+
+	err = s->backend->update(s, event);
+	if (err) {
+		free(event);
+		return err;
+	}
+
+	event->id = s->uuid++;
 	if (!s->uuid)
 		s->uuid++;
 
 	list_add_tail(&event->next, &s->events);
+	list_add_tail(&event->id_next, scheduler_event_bucket(s, event->id));
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		s->reg_timers++;
+		scheduler_timer_arm(s, event);
+	}
 
 	return event->id;
 }
@@ -268,11 +705,21 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->dead = 1;
-			break;
-		}
+	event = scheduler_get_event(s, id);
+	if (!event)
+		return;
+
+	event->dead = 1;
+	s->backend->update(s, event);
+
+	scheduler_timer_remove(s, event);
+	if (event->mode & SCHEDULER_POLL_TIMEOUT)
+		s->reg_timers--;
+	list_del_init(&event->pending_next);
+	event->pending = 0;
+
+	list_del_init(&event->id_next);
+	list_move_tail(&event->next, &s->dead);
 }
 
 void
@@ -283,11 +730,20 @@ scheduler_mask_event(scheduler_t *s, event_id_t id, int masked)
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->masked = !!masked;
-			break;
-		}
+	event = scheduler_get_event(s, id);
+	if (!event || event->masked == !!masked)
+		return;
+
+	event->masked = !!masked;
+	s->backend->update(s, event);
+
+	if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
+		return;
+
+	if (masked)
+		scheduler_timer_remove(s, event);
+	else if (!event->pending)
+		scheduler_timer_arm(s, event);
 }
 
 static void
@@ -295,11 +751,10 @@ scheduler_gc_events(scheduler_t *s)
 {
 	event_t *event, *next;
 
-	scheduler_for_each_event_safe(s, event, next)
-		if (event->dead) {
-			list_del(&event->next);
-			free(event);
-		}
+	list_for_each_entry_safe(event, next, &s->dead, next) {
+		list_del(&event->next);
+		free(event);
+	}
 }
 
 void
@@ -313,7 +768,6 @@ int
 scheduler_wait_for_events(scheduler_t *s)
 {
 	int ret;
-	struct timeval tv;
 
 	s->depth++;
 	ret = 0;
@@ -324,22 +778,16 @@ scheduler_wait_for_events(scheduler_t *s)
 		 * progress. */
 		goto out;
 
-	scheduler_prepare_events(s);
-
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
+	scheduler_prepare_timeout(s);
 
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
-
+	ret = s->backend->wait(s);
 	if (ret < 0)
 		goto out;
 
-	ret = scheduler_check_events(s, ret);
-	BUG_ON(ret);
+	scheduler_check_timeouts(s);
 
 	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
@@ -355,17 +803,89 @@ out:
 	return ret;
 }
 
-void
+const char *
+scheduler_backend_name(scheduler_t *s)
+{
+	return s->backend->name;
+}
+
+int
 scheduler_initialize(scheduler_t *s)
 {
+	int i, err;
+
 	memset(s, 0, sizeof(scheduler_t));
 
-	s->uuid  = 1;
-	s->depth = 0;
+	s->uuid     = 1;
+	s->depth    = 0;
+	s->epoll_fd = -1;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->timeout     = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->pending);
+	INIT_LIST_HEAD(&s->dead);
+	INIT_LIST_HEAD(&s->stale_fds);
+
+	for (i = 0; i < SCHEDULER_EVENT_BUCKETS; i++)
+		INIT_LIST_HEAD(&s->buckets[i]);
+
+	s->backend = &scheduler_epoll;
+	err = s->backend->init(s);
+	if (!err)
+		return 0;
+
+	tlog_syslog(TLOG_WARN, "epoll unavailable (%d), "
+		    "falling back to select\n", err);
+
+	s->backend = &scheduler_select;
+	return s->backend->init(s);
+}
+
+/*
+ * Releases whatever @s still holds. Events left registered are
+ * dropped without callbacks.
+ */
+void
+scheduler_destroy(scheduler_t *s)
+{
+	event_t *event, *next;
+	int i;
+
+	scheduler_for_each_event_safe(s, event, next) {
+		list_del(&event->next);
+		free(event);
+	}
+
+	scheduler_gc_events(s);
+
+	for (i = 0; i < s->n_fds; i++)
+		free(s->fds[i]);
+	free(s->fds);
+	s->fds   = NULL;
+	s->n_fds = 0;
+
+	while (!list_empty(&s->stale_fds)) {
+		struct scheduler_fd *sfd;
+
+		sfd = list_entry(s->stale_fds.next,
+				 struct scheduler_fd, stale);
+		list_del(&sfd->stale);
+		free(sfd);
+	}
+
+	free(s->timers);
+	s->timers     = NULL;
+	s->n_timers   = 0;
+	s->max_timers = 0;
+	s->reg_timers = 0;
+
+	if (s->epoll_fd >= 0) {
+		close(s->epoll_fd);
+		s->epoll_fd = -1;
+	}
+
+	free(s->epoll_events);
+	s->epoll_events = NULL;
 }
@@ -27,24 +27,55 @@
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+#define SCHEDULER_EVENT_BUCKETS      256
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct event;
+struct epoll_event;
+struct scheduler_fd;
+struct scheduler_backend;
+
 typedef struct scheduler {
+	const struct scheduler_backend *backend;
+
+	/* select backend */
 	fd_set                       read_fds;
 	fd_set                       write_fds;
 	fd_set                       except_fds;
 
+	/* epoll backend */
+	int                          epoll_fd;
+	struct epoll_event          *epoll_events;
+	struct scheduler_fd        **fds;
+	int                          n_fds;
+	struct list_head             stale_fds;
+
 	struct list_head             events;
+	struct list_head             pending;
+	struct list_head             dead;
+	struct list_head             buckets[SCHEDULER_EVENT_BUCKETS];
+
+	/* min-heap of armed timers, ordered by deadline */
+	struct event               **timers;
+	int                          n_timers;
+	int                          max_timers;
+	int                          reg_timers;  /* registered, armed or not */
 
 	int                          uuid;
 	int                          max_fd;
-	int                          timeout;
-	int                          max_timeout;
+	int                          timeout;     /* in milliseconds */
+	int                          max_timeout; /* in milliseconds */
 	int                          depth;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+/*
+ * Timeouts are given in milliseconds.
+ */
+int scheduler_initialize(scheduler_t *);
+void scheduler_destroy(scheduler_t *);
+const char *scheduler_backend_name(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
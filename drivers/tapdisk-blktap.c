@@ -25,8 +25,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <string.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -60,6 +65,19 @@
 #define BLKTAP_GET_REQUEST(_tap, _idx) \
 	(&(_tap)->sring->entry[(_idx) % BLKTAP_RING_SIZE].req)
 
+/*
+ * Response moderation. Depth and latency averages are kept in 1/16ths,
+ * with a 1/8 weight for each new sample.
+ */
+#define TD_BLKTAP_MOD_FIXED      4
+#define TD_BLKTAP_MOD_WEIGHT     3
+#define TD_BLKTAP_MOD_MIN_USECS  5
+
+static struct {
+	unsigned int            usecs;
+	unsigned int            batch;
+} tapdisk_blktap_moderation;
+
 static void __tapdisk_blktap_close(td_blktap_t *);
 
 struct td_blktap_req {
@@ -140,6 +158,140 @@ tapdisk_blktap_kick(td_blktap_t *tap)
 	}
 }
 
+static int
+tapdisk_blktap_set_timer(td_blktap_t *tap, unsigned int usecs)
+{
+	struct td_blktap_moderation *mod = &tap->mod;
+	struct itimerspec its;
+	int err;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = usecs / 1000000;
+	its.it_value.tv_nsec = (usecs % 1000000) * 1000;
+
+	err = timerfd_settime(mod->timer_fd, 0, &its, NULL);
+	if (err)
+		return -errno;
+
+	mod->armed = !!usecs;
+	return 0;
+}
+
+static void
+tapdisk_blktap_push_responses(td_blktap_t *tap)
+{
+	struct td_blktap_moderation *mod = &tap->mod;
+
+	if (likely(tap->vma)) {
+		tap->sring->rsp_prod = tap->rsp_prod_pvt;
+		tapdisk_blktap_kick(tap);
+	}
+
+	mod->pending = 0;
+
+	if (mod->armed)
+		tapdisk_blktap_set_timer(tap, 0);
+}
+
+static inline unsigned int
+tapdisk_blktap_ewma(unsigned int avg, unsigned int val)
+{
+	val <<= TD_BLKTAP_MOD_FIXED;
+	return avg - (avg >> TD_BLKTAP_MOD_WEIGHT) + (val >> TD_BLKTAP_MOD_WEIGHT);
+}
+
+/*
+ * Wait for at most half the average queue depth, so a batch can
+ * actually fill, and hold for at most a quarter of the average
+ * completion latency, so coalescing adds a bounded fraction of the
+ * service time. Shallow or fast queues are not moderated at all.
+ */
+static void
+tapdisk_blktap_tune_moderation(td_blktap_t *tap)
+{
+	struct td_blktap_moderation *mod = &tap->mod;
+	unsigned int batch, delay;
+
+	batch = (mod->depth >> TD_BLKTAP_MOD_FIXED) / 2;
+	batch = MIN(batch, tapdisk_blktap_moderation.batch);
+
+	delay = (mod->latency >> TD_BLKTAP_MOD_FIXED) / 4;
+	delay = MIN(delay, tapdisk_blktap_moderation.usecs);
+
+	if (delay < TD_BLKTAP_MOD_MIN_USECS)
+		batch = 1;
+
+	mod->batch = MAX(batch, 1);
+	mod->delay = delay;
+}
+
+static void
+tapdisk_blktap_moderate(td_blktap_t *tap, const td_blktap_req_t *req)
+{
+	struct td_blktap_moderation *mod = &tap->mod;
+	struct timeval now, delta;
+	unsigned int inflight;
+	int err;
+
+	if (mod->timer_fd < 0) {
+		tapdisk_blktap_push_responses(tap);
+		return;
+	}
+
+	/* requests outstanding besides @req, which is not freed yet */
+	inflight = tap->n_reqs - tap->n_reqs_free - 1;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &req->vreq.ts, &delta);
+
+	mod->depth   = tapdisk_blktap_ewma(mod->depth, inflight + 1);
+	mod->latency = tapdisk_blktap_ewma(mod->latency,
+					   delta.tv_sec * 1000000 +
+					   delta.tv_usec);
+	tapdisk_blktap_tune_moderation(tap);
+
+	if (!inflight) {
+		tap->stats.flush.idle++;
+		goto push;
+	}
+
+	if (mod->pending >= mod->batch) {
+		tap->stats.flush.full++;
+		goto push;
+	}
+
+	if (!mod->armed) {
+		err = tapdisk_blktap_set_timer(tap, mod->delay);
+		if (err)
+			goto push;
+	}
+
+	return;
+
+push:
+	tapdisk_blktap_push_responses(tap);
+}
+
+static void
+tapdisk_blktap_timer_event(event_id_t id, char mode, void *data)
+{
+	td_blktap_t *tap = data;
+	struct td_blktap_moderation *mod = &tap->mod;
+	uint64_t ticks;
+	ssize_t n;
+
+	n = read(mod->timer_fd, &ticks, sizeof(ticks));
+	if (n != sizeof(ticks))
+		return;
+
+	mod->armed = 0;
+
+	if (mod->pending) {
+		tap->stats.flush.timer++;
+		tapdisk_blktap_push_responses(tap);
+	}
+}
+
 static int
 tapdisk_blktap_error_status(td_blktap_t *tap, int error)
 {
@@ -165,11 +317,10 @@ static void
 __tapdisk_blktap_push_response(td_blktap_t *tap, int final)
 {
 	tap->rsp_prod_pvt++;
+	tap->mod.pending++;
 
-	if (final) {
-		tap->sring->rsp_prod = tap->rsp_prod_pvt;
-		tapdisk_blktap_kick(tap);
-	}
+	if (final)
+		tapdisk_blktap_push_responses(tap);
 
 	tap->stats.reqs.out++;
 }
@@ -217,7 +368,10 @@ tapdisk_blktap_put_response(td_blktap_t *tap,
 	rsp->operation = op;
 	rsp->status    = tapdisk_blktap_error_status(tap, error);
 
-	__tapdisk_blktap_push_response(tap, final);
+	__tapdisk_blktap_push_response(tap, 0);
+
+	if (final)
+		tapdisk_blktap_moderate(tap, req);
 }
 
 static void
@@ -305,7 +459,7 @@ tapdisk_blktap_parse_request(td_blktap_t *tap,
 		goto fail;
 
 	if (msg->nr_segments < 1 ||
-	    msg->nr_segments > BLKTAP_SEGMENT_MAX)
+	    msg->nr_segments > tap->vbd->max_segments)
 		goto fail;
 
 	req->id = msg->id;
@@ -506,6 +660,16 @@ __tapdisk_blktap_close(td_blktap_t *tap)
 		tap->event_id = -1;
 	}
 
+	if (tap->mod.timer_id >= 0) {
+		tapdisk_server_unregister_event(tap->mod.timer_id);
+		tap->mod.timer_id = -1;
+	}
+
+	if (tap->mod.timer_fd >= 0) {
+		close(tap->mod.timer_fd);
+		tap->mod.timer_fd = -1;
+	}
+
 	tapdisk_blktap_unmap(tap);
 
 	if (tap->fd >= 0) {
@@ -514,6 +678,34 @@ __tapdisk_blktap_close(td_blktap_t *tap)
 	}
 }
 
+static int
+tapdisk_blktap_open_moderation(td_blktap_t *tap)
+{
+	struct td_blktap_moderation *mod = &tap->mod;
+	int err;
+
+	mod->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK|TFD_CLOEXEC);
+	if (mod->timer_fd < 0)
+		return -errno;
+
+	mod->timer_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      mod->timer_fd, 0,
+					      tapdisk_blktap_timer_event,
+					      tap);
+	if (mod->timer_id < 0) {
+		err = mod->timer_id;
+		close(mod->timer_fd);
+		mod->timer_fd = -1;
+		return err;
+	}
+
+	mod->batch = 1;
+
+	return 0;
+}
+
 void
 tapdisk_blktap_close(td_blktap_t *tap)
 {
@@ -538,6 +730,8 @@ tapdisk_blktap_open(const char *devname, td_vbd_t *vbd, td_blktap_t **_tap)
 	memset(tap, 0, sizeof(*tap));
 	tap->fd = -1;
 	tap->event_id = -1;
+	tap->mod.timer_fd = -1;
+	tap->mod.timer_id = -1;
 
 	tap->fd = open(devname, O_RDWR);
 	if (tap->fd < 0) {
@@ -572,6 +766,12 @@ tapdisk_blktap_open(const char *devname, td_vbd_t *vbd, td_blktap_t **_tap)
 	if (err)
 		goto fail;
 
+	if (tapdisk_blktap_moderation.usecs) {
+		err = tapdisk_blktap_open_moderation(tap);
+		if (err)
+			goto fail;
+	}
+
 	if (_tap)
 		*_tap = tap;
 
@@ -598,4 +798,42 @@ tapdisk_blktap_stats(td_blktap_t *tap, td_stats_t *st)
 	tapdisk_stats_val(st, "llu", tap->stats.kicks.in);
 	tapdisk_stats_val(st, "llu", tap->stats.kicks.out);
 	tapdisk_stats_leave(st, ']');
+
+	if (tap->mod.timer_fd >= 0) {
+		struct td_blktap_moderation *mod = &tap->mod;
+
+		tapdisk_stats_field(st, "moderation", "{");
+		tapdisk_stats_field(st, "batch", "u", mod->batch);
+		tapdisk_stats_field(st, "delay", "u", mod->delay);
+		tapdisk_stats_field(st, "depth", "u",
+				    mod->depth >> TD_BLKTAP_MOD_FIXED);
+		tapdisk_stats_field(st, "latency", "u",
+				    mod->latency >> TD_BLKTAP_MOD_FIXED);
+		tapdisk_stats_field(st, "flush", "[");
+		tapdisk_stats_val(st, "llu", tap->stats.flush.idle);
+		tapdisk_stats_val(st, "llu", tap->stats.flush.full);
+		tapdisk_stats_val(st, "llu", tap->stats.flush.timer);
+		tapdisk_stats_leave(st, ']');
+		tapdisk_stats_leave(st, '}');
+	}
+}
+
+/*
+ * Enable response coalescing for blktap rings opened from now on.
+ * @usecs bounds how long a completion may be held back, @batch how
+ * many responses are collected per kick (0: half the ring).
+ */
+int
+tapdisk_blktap_set_moderation(unsigned int usecs, unsigned int batch)
+{
+	if (usecs > 1000000)
+		return -EINVAL;
+
+	if (!batch || batch > BLKTAP_RING_SIZE)
+		batch = BLKTAP_RING_SIZE / 2;
+
+	tapdisk_blktap_moderation.usecs = usecs;
+	tapdisk_blktap_moderation.batch = batch;
+
+	return 0;
 }
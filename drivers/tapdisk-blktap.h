@@ -34,6 +34,30 @@ struct td_blktap_stats {
 		unsigned long long      in;
 		unsigned long long      out;
 	} kicks;
+	struct {
+		unsigned long long      idle;
+		unsigned long long      full;
+		unsigned long long      timer;
+	} flush;
+};
+
+/*
+ * Adaptive response coalescing. Completions are held back while more
+ * requests are in flight, until either the batch target is reached or
+ * the hold timer expires. Both limits follow the observed queue depth
+ * and completion latency.
+ */
+struct td_blktap_moderation {
+	int                     timer_fd;
+	int                     timer_id;
+	int                     armed;
+
+	unsigned int            pending;
+	unsigned int            batch;
+	unsigned int            delay;
+
+	unsigned int            depth;
+	unsigned int            latency;
 };
 
 struct td_blktap {
@@ -59,6 +83,8 @@ struct td_blktap {
 
 	struct list_head        entry;
 
+	struct td_blktap_moderation mod;
+
 	struct td_blktap_stats  stats;
 };
 
@@ -70,4 +96,6 @@ int tapdisk_blktap_remove_device(td_blktap_t *);
 
 void tapdisk_blktap_stats(td_blktap_t *, td_stats_t *);
 
+int tapdisk_blktap_set_moderation(unsigned int usecs, unsigned int batch);
+
 #endif /* _TAPDISK_BLKTAP_H_ */
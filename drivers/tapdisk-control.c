@@ -91,6 +91,7 @@ struct tapdisk_ctl_conn {
 
 #define TAPDISK_MSG_REENTER    (1<<0) /* non-blocking, idempotent */
 #define TAPDISK_MSG_VERBOSE    (1<<1) /* tell syslog about it */
+#define TAPDISK_MSG_VBD        (1<<2) /* runs on the vbd's worker */
 
 struct tapdisk_control_info {
 	void (*handler)(struct tapdisk_ctl_conn *, tapdisk_message_t *);
@@ -182,6 +183,11 @@ tapdisk_ctl_conn_close(struct tapdisk_ctl_conn *conn)
 		conn->out.event_id = -1;
 	}
 
+	if (conn->in.event_id >= 0) {
+		tapdisk_server_unregister_event(conn->in.event_id);
+		conn->in.event_id = -1;
+	}
+
 	if (conn->fd >= 0) {
 		close(conn->fd);
 		conn->fd = -1;
@@ -299,7 +305,7 @@ tapdisk_ctl_conn_open(int fd)
 
 	conn->out.event_id =
 		tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
-					      fd, TD_CTL_SEND_TIMEOUT,
+					      fd, TD_CTL_SEND_TIMEOUT * 1000,
 					      tapdisk_ctl_conn_send_event,
 					      conn);
 	if (conn->out.event_id < 0)
@@ -331,11 +337,15 @@ tapdisk_ctl_conn_write(struct tapdisk_ctl_conn *conn, void *buf, size_t size)
 
 	memcpy(conn->out.prod, buf, size);
 	conn->out.prod += size;
-	tapdisk_ctl_conn_unmask_out(conn);
 
 	return size;
 }
 
+/*
+ * NB. handlers may run on a worker thread, so output is only queued
+ * by tapdisk_ctl_conn_write. We start sending once the handler is
+ * through, back on the control thread.
+ */
 static void
 tapdisk_ctl_conn_release(struct tapdisk_ctl_conn *conn)
 {
@@ -343,6 +353,8 @@ tapdisk_ctl_conn_release(struct tapdisk_ctl_conn *conn)
 
 	if (conn->out.prod == conn->out.cons)
 		tapdisk_ctl_conn_close(conn);
+	else
+		tapdisk_ctl_conn_unmask_out(conn);
 }
 
 static void
@@ -532,38 +544,74 @@ tapdisk_control_list_minors(struct tapdisk_ctl_conn *conn,
 }
 #endif
 
+struct tapdisk_control_list {
+	tapdisk_message_t *rsp;
+	int                count;
+	int                size;
+	int                err;
+};
+
 static void
-tapdisk_control_list(struct tapdisk_ctl_conn *conn, tapdisk_message_t *request)
+tapdisk_control_list_vbds(void *private)
 {
+	struct tapdisk_control_list *list = private;
+	tapdisk_message_t *rsp;
 	td_vbd_t *vbd;
-	struct list_head *head;
+
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next) {
+		if (list->count == list->size) {
+			rsp = realloc(list->rsp,
+				      (list->size + 16) * sizeof(*rsp));
+			if (!rsp) {
+				list->err = -ENOMEM;
+				return;
+			}
+
+			list->rsp   = rsp;
+			list->size += 16;
+		}
+
+		rsp = &list->rsp[list->count++];
+		memset(rsp, 0, sizeof(*rsp));
+
+		rsp->u.list.minor = vbd->tap ? vbd->tap->minor : -1;
+		rsp->u.list.state = vbd->state;
+
+		if (vbd->name)
+			strncpy(rsp->u.list.path, vbd->name,
+				sizeof(rsp->u.list.path));
+	}
+}
+
+static void
+tapdisk_control_list(struct tapdisk_ctl_conn *conn, tapdisk_message_t *request)
+{
+	struct tapdisk_control_list list;
 	tapdisk_message_t response;
-	int count;
+	int i, count;
+
+	memset(&list, 0, sizeof(list));
+	tapdisk_server_call_all(tapdisk_control_list_vbds, &list);
 
 	memset(&response, 0, sizeof(response));
 	response.type = TAPDISK_MESSAGE_LIST_RSP;
 	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
-
-	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
+	count = list.err ? 0 : list.count;
 
-	list_for_each_entry(vbd, head, next) {
-		response.u.list.count   = count--;
-		response.u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
-		response.u.list.state   = vbd->state;
-		response.u.list.path[0] = 0;
-
-		if (vbd->name)
-			strncpy(response.u.list.path, vbd->name,
-				sizeof(response.u.list.path));
+	for (i = 0; i < count; i++) {
+		response.u.list.count   = count - i;
+		response.u.list.minor   = list.rsp[i].u.list.minor;
+		response.u.list.state   = list.rsp[i].u.list.state;
+		memcpy(response.u.list.path, list.rsp[i].u.list.path,
+		       sizeof(response.u.list.path));
 
 		tapdisk_control_write_message(conn, &response);
 	}
 
-	response.u.list.count   = count;
+	free(list.rsp);
+
+	response.u.list.count   = 0;
 	response.u.list.minor   = -1;
 	response.u.list.path[0] = 0;
 
@@ -686,6 +734,69 @@ out:
 	tapdisk_control_write_message(conn, &response);
 }
 
+static void
+tapdisk_control_reset_tuning(td_vbd_t *vbd)
+{
+	tapdisk_vbd_set_queue_limits(vbd, 0, 0);
+	vbd->cache_size   = 0;
+	vbd->prealloc     = 0;
+	vbd->prealloc_low = 0;
+	vbd->lcache_size  = 0;
+}
+
+static void
+tapdisk_control_tune_vbd(struct tapdisk_ctl_conn *conn,
+			 tapdisk_message_t *request)
+{
+	tapdisk_message_tune_t *tune = &request->u.tune;
+	tapdisk_message_t response;
+	td_vbd_t *vbd;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (vbd->name) {
+		err = -EALREADY;
+		goto out;
+	}
+
+	err = tapdisk_vbd_set_queue_limits(vbd, tune->queue_depth,
+					   tune->max_request_size);
+	if (err)
+		goto out;
+
+	if (tune->queue_depth || tune->max_request_size)
+		DPRINTF("Set queue depth %u, max request %u segments\n",
+			vbd->queue_depth, vbd->max_segments);
+
+	vbd->cache_size = tune->cache_size;
+	if (vbd->cache_size)
+		DPRINTF("Set image cache size %zu bytes\n", vbd->cache_size);
+
+	vbd->prealloc     = tune->prealloc;
+	vbd->prealloc_low = tune->prealloc_low;
+	if (vbd->prealloc)
+		DPRINTF("Set preallocation pool %u blocks, low %u\n",
+			vbd->prealloc, vbd->prealloc_low);
+
+	vbd->lcache_size = (uint64_t)tune->lcache_size << 20;
+	if (vbd->lcache_size)
+		DPRINTF("Set local cache capacity %"PRIu64" bytes\n",
+			vbd->lcache_size);
+
+out:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_TUNE_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(conn, &response);
+}
+
 static void
 tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 			   tapdisk_message_t *request)
@@ -729,6 +840,12 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		flags |= TD_OPEN_REUSE_PARENT;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_STANDBY)
 		flags |= TD_OPEN_STANDBY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_LAZY_BAT)
+		flags |= TD_OPEN_LAZY_BAT;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_META_LOG)
+		flags |= TD_OPEN_META_LOG;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_WRITE_BACK)
+		flags |= TD_OPEN_WRITE_BACK;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SECONDARY) {
 		char *name = strdup(request->u.params.secondary);
 		if (!name) {
@@ -741,8 +858,10 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 
 	err = tapdisk_vbd_open_vdi(vbd, request->u.params.path, flags,
 				   request->u.params.prt_devnum);
-	if (err)
+	if (err) {
+		tapdisk_control_reset_tuning(vbd);
 		goto out;
+	}
 
 	err = tapdisk_vbd_get_disk_info(vbd, &info);
 	if (err)
@@ -799,6 +918,7 @@ fail_close:
 		vbd->name = NULL;
 	}
 
+	tapdisk_control_reset_tuning(vbd);
 	goto out;
 }
 
@@ -868,6 +988,8 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 	free(vbd->name);
 	vbd->name = NULL;
 
+	tapdisk_control_reset_tuning(vbd);
+
 	if (!vbd->tap) {
 		tapdisk_server_remove_vbd(vbd);
 		free(vbd);
@@ -959,13 +1081,44 @@ out:
 	tapdisk_control_write_message(conn, &response);
 }
 
+struct tapdisk_control_stats {
+	td_stats_t        *st;
+	td_uuid_t          uuid;
+	int                err;
+};
+
+static void
+tapdisk_control_stats_vbd(void *private)
+{
+	struct tapdisk_control_stats *stats = private;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(stats->uuid);
+	if (!vbd) {
+		stats->err = -ENODEV;
+		return;
+	}
+
+	tapdisk_vbd_stats(vbd, stats->st);
+}
+
+static void
+tapdisk_control_stats_vbds(void *private)
+{
+	struct tapdisk_control_stats *stats = private;
+	td_vbd_t *vbd;
+
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next)
+		tapdisk_vbd_stats(vbd, stats->st);
+}
+
 static void
 tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 		      tapdisk_message_t *request)
 {
+	struct tapdisk_control_stats stats;
 	tapdisk_message_t response;
 	td_stats_t _st, *st = &_st;
-	td_vbd_t *vbd;
 	size_t rv;
 	void *buf;
 	int new_size;
@@ -978,24 +1131,22 @@ tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 
 	tapdisk_stats_init(st, buf, TD_CTL_SEND_BUFSZ);
 
+	memset(&stats, 0, sizeof(stats));
+	stats.st   = st;
+	stats.uuid = request->cookie;
+
 	if (request->cookie != (uint16_t)-1) {
 
-		vbd = tapdisk_server_get_vbd(request->cookie);
-		if (!vbd) {
-			rv = -ENODEV;
+		tapdisk_server_call(tapdisk_server_vbd_worker(stats.uuid),
+				    tapdisk_control_stats_vbd, &stats);
+		if (stats.err) {
+			rv = stats.err;
 			goto out;
 		}
 
-		tapdisk_vbd_stats(vbd, st);
-
 	} else {
-		struct list_head *list = tapdisk_server_get_all_vbds();
-
 		tapdisk_stats_enter(st, '[');
-
-		list_for_each_entry(vbd, list, next)
-			tapdisk_vbd_stats(vbd, st);
-
+		tapdisk_server_call_all(tapdisk_control_stats_vbds, &stats);
 		tapdisk_stats_leave(st, ']');
 	}
 
@@ -1030,7 +1181,7 @@ out:
 		conn->out.prod += rv;
 }
 
-struct tapdisk_control_info message_infos[] = {
+struct tapdisk_control_info message_infos[TAPDISK_MESSAGE_MAX + 1] = {
 	[TAPDISK_MESSAGE_PID] = {
 		.handler = tapdisk_control_get_pid,
 		.flags   = TAPDISK_MSG_REENTER,
@@ -1041,34 +1192,50 @@ struct tapdisk_control_info message_infos[] = {
 	},
 	[TAPDISK_MESSAGE_ATTACH] = {
 		.handler = tapdisk_control_attach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_DETACH] = {
 		.handler = tapdisk_control_detach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_OPEN] = {
 		.handler = tapdisk_control_open_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_PAUSE] = {
 		.handler = tapdisk_control_pause_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_RESUME] = {
 		.handler = tapdisk_control_resume_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_CLOSE] = {
 		.handler = tapdisk_control_close_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_STATS] = {
 		.handler = tapdisk_control_stats,
 		.flags   = TAPDISK_MSG_REENTER,
 	},
+	[TAPDISK_MESSAGE_TUNE] = {
+		.handler = tapdisk_control_tune_vbd,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
+	},
+};
+
+struct tapdisk_control_call {
+	struct tapdisk_ctl_conn *conn;
+	tapdisk_message_t       *message;
 };
 
+static void
+tapdisk_control_call_handler(void *private)
+{
+	struct tapdisk_control_call *call = private;
+
+	call->conn->info->handler(call->conn, call->message);
+}
 
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
@@ -1087,7 +1254,7 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	if (err)
 		goto invalid;
 
-	if (message.type > TAPDISK_MESSAGE_EXIT)
+	if (message.type > TAPDISK_MESSAGE_MAX)
 		goto invalid;
 
 	conn->info = &message_infos[message.type];
@@ -1111,7 +1278,16 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	}
 	conn->in.busy = 1;
 
-	conn->info->handler(conn, &message);
+	if (conn->info->flags & TAPDISK_MSG_VBD) {
+		struct tapdisk_control_call call = {
+			.conn    = conn,
+			.message = &message,
+		};
+
+		tapdisk_server_call(tapdisk_server_vbd_worker(message.cookie),
+				    tapdisk_control_call_handler, &call);
+	} else
+		conn->info->handler(conn, &message);
 
 	conn->in.busy = 0;
 	if (excl)
@@ -1163,7 +1339,7 @@ tapdisk_control_accept(event_id_t id, char mode, void *private)
 	}
 
 	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    conn->fd, TD_CTL_RECV_TIMEOUT,
+					    conn->fd, TD_CTL_RECV_TIMEOUT * 1000,
 					    tapdisk_control_handle_request,
 					    conn);
 	if (err == -1) {
@@ -27,6 +27,56 @@
 #include "tapdisk-disktype.h"
 #include "tapdisk-stats.h"
 
+/*
+ * Queue limits given to drivers allocated on this thread. A VBD sets
+ * them around opening its images, so every layer of the chain sizes
+ * its request pools for the VBD's queue depth and request size.
+ */
+static __thread unsigned int td_driver_queue_depth  = MAX_REQUESTS;
+static __thread unsigned int td_driver_max_segments = MAX_SEGMENTS_PER_REQ;
+static __thread size_t       td_driver_cache_size;
+static __thread unsigned int td_driver_prealloc;
+static __thread unsigned int td_driver_prealloc_low;
+static __thread uint64_t     td_driver_lcache_size;
+
+void
+tapdisk_driver_set_queue_limits(unsigned int depth, unsigned int segs)
+{
+	td_driver_queue_depth  = depth ? : MAX_REQUESTS;
+	td_driver_max_segments = segs ? : MAX_SEGMENTS_PER_REQ;
+}
+
+/*
+ * Same for the memory each image may spend on caching its metadata,
+ * such as vhd bitmaps.
+ */
+void
+tapdisk_driver_set_cache_size(size_t size)
+{
+	td_driver_cache_size = size;
+}
+
+/*
+ * And for the number of blocks writable images keep allocated ahead of
+ * writes, refilled once fewer than low are left.
+ */
+void
+tapdisk_driver_set_prealloc(unsigned int blocks, unsigned int low)
+{
+	td_driver_prealloc     = blocks;
+	td_driver_prealloc_low = low;
+}
+
+/*
+ * And for how much of the leaf a local read cache may fill with
+ * parent data.
+ */
+void
+tapdisk_driver_set_lcache_size(uint64_t size)
+{
+	td_driver_lcache_size = size;
+}
+
 static void
 tapdisk_driver_log_flush(td_driver_t *driver, const char *__caller)
 {
@@ -81,6 +131,14 @@ tapdisk_driver_allocate(int type, const char *name, td_flag_t flags)
 	driver->ops     = ops;
 	driver->type    = type;
 	driver->storage = -1;
+
+	driver->queue_depth  = td_driver_queue_depth;
+	driver->max_segments = td_driver_max_segments;
+	driver->cache_size   = td_driver_cache_size;
+	driver->prealloc     = td_driver_prealloc;
+	driver->prealloc_low = td_driver_prealloc_low;
+	driver->lcache_size  = td_driver_lcache_size;
+
 	driver->data    = calloc(1, ops->private_data_size);
 	if (!driver->data)
 		goto fail;
@@ -37,6 +37,16 @@ struct td_driver_handle {
 
 	td_disk_info_t               info;
 
+	unsigned int                 queue_depth;
+	unsigned int                 max_segments;
+	size_t                       cache_size; /* cache memory budget,
+						  * bytes; 0 for default */
+	unsigned int                 prealloc; /* blocks kept allocated
+						* ahead of writes */
+	unsigned int                 prealloc_low;
+	uint64_t                     lcache_size; /* local cache capacity,
+						   * bytes; 0 if unbounded */
+
 	void                        *data;
 	const struct tap_disk       *ops;
 
@@ -47,6 +57,22 @@ struct td_driver_handle {
 td_driver_t *tapdisk_driver_allocate(int, const char *, td_flag_t);
 void tapdisk_driver_free(td_driver_t *);
 
+void tapdisk_driver_set_queue_limits(unsigned int depth, unsigned int segs);
+void tapdisk_driver_set_cache_size(size_t);
+void tapdisk_driver_set_prealloc(unsigned int blocks, unsigned int low);
+void tapdisk_driver_set_lcache_size(uint64_t);
+
+/*
+ * Upper bound on the number of single-segment requests the VBD may
+ * have outstanding against a driver. Drivers size their request pools
+ * from this at open time.
+ */
+static inline unsigned int
+tapdisk_driver_data_requests(const td_driver_t *driver)
+{
+	return driver->queue_depth * driver->max_segments;
+}
+
 void tapdisk_driver_queue_tiocb(td_driver_t *, struct tiocb *);
 
 void tapdisk_driver_debug(td_driver_t *);
@@ -96,12 +96,12 @@ td_fdreceiver_recv_fd(event_id_t id, char mode, void *data)
 	 * We're done with this connection, it was only transiently used to 
 	 * connect the client
 	 */
-	close(fdreceiver->client_fd);
-	fdreceiver->client_fd = -1;
-
 	tapdisk_server_unregister_event(fdreceiver->client_event_id);
 	fdreceiver->client_event_id = -1;
 
+	close(fdreceiver->client_fd);
+	fdreceiver->client_fd = -1;
+
 	/*
 	 * It is the responsibility of this callback function to arrange that 
 	 * the fd is eventually closed
@@ -148,18 +148,18 @@ td_fdreceiver_accept_fd(event_id_t id, char mode, void *data)
 void
 td_fdreceiver_stop(struct td_fdreceiver *fdreceiver)
 {
-	if (fdreceiver->client_fd >= 0)
-		close(fdreceiver->client_fd);
-
 	if (fdreceiver->client_event_id >= 0)
 		tapdisk_server_unregister_event(fdreceiver->client_event_id);
 
-	if (fdreceiver->fd >= 0)
-		close(fdreceiver->fd);
+	if (fdreceiver->client_fd >= 0)
+		close(fdreceiver->client_fd);
 
 	if (fdreceiver->fd_event_id >= 0)
 		tapdisk_server_unregister_event(fdreceiver->fd_event_id);
 
+	if (fdreceiver->fd >= 0)
+		close(fdreceiver->fd);
+
 	if (fdreceiver->path != NULL) {
 		unlink(fdreceiver->path);
 		free(fdreceiver->path);
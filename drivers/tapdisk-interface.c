@@ -221,6 +221,74 @@ fail:
 	td_complete_request(treq, err);
 }
 
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	if (!driver->ops->td_queue_discard) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	driver->ops->td_queue_discard(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+void
+td_queue_flush(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	if (!driver->ops->td_queue_flush) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	driver->ops->td_queue_flush(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
 void
 td_forward_request(td_request_t treq)
 {
@@ -239,6 +307,22 @@ td_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 	tapdisk_driver_queue_tiocb(driver, tiocb);
 }
 
+/*
+ * Image fds used with td_queue_tiocb may be registered with the I/O
+ * backend for cheaper submission. Unregister before closing the fd.
+ */
+void
+td_register_file(int fd)
+{
+	tapdisk_server_register_file(fd);
+}
+
+void
+td_unregister_file(int fd)
+{
+	tapdisk_server_unregister_file(fd);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	     long long offset, td_queue_callback_t cb, void *arg)
@@ -253,6 +337,26 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	tapdisk_prep_tiocb(tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+void
+td_prep_flush(struct tiocb *tiocb, int fd, td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_flush_tiocb(tiocb, fd, cb, arg);
+}
+
+void
+td_prep_fallocate(struct tiocb *tiocb, int fd, int mode, long long offset,
+		  size_t bytes, td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_fallocate_tiocb(tiocb, fd, mode, offset, bytes, cb, arg);
+}
+
+void
+td_prep_discard(struct tiocb *tiocb, int fd, long long offset,
+		size_t bytes, td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_discard_tiocb(tiocb, fd, offset, bytes, cb, arg);
+}
+
 void
 td_debug(td_image_t *image)
 {
@@ -266,6 +370,21 @@ td_debug(td_image_t *image)
 	tapdisk_driver_debug(driver);
 }
 
+int
+td_drain(td_image_t *image, td_vbd_t *vbd)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 0;
+
+	if (!driver->ops->td_drain)
+		return 0;
+
+	return driver->ops->td_drain(driver, vbd);
+}
+
 __noreturn void
 td_panic(void)
 {
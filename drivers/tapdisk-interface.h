@@ -30,16 +30,26 @@ int td_validate_parent(td_image_t *, td_image_t *);
 
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
+void td_queue_discard(td_image_t *, td_request_t);
+void td_queue_flush(td_image_t *, td_request_t);
 void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
 void td_debug(td_image_t *);
+int td_drain(td_image_t *, td_vbd_t *);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
+void td_register_file(int);
+void td_unregister_file(int);
 void td_prep_read(struct tiocb *, int, char *, size_t,
 		  long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
 		   long long, td_queue_callback_t, void *);
+void td_prep_flush(struct tiocb *, int, td_queue_callback_t, void *);
+void td_prep_fallocate(struct tiocb *, int, int, long long, size_t,
+		       td_queue_callback_t, void *);
+void td_prep_discard(struct tiocb *, int, long long, size_t,
+		     td_queue_callback_t, void *);
 void td_panic(void) __noreturn;
 
 #endif
@@ -42,8 +42,6 @@
 #include "config.h"
 #endif
 
-#define NBD_SERVER_NUM_REQS TAPDISK_DATA_REQUESTS
-
 #define TAPDISK_NBDSERVER_LISTEN_SOCK_PATH "/var/run/blktap-control/nbdserver"
 #define TAPDISK_NBDSERVER_MAX_PATH_LEN 256
 
@@ -163,7 +161,10 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 
 	bzero(client, sizeof(td_nbdserver_client_t));
 
-	err = tapdisk_nbdserver_reqs_init(client, NBD_SERVER_NUM_REQS);
+	/* NBD requests are single-segment: allow one per segment slot */
+	err = tapdisk_nbdserver_reqs_init(client,
+					  server->vbd->queue_depth *
+					  server->vbd->max_segments);
 	if (err < 0) {
 		ERROR("Couldn't allocate client reqs: %d", err);
 		goto fail;
@@ -369,12 +370,6 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	bzero(req->id, sizeof(req->id));
 	memcpy(req->id, request.handle, sizeof(request.handle));
 
-	rc = posix_memalign(&req->iov.base, 512, len);
-	if (rc < 0) {
-		ERROR("posix_memalign failed (%d)", rc);
-		goto fail;
-	}
-
 	vreq->sec = request.from >> SECTOR_SHIFT;
 	vreq->iovcnt = 1;
 	vreq->iov = &req->iov;
@@ -384,13 +379,25 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 	vreq->name = req->id;
 	vreq->vbd = server->vbd;
 
-	switch(request.type) {
+	switch(request.type & NBD_CMD_MASK_COMMAND) {
 	case NBD_CMD_READ:
 		vreq->op = TD_OP_READ;
+
+		rc = posix_memalign(&req->iov.base, 512, len);
+		if (rc) {
+			ERROR("posix_memalign failed (%d)", rc);
+			goto fail;
+		}
 		break;
 	case NBD_CMD_WRITE:
 		vreq->op = TD_OP_WRITE;
 
+		rc = posix_memalign(&req->iov.base, 512, len);
+		if (rc) {
+			ERROR("posix_memalign failed (%d)", rc);
+			goto fail;
+		}
+
 		n = 0;
 		while (n < len) {
 			rc = recv(fd, vreq->iov->base + n, (len - n), 0);
@@ -403,6 +410,19 @@ tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
 			n += rc;
 		};
 
+		break;
+	case NBD_CMD_FLUSH:
+		vreq->op = TD_OP_FLUSH;
+		vreq->sec = 0;
+		vreq->iov->secs = 1;
+		break;
+	case NBD_CMD_TRIM:
+		vreq->op = TD_OP_DISCARD;
+
+		if (!len) {
+			__tapdisk_nbdserver_request_cb(vreq, 0, client, 1);
+			return;
+		}
 		break;
 	case NBD_CMD_DISC:
 		INFO("Received close message. Sending reconnect "
@@ -431,6 +451,23 @@ fail:
 	return;
 }
 
+/*
+ * Transmission flags for the oldstyle handshake. Flush and trim are
+ * offered if the chain supports them.
+ */
+static uint32_t
+tapdisk_nbdserver_flags(td_nbdserver_t *server)
+{
+	uint32_t flags = NBD_FLAG_HAS_FLAGS;
+
+	if (tapdisk_vbd_op_supported(server->vbd, TD_OP_FLUSH))
+		flags |= NBD_FLAG_SEND_FLUSH;
+	if (tapdisk_vbd_op_supported(server->vbd, TD_OP_DISCARD))
+		flags |= NBD_FLAG_SEND_TRIM;
+
+	return flags;
+}
+
 static void
 tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
 {
@@ -448,7 +485,7 @@ tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
 	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
 	tmp64 = htonll(server->info.size * server->info.sector_size);
 	memcpy(buffer + 16, &tmp64, sizeof(tmp64));
-	tmp32 = htonl(0);
+	tmp32 = htonl(tapdisk_nbdserver_flags(server));
 	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
 	bzero(buffer + 28, 124);
 
@@ -20,9 +20,13 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -35,6 +39,9 @@
 #include "tapdisk-utils.h"
 
 #include "libaio-compat.h"
+#ifdef HAVE_LINUX_IO_URING_H
+#include "uring-compat.h"
+#endif
 #include "atomicio.h"
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
@@ -99,9 +106,13 @@ queue_deferred_tiocb(struct tqueue *queue)
 	}
 }
 
+static void queue_resize(struct tqueue *);
+
 static inline void
 queue_deferred_tiocbs(struct tqueue *queue)
 {
+	queue_resize(queue);
+
 	while (!tapdisk_queue_full(queue) && deferred_tiocbs(queue))
 		queue_deferred_tiocb(queue);
 }
@@ -195,6 +206,20 @@ tapdisk_rwio_setup(struct tqueue *queue, int size)
 	return 0;
 }
 
+static int
+tapdisk_rwio_resize(struct tqueue *queue, int size)
+{
+	struct rwio *rwio = queue->tio_data;
+	struct io_event *events;
+
+	events = realloc(rwio->aio_events, size * sizeof(struct io_event));
+	if (!events)
+		return -ENOMEM;
+
+	rwio->aio_events = events;
+	return 0;
+}
+
 static inline ssize_t
 tapdisk_rwio_rw(const struct iocb *iocb)
 {
@@ -257,7 +282,8 @@ static const struct tio td_tio_rwio = {
 	.data_size   = 0,
 	.tio_setup   = tapdisk_rwio_setup,
 	.tio_destroy = tapdisk_rwio_destroy,
-	.tio_submit  = tapdisk_rwio_submit
+	.tio_submit  = tapdisk_rwio_submit,
+	.tio_resize  = tapdisk_rwio_resize,
 };
 
 /*
@@ -497,6 +523,40 @@ fail:
 	return err;
 }
 
+/*
+ * A context can't grow, so it is replaced. The eventfd stays, the
+ * poll fd of the old api comes with the context and can't.
+ */
+static int
+tapdisk_lio_resize(struct tqueue *queue, int qlen)
+{
+	struct lio *lio = queue->tio_data;
+	struct io_event *events;
+	io_context_t ctx = 0;
+	int err;
+
+	if (!(lio->flags & LIO_FLAG_EVENTFD))
+		return -EOPNOTSUPP;
+
+	events = calloc(qlen, sizeof(struct io_event));
+	if (!events)
+		return -errno;
+
+	err = io_setup(qlen, &ctx);
+	if (err < 0) {
+		free(events);
+		return err;
+	}
+
+	io_destroy(lio->aio_ctx);
+	lio->aio_ctx = ctx;
+
+	free(lio->aio_events);
+	lio->aio_events = events;
+
+	return 0;
+}
+
 static int
 tapdisk_lio_submit(struct tqueue *queue)
 {
@@ -537,167 +597,1598 @@ static const struct tio td_tio_lio = {
 	.tio_setup   = tapdisk_lio_setup,
 	.tio_destroy = tapdisk_lio_destroy,
 	.tio_submit  = tapdisk_lio_submit,
+	.tio_resize  = tapdisk_lio_resize,
 };
 
-static void
-tapdisk_queue_free_io(struct tqueue *queue)
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * io_uring
+ *
+ * Submission and completion go through the shared rings: one
+ * io_uring_enter per batch, and completions are reaped straight off
+ * the CQ ring when the registered eventfd fires. Unlike libaio, this
+ * stays asynchronous on buffered files.
+ */
+
+#define URING_MAX_FILES         1024
+#define URING_MAX_BUFFERS       64
+
+struct uring {
+	int                      ring_fd;
+	unsigned                 sq_entries;
+
+	void                    *sq_ptr;
+	size_t                   sq_size;
+	unsigned                *sq_head;
+	unsigned                *sq_tail;
+	unsigned                *sq_mask;
+	unsigned                *sq_array;
+
+	struct io_uring_sqe     *sqes;
+	size_t                   sqes_size;
+
+	void                    *cq_ptr;
+	size_t                   cq_size;
+	unsigned                *cq_head;
+	unsigned                *cq_tail;
+	unsigned                *cq_mask;
+	struct io_uring_cqe     *cqes;
+
+	int                      event_fd;
+	int                      event_id;
+
+	struct io_event         *aio_events;
+
+	/* registered files, indexed by fd; -1 if not registered */
+	int                     *files;
+
+	/*
+	 * registered fixed buffers, a sparse table of stable slots. An
+	 * empty slot has a NULL base. Zero slots if unsupported.
+	 */
+	struct iovec             bufs[URING_MAX_BUFFERS];
+	int                      n_bufs;
+};
+
+static int
+tapdisk_uring_probe(struct uring *uring)
 {
-	if (queue->tio) {
-		if (queue->tio->tio_destroy)
-			queue->tio->tio_destroy(queue);
-		queue->tio = NULL;
-	}
+	struct io_uring_probe *probe;
+	size_t size;
+	int err;
 
-	if (queue->tio_data) {
-		free(queue->tio_data);
-		queue->tio_data = NULL;
+	size  = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (!probe)
+		return -errno;
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_PROBE,
+				  probe, 256);
+	if (err < 0) {
+		err = -errno;
+		goto out;
 	}
+
+	err = -ENOSYS;
+	if (probe->last_op < IORING_OP_WRITE)
+		goto out;
+
+	if (!(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+	    !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+		goto out;
+
+	err = 0;
+out:
+	free(probe);
+	return err;
 }
 
 static int
-tapdisk_queue_init_io(struct tqueue *queue, int drv)
+tapdisk_uring_map_rings(struct uring *uring, struct io_uring_params *p)
 {
-	const struct tio *tio;
-	int err;
+	void *ptr;
 
-	switch (drv) {
-	case TIO_DRV_LIO:
-		tio = &td_tio_lio;
-		break;
-	case TIO_DRV_RWIO:
-		tio = &td_tio_rwio;
-		break;
-	default:
-		err = -EINVAL;
-		goto fail;
+	uring->sq_size   = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	uring->cq_size   = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	uring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_size > uring->sq_size)
+			uring->sq_size = uring->cq_size;
+		uring->cq_size = uring->sq_size;
 	}
 
-	queue->tio_data = calloc(1, tio->data_size);
-	if (!queue->tio_data) {
-		PERROR("malloc(%zu)", tio->data_size);
-		err = -errno;
-		goto fail;
+	ptr = mmap(NULL, uring->sq_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	uring->sq_ptr = ptr;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ptr = uring->sq_ptr;
+	else {
+		ptr = mmap(NULL, uring->cq_size, PROT_READ|PROT_WRITE,
+			   MAP_SHARED|MAP_POPULATE, uring->ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			return -errno;
 	}
+	uring->cq_ptr = ptr;
 
-	queue->tio = tio;
+	ptr = mmap(NULL, uring->sqes_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	uring->sqes = ptr;
 
-	if (tio->tio_setup) {
-		err = tio->tio_setup(queue, queue->size);
-		if (err)
-			goto fail;
-	}
+	uring->sq_head  = uring->sq_ptr + p->sq_off.head;
+	uring->sq_tail  = uring->sq_ptr + p->sq_off.tail;
+	uring->sq_mask  = uring->sq_ptr + p->sq_off.ring_mask;
+	uring->sq_array = uring->sq_ptr + p->sq_off.array;
 
-	DPRINTF("I/O queue driver: %s\n", tio->name);
+	uring->cq_head  = uring->cq_ptr + p->cq_off.head;
+	uring->cq_tail  = uring->cq_ptr + p->cq_off.tail;
+	uring->cq_mask  = uring->cq_ptr + p->cq_off.ring_mask;
+	uring->cqes     = uring->cq_ptr + p->cq_off.cqes;
+
+	uring->sq_entries = p->sq_entries;
 
 	return 0;
+}
 
-fail:
-	tapdisk_queue_free_io(queue);
-	return err;
+static void
+tapdisk_uring_register_files(struct uring *uring)
+{
+	int i, err;
+
+	uring->files = malloc(URING_MAX_FILES * sizeof(int));
+	if (!uring->files)
+		return;
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		uring->files[i] = -1;
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_FILES,
+				  uring->files, URING_MAX_FILES);
+	if (err < 0) {
+		DPRINTF("io_uring: no registered files: %d\n", -errno);
+		free(uring->files);
+		uring->files = NULL;
+	}
 }
 
-int
-tapdisk_init_queue(struct tqueue *queue, int size,
-		   int drv, struct tfilter *filter)
+/*
+ * Buffers come and go one slot at a time, so slot indices in flight
+ * never move. Needs sparse registration (Linux 5.19); older kernels
+ * go without fixed buffers.
+ */
+static void
+tapdisk_uring_register_buffers(struct uring *uring)
 {
+	struct io_uring_rsrc_register reg;
 	int err;
 
-	memset(queue, 0, sizeof(struct tqueue));
+	memset(uring->bufs, 0, sizeof(uring->bufs));
 
-	queue->size   = size;
-	queue->filter = filter;
+	memset(&reg, 0, sizeof(reg));
+	reg.nr    = URING_MAX_BUFFERS;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
 
-	if (!size)
-		return 0;
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS2,
+				  &reg, sizeof(reg));
+	if (err < 0) {
+		DPRINTF("io_uring: no registered buffers: %d\n", -errno);
+		return;
+	}
 
-	err = tapdisk_queue_init_io(queue, drv);
-	if (err)
-		goto fail;
+	uring->n_bufs = URING_MAX_BUFFERS;
+}
 
-	queue->iocbs = calloc(size, sizeof(struct iocb *));
-	if (!queue->iocbs) {
-		err = -errno;
-		goto fail;
+static void
+tapdisk_uring_close_ring(struct uring *uring)
+{
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_size);
+		uring->sqes = NULL;
 	}
 
-	err = opio_init(&queue->opioctx, size);
-	if (err)
-		goto fail;
+	if (uring->cq_ptr && uring->cq_ptr != uring->sq_ptr)
+		munmap(uring->cq_ptr, uring->cq_size);
+	uring->cq_ptr = NULL;
 
-	return 0;
+	if (uring->sq_ptr) {
+		munmap(uring->sq_ptr, uring->sq_size);
+		uring->sq_ptr = NULL;
+	}
 
- fail:
-	tapdisk_free_queue(queue);
-	return err;
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
 }
 
-void
-tapdisk_free_queue(struct tqueue *queue)
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
 {
-	tapdisk_queue_free_io(queue);
+	struct uring *uring = queue->tio_data;
 
-	free(queue->iocbs);
-	queue->iocbs = NULL;
+	if (!uring)
+		return;
 
-	opio_free(&queue->opioctx);
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	tapdisk_uring_close_ring(uring);
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	free(uring->files);
+	uring->files = NULL;
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
 }
 
-void 
-tapdisk_debug_queue(struct tqueue *queue)
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
 {
-	struct tiocb *tiocb = queue->deferred.head;
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	unsigned head, tail;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+	struct io_uring_cqe *cqe;
+	uint64_t val;
 
-	WARN("TAPDISK QUEUE:\n");
-	WARN("size: %d, tio: %s, queued: %d, iocbs_pending: %d, "
-	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
-	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
-	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	ret = read(uring->event_fd, &val, sizeof(val));
+	if (ret) {};
 
-	if (tiocb) {
-		WARN("deferred:\n");
-		for (; tiocb != NULL; tiocb = tiocb->next) {
-			struct iocb *io = &tiocb->iocb;
-			WARN("%s of %lu bytes at %lld\n",
-			     (io->aio_lio_opcode == IO_CMD_PWRITE ?
-			      "write" : "read"),
-			     io->u.c.nbytes, io->u.c.offset);
-		}
+	head = *uring->cq_head;
+	tail = __uring_load_acquire(uring->cq_tail);
+
+	for (ret = 0; head != tail && ret < queue->size; head++, ret++) {
+		cqe     = &uring->cqes[head & *uring->cq_mask];
+		ep      = uring->aio_events + ret;
+		ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res = cqe->res;
 	}
-}
 
-void
-tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
-		   long long offset, td_queue_callback_t cb, void *arg)
-{
-	struct iocb *iocb = &tiocb->iocb;
+	__uring_store_release(uring->cq_head, head);
 
-	if (rw)
-		io_prep_pwrite(iocb, fd, buf, size, offset);
-	else
-		io_prep_pread(iocb, fd, buf, size, offset);
+	split = io_split(&queue->opioctx, uring->aio_events, ret);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
 
-	iocb->data  = tiocb;
-	tiocb->cb   = cb;
-	tiocb->arg  = arg;
-	tiocb->next = NULL;
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
 }
 
-void
-tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
 {
-	if (!tapdisk_queue_full(queue))
-		queue_tiocb(queue, tiocb);
-	else
-		defer_tiocb(queue, tiocb);
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+
+	uring->ring_fd = __io_uring_setup(qlen, &p);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = tapdisk_uring_probe(uring);
+	if (err)
+		goto fail;
+
+	err = tapdisk_uring_map_rings(uring, &p);
+	if (err)
+		goto fail;
+
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __io_uring_register(uring->ring_fd, IORING_REGISTER_EVENTFD,
+				  &uring->event_fd, 1);
+	if (err < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	tapdisk_uring_register_files(uring);
+	tapdisk_uring_register_buffers(uring);
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
 }
 
+static int tapdisk_uring_update_buffer(struct uring *, int, void *, size_t);
 
 /*
- * fail_tiocbs may queue more tiocbs
+ * Rings don't grow, so a bigger one takes over. It gets the same
+ * eventfd, and the files and buffers registered with the old one, in
+ * the same slots. Whichever of those fails to carry over is dropped.
  */
-int
-tapdisk_submit_tiocbs(struct tqueue *queue)
+static int
+tapdisk_uring_resize(struct tqueue *queue, int qlen)
 {
+	struct uring *uring = queue->tio_data;
+	struct io_uring_rsrc_register reg;
+	struct io_uring_params p;
+	struct io_event *events;
+	struct uring ring;
+	int i, err, files, bufs;
+
+	memset(&ring, 0, sizeof(ring));
+	memset(&p, 0, sizeof(p));
+
+	events = calloc(qlen, sizeof(struct io_event));
+	if (!events)
+		return -errno;
+
+	ring.ring_fd = __io_uring_setup(qlen, &p);
+	if (ring.ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = tapdisk_uring_map_rings(&ring, &p);
+	if (err)
+		goto fail;
+
+	err = __io_uring_register(ring.ring_fd, IORING_REGISTER_EVENTFD,
+				  &uring->event_fd, 1);
+	if (err < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	files = uring->files &&
+		__io_uring_register(ring.ring_fd, IORING_REGISTER_FILES,
+				    uring->files, URING_MAX_FILES) >= 0;
+
+	bufs = 0;
+	if (uring->n_bufs) {
+		memset(&reg, 0, sizeof(reg));
+		reg.nr    = URING_MAX_BUFFERS;
+		reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+		bufs = __io_uring_register(ring.ring_fd,
+					   IORING_REGISTER_BUFFERS2,
+					   &reg, sizeof(reg)) >= 0;
+
+		for (i = 0; bufs && i < uring->n_bufs; i++)
+			if (uring->bufs[i].iov_base &&
+			    tapdisk_uring_update_buffer(&ring, i,
+							uring->bufs[i].iov_base,
+							uring->bufs[i].iov_len))
+				bufs = 0;
+	}
+
+	tapdisk_uring_close_ring(uring);
+
+	uring->ring_fd    = ring.ring_fd;
+	uring->sq_entries = ring.sq_entries;
+	uring->sq_ptr     = ring.sq_ptr;
+	uring->sq_size    = ring.sq_size;
+	uring->sq_head    = ring.sq_head;
+	uring->sq_tail    = ring.sq_tail;
+	uring->sq_mask    = ring.sq_mask;
+	uring->sq_array   = ring.sq_array;
+	uring->sqes       = ring.sqes;
+	uring->sqes_size  = ring.sqes_size;
+	uring->cq_ptr     = ring.cq_ptr;
+	uring->cq_size    = ring.cq_size;
+	uring->cq_head    = ring.cq_head;
+	uring->cq_tail    = ring.cq_tail;
+	uring->cq_mask    = ring.cq_mask;
+	uring->cqes       = ring.cqes;
+
+	if (uring->files && !files) {
+		DPRINTF("io_uring: registered files lost in resize\n");
+		free(uring->files);
+		uring->files = NULL;
+	}
+
+	if (uring->n_bufs && !bufs) {
+		DPRINTF("io_uring: registered buffers lost in resize\n");
+		memset(uring->bufs, 0, sizeof(uring->bufs));
+		uring->n_bufs = 0;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = events;
+
+	return 0;
+
+fail:
+	tapdisk_uring_close_ring(&ring);
+	free(events);
+	return err;
+}
+
+static inline int
+tapdisk_uring_find_buffer(struct uring *uring, const void *buf, size_t size)
+{
+	const struct iovec *iov;
+	int i;
+
+	for (i = 0; i < uring->n_bufs; i++) {
+		iov = &uring->bufs[i];
+		if (iov->iov_base &&
+		    buf >= iov->iov_base &&
+		    buf + size <= iov->iov_base + iov->iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static inline void
+tapdisk_uring_prep_sqe(struct uring *uring, struct io_uring_sqe *sqe,
+		       struct iocb *iocb)
+{
+	int fd = iocb->aio_fildes;
+	int write = iocb->aio_lio_opcode == IO_CMD_PWRITE;
+	int idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	idx = tapdisk_uring_find_buffer(uring,
+					iocb->u.c.buf, iocb->u.c.nbytes);
+	if (idx >= 0) {
+		sqe->opcode    = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = idx;
+	} else
+		sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	sqe->fd        = fd;
+	sqe->addr      = (uintptr_t)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = (uintptr_t)iocb;
+
+	if (uring->files && fd >= 0 && fd < URING_MAX_FILES &&
+	    uring->files[fd] == fd)
+		sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, queued, submitted, err = 0;
+	unsigned head, tail, idx;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	head = __uring_load_acquire(uring->sq_head);
+	tail = *uring->sq_tail;
+
+	for (i = 0; i < merged && tail - head < uring->sq_entries; i++) {
+		idx = tail++ & *uring->sq_mask;
+		tapdisk_uring_prep_sqe(uring, &uring->sqes[idx],
+				       queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+	}
+	queued = i;
+
+	__uring_store_release(uring->sq_tail, tail);
+
+	submitted = __io_uring_enter(uring->ring_fd, queued, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/* drop whatever the kernel did not consume */
+	if (submitted < queued)
+		__uring_store_release(uring->sq_tail,
+				      tail - (queued - submitted));
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static void
+tapdisk_uring_update_file(struct tqueue *queue, int fd, int file)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_files_update up;
+	int err;
+
+	if (!uring->files || fd < 0 || fd >= URING_MAX_FILES)
+		return;
+
+	if (uring->files[fd] == file)
+		return;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = fd;
+	up.fds    = (uintptr_t)&file;
+
+	err = __io_uring_register(uring->ring_fd,
+				  IORING_REGISTER_FILES_UPDATE, &up, 1);
+	if (err < 0) {
+		DBG("io_uring: file update %d failed: %d\n", fd, -errno);
+		/* never leave a stale fixed file behind */
+		file = -1;
+	}
+
+	uring->files[fd] = file;
+}
+
+static void
+tapdisk_uring_register_fd(struct tqueue *queue, int fd)
+{
+	tapdisk_uring_update_file(queue, fd, fd);
+}
+
+static void
+tapdisk_uring_unregister_fd(struct tqueue *queue, int fd)
+{
+	tapdisk_uring_update_file(queue, fd, -1);
+}
+
+static int
+tapdisk_uring_update_buffer(struct uring *uring, int slot,
+			    void *base, size_t size)
+{
+	struct io_uring_rsrc_update2 up;
+	struct iovec iov;
+	int err;
+
+	iov.iov_base = base;
+	iov.iov_len  = size;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.data   = (uintptr_t)&iov;
+	up.nr     = 1;
+
+	err = __io_uring_register(uring->ring_fd,
+				  IORING_REGISTER_BUFFERS_UPDATE,
+				  &up, sizeof(up));
+	if (err < 0)
+		return -errno;
+
+	uring->bufs[slot] = iov;
+	return 0;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *base, size_t size)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	if (!uring->n_bufs)
+		return -EOPNOTSUPP;
+
+	for (i = 0; i < uring->n_bufs; i++)
+		if (!uring->bufs[i].iov_base)
+			return tapdisk_uring_update_buffer(uring, i, base, size);
+
+	return -ENOSPC;
+}
+
+/*
+ * The owner stops issuing I/O from @base first. The kernel holds on
+ * to the old pages until requests already using the slot complete.
+ */
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *base)
+{
+	struct uring *uring = queue->tio_data;
+	int i, err;
+
+	for (i = 0; i < uring->n_bufs; i++) {
+		if (uring->bufs[i].iov_base != base)
+			continue;
+
+		err = tapdisk_uring_update_buffer(uring, i, NULL, 0);
+		if (err) {
+			DBG("io_uring: buffer %d release failed: %d\n",
+			    i, err);
+			/* never issue fixed I/O against it again */
+			uring->bufs[i].iov_base = NULL;
+			uring->bufs[i].iov_len  = 0;
+		}
+		return;
+	}
+}
+
+static const struct tio td_tio_uring = {
+	.name              = "uring",
+	.data_size         = sizeof(struct uring),
+	.tio_setup         = tapdisk_uring_setup,
+	.tio_destroy       = tapdisk_uring_destroy,
+	.tio_submit        = tapdisk_uring_submit,
+	.tio_resize        = tapdisk_uring_resize,
+	.tio_register_fd   = tapdisk_uring_register_fd,
+	.tio_unregister_fd = tapdisk_uring_unregister_fd,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/*
+ * group commit
+ *
+ * Flushes never reach the tio. They go to a single syncer thread
+ * shared by all queues in the process. While one commit runs, further
+ * flushes gather, and the next commit serves all of them at once: one
+ * fdatasync() per file, or a single syncfs() for a filesystem with
+ * several files waiting. Results return to each queue through its
+ * eventfd and complete on the queue's own thread.
+ */
+
+struct tsync_file {
+	dev_t                 dev;
+	ino_t                 ino;
+	int                   bdev;
+	int                   fd;
+	int                   done;
+	int                   err;
+};
+
+static struct {
+	pthread_mutex_t       lock;
+	pthread_cond_t        cond;
+	pthread_t             thread;
+	struct list_head      queues;
+	int                   users;
+	int                   run;
+	int                   busy;
+	int                   stopping;
+
+	struct tsync_file    *files;
+	int                   n_files;
+	int                   max_files;
+
+	uint64_t              commits;
+	uint64_t              syncs;
+} syncer = {
+	.lock   = PTHREAD_MUTEX_INITIALIZER,
+	.cond   = PTHREAD_COND_INITIALIZER,
+	.queues = LIST_HEAD_INIT(syncer.queues),
+};
+
+static inline void
+tlist_add(struct tlist *list, struct tiocb *tiocb)
+{
+	tiocb->next = NULL;
+
+	if (!list->head)
+		list->head = list->tail = tiocb;
+	else
+		list->tail = list->tail->next = tiocb;
+}
+
+static inline void
+tlist_splice(struct tlist *dst, struct tlist *src)
+{
+	if (!src->head)
+		return;
+
+	if (!dst->head)
+		dst->head = src->head;
+	else
+		dst->tail->next = src->head;
+
+	dst->tail = src->tail;
+	src->head = src->tail = NULL;
+}
+
+/*
+ * Files are told apart by device and inode. Block devices all live
+ * on devtmpfs, so they go by their own device number, and never share
+ * a syncfs().
+ */
+static int
+tsync_find_file(int fd)
+{
+	struct tsync_file *f;
+	struct stat st;
+	dev_t dev;
+	int i, bdev;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	bdev = !!S_ISBLK(st.st_mode);
+	dev  = bdev ? st.st_rdev : st.st_dev;
+
+	for (i = 0; i < syncer.n_files; i++) {
+		f = &syncer.files[i];
+		if (f->bdev == bdev && f->dev == dev &&
+		    (bdev || f->ino == st.st_ino))
+			return i;
+	}
+
+	if (syncer.n_files == syncer.max_files) {
+		int max = syncer.max_files ? syncer.max_files * 2 : 16;
+
+		f = realloc(syncer.files, max * sizeof(*f));
+		if (!f)
+			return -ENOMEM;
+
+		syncer.files     = f;
+		syncer.max_files = max;
+	}
+
+	f = &syncer.files[syncer.n_files];
+	memset(f, 0, sizeof(*f));
+	f->dev  = dev;
+	f->ino  = st.st_ino;
+	f->bdev = bdev;
+	f->fd   = fd;
+
+	return syncer.n_files++;
+}
+
+static void
+tsync_sync_file(int i)
+{
+	struct tsync_file *f = &syncer.files[i];
+	int j, shared, err;
+
+	shared = 0;
+	if (!f->bdev)
+		for (j = i + 1; j < syncer.n_files; j++)
+			if (!syncer.files[j].bdev &&
+			    syncer.files[j].dev == f->dev)
+				shared = 1;
+
+	if (!shared) {
+		err = fdatasync(f->fd) ? -errno : 0;
+		f->err  = err;
+		f->done = 1;
+		syncer.syncs++;
+		return;
+	}
+
+	err = syncfs(f->fd) ? -errno : 0;
+	syncer.syncs++;
+
+	for (j = i; j < syncer.n_files; j++)
+		if (!syncer.files[j].bdev && syncer.files[j].dev == f->dev) {
+			syncer.files[j].err  = err;
+			syncer.files[j].done = 1;
+		}
+}
+
+/*
+ * Runs unlocked; the queue list and the syncing lists stay put while
+ * the syncer is busy. During the commit, tiocb->err holds the file
+ * slot + 1 of each flush, then its result.
+ */
+static void
+tsync_commit(void)
+{
+	struct tqueue *queue;
+	struct tiocb *tiocb;
+	int i;
+
+	syncer.n_files = 0;
+
+	list_for_each_entry(queue, &syncer.queues, sync_entry)
+		for (tiocb = queue->syncing.head; tiocb; tiocb = tiocb->next) {
+			i = tsync_find_file(tiocb->iocb.aio_fildes);
+			tiocb->err = i < 0 ? i : i + 1;
+		}
+
+	for (i = 0; i < syncer.n_files; i++)
+		if (!syncer.files[i].done)
+			tsync_sync_file(i);
+
+	list_for_each_entry(queue, &syncer.queues, sync_entry)
+		for (tiocb = queue->syncing.head; tiocb; tiocb = tiocb->next)
+			if (tiocb->err > 0)
+				tiocb->err = syncer.files[tiocb->err - 1].err;
+}
+
+static void
+tsync_kick(struct tqueue *queue)
+{
+	uint64_t val = 1;
+	int gcc = write(queue->sync_fd, &val, sizeof(val));
+	if (gcc) {};
+}
+
+static void *
+tsync_thread(void *arg)
+{
+	struct tqueue *queue;
+	int pending;
+
+	pthread_mutex_lock(&syncer.lock);
+
+	while (syncer.run) {
+		pending = 0;
+
+		list_for_each_entry(queue, &syncer.queues, sync_entry)
+			if (queue->sync_wait.head) {
+				tlist_splice(&queue->syncing, &queue->sync_wait);
+				pending = 1;
+			}
+
+		if (!pending) {
+			pthread_cond_wait(&syncer.cond, &syncer.lock);
+			continue;
+		}
+
+		syncer.busy = 1;
+		pthread_mutex_unlock(&syncer.lock);
+
+		tsync_commit();
+
+		pthread_mutex_lock(&syncer.lock);
+
+		list_for_each_entry(queue, &syncer.queues, sync_entry)
+			if (queue->syncing.head) {
+				tlist_splice(&queue->synced, &queue->syncing);
+				tsync_kick(queue);
+			}
+
+		syncer.busy = 0;
+		syncer.commits++;
+		pthread_cond_broadcast(&syncer.cond);
+	}
+
+	pthread_mutex_unlock(&syncer.lock);
+
+	return NULL;
+}
+
+/*
+ * space management
+ *
+ * fallocate() and discards have no aio equivalent and can take a long
+ * while, so they go to a thread of its own, shared by all queues in the process
+ * like the syncer, and kept apart from it: a commit never waits for
+ * space to be allocated. Jobs run in chunks of TSPACE_CHUNK bytes,
+ * taking turns between queues, so one large request does not hold up
+ * everybody else. Results return through the queue's sync eventfd.
+ *
+ * The space thread owns the tiocbs on the space_wait lists. It steps
+ * offset and length of the iocb as chunks complete.
+ */
+
+#define TSPACE_CHUNK          (128ULL << 20)
+
+static struct {
+	pthread_mutex_t       lock;
+	pthread_cond_t        cond;
+	pthread_t             thread;
+	struct list_head      queues;
+	int                   users;
+	int                   run;
+	int                   busy;
+	int                   stopping;
+
+	uint64_t              jobs;
+	uint64_t              chunks;
+} tspace = {
+	.lock   = PTHREAD_MUTEX_INITIALIZER,
+	.cond   = PTHREAD_COND_INITIALIZER,
+	.queues = LIST_HEAD_INIT(tspace.queues),
+};
+
+/*
+ * Runs unlocked. Returns 1 once the job is done.
+ */
+static int
+tspace_run_chunk(struct tiocb *tiocb)
+{
+	struct iocb *io = &tiocb->iocb;
+	uint64_t len;
+	int err;
+
+	len = io->u.c.nbytes;
+	if (len > TSPACE_CHUNK)
+		len = TSPACE_CHUNK;
+
+	switch (tiocb->cmd) {
+	case TIO_CMD_FALLOCATE:
+		err = fallocate(io->aio_fildes, tiocb->mode,
+				io->u.c.offset, len) ? -errno : 0;
+		break;
+	case TIO_CMD_DISCARD:
+		err = tapdisk_discard_range(io->aio_fildes,
+					    io->u.c.offset, len);
+		break;
+	default:
+		err = -EINVAL;
+		break;
+	}
+
+	tspace.chunks++;
+
+	io->u.c.offset += len;
+	io->u.c.nbytes -= len;
+
+	if (err || !io->u.c.nbytes) {
+		tiocb->err = err;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *
+tspace_thread(void *arg)
+{
+	struct tqueue *queue;
+	struct tiocb *tiocb;
+	int pending;
+
+	pthread_mutex_lock(&tspace.lock);
+
+	while (tspace.run) {
+		pending = 0;
+
+		list_for_each_entry(queue, &tspace.queues, space_entry)
+			if (queue->space_wait.head)
+				pending = 1;
+
+		if (!pending) {
+			pthread_cond_wait(&tspace.cond, &tspace.lock);
+			continue;
+		}
+
+		tspace.busy = 1;
+
+		list_for_each_entry(queue, &tspace.queues, space_entry) {
+			tiocb = queue->space_wait.head;
+			if (!tiocb)
+				continue;
+
+			pthread_mutex_unlock(&tspace.lock);
+			pending = tspace_run_chunk(tiocb);
+			pthread_mutex_lock(&tspace.lock);
+
+			if (!pending)
+				continue;
+
+			queue->space_wait.head = tiocb->next;
+			if (!queue->space_wait.head)
+				queue->space_wait.tail = NULL;
+
+			tlist_add(&queue->space_done, tiocb);
+			tsync_kick(queue);
+			tspace.jobs++;
+		}
+
+		tspace.busy = 0;
+		pthread_cond_broadcast(&tspace.cond);
+	}
+
+	pthread_mutex_unlock(&tspace.lock);
+
+	return NULL;
+}
+
+static void
+tapdisk_queue_sync_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct tiocb *tiocb, *next;
+	struct tlist done;
+	uint64_t val;
+	int gcc;
+
+	gcc = read(queue->sync_fd, &val, sizeof(val));
+	if (gcc) {};
+
+	pthread_mutex_lock(&syncer.lock);
+	done = queue->synced;
+	queue->synced.head = queue->synced.tail = NULL;
+	pthread_mutex_unlock(&syncer.lock);
+
+	for (tiocb = done.head; tiocb; tiocb = next) {
+		next        = tiocb->next;
+		tiocb->next = NULL;
+
+		queue->tiocbs_syncing--;
+		tiocb->cb(tiocb->arg, tiocb, tiocb->err);
+	}
+
+	pthread_mutex_lock(&tspace.lock);
+	done = queue->space_done;
+	queue->space_done.head = queue->space_done.tail = NULL;
+	pthread_mutex_unlock(&tspace.lock);
+
+	for (tiocb = done.head; tiocb; tiocb = next) {
+		next        = tiocb->next;
+		tiocb->next = NULL;
+
+		queue->tiocbs_space--;
+		tiocb->cb(tiocb->arg, tiocb, tiocb->err);
+	}
+}
+
+static void
+tapdisk_queue_sync(struct tqueue *queue)
+{
+	pthread_mutex_lock(&syncer.lock);
+	tlist_splice(&queue->sync_wait, &queue->flushes);
+	pthread_cond_broadcast(&syncer.cond);
+	pthread_mutex_unlock(&syncer.lock);
+}
+
+static void
+tapdisk_queue_close_sync(struct tqueue *queue)
+{
+	pthread_t thread;
+
+	/* never initialized */
+	if (!queue->sync_entry.next)
+		return;
+
+	pthread_mutex_lock(&syncer.lock);
+
+	while (syncer.busy || syncer.stopping)
+		pthread_cond_wait(&syncer.cond, &syncer.lock);
+
+	if (!list_empty(&queue->sync_entry)) {
+		list_del_init(&queue->sync_entry);
+
+		if (!--syncer.users) {
+			syncer.run      = 0;
+			syncer.stopping = 1;
+			thread          = syncer.thread;
+			pthread_cond_broadcast(&syncer.cond);
+			pthread_mutex_unlock(&syncer.lock);
+
+			pthread_join(thread, NULL);
+
+			pthread_mutex_lock(&syncer.lock);
+			free(syncer.files);
+			syncer.files     = NULL;
+			syncer.max_files = 0;
+			syncer.stopping  = 0;
+			pthread_cond_broadcast(&syncer.cond);
+		}
+	}
+
+	pthread_mutex_unlock(&syncer.lock);
+
+	if (queue->sync_event >= 0) {
+		tapdisk_server_unregister_event(queue->sync_event);
+		queue->sync_event = -1;
+	}
+
+	if (queue->sync_fd >= 0) {
+		close(queue->sync_fd);
+		queue->sync_fd = -1;
+	}
+}
+
+static int
+tapdisk_queue_open_sync(struct tqueue *queue)
+{
+	int err;
+
+	queue->sync_fd = tapdisk_sys_eventfd(0);
+	if (queue->sync_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	queue->sync_event =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      queue->sync_fd, 0,
+					      tapdisk_queue_sync_event,
+					      queue);
+	if (queue->sync_event < 0) {
+		err = queue->sync_event;
+		goto fail;
+	}
+
+	pthread_mutex_lock(&syncer.lock);
+
+	while (syncer.busy || syncer.stopping)
+		pthread_cond_wait(&syncer.cond, &syncer.lock);
+
+	if (!syncer.users) {
+		syncer.run = 1;
+		err = pthread_create(&syncer.thread, NULL, tsync_thread, NULL);
+		if (err) {
+			syncer.run = 0;
+			pthread_mutex_unlock(&syncer.lock);
+			err = -err;
+			goto fail;
+		}
+	}
+
+	syncer.users++;
+	list_add_tail(&queue->sync_entry, &syncer.queues);
+
+	pthread_mutex_unlock(&syncer.lock);
+
+	return 0;
+
+fail:
+	tapdisk_queue_close_sync(queue);
+	return err;
+}
+
+static void
+tapdisk_queue_space(struct tqueue *queue)
+{
+	pthread_mutex_lock(&tspace.lock);
+	tlist_splice(&queue->space_wait, &queue->space);
+	pthread_cond_broadcast(&tspace.cond);
+	pthread_mutex_unlock(&tspace.lock);
+}
+
+static void
+tapdisk_queue_close_space(struct tqueue *queue)
+{
+	pthread_t thread;
+
+	/* never initialized */
+	if (!queue->space_entry.next)
+		return;
+
+	pthread_mutex_lock(&tspace.lock);
+
+	while (tspace.busy || tspace.stopping)
+		pthread_cond_wait(&tspace.cond, &tspace.lock);
+
+	if (!list_empty(&queue->space_entry)) {
+		list_del_init(&queue->space_entry);
+
+		if (!--tspace.users) {
+			tspace.run      = 0;
+			tspace.stopping = 1;
+			thread          = tspace.thread;
+			pthread_cond_broadcast(&tspace.cond);
+			pthread_mutex_unlock(&tspace.lock);
+
+			pthread_join(thread, NULL);
+
+			pthread_mutex_lock(&tspace.lock);
+			tspace.stopping = 0;
+			pthread_cond_broadcast(&tspace.cond);
+		}
+	}
+
+	pthread_mutex_unlock(&tspace.lock);
+}
+
+static int
+tapdisk_queue_open_space(struct tqueue *queue)
+{
+	int err;
+
+	pthread_mutex_lock(&tspace.lock);
+
+	while (tspace.busy || tspace.stopping)
+		pthread_cond_wait(&tspace.cond, &tspace.lock);
+
+	if (!tspace.users) {
+		tspace.run = 1;
+		err = pthread_create(&tspace.thread, NULL, tspace_thread, NULL);
+		if (err) {
+			tspace.run = 0;
+			pthread_mutex_unlock(&tspace.lock);
+			return -err;
+		}
+	}
+
+	tspace.users++;
+	list_add_tail(&queue->space_entry, &tspace.queues);
+
+	pthread_mutex_unlock(&tspace.lock);
+
+	return 0;
+}
+
+static void
+tapdisk_queue_free_io(struct tqueue *queue)
+{
+	if (queue->tio) {
+		if (queue->tio->tio_destroy)
+			queue->tio->tio_destroy(queue);
+		queue->tio = NULL;
+	}
+
+	if (queue->tio_data) {
+		free(queue->tio_data);
+		queue->tio_data = NULL;
+	}
+}
+
+static int
+tapdisk_queue_init_io(struct tqueue *queue, int drv)
+{
+	const struct tio *tio;
+	int err;
+
+	switch (drv) {
+	case TIO_DRV_LIO:
+		tio = &td_tio_lio;
+		break;
+	case TIO_DRV_RWIO:
+		tio = &td_tio_rwio;
+		break;
+	case TIO_DRV_URING:
+#ifdef HAVE_LINUX_IO_URING_H
+		tio = &td_tio_uring;
+		break;
+#else
+		err = -ENOSYS;
+		goto fail;
+#endif
+	default:
+		err = -EINVAL;
+		goto fail;
+	}
+
+	queue->tio_data = calloc(1, tio->data_size);
+	if (!queue->tio_data) {
+		PERROR("malloc(%zu)", tio->data_size);
+		err = -errno;
+		goto fail;
+	}
+
+	queue->tio = tio;
+
+	if (tio->tio_setup) {
+		err = tio->tio_setup(queue, queue->size);
+		if (err)
+			goto fail;
+	}
+
+	DPRINTF("I/O queue driver: %s\n", tio->name);
+
+	return 0;
+
+fail:
+	tapdisk_queue_free_io(queue);
+	return err;
+}
+
+int
+tapdisk_init_queue(struct tqueue *queue, int size,
+		   int drv, struct tfilter *filter)
+{
+	int err;
+
+	memset(queue, 0, sizeof(struct tqueue));
+
+	queue->size       = size;
+	queue->filter     = filter;
+	queue->sync_fd    = -1;
+	queue->sync_event = -1;
+	INIT_LIST_HEAD(&queue->sync_entry);
+	INIT_LIST_HEAD(&queue->space_entry);
+
+	if (!size)
+		return 0;
+
+	err = tapdisk_queue_init_io(queue, drv);
+	if (err)
+		goto fail;
+
+	err = tapdisk_queue_open_sync(queue);
+	if (err)
+		goto fail;
+
+	err = tapdisk_queue_open_space(queue);
+	if (err)
+		goto fail;
+
+	queue->iocbs = calloc(size, sizeof(struct iocb *));
+	if (!queue->iocbs) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = opio_init(&queue->opioctx, size);
+	if (err)
+		goto fail;
+
+	return 0;
+
+ fail:
+	tapdisk_free_queue(queue);
+	return err;
+}
+
+/*
+ * Nothing may be in flight while the tio changes, so this waits for
+ * the queue to drain. A failed resize leaves the old size in place.
+ */
+static void
+queue_resize(struct tqueue *queue)
+{
+	struct opioctx opioctx;
+	struct iocb **iocbs;
+	int size, err;
+
+	size = queue->resize;
+	if (!size || queue->queued || queue->tiocbs_pending)
+		return;
+
+	queue->resize = 0;
+
+	err = -EOPNOTSUPP;
+	if (!queue->tio->tio_resize)
+		goto fail;
+
+	iocbs = realloc(queue->iocbs, size * sizeof(struct iocb *));
+	if (!iocbs) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	queue->iocbs = iocbs;
+
+	err = opio_init(&opioctx, size);
+	if (err)
+		goto fail;
+
+	err = queue->tio->tio_resize(queue, size);
+	if (err) {
+		opio_free(&opioctx);
+		goto fail;
+	}
+
+	opio_free(&queue->opioctx);
+	queue->opioctx = opioctx;
+
+	DPRINTF("I/O queue resized from %d to %d\n", queue->size, size);
+	queue->size = size;
+	return;
+
+fail:
+	EPRINTF("I/O queue stays at %d, resizing to %d: %d\n",
+		queue->size, size, err);
+}
+
+/*
+ * Grows the queue to @size tiocbs in flight. Never shrinks it.
+ */
+void
+tapdisk_queue_resize(struct tqueue *queue, int size)
+{
+	if (!queue->tio || size <= queue->size || size <= queue->resize)
+		return;
+
+	queue->resize = size;
+	queue_deferred_tiocbs(queue);
+}
+
+void
+tapdisk_free_queue(struct tqueue *queue)
+{
+	tapdisk_queue_close_space(queue);
+	tapdisk_queue_close_sync(queue);
+	tapdisk_queue_free_io(queue);
+
+	free(queue->iocbs);
+	queue->iocbs = NULL;
+
+	opio_free(&queue->opioctx);
+}
+
+void 
+tapdisk_debug_queue(struct tqueue *queue)
+{
+	struct tiocb *tiocb = queue->deferred.head;
+
+	WARN("TAPDISK QUEUE:\n");
+	WARN("size: %d, tio: %s, queued: %d, iocbs_pending: %d, "
+	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
+	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
+	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("tiocbs_syncing: %d, commits: %"PRIu64", syncs: %"PRIu64"\n",
+	     queue->tiocbs_syncing, syncer.commits, syncer.syncs);
+	WARN("tiocbs_space: %d, jobs: %"PRIu64", chunks: %"PRIu64"\n",
+	     queue->tiocbs_space, tspace.jobs, tspace.chunks);
+
+	if (tiocb) {
+		WARN("deferred:\n");
+		for (; tiocb != NULL; tiocb = tiocb->next) {
+			struct iocb *io = &tiocb->iocb;
+			WARN("%s of %lu bytes at %lld\n",
+			     (io->aio_lio_opcode == IO_CMD_PWRITE ?
+			      "write" : "read"),
+			     io->u.c.nbytes, io->u.c.offset);
+		}
+	}
+}
+
+void
+tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
+		   long long offset, td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &tiocb->iocb;
+
+	if (rw)
+		io_prep_pwrite(iocb, fd, buf, size, offset);
+	else
+		io_prep_pread(iocb, fd, buf, size, offset);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+	tiocb->cmd  = TIO_CMD_AIO;
+}
+
+void
+tapdisk_prep_flush_tiocb(struct tiocb *tiocb, int fd,
+			 td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &tiocb->iocb;
+
+	io_prep_fdsync(iocb, fd);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+	tiocb->cmd  = TIO_CMD_AIO;
+	tiocb->err  = 0;
+}
+
+void
+tapdisk_prep_fallocate_tiocb(struct tiocb *tiocb, int fd, int mode,
+			     long long offset, size_t len,
+			     td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &tiocb->iocb;
+
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_fildes     = fd;
+	iocb->aio_lio_opcode = IO_CMD_NOOP;
+	iocb->u.c.offset     = offset;
+	iocb->u.c.nbytes     = len;
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+	tiocb->cmd  = TIO_CMD_FALLOCATE;
+	tiocb->err  = 0;
+	tiocb->mode = mode;
+}
+
+void
+tapdisk_prep_discard_tiocb(struct tiocb *tiocb, int fd,
+			   long long offset, size_t len,
+			   td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_fallocate_tiocb(tiocb, fd, 0, offset, len, cb, arg);
+	tiocb->cmd = TIO_CMD_DISCARD;
+}
+
+void
+tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
+{
+	if (tiocb->cmd != TIO_CMD_AIO) {
+		tlist_add(&queue->space, tiocb);
+		queue->tiocbs_space++;
+		return;
+	}
+
+	if (tiocb->iocb.aio_lio_opcode == IO_CMD_FDSYNC) {
+		tlist_add(&queue->flushes, tiocb);
+		queue->tiocbs_syncing++;
+		return;
+	}
+
+	if (!tapdisk_queue_full(queue))
+		queue_tiocb(queue, tiocb);
+	else
+		defer_tiocb(queue, tiocb);
+}
+
+
+void
+tapdisk_queue_register_fd(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_register_fd)
+		queue->tio->tio_register_fd(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_fd(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_fd)
+		queue->tio->tio_unregister_fd(queue, fd);
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *base, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_buffer(queue, base, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *base)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, base);
+}
+
+/*
+ * fail_tiocbs may queue more tiocbs
+ */
+int
+tapdisk_submit_tiocbs(struct tqueue *queue)
+{
+	if (queue->flushes.head)
+		tapdisk_queue_sync(queue);
+
+	if (queue->space.head)
+		tapdisk_queue_space(queue);
+
 	return queue->tio->tio_submit(queue);
 }
 
@@ -20,6 +20,7 @@
 
 #include <libaio.h>
 
+#include "list.h"
 #include "io-optimize.h"
 #include "scheduler.h"
 
@@ -28,6 +29,12 @@ struct tfilter;
 
 typedef void (*td_queue_callback_t)(void *arg, struct tiocb *, int err);
 
+/* what a tiocb asks for, beyond the aio opcode */
+enum {
+	TIO_CMD_AIO       = 0,	/* read, write or flush */
+	TIO_CMD_FALLOCATE = 1,
+	TIO_CMD_DISCARD   = 2,
+};
 
 struct tiocb {
 	td_queue_callback_t   cb;
@@ -35,6 +42,15 @@ struct tiocb {
 
 	struct iocb           iocb;
 	struct tiocb         *next;
+
+	/* TIO_CMD_*, set by the prep functions */
+	int                   cmd;
+
+	/* result of a flush or fallocate, set by its helper thread */
+	int                   err;
+
+	/* fallocate mode, for fallocate tiocbs */
+	int                   mode;
 };
 
 struct tlist {
@@ -45,6 +61,10 @@ struct tlist {
 struct tqueue {
 	int                   size;
 
+	/* size asked for by tapdisk_queue_resize, applied once idle.
+	 * new tiocbs are deferred meanwhile, so the tio drains. */
+	int                   resize;
+
 	const struct tio     *tio;
 	void                 *tio_data;
 
@@ -71,6 +91,27 @@ struct tqueue {
 	struct tfilter       *filter;
 
 	uint64_t              deferrals;
+
+	/* flushes bypass the tio and go to the group commit.
+	 * they are staged here and handed over on the next submit.
+	 * the remaining lists belong to the syncer, under its lock:
+	 * waiting for the next commit, in it, and completed. */
+	struct tlist          flushes;
+	struct tlist          sync_wait;
+	struct tlist          syncing;
+	struct tlist          synced;
+	int                   tiocbs_syncing;
+	int                   sync_fd;
+	event_id_t            sync_event;
+	struct list_head      sync_entry;
+
+	/* fallocates and discards go to the space thread, staged the same way.
+	 * it reports back through sync_fd as well. */
+	struct tlist          space;
+	struct tlist          space_wait;
+	struct tlist          space_done;
+	int                   tiocbs_space;
+	struct list_head      space_entry;
 };
 
 struct tio {
@@ -80,11 +121,22 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: start over with room for qlen, nothing in flight */
+	int  (*tio_resize)   (struct tqueue *queue, int qlen);
+
+	/* optional: pin image fds and data buffers for cheaper submission */
+	void (*tio_register_fd)       (struct tqueue *queue, int fd);
+	void (*tio_unregister_fd)     (struct tqueue *queue, int fd);
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *base, size_t size);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *base);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -99,16 +151,26 @@ enum {
 #define tapdisk_queue_count(q) ((q)->queued)
 #define tapdisk_queue_empty(q) ((q)->queued == 0)
 #define tapdisk_queue_full(q)  \
-	(((q)->tiocbs_pending + (q)->queued) >= (q)->size)
+	((q)->resize || ((q)->tiocbs_pending + (q)->queued) >= (q)->size)
 int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
+void tapdisk_queue_resize(struct tqueue *, int size);
 void tapdisk_debug_queue(struct tqueue *);
 void tapdisk_queue_tiocb(struct tqueue *, struct tiocb *);
+void tapdisk_queue_register_fd(struct tqueue *, int);
+void tapdisk_queue_unregister_fd(struct tqueue *, int);
+int tapdisk_queue_register_buffer(struct tqueue *, void *, size_t);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *);
 int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
+void tapdisk_prep_flush_tiocb(struct tiocb *, int, td_queue_callback_t, void *);
+void tapdisk_prep_fallocate_tiocb(struct tiocb *, int, int, long long, size_t,
+				  td_queue_callback_t, void *);
+void tapdisk_prep_discard_tiocb(struct tiocb *, int, long long, size_t,
+				td_queue_callback_t, void *);
 
 #endif
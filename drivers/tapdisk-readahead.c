@@ -0,0 +1,578 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Sequential readahead per VBD. Guest reads are matched against a
+ * few streams; once a stream has run long enough, aligned chunks
+ * ahead of it are read through the chain into a small buffer pool,
+ * and later reads are copied out of the pool instead of going to
+ * the images. A read hitting a chunk still in flight waits for it.
+ *
+ * Writes and discards drop any chunk they overlap, both when they
+ * are issued and when they complete, so the pool never serves data
+ * older than a write the guest has seen complete.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libvhd.h"
+#include "tapdisk-log.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-readahead.h"
+
+#define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
+
+/*
+ * Chunks divide the 2M vhd block, so a prefetch never spans blocks
+ * which may live in different images of the chain.
+ */
+#define TD_RA_CHUNK_SHIFT       8    /* 128k */
+#define TD_RA_CHUNK_SECS        (1 << TD_RA_CHUNK_SHIFT)
+#define TD_RA_BLOCK_CHUNKS      (4096 >> TD_RA_CHUNK_SHIFT)
+
+#define TD_RA_BUFFERS           16
+#define TD_RA_WAITERS           64
+#define TD_RA_STREAMS           4
+
+#define TD_RA_TRIGGER           TD_RA_CHUNK_SECS /* secs */
+#define TD_RA_WINDOW_MIN        2                /* chunks */
+#define TD_RA_WINDOW_MAX        8
+#define TD_RA_IDLE              (4 * TD_RA_BUFFERS)
+
+#define TD_RA_VBD_IDLE          (TD_VBD_DEAD               | \
+				 TD_VBD_CLOSED             | \
+				 TD_VBD_QUIESCE_REQUESTED  | \
+				 TD_VBD_QUIESCED           | \
+				 TD_VBD_PAUSE_REQUESTED    | \
+				 TD_VBD_PAUSED             | \
+				 TD_VBD_SHUTDOWN_REQUESTED)
+
+enum {
+	TD_RA_FREE = 0,
+	TD_RA_PENDING,
+	TD_RA_STALE,
+	TD_RA_READY,
+};
+
+struct td_ra_waiter {
+	td_request_t                treq;
+	struct list_head            next;
+};
+
+struct td_ra_buffer {
+	td_readahead_t             *ra;
+
+	int                         state;
+	int                         used;
+	int                         done;
+	uint64_t                    chunk;
+	uint64_t                    tick;
+
+	int                         stream;
+	uint64_t                    gen;
+
+	char                       *data;
+	struct td_iovec             iov;
+	td_vbd_request_t            vreq;
+
+	struct list_head            waiters;
+	struct list_head            next;
+};
+
+struct td_ra_stream {
+	td_sector_t                 next;
+	uint64_t                    run;
+	int                         window;
+	uint64_t                    tick;
+	uint64_t                    gen;
+};
+
+struct td_readahead {
+	td_vbd_t                   *vbd;
+
+	char                       *pool;
+	int                         disabled;
+
+	struct td_ra_buffer         buffers[TD_RA_BUFFERS];
+	struct list_head            lru;
+
+	struct td_ra_waiter         waiters[TD_RA_WAITERS];
+	struct list_head            free_waiters;
+
+	struct td_ra_stream         streams[TD_RA_STREAMS];
+	uint64_t                    tick;
+
+	uint64_t                    issued;
+	uint64_t                    hits;
+	uint64_t                    waits;
+	uint64_t                    wasted;
+	uint64_t                    stale;
+	uint64_t                    errors;
+};
+
+static void tapdisk_readahead_complete(td_vbd_request_t *, int, void *, int);
+
+td_readahead_t *
+tapdisk_readahead_create(td_vbd_t *vbd)
+{
+	td_readahead_t *ra;
+	int i;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return NULL;
+
+	ra->vbd = vbd;
+	INIT_LIST_HEAD(&ra->lru);
+	INIT_LIST_HEAD(&ra->free_waiters);
+
+	for (i = 0; i < TD_RA_BUFFERS; i++) {
+		struct td_ra_buffer *buf = &ra->buffers[i];
+
+		buf->ra = ra;
+		INIT_LIST_HEAD(&buf->waiters);
+		INIT_LIST_HEAD(&buf->next);
+	}
+
+	for (i = 0; i < TD_RA_WAITERS; i++)
+		list_add_tail(&ra->waiters[i].next, &ra->free_waiters);
+
+	return ra;
+}
+
+/*
+ * Only called with the queue quiesced. Prefetches not yet issued, or
+ * completed but not yet returned, are taken off the vbd lists.
+ */
+void
+tapdisk_readahead_destroy(td_readahead_t *ra)
+{
+	td_vbd_t *vbd;
+	int i;
+
+	if (!ra)
+		return;
+
+	vbd = ra->vbd;
+
+	for (i = 0; i < TD_RA_BUFFERS; i++) {
+		struct td_ra_buffer *buf = &ra->buffers[i];
+
+		if (buf->state != TD_RA_PENDING && buf->state != TD_RA_STALE)
+			continue;
+
+		if (buf->vreq.list_head == &vbd->pending_requests) {
+			EPRINTF("%s: readahead of chunk %"PRIu64" in flight, "
+				"leaking buffer pool\n", vbd->name, buf->chunk);
+			return;
+		}
+	}
+
+	for (i = 0; i < TD_RA_BUFFERS; i++) {
+		struct td_ra_buffer *buf = &ra->buffers[i];
+
+		if (buf->state != TD_RA_PENDING && buf->state != TD_RA_STALE)
+			continue;
+
+		list_del_init(&buf->vreq.next);
+		buf->vreq.list_head = NULL;
+		vbd->returned++;
+	}
+
+	free(ra->pool);
+	free(ra);
+}
+
+int
+tapdisk_readahead_owns(td_vbd_request_t *vreq)
+{
+	return vreq->cb == tapdisk_readahead_complete;
+}
+
+static int
+tapdisk_readahead_alloc_pool(td_readahead_t *ra)
+{
+	size_t size;
+	void *pool;
+	int i, err;
+
+	size = (size_t)TD_RA_BUFFERS * TD_RA_CHUNK_SECS << SECTOR_SHIFT;
+
+	err = posix_memalign(&pool, 4096, size);
+	if (err) {
+		ERR(-err, "%s: no memory for readahead, disabling\n",
+		    ra->vbd->name);
+		ra->disabled = 1;
+		return -err;
+	}
+
+	ra->pool = pool;
+	for (i = 0; i < TD_RA_BUFFERS; i++)
+		ra->buffers[i].data = ra->pool +
+			((size_t)i * TD_RA_CHUNK_SECS << SECTOR_SHIFT);
+
+	return 0;
+}
+
+static struct td_ra_buffer *
+tapdisk_readahead_lookup(td_readahead_t *ra, uint64_t chunk)
+{
+	int i;
+
+	for (i = 0; i < TD_RA_BUFFERS; i++) {
+		struct td_ra_buffer *buf = &ra->buffers[i];
+
+		if (buf->state != TD_RA_FREE && buf->chunk == chunk)
+			return buf;
+	}
+
+	return NULL;
+}
+
+static void
+tapdisk_readahead_release(struct td_ra_buffer *buf)
+{
+	list_del_init(&buf->next);
+	buf->state = TD_RA_FREE;
+	buf->used  = 0;
+	buf->done  = 0;
+}
+
+static struct td_ra_stream *
+tapdisk_readahead_buffer_stream(struct td_ra_buffer *buf)
+{
+	struct td_ra_stream *s = &buf->ra->streams[buf->stream];
+
+	return s->gen == buf->gen ? s : NULL;
+}
+
+/*
+ * An unused chunk is worth keeping while its stream is alive and
+ * has yet to reach it.
+ */
+static int
+tapdisk_readahead_evictable(struct td_ra_buffer *buf)
+{
+	td_readahead_t *ra = buf->ra;
+	struct td_ra_stream *s;
+
+	if (buf->used)
+		return 1;
+
+	if (ra->tick - buf->tick > TD_RA_IDLE)
+		return 1;
+
+	s = tapdisk_readahead_buffer_stream(buf);
+	if (!s)
+		return 1;
+
+	return (buf->chunk + 1) << TD_RA_CHUNK_SHIFT <= s->next;
+}
+
+static struct td_ra_buffer *
+tapdisk_readahead_get_buffer(td_readahead_t *ra)
+{
+	struct td_ra_buffer *buf;
+	struct td_ra_stream *s;
+	int i;
+
+	for (i = 0; i < TD_RA_BUFFERS; i++)
+		if (ra->buffers[i].state == TD_RA_FREE)
+			return &ra->buffers[i];
+
+	list_for_each_entry(buf, &ra->lru, next) {
+		if (!tapdisk_readahead_evictable(buf))
+			continue;
+
+		if (!buf->used) {
+			ra->wasted++;
+			s = tapdisk_readahead_buffer_stream(buf);
+			if (s)
+				s->window = MAX(TD_RA_WINDOW_MIN, s->window / 2);
+		}
+
+		tapdisk_readahead_release(buf);
+		return buf;
+	}
+
+	return NULL;
+}
+
+static void
+tapdisk_readahead_issue(td_readahead_t *ra, struct td_ra_buffer *buf,
+			struct td_ra_stream *s, uint64_t chunk)
+{
+	td_vbd_request_t *vreq = &buf->vreq;
+
+	buf->state  = TD_RA_PENDING;
+	buf->chunk  = chunk;
+	buf->tick   = ra->tick;
+	buf->stream = s - ra->streams;
+	buf->gen    = s->gen;
+
+	buf->iov.base = buf->data;
+	buf->iov.secs = TD_RA_CHUNK_SECS;
+
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = chunk << TD_RA_CHUNK_SHIFT;
+	vreq->iov    = &buf->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = tapdisk_readahead_complete;
+	vreq->token  = buf;
+	vreq->name   = "readahead";
+	INIT_LIST_HEAD(&vreq->next);
+
+	tapdisk_vbd_queue_request(ra->vbd, vreq);
+	ra->issued++;
+}
+
+/*
+ * Keep a stream's window of chunks in flight or ready. Until a
+ * stream has run a full block it stays inside the block it is in:
+ * short runs tend to end where a file does, and the next block may
+ * not even come from the same image.
+ */
+static void
+tapdisk_readahead_prefetch(td_readahead_t *ra, struct td_ra_stream *s)
+{
+	td_vbd_t *vbd = ra->vbd;
+	struct td_ra_buffer *buf;
+	uint64_t chunk, end;
+	td_image_t *image;
+
+	if (ra->disabled || td_flag_test(vbd->state, TD_RA_VBD_IDLE))
+		return;
+
+	image = tapdisk_vbd_first_image(vbd);
+	if (!image)
+		return;
+
+	if (!ra->pool && tapdisk_readahead_alloc_pool(ra))
+		return;
+
+	chunk = s->next >> TD_RA_CHUNK_SHIFT;
+	end   = chunk + s->window;
+
+	if (s->run < TD_RA_BLOCK_CHUNKS << TD_RA_CHUNK_SHIFT)
+		end = MIN(end, (chunk / TD_RA_BLOCK_CHUNKS + 1) *
+			  TD_RA_BLOCK_CHUNKS);
+
+	end = MIN(end, image->info.size >> TD_RA_CHUNK_SHIFT);
+
+	for (; chunk < end; chunk++) {
+		if (tapdisk_readahead_lookup(ra, chunk))
+			continue;
+
+		buf = tapdisk_readahead_get_buffer(ra);
+		if (!buf)
+			break;
+
+		tapdisk_readahead_issue(ra, buf, s, chunk);
+	}
+}
+
+void
+tapdisk_readahead_observe(td_readahead_t *ra, td_sector_t sec, int secs)
+{
+	struct td_ra_stream *s, *victim;
+	int i;
+
+	ra->tick++;
+	victim = NULL;
+
+	for (i = 0; i < TD_RA_STREAMS; i++) {
+		s = &ra->streams[i];
+
+		if (s->run && s->next == sec)
+			goto found;
+
+		if (!victim || s->tick < victim->tick)
+			victim = s;
+	}
+
+	s = victim;
+	s->run    = 0;
+	s->window = TD_RA_WINDOW_MIN;
+	s->gen++;
+
+found:
+	s->next  = sec + secs;
+	s->run  += secs;
+	s->tick  = ra->tick;
+
+	if (s->run >= TD_RA_TRIGGER)
+		tapdisk_readahead_prefetch(ra, s);
+}
+
+/*
+ * Serve the head of @treq from the pool. Returns the number of
+ * sectors taken over, which are completed through treq.cb once the
+ * data is in place, or 0 if the caller must read them itself.
+ */
+int
+tapdisk_readahead_read(td_readahead_t *ra, td_request_t treq)
+{
+	struct td_ra_buffer *buf;
+	struct td_ra_waiter *w;
+	struct td_ra_stream *s;
+	uint64_t chunk;
+	int off, secs;
+
+	chunk = treq.sec >> TD_RA_CHUNK_SHIFT;
+
+	buf = tapdisk_readahead_lookup(ra, chunk);
+	if (!buf || buf->state == TD_RA_STALE)
+		return 0;
+
+	off  = treq.sec - (chunk << TD_RA_CHUNK_SHIFT);
+	secs = MIN(treq.secs, TD_RA_CHUNK_SECS - off);
+	treq.secs = secs;
+
+	if (buf->state == TD_RA_PENDING) {
+		if (list_empty(&ra->free_waiters))
+			return 0;
+
+		w = list_entry(ra->free_waiters.next, struct td_ra_waiter, next);
+		list_move_tail(&w->next, &buf->waiters);
+		w->treq = treq;
+		ra->waits += secs;
+	} else {
+		memcpy(treq.buf, buf->data + (off << SECTOR_SHIFT),
+		       secs << SECTOR_SHIFT);
+		list_move_tail(&buf->next, &ra->lru);
+		ra->hits += secs;
+	}
+
+	if (!buf->used) {
+		buf->used = 1;
+		s = tapdisk_readahead_buffer_stream(buf);
+		if (s)
+			s->window = MIN(TD_RA_WINDOW_MAX, s->window + 1);
+	}
+
+	if (off + secs == TD_RA_CHUNK_SECS)
+		buf->done = 1;
+
+	if (buf->state == TD_RA_READY) {
+		if (buf->done)
+			tapdisk_readahead_release(buf);
+		td_complete_request(treq, 0);
+	}
+
+	return secs;
+}
+
+static void
+tapdisk_readahead_complete(td_vbd_request_t *vreq, int error,
+			   void *token, int final)
+{
+	struct td_ra_buffer *buf = token;
+	td_readahead_t *ra = buf->ra;
+	struct td_ra_waiter *w, *tmp;
+	td_request_t treq;
+	int err, off;
+
+	err = error;
+	if (err)
+		ra->errors++;
+	else if (buf->state == TD_RA_STALE)
+		err = -EAGAIN;
+
+	if (!err) {
+		buf->state = TD_RA_READY;
+		buf->tick  = ra->tick;
+		list_add_tail(&buf->next, &ra->lru);
+	}
+
+	list_for_each_entry_safe(w, tmp, &buf->waiters, next) {
+		treq = w->treq;
+		list_move(&w->next, &ra->free_waiters);
+
+		if (!err) {
+			off = treq.sec - (buf->chunk << TD_RA_CHUNK_SHIFT);
+			memcpy(treq.buf, buf->data + (off << SECTOR_SHIFT),
+			       treq.secs << SECTOR_SHIFT);
+		}
+
+		td_complete_request(treq, err);
+	}
+
+	if (err || buf->done)
+		tapdisk_readahead_release(buf);
+}
+
+/*
+ * Drop every chunk overlapping a range the guest changes. Chunks
+ * still in flight are marked stale and dropped on completion, their
+ * waiters going back to the chain.
+ */
+void
+tapdisk_readahead_invalidate(td_readahead_t *ra, td_sector_t sec, int secs)
+{
+	uint64_t first, last;
+	int i;
+
+	if (secs <= 0)
+		return;
+
+	first = sec >> TD_RA_CHUNK_SHIFT;
+	last  = (sec + secs - 1) >> TD_RA_CHUNK_SHIFT;
+
+	for (i = 0; i < TD_RA_BUFFERS; i++) {
+		struct td_ra_buffer *buf = &ra->buffers[i];
+
+		if (buf->state == TD_RA_FREE || buf->state == TD_RA_STALE)
+			continue;
+
+		if (buf->chunk < first || buf->chunk > last)
+			continue;
+
+		ra->stale++;
+
+		if (buf->state == TD_RA_PENDING)
+			buf->state = TD_RA_STALE;
+		else
+			tapdisk_readahead_release(buf);
+	}
+}
+
+void
+tapdisk_readahead_stats(td_readahead_t *ra, td_stats_t *st)
+{
+	int i;
+
+	tapdisk_stats_field(st, "pool", "d", ra->pool != NULL);
+	tapdisk_stats_field(st, "issued", "llu", ra->issued);
+	tapdisk_stats_field(st, "hits", "llu", ra->hits);
+	tapdisk_stats_field(st, "waits", "llu", ra->waits);
+	tapdisk_stats_field(st, "wasted", "llu", ra->wasted);
+	tapdisk_stats_field(st, "stale", "llu", ra->stale);
+	tapdisk_stats_field(st, "errors", "llu", ra->errors);
+
+	tapdisk_stats_field(st, "windows", "[");
+	for (i = 0; i < TD_RA_STREAMS; i++)
+		tapdisk_stats_val(st, "d", ra->streams[i].window);
+	tapdisk_stats_leave(st, ']');
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __TAPDISK_READAHEAD_H__
+#define __TAPDISK_READAHEAD_H__
+
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+typedef struct td_readahead td_readahead_t;
+
+td_readahead_t *tapdisk_readahead_create(td_vbd_t *);
+void tapdisk_readahead_destroy(td_readahead_t *);
+
+int tapdisk_readahead_owns(td_vbd_request_t *);
+void tapdisk_readahead_observe(td_readahead_t *, td_sector_t, int);
+int tapdisk_readahead_read(td_readahead_t *, td_request_t);
+void tapdisk_readahead_invalidate(td_readahead_t *, td_sector_t, int);
+
+void tapdisk_readahead_stats(td_readahead_t *, td_stats_t *);
+
+#endif /* __TAPDISK_READAHEAD_H__ */
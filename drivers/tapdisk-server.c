@@ -23,6 +23,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -31,26 +33,245 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-log.h"
+#include "libaio-compat.h"
 
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 
-#define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
-
-typedef struct tapdisk_server {
+/*
+ * Room for the data I/O of a default vbd, and some for metadata. The
+ * queue grows as vbds with deeper queues or bigger requests open.
+ */
+#define TAPDISK_TIOCBS_EXTRA        50
+#define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + TAPDISK_TIOCBS_EXTRA)
+
+/*
+ * A worker is one event loop: a scheduler, an I/O queue and the vbds
+ * it serves. The main thread always runs one (control, logging, and
+ * all vbds by default). With tapdisk_server_set_workers(), vbds are
+ * spread over additional threads, by uuid. Everything a vbd touches
+ * then lives on its worker; other threads get there through
+ * tapdisk_server_call() and tapdisk_server_post().
+ */
+struct tapdisk_worker {
+	int                          id;
+	pthread_t                    thread;
+	int                          cpu;
 	int                          run;
-	struct list_head             vbds;
+	int                          started;
+	int                          err;
+
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+	int                          tiocbs;  /* reserved by vbds */
+	struct list_head             vbds;
+
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
+	struct list_head             calls;
+	int                          call_fd;
+	event_id_t                   call_event;
+	volatile sig_atomic_t        signal;
+};
+
+typedef struct tapdisk_server {
+	int                          run;
+	int                          n_vbds;
+	tapdisk_worker_t             main;
+	tapdisk_worker_t            *workers;
+	int                          n_workers;
+	int                          workers_requested;
+	int                         *cpus;
+	int                          n_cpus;
 	char                        *name;
 	char                        *ident;
 	int                          facility;
 } tapdisk_server_t;
 
 static tapdisk_server_t server;
+static __thread tapdisk_worker_t *tapdisk_worker;
 
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	list_for_each_entry_safe(vbd, tmp,				\
+				 &tapdisk_server_worker()->vbds, next)
+
+#define tapdisk_server_for_each_worker(w)				\
+	for ((w) = server.workers;					\
+	     (w) < server.workers + server.n_workers; (w)++)
+
+/*
+ * run flags are written on one thread and polled on others. Writers
+ * store, then kick the loop they stop through its eventfd.
+ */
+#define tapdisk_run_get(_p)          __atomic_load_n(_p, __ATOMIC_ACQUIRE)
+#define tapdisk_run_set(_p, _v)      __atomic_store_n(_p, _v, __ATOMIC_RELEASE)
+
+static void tapdisk_server_handle_signal(int);
+
+tapdisk_worker_t *
+tapdisk_server_worker(void)
+{
+	return tapdisk_worker ? : &server.main;
+}
+
+tapdisk_worker_t *
+tapdisk_server_vbd_worker(td_uuid_t uuid)
+{
+	if (!server.n_workers)
+		return &server.main;
+
+	return &server.workers[uuid % server.n_workers];
+}
+
+static void
+tapdisk_worker_kick(tapdisk_worker_t *w)
+{
+	uint64_t val = 1;
+	int gcc = write(w->call_fd, &val, sizeof(val));
+	if (gcc) {};
+}
+
+void
+tapdisk_server_post(tapdisk_worker_t *w, struct tapdisk_call *call)
+{
+	pthread_mutex_lock(&w->lock);
+	if (!call->queued) {
+		call->queued = 1;
+		call->done   = 0;
+		list_add_tail(&call->entry, &w->calls);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	tapdisk_worker_kick(w);
+}
+
+/*
+ * Run fn on worker w and wait for it. Direct call if w is us.
+ */
+void
+tapdisk_server_call(tapdisk_worker_t *w, void (*fn)(void *), void *arg)
+{
+	struct tapdisk_call call;
+
+	if (w == tapdisk_server_worker()) {
+		fn(arg);
+		return;
+	}
+
+	memset(&call, 0, sizeof(call));
+	call.fn  = fn;
+	call.arg = arg;
+	INIT_LIST_HEAD(&call.entry);
+
+	tapdisk_server_post(w, &call);
+
+	pthread_mutex_lock(&w->lock);
+	while (!call.done)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void
+tapdisk_server_call_all(void (*fn)(void *), void *arg)
+{
+	tapdisk_worker_t *w;
+
+	tapdisk_server_call(&server.main, fn, arg);
+
+	tapdisk_server_for_each_worker(w)
+		tapdisk_server_call(w, fn, arg);
+}
+
+static void
+tapdisk_worker_call_event(event_id_t id, char mode, void *private)
+{
+	tapdisk_worker_t *w = private;
+	struct tapdisk_call *call;
+	uint64_t val;
+	int sig;
+
+	sig = read(w->call_fd, &val, sizeof(val));
+	if (sig) {};
+
+	sig = __atomic_exchange_n(&w->signal, 0, __ATOMIC_ACQ_REL);
+	if (sig)
+		tapdisk_server_handle_signal(sig);
+
+	pthread_mutex_lock(&w->lock);
+
+	while (!list_empty(&w->calls)) {
+		call = list_entry(w->calls.next, struct tapdisk_call, entry);
+		list_del_init(&call->entry);
+		call->queued = 0;
+		pthread_mutex_unlock(&w->lock);
+
+		call->fn(call->arg);
+
+		pthread_mutex_lock(&w->lock);
+		call->done = 1;
+		pthread_cond_broadcast(&w->cond);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void
+tapdisk_worker_close_calls(tapdisk_worker_t *w)
+{
+	if (w->call_event >= 0) {
+		scheduler_unregister_event(&w->scheduler, w->call_event);
+		w->call_event = -1;
+	}
+
+	if (w->call_fd >= 0) {
+		close(w->call_fd);
+		w->call_fd = -1;
+	}
+}
+
+static int
+tapdisk_worker_open_calls(tapdisk_worker_t *w)
+{
+	int err;
+
+	w->call_fd = tapdisk_sys_eventfd(0);
+	if (w->call_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	w->call_event =
+		scheduler_register_event(&w->scheduler,
+					 SCHEDULER_POLL_READ_FD,
+					 w->call_fd, 0,
+					 tapdisk_worker_call_event, w);
+	if (w->call_event < 0) {
+		err = w->call_event;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_worker_close_calls(w);
+	return err;
+}
+
+static void
+tapdisk_worker_init(tapdisk_worker_t *w, int id)
+{
+	memset(w, 0, sizeof(*w));
+
+	w->id         = id;
+	w->cpu        = -1;
+	w->call_fd    = -1;
+	w->call_event = -1;
+
+	INIT_LIST_HEAD(&w->vbds);
+	INIT_LIST_HEAD(&w->calls);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+}
 
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
@@ -73,7 +294,7 @@ tapdisk_server_get_shared_image(td_image_t *image)
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
-	return &server.vbds;
+	return &tapdisk_server_worker()->vbds;
 }
 
 td_vbd_t *
@@ -91,7 +312,8 @@ tapdisk_server_get_vbd(uint16_t uuid)
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	list_add_tail(&vbd->next, &tapdisk_server_worker()->vbds);
+	__sync_add_and_fetch(&server.n_vbds, 1);
 }
 
 void
@@ -99,13 +321,58 @@ tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	__sync_sub_and_fetch(&server.n_vbds, 1);
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&tapdisk_server_worker()->aio_queue, tiocb);
+}
+
+void
+tapdisk_server_register_file(int fd)
+{
+	tapdisk_queue_register_fd(&tapdisk_server_worker()->aio_queue, fd);
+}
+
+void
+tapdisk_server_unregister_file(int fd)
+{
+	tapdisk_queue_unregister_fd(&tapdisk_server_worker()->aio_queue, fd);
+}
+
+/*
+ * Vbds reserve a tiocb for every segment they may have in flight. The
+ * queue of their worker grows to hold all of them, and stays that big.
+ */
+void
+tapdisk_server_reserve_tiocbs(int n)
+{
+	tapdisk_worker_t *w = tapdisk_server_worker();
+
+	w->tiocbs += n;
+	tapdisk_queue_resize(&w->aio_queue,
+			     w->tiocbs + TAPDISK_TIOCBS_EXTRA);
+}
+
+void
+tapdisk_server_release_tiocbs(int n)
+{
+	tapdisk_server_worker()->tiocbs -= n;
+}
+
+int
+tapdisk_server_register_buffer(void *base, size_t size)
+{
+	return tapdisk_queue_register_buffer(&tapdisk_server_worker()->aio_queue, base, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *base)
+{
+	tapdisk_queue_unregister_buffer(&tapdisk_server_worker()->aio_queue, base);
 }
 
 void
@@ -113,7 +380,7 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&tapdisk_server_worker()->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -125,34 +392,37 @@ tapdisk_server_debug(void)
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	if (!server.n_vbds) {
+		tapdisk_run_set(&server.run, 0);
+		if (tapdisk_server_worker() != &server.main)
+			tapdisk_worker_kick(&server.main);
+	}
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&tapdisk_server_worker()->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&tapdisk_server_worker()->scheduler, event);
 }
 
 void
 tapdisk_server_mask_event(event_id_t event, int masked)
 {
-	return scheduler_mask_event(&server.scheduler, event, masked);
+	return scheduler_mask_event(&tapdisk_server_worker()->scheduler, event, masked);
 }
 
 void
-tapdisk_server_set_max_timeout(int seconds)
+tapdisk_server_set_max_timeout(int ms)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&tapdisk_server_worker()->scheduler, ms);
 }
 
 static void
@@ -165,12 +435,13 @@ static void
 tapdisk_server_set_retry_timeout(void)
 {
 	td_vbd_t *vbd, *tmp;
+	int timeout;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		if (tapdisk_vbd_retry_needed(vbd)) {
-			tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
-			return;
-		}
+	tapdisk_server_for_each_vbd(vbd, tmp) {
+		timeout = tapdisk_vbd_retry_timeout(vbd);
+		if (timeout >= 0)
+			tapdisk_server_set_max_timeout(timeout);
+	}
 }
 
 static void
@@ -188,7 +459,7 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&tapdisk_server_worker()->aio_queue);
 }
 
 static void
@@ -233,14 +504,23 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+	int err;
+
+	err = tapdisk_init_queue(&tapdisk_server_worker()->aio_queue, TAPDISK_TIOCBS,
+				 TIO_DRV_URING, NULL);
+	if (!err)
+		return 0;
+
+	DPRINTF("io_uring unavailable (%d), using libaio\n", err);
+
+	return tapdisk_init_queue(&tapdisk_server_worker()->aio_queue, TAPDISK_TIOCBS,
 				  TIO_DRV_LIO, NULL);
 }
 
 static void
 tapdisk_server_close_aio(void)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_free_queue(&tapdisk_server_worker()->aio_queue);
 }
 
 int
@@ -287,11 +567,227 @@ tapdisk_server_close_tlog(void)
 	tlog_close();
 }
 
+static void *
+tapdisk_worker_thread(void *arg)
+{
+	tapdisk_worker_t *w = arg;
+	int err;
+
+	tapdisk_worker = w;
+
+	err = scheduler_initialize(&w->scheduler);
+	if (err)
+		goto out;
+
+	err = tapdisk_worker_open_calls(w);
+	if (err)
+		goto out;
+
+	err = tapdisk_server_init_aio();
+	if (err)
+		goto out;
+
+out:
+	pthread_mutex_lock(&w->lock);
+	w->err     = err;
+	w->started = 1;
+	tapdisk_run_set(&w->run, !err);
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	/* NB. workers outlive server.run, until tapdisk_worker_stop() */
+	while (tapdisk_run_get(&w->run))
+		tapdisk_server_iterate();
+
+	tapdisk_server_close_aio();
+	tapdisk_worker_close_calls(w);
+	scheduler_destroy(&w->scheduler);
+
+	return NULL;
+}
+
+static int
+tapdisk_worker_start(tapdisk_worker_t *w)
+{
+	cpu_set_t cpus;
+	int err;
+
+	err = pthread_create(&w->thread, NULL, tapdisk_worker_thread, w);
+	if (err)
+		return -err;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->started)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	if (w->err) {
+		pthread_join(w->thread, NULL);
+		return w->err;
+	}
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+
+		err = pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus);
+		if (err)
+			EPRINTF("worker %d: cannot bind to cpu %d: %d\n",
+				w->id, w->cpu, -err);
+	}
+
+	DPRINTF("worker %d: started, cpu %d\n", w->id, w->cpu);
+
+	return 0;
+}
+
+static void
+tapdisk_worker_stop(tapdisk_worker_t *w)
+{
+	tapdisk_run_set(&w->run, 0);
+	tapdisk_worker_kick(w);
+	pthread_join(w->thread, NULL);
+}
+
+static void
+tapdisk_server_stop_workers(void)
+{
+	tapdisk_worker_t *w;
+
+	if (!server.workers)
+		return;
+
+	tapdisk_server_for_each_worker(w)
+		if (tapdisk_run_get(&w->run))
+			tapdisk_worker_stop(w);
+
+	free(server.workers);
+	server.workers   = NULL;
+	server.n_workers = 0;
+}
+
+static int
+tapdisk_server_start_workers(int n)
+{
+	sigset_t set, oset;
+	int i, err = 0;
+
+	if (!n)
+		return 0;
+
+	server.workers = calloc(n, sizeof(tapdisk_worker_t));
+	if (!server.workers)
+		return -ENOMEM;
+
+	/* signals go to the main loop, which forwards them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+	for (i = 0; i < n; i++) {
+		tapdisk_worker_t *w = &server.workers[i];
+
+		tapdisk_worker_init(w, i + 1);
+		if (server.n_cpus)
+			w->cpu = server.cpus[i % server.n_cpus];
+
+		err = tapdisk_worker_start(w);
+		if (err)
+			break;
+
+		server.n_workers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	if (err)
+		tapdisk_server_stop_workers();
+
+	return err;
+}
+
+static int
+tapdisk_server_parse_cpus(const char *list)
+{
+	const char *p = list;
+	char *end;
+	long lo, hi;
+	int *cpus;
+
+	while (*p) {
+		lo = strtol(p, &end, 10);
+		if (end == p || lo < 0)
+			return -EINVAL;
+
+		hi = lo;
+		if (*end == '-') {
+			p  = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo)
+				return -EINVAL;
+		}
+
+		for (; lo <= hi; lo++) {
+			cpus = realloc(server.cpus,
+				       (server.n_cpus + 1) * sizeof(int));
+			if (!cpus)
+				return -ENOMEM;
+
+			server.cpus = cpus;
+			server.cpus[server.n_cpus++] = lo;
+		}
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -EINVAL;
+
+		p = end;
+	}
+
+	return 0;
+}
+
+/*
+ * Serve vbds from n additional threads, pinned round-robin to the
+ * cpus in list (e.g. "2-5,8"), if given. Call before
+ * tapdisk_server_complete().
+ */
+int
+tapdisk_server_set_workers(int n, const char *list)
+{
+	int err;
+
+	if (n < 0)
+		return -EINVAL;
+
+	server.workers_requested = n;
+
+	if (list) {
+		err = tapdisk_server_parse_cpus(list);
+		if (err) {
+			free(server.cpus);
+			server.cpus   = NULL;
+			server.n_cpus = 0;
+			return err;
+		}
+	}
+
+	return 0;
+}
+
 static void
 tapdisk_server_close(void)
 {
+	tapdisk_server_stop_workers();
 	tapdisk_server_close_tlog();
 	tapdisk_server_close_aio();
+	tapdisk_worker_close_calls(&server.main);
+
+	free(server.cpus);
+	server.cpus   = NULL;
+	server.n_cpus = 0;
 }
 
 void
@@ -303,7 +799,7 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&tapdisk_server_worker()->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
@@ -319,12 +815,12 @@ tapdisk_server_iterate(void)
 static void
 __tapdisk_server_run(void)
 {
-	while (server.run)
+	while (tapdisk_run_get(&server.run))
 		tapdisk_server_iterate();
 }
 
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_handle_signal(int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	static int xfsz_error_sent = 0;
@@ -352,13 +848,46 @@ tapdisk_server_signal_handler(int signal)
 	}
 }
 
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	tapdisk_worker_t *self, *w;
+
+	self = tapdisk_server_worker();
+
+	tapdisk_server_handle_signal(signal);
+
+	/* workers pick these up from their call event */
+	if (self != &server.main) {
+		__atomic_store_n(&server.main.signal, signal, __ATOMIC_RELEASE);
+		tapdisk_worker_kick(&server.main);
+	}
+
+	tapdisk_server_for_each_worker(w)
+		if (w != self && tapdisk_run_get(&w->run)) {
+			__atomic_store_n(&w->signal, signal, __ATOMIC_RELEASE);
+			tapdisk_worker_kick(w);
+		}
+}
+
 int
 tapdisk_server_init(void)
 {
+	int err;
+
 	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
+	tapdisk_worker_init(&server.main, 0);
+
+	err = scheduler_initialize(&server.main.scheduler);
+	if (err)
+		return err;
+
+	err = tapdisk_worker_open_calls(&server.main);
+	if (err)
+		return err;
 
-	scheduler_initialize(&server.scheduler);
+	DBG(TLOG_INFO, "using %s scheduler\n",
+	    scheduler_backend_name(&server.main.scheduler));
 
 	return 0;
 }
@@ -376,11 +905,19 @@ tapdisk_server_complete(void)
 	if (err)
 		goto fail;
 
-	server.run = 1;
+	tapdisk_run_set(&server.run, 1);
+
+	err = tapdisk_server_start_workers(server.workers_requested);
+	if (err) {
+		EPRINTF("failed to start %d workers: %d\n",
+			server.workers_requested, err);
+		goto fail;
+	}
 
 	return 0;
 
 fail:
+	tapdisk_run_set(&server.run, 0);
 	tapdisk_server_close_tlog();
 	tapdisk_server_close_aio();
 	return err;
@@ -391,7 +928,9 @@ tapdisk_server_initialize(const char *read, const char *write)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
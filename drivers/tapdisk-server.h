@@ -22,6 +22,16 @@
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
 
+typedef struct tapdisk_worker tapdisk_worker_t;
+
+struct tapdisk_call {
+	void                (*fn)(void *);
+	void                 *arg;
+	int                   queued;
+	int                   done;
+	struct list_head      entry;
+};
+
 struct tap_disk *tapdisk_server_find_driver_interface(int);
 
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
@@ -32,6 +42,12 @@ void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+void tapdisk_server_register_file(int);
+void tapdisk_server_unregister_file(int);
+void tapdisk_server_reserve_tiocbs(int);
+void tapdisk_server_release_tiocbs(int);
+int tapdisk_server_register_buffer(void *, size_t);
+void tapdisk_server_unregister_buffer(void *);
 
 void tapdisk_server_check_state(void);
 
@@ -40,6 +56,13 @@ void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_mask_event(event_id_t, int);
 void tapdisk_server_set_max_timeout(int);
 
+tapdisk_worker_t *tapdisk_server_worker(void);
+tapdisk_worker_t *tapdisk_server_vbd_worker(td_uuid_t);
+void tapdisk_server_call(tapdisk_worker_t *, void (*)(void *), void *);
+void tapdisk_server_call_all(void (*)(void *), void *);
+void tapdisk_server_post(tapdisk_worker_t *, struct tapdisk_call *);
+int tapdisk_server_set_workers(int, const char *);
+
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(const char *, const char *);
 int tapdisk_server_complete(void);
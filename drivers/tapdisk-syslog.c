@@ -307,8 +307,8 @@ tapdisk_syslog_vsprintf(char *buf, size_t size,
  * In summary, no attempts to mask service blackouts in here.
  */
 
-int
-tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+static int
+__tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
 {
 	struct timeval now;
 	size_t len;
@@ -364,6 +364,18 @@ fail:
 	return err;
 }
 
+int
+tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+{
+	int err;
+
+	pthread_mutex_lock(&log->lock);
+	err = __tapdisk_vsyslog(log, prio, fmt, ap);
+	pthread_mutex_unlock(&log->lock);
+
+	return err;
+}
+
 int
 tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...)
 {
@@ -396,10 +408,14 @@ tapdisk_syslog_sock_event(event_id_t id, char mode, void *private)
 {
 	td_syslog_t *log = private;
 
+	pthread_mutex_lock(&log->lock);
+
 	tapdisk_syslog_ring_dispatch(log);
 
 	if (log->cons == log->prod)
 		tapdisk_syslog_sock_mask(log);
+
+	pthread_mutex_unlock(&log->lock);
 }
 
 static void
@@ -412,12 +428,12 @@ __tapdisk_syslog_sock_init(td_syslog_t *log)
 static void
 tapdisk_syslog_sock_close(td_syslog_t *log)
 {
-	if (log->sock >= 0)
-		close(log->sock);
-
 	if (log->event_id >= 0)
 		tapdisk_server_unregister_event(log->event_id);
 
+	if (log->sock >= 0)
+		close(log->sock);
+
 	__tapdisk_syslog_sock_init(log);
 }
 
@@ -484,17 +500,41 @@ tapdisk_syslog_sock_mask(td_syslog_t *log)
 }
 
 static void
-tapdisk_syslog_sock_unmask(td_syslog_t *log)
+tapdisk_syslog_sock_kick(void *private)
 {
+	td_syslog_t *log = private;
+
 	tapdisk_server_mask_event(log->event_id, 0);
 }
 
+static void
+tapdisk_syslog_sock_unmask(td_syslog_t *log)
+{
+	if (log->owner == tapdisk_server_worker())
+		tapdisk_server_mask_event(log->event_id, 0);
+	else
+		tapdisk_server_post(log->owner, &log->kick);
+}
+
 void
 __tapdisk_syslog_init(td_syslog_t *log)
 {
+	pthread_mutexattr_t attr;
+
 	memset(log, 0, sizeof(td_syslog_t));
 	__tapdisk_syslog_sock_init(log);
 	__tapdisk_syslog_ring_init(log);
+
+	/* NB. dispatch may log a warning about dropped messages */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&log->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	log->owner    = tapdisk_server_worker();
+	log->kick.fn  = tapdisk_syslog_sock_kick;
+	log->kick.arg = log;
+	INIT_LIST_HEAD(&log->kick.entry);
 }
 
 void
@@ -20,7 +20,9 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "scheduler.h"
+#include "tapdisk-server.h"
 
 typedef struct _td_syslog td_syslog_t;
 
@@ -55,6 +57,11 @@ struct _td_syslog {
 	int              oom;
 	struct timeval   oom_tv;
 
+	/* workers log too; the socket lives on the opening thread */
+	pthread_mutex_t  lock;
+	tapdisk_worker_t *owner;
+	struct tapdisk_call kick;
+
 	struct _td_syslog_stats stats;
 };
 
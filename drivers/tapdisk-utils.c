@@ -24,7 +24,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
@@ -232,6 +234,77 @@ tapdisk_get_image_size(int fd, uint64_t *_sectors, uint32_t *_sector_size)
 	return 0;
 }
 
+/*
+ * Releases the storage backing @len bytes at @offset of @fd: punches
+ * a hole into regular files, discards the range on block devices.
+ */
+int
+tapdisk_discard_range(int fd, uint64_t offset, uint64_t len)
+{
+	struct stat st;
+	uint64_t range[2];
+	int err;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		range[0] = offset;
+		range[1] = len;
+		err = ioctl(fd, BLKDISCARD, range);
+	} else
+		err = fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+				offset, len);
+
+	return err ? -errno : 0;
+}
+
+/*
+ * Like tapdisk_discard_range, but the range must read back as zeros
+ * afterwards. Only holes in regular files promise that, so block
+ * devices get -EOPNOTSUPP.
+ */
+int
+tapdisk_zero_range(int fd, uint64_t offset, uint64_t len)
+{
+	struct stat st;
+	int err;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (!S_ISREG(st.st_mode))
+		return -EOPNOTSUPP;
+
+	err = fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			offset, len);
+
+	return err ? -errno : 0;
+}
+
+/*
+ * Tests whether @len bytes at @buf are all zero. Non-zero data is
+ * usually caught by the first few words; a zero head is compared
+ * against the rest of the buffer with memcmp, which libc vectorizes.
+ */
+int
+tapdisk_buffer_is_zero(const void *buf, size_t len)
+{
+	const uint64_t *w = buf;
+	const size_t head = 8 * sizeof(uint64_t);
+	size_t i;
+
+	if (len < head || ((unsigned long)buf & (sizeof(uint64_t) - 1)))
+		return !len || (!*(const char *)buf &&
+				!memcmp(buf, (const char *)buf + 1, len - 1));
+
+	for (i = 0; i < head / sizeof(uint64_t); i++)
+		if (w[i])
+			return 0;
+
+	return !memcmp(buf, (const char *)buf + head, len - head);
+}
+
 #ifdef __linux__
 
 int tapdisk_linux_version(void)
@@ -33,6 +33,9 @@ int tapdisk_set_resource_limits(void);
 int tapdisk_namedup(char **, const char *);
 int tapdisk_parse_disk_type(const char *, char **, int *);
 int tapdisk_get_image_size(int, uint64_t *, uint32_t *);
+int tapdisk_discard_range(int, uint64_t, uint64_t);
+int tapdisk_zero_range(int, uint64_t, uint64_t);
+int tapdisk_buffer_is_zero(const void *, size_t);
 int tapdisk_linux_version(void);
 uint64_t ntohll(uint64_t);
 #define htonll ntohll
@@ -40,6 +40,8 @@
 #include "tapdisk-stats.h"
 #include "tapdisk-storage.h"
 #include "tapdisk-nbdserver.h"
+#include "tapdisk-readahead.h"
+#include "block-lcache.h"
 
 #define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -89,8 +91,10 @@ tapdisk_vbd_create(uint16_t uuid)
 		return NULL;
 	}
 
-	vbd->uuid        = uuid;
-	vbd->req_timeout = TD_VBD_REQUEST_TIMEOUT;
+	vbd->uuid         = uuid;
+	vbd->req_timeout  = TD_VBD_REQUEST_TIMEOUT;
+	vbd->queue_depth  = MAX_REQUESTS;
+	vbd->max_segments = MAX_SEGMENTS_PER_REQ;
 
 	INIT_LIST_HEAD(&vbd->images);
 	INIT_LIST_HEAD(&vbd->new_requests);
@@ -127,11 +131,187 @@ tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 	return tapdisk_image_validate_chain(&vbd->images);
 }
 
+/*
+ * chain resolution cache
+ */
+
+static void
+tapdisk_vbd_resolve_free(td_vbd_t *vbd)
+{
+	struct td_vbd_resolve *r = &vbd->resolve;
+
+	free(r->chain);
+	r->chain = NULL;
+	free(r->map);
+	r->map   = NULL;
+	r->depth = 0;
+	r->gen++;
+}
+
+/*
+ * (Re)build the resolution cache for the current chain. Reads may
+ * only skip images which forward what they don't hold, so the cache
+ * stays off for filters and for anything but vhd above the base.
+ */
+static void
+tapdisk_vbd_resolve_init(td_vbd_t *vbd)
+{
+	struct td_vbd_resolve *r = &vbd->resolve;
+	td_image_t *image, *tmp;
+	int depth;
+
+	tapdisk_vbd_resolve_free(vbd);
+
+	depth = 0;
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (tapdisk_disk_types[image->type]->flags & DISK_TYPE_FILTER)
+			return;
+		if (!tapdisk_vbd_is_last_image(vbd, image) &&
+		    image->type != DISK_TYPE_VHD)
+			return;
+		depth++;
+	}
+
+	if (depth < 2)
+		return;
+
+	r->chain = calloc(depth, sizeof(td_image_t *));
+	r->map   = calloc(TD_VBD_RESOLVE_ENTRIES,
+			  sizeof(struct td_vbd_resolve_entry));
+	if (!r->chain || !r->map) {
+		EPRINTF("%s: no memory for chain resolution cache\n",
+			vbd->name);
+		tapdisk_vbd_resolve_free(vbd);
+		return;
+	}
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		r->chain[r->depth++] = image;
+}
+
+static inline struct td_vbd_resolve_entry *
+tapdisk_vbd_resolve_entry(struct td_vbd_resolve *r, uint64_t chunk)
+{
+	return &r->map[chunk & (TD_VBD_RESOLVE_ENTRIES - 1)];
+}
+
+/*
+ * Drop every chunk overlapping a range the leaf is changing. Bumping
+ * the generation keeps reads already in flight from putting back what
+ * they found before the change.
+ */
+static void
+tapdisk_vbd_resolve_invalidate(td_vbd_t *vbd, td_sector_t sec, int secs)
+{
+	struct td_vbd_resolve *r = &vbd->resolve;
+	struct td_vbd_resolve_entry *e;
+	uint64_t chunk, last;
+
+	r->gen++;
+
+	if (!r->map || secs <= 0)
+		return;
+
+	chunk = sec >> TD_VBD_RESOLVE_SHIFT;
+	last  = (sec + secs - 1) >> TD_VBD_RESOLVE_SHIFT;
+
+	if (last - chunk >= TD_VBD_RESOLVE_ENTRIES) {
+		memset(r->map, 0, TD_VBD_RESOLVE_ENTRIES * sizeof(*e));
+		return;
+	}
+
+	for (; chunk <= last; chunk++) {
+		e = tapdisk_vbd_resolve_entry(r, chunk);
+		if (e->tag == chunk + 1)
+			e->tag = 0;
+	}
+}
+
+/*
+ * Record the image which completed a read, for each chunk the
+ * request covered in full.
+ */
+static void
+tapdisk_vbd_resolve_record(td_vbd_t *vbd, td_vbd_request_t *vreq,
+			   td_request_t treq)
+{
+	struct td_vbd_resolve *r = &vbd->resolve;
+	struct td_vbd_resolve_entry *e;
+	uint64_t chunk, end;
+	int depth;
+
+	if (!r->map || vreq->resolve_gen != r->gen)
+		return;
+
+	for (depth = 0; depth < r->depth; depth++)
+		if (r->chain[depth] == treq.image)
+			break;
+
+	if (depth == r->depth)
+		return;
+
+	chunk = (treq.sec + (1 << TD_VBD_RESOLVE_SHIFT) - 1)
+		>> TD_VBD_RESOLVE_SHIFT;
+	end   = (treq.sec + treq.secs) >> TD_VBD_RESOLVE_SHIFT;
+
+	for (; chunk < end; chunk++) {
+		e = tapdisk_vbd_resolve_entry(r, chunk);
+		e->tag   = chunk + 1;
+		e->depth = depth;
+	}
+}
+
+/*
+ * Pick the image to queue a read on: the shallowest image known to
+ * serve any chunk of it, or the leaf if some chunk is unknown.
+ */
+static td_image_t *
+tapdisk_vbd_resolve_read(td_vbd_t *vbd, td_request_t treq)
+{
+	struct td_vbd_resolve *r = &vbd->resolve;
+	struct td_vbd_resolve_entry *e;
+	uint64_t chunk, last;
+	td_image_t *target;
+	int depth;
+
+	if (!r->map)
+		return treq.image;
+
+	chunk = treq.sec >> TD_VBD_RESOLVE_SHIFT;
+	last  = (treq.sec + treq.secs - 1) >> TD_VBD_RESOLVE_SHIFT;
+	depth = r->depth - 1;
+
+	for (; chunk <= last && depth; chunk++) {
+		e = tapdisk_vbd_resolve_entry(r, chunk);
+		if (e->tag != chunk + 1) {
+			r->misses++;
+			return treq.image;
+		}
+		depth = MIN(depth, e->depth);
+	}
+
+	r->hits++;
+
+	target = r->chain[depth];
+	if (!depth || treq.sec + treq.secs > target->info.size)
+		return treq.image;
+
+	r->skipped += depth;
+	return target;
+}
+
 void
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
+	tapdisk_vbd_resolve_free(vbd);
+	tapdisk_readahead_destroy(vbd->readahead);
+	vbd->readahead = NULL;
+	vbd->lcache    = NULL;
 	tapdisk_image_close_chain(&vbd->images);
 
+	tapdisk_server_release_tiocbs(vbd->tiocbs);
+	vbd->tiocbs = 0;
+
 	if (vbd->secondary &&
 	    vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR) {
 		tapdisk_image_close(vbd->secondary);
@@ -253,6 +433,7 @@ fail:
 done:
 	/* insert cache right above leaf image */
 	list_add(&cache->next, &parent->next);
+	vbd->lcache = cache->driver;
 
 	DPRINTF("Added local_cache driver\n");
 	return 0;
@@ -430,8 +611,43 @@ fail:
 	return err;
 }
 
+/*
+ * Set the number of requests the VBD may have in flight, and the
+ * largest request (in bytes) it accepts. Images opened afterwards
+ * size their request pools accordingly. Zero keeps the default.
+ * Request sizes beyond a ring slot are clamped to it.
+ */
 int
-tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_devnum)
+tapdisk_vbd_set_queue_limits(td_vbd_t *vbd, unsigned int depth,
+			     size_t max_request_size)
+{
+	unsigned int segs;
+
+	if (!list_empty(&vbd->images))
+		return -EBUSY;
+
+	if (!depth)
+		depth = MAX_REQUESTS;
+
+	segs = MAX_SEGMENTS_PER_REQ;
+	if (max_request_size) {
+		size_t page_size = sysconf(_SC_PAGE_SIZE);
+		segs = (max_request_size + page_size - 1) / page_size;
+	}
+
+	if (depth > TD_MAX_QUEUE_DEPTH)
+		return -EINVAL;
+
+	segs = MIN(segs, TD_MAX_SEGMENTS_PER_REQ);
+
+	vbd->queue_depth  = depth;
+	vbd->max_segments = segs;
+
+	return 0;
+}
+
+static int
+__tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_devnum)
 {
 	char *tmp = vbd->name;
 	int err;
@@ -493,6 +709,12 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
+	tapdisk_vbd_resolve_init(vbd);
+
+	vbd->readahead = tapdisk_readahead_create(vbd);
+	if (!vbd->readahead)
+		EPRINTF("%s: no memory for readahead\n", vbd->name);
+
 	if (tmp != vbd->name)
 		free(tmp);
 
@@ -512,6 +734,29 @@ fail:
 	return err;
 }
 
+int
+tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_devnum)
+{
+	int err;
+
+	tapdisk_driver_set_queue_limits(vbd->queue_depth, vbd->max_segments);
+	tapdisk_driver_set_cache_size(vbd->cache_size);
+	tapdisk_driver_set_prealloc(vbd->prealloc, vbd->prealloc_low);
+	tapdisk_driver_set_lcache_size(vbd->lcache_size);
+	err = __tapdisk_vbd_open_vdi(vbd, name, flags, prt_devnum);
+	tapdisk_driver_set_queue_limits(0, 0);
+	tapdisk_driver_set_cache_size(0);
+	tapdisk_driver_set_prealloc(0, 0);
+	tapdisk_driver_set_lcache_size(0);
+
+	if (!err && !vbd->tiocbs) {
+		vbd->tiocbs = vbd->queue_depth * vbd->max_segments;
+		tapdisk_server_reserve_tiocbs(vbd->tiocbs);
+	}
+
+	return err;
+}
+
 void
 tapdisk_vbd_detach(td_vbd_t *vbd)
 {
@@ -691,6 +936,44 @@ tapdisk_vbd_get_disk_info(td_vbd_t *vbd, td_disk_info_t *info)
 	return 0;
 }
 
+/*
+ * Discard and flush are offered to the frontend only if every writable
+ * image in the chain, filters included, implements them. Read-only
+ * parents are never discarded into, and have nothing to flush.
+ */
+int
+tapdisk_vbd_op_supported(td_vbd_t *vbd, int op)
+{
+	const struct tap_disk *ops;
+	td_image_t *image, *tmp;
+	int supported = 0;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (td_flag_test(image->flags, TD_OPEN_RDONLY))
+			continue;
+
+		if (!image->driver)
+			return 0;
+
+		ops = image->driver->ops;
+
+		switch (op) {
+		case TD_OP_DISCARD:
+			if (!ops->td_queue_discard)
+				return 0;
+			break;
+		case TD_OP_FLUSH:
+			if (!ops->td_queue_flush)
+				return 0;
+			break;
+		}
+
+		supported = 1;
+	}
+
+	return supported;
+}
+
 static int
 tapdisk_vbd_queue_ready(td_vbd_t *vbd)
 {
@@ -700,11 +983,42 @@ tapdisk_vbd_queue_ready(td_vbd_t *vbd)
 		!td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED));
 }
 
+/*
+ * Milliseconds until the next request on this vbd wants reissuing,
+ * or -1 if nothing is waiting.
+ */
 int
-tapdisk_vbd_retry_needed(td_vbd_t *vbd)
+tapdisk_vbd_retry_timeout(td_vbd_t *vbd)
 {
-	return !(list_empty(&vbd->failed_requests) &&
-		 list_empty(&vbd->new_requests));
+	td_vbd_request_t *vreq, *tmp;
+	struct timeval now, delta;
+	int timeout, ms;
+
+	if (list_empty(&vbd->failed_requests) &&
+	    list_empty(&vbd->new_requests))
+		return -1;
+
+	if (!tapdisk_vbd_queue_ready(vbd))
+		return TD_VBD_RETRY_INTERVAL;
+
+	if (!list_empty(&vbd->new_requests))
+		return TD_VBD_BUSY_RETRY_INTERVAL;
+
+	timeout = TD_VBD_RETRY_INTERVAL;
+	gettimeofday(&now, NULL);
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests) {
+		if (vreq->error == -EBUSY)
+			return TD_VBD_BUSY_RETRY_INTERVAL;
+
+		timersub(&now, &vreq->last_try, &delta);
+		ms = TD_VBD_RETRY_INTERVAL -
+			(delta.tv_sec * 1000 + delta.tv_usec / 1000);
+		if (ms < timeout)
+			timeout = ms;
+	}
+
+	return timeout > 0 ? timeout : 0;
 }
 
 int
@@ -767,6 +1081,23 @@ tapdisk_vbd_open_image(td_vbd_t *vbd, td_image_t *image)
 }
 #endif
 
+/*
+ * Images holding writes back from their parents get to finish them
+ * while the queue still runs, so a paused chain is complete, e.g. for
+ * a snapshot.
+ */
+static int
+tapdisk_vbd_drain(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+	int err = 0;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		err = td_drain(image, vbd) ? : err;
+
+	return err;
+}
+
 int
 tapdisk_vbd_pause(td_vbd_t *vbd)
 {
@@ -779,6 +1110,10 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 	if (vbd->nbdserver)
 		tapdisk_nbdserver_pause(vbd->nbdserver);
 
+	err = tapdisk_vbd_drain(vbd);
+	if (err)
+		return err;
+
 	err = tapdisk_vbd_quiesce_queue(vbd);
 	if (err)
 		return err;
@@ -918,7 +1253,7 @@ tapdisk_vbd_check_progress(td_vbd_t *vbd)
 		return;
 	}
 
-	tapdisk_server_set_max_timeout(TD_VBD_WATCHDOG_TIMEOUT - diff);
+	tapdisk_server_set_max_timeout((TD_VBD_WATCHDOG_TIMEOUT - diff) * 1000);
 }
 
 /*
@@ -949,6 +1284,7 @@ tapdisk_vbd_request_should_retry(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	case ENOSYS:
 	case ESTALE:
 	case ENOSPC:
+	case EOPNOTSUPP:
 		return 0;
 	}
 
@@ -970,6 +1306,23 @@ tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	}
 }
 
+static const char *
+tapdisk_vbd_op_name(int op)
+{
+	switch (op) {
+	case TD_OP_READ:
+		return "read";
+	case TD_OP_WRITE:
+		return "write";
+	case TD_OP_DISCARD:
+		return "discard";
+	case TD_OP_FLUSH:
+		return "flush";
+	}
+
+	return "unknown";
+}
+
 static void
 FIXME_maybe_count_enospc_redirect(td_vbd_t *vbd, td_request_t treq)
 {
@@ -991,8 +1344,22 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	vbd->secs_pending  -= treq.secs;
 	vreq->secs_pending -= treq.secs;
 
-	if (err != -EBUSY) {
-		int write = treq.op == TD_OP_WRITE;
+	switch (treq.op) {
+	case TD_OP_READ:
+		if (!err)
+			tapdisk_vbd_resolve_record(vbd, vreq, treq);
+		break;
+	case TD_OP_WRITE:
+	case TD_OP_DISCARD:
+		tapdisk_vbd_resolve_invalidate(vbd, treq.sec, treq.secs);
+		if (vbd->readahead)
+			tapdisk_readahead_invalidate(vbd->readahead,
+						     treq.sec, treq.secs);
+		break;
+	}
+
+	if (err != -EBUSY && treq.op != TD_OP_FLUSH) {
+		int write = treq.op != TD_OP_READ;
 		td_sector_count_add(&image->stats.hits, treq.secs, write);
 		if (err)
 			td_sector_count_add(&image->stats.fail,
@@ -1008,7 +1375,7 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 				tlog_drv_error(image->driver, err,
 					       "req %s: %s 0x%04x secs @ 0x%08"PRIx64" - %s",
 					       vreq->name,
-					       (treq.op == TD_OP_WRITE ? "write" : "read"),
+					       tapdisk_vbd_op_name(treq.op),
 					       treq.secs, treq.sec, strerror(abs(err)));
 			vbd->errors++;
 		}
@@ -1030,8 +1397,12 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	vreq->submitting++;
 
+	if (treq.op == TD_OP_READ)
+		vbd->resolve.hops++;
+
 	if (tapdisk_vbd_is_last_image(vbd, image)) {
-		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+		if (treq.op == TD_OP_READ)
+			memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
 		td_complete_request(treq, 0);
 		goto done;
 	}
@@ -1047,12 +1418,14 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 			int secs    = parent->info.size - treq.sec;
 			clone.sec  += secs;
 			clone.secs -= secs;
-			clone.buf  += (secs << SECTOR_SHIFT);
+			if (clone.buf)
+				clone.buf += (secs << SECTOR_SHIFT);
 			treq.secs   = secs;
 		} else
 			treq.secs   = 0;
 
-		memset(clone.buf, 0, clone.secs << SECTOR_SHIFT);
+		if (treq.op == TD_OP_READ)
+			memset(clone.buf, 0, clone.secs << SECTOR_SHIFT);
 		td_complete_request(clone, 0);
 
 		if (!treq.secs)
@@ -1067,6 +1440,14 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 	case TD_OP_READ:
 		td_queue_read(parent, treq);
 		break;
+
+	case TD_OP_DISCARD:
+		td_queue_discard(parent, treq);
+		break;
+
+	case TD_OP_FLUSH:
+		td_queue_flush(parent, treq);
+		break;
 	}
 
 done:
@@ -1125,6 +1506,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
 			signal_enospc(vbd);
 		}
+		tapdisk_vbd_resolve_init(vbd);
 	}
 
 	if (res != 0)
@@ -1145,6 +1527,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			vbd->secondary = NULL;
 			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
 		}
+		tapdisk_vbd_resolve_init(vbd);
 	}
 
 	DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08"PRIx64
@@ -1155,6 +1538,62 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 	__tapdisk_vbd_complete_td_request(vbd, vreq, treq, res);
 }
 
+/*
+ * Sectors served by readahead complete here. If the prefetch went
+ * stale or failed, they are read from the chain after all.
+ */
+static void
+tapdisk_vbd_complete_readahead(td_request_t treq, int res)
+{
+	td_vbd_request_t *vreq = treq.vreq;
+	td_vbd_t *vbd = vreq->vbd;
+
+	tapdisk_vbd_mark_progress(vbd);
+
+	if (res) {
+		vreq->submitting++;
+		treq.cb    = tapdisk_vbd_complete_td_request;
+		treq.image = tapdisk_vbd_resolve_read(vbd, treq);
+		td_queue_read(treq.image, treq);
+		vreq->submitting--;
+	} else {
+		vbd->secs_pending  -= treq.secs;
+		vreq->secs_pending -= treq.secs;
+	}
+
+	tapdisk_vbd_complete_vbd_request(vbd, vreq);
+}
+
+/*
+ * Take what readahead holds of a guest read, and queue the rest
+ * on the chain.
+ */
+static void
+tapdisk_vbd_queue_read(td_vbd_t *vbd, td_request_t treq, int readahead)
+{
+	td_request_t clone;
+	int secs;
+
+	while (readahead && vbd->readahead && treq.secs) {
+		clone    = treq;
+		clone.cb = tapdisk_vbd_complete_readahead;
+
+		secs = tapdisk_readahead_read(vbd->readahead, clone);
+		if (!secs)
+			break;
+
+		treq.sec  += secs;
+		treq.secs -= secs;
+		treq.buf  += secs << SECTOR_SHIFT;
+	}
+
+	if (!treq.secs)
+		return;
+
+	treq.image = tapdisk_vbd_resolve_read(vbd, treq);
+	td_queue_read(treq.image, treq);
+}
+
 static inline void
 queue_mirror_req(td_vbd_t *vbd, td_request_t clone)
 {
@@ -1192,6 +1631,26 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		goto fail;
 	}
 
+	if (vreq->op == TD_OP_WRITE || vreq->op == TD_OP_DISCARD) {
+		int secs = 0;
+
+		for (i = 0; i < vreq->iovcnt; i++)
+			secs += vreq->iov[i].secs;
+
+		tapdisk_vbd_resolve_invalidate(vbd, sec, secs);
+		if (vbd->readahead)
+			tapdisk_readahead_invalidate(vbd->readahead, sec, secs);
+		if (vbd->lcache) {
+			err = tapdisk_lcache_invalidate(vbd->lcache, vreq,
+							sec, secs);
+			if (err) {
+				vreq->error = err;
+				goto fail;
+			}
+		}
+	}
+	vreq->resolve_gen = vbd->resolve.gen;
+
 	for (i = 0; i < vreq->iovcnt; i++) {
 		struct td_iovec *iov = &vreq->iov[i];
 
@@ -1232,7 +1691,18 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 
 		case TD_OP_READ:
 			treq.op = TD_OP_READ;
-			td_queue_read(treq.image, treq);
+			tapdisk_vbd_queue_read(vbd, treq,
+					       !tapdisk_readahead_owns(vreq));
+			break;
+
+		case TD_OP_DISCARD:
+			treq.op = TD_OP_DISCARD;
+			td_queue_discard(treq.image, treq);
+			break;
+
+		case TD_OP_FLUSH:
+			treq.op = TD_OP_FLUSH;
+			td_queue_flush(treq.image, treq);
 			break;
 		}
 
@@ -1242,6 +1712,11 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		sec += iov->secs;
 	}
 
+	if (vreq->op == TD_OP_READ && vbd->readahead &&
+	    !tapdisk_readahead_owns(vreq))
+		tapdisk_readahead_observe(vbd->readahead, vreq->sec,
+					  sec - vreq->sec);
+
 	err = 0;
 
 out:
@@ -1283,9 +1758,14 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 			continue;
 		}
 
-		if (vreq->error != -EBUSY &&
-		    now.tv_sec - vreq->last_try.tv_sec < TD_VBD_RETRY_INTERVAL)
-			continue;
+		if (vreq->error != -EBUSY) {
+			struct timeval delta;
+
+			timersub(&now, &vreq->last_try, &delta);
+			if (delta.tv_sec * 1000 + delta.tv_usec / 1000 <
+			    TD_VBD_RETRY_INTERVAL)
+				continue;
+		}
 
 		vbd->retries++;
 		vreq->num_retries++;
@@ -1315,6 +1795,10 @@ tapdisk_vbd_count_new_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	struct td_iovec *iov;
 	int write;
 
+	/* discards and flushes move no data */
+	if (vreq->op == TD_OP_DISCARD || vreq->op == TD_OP_FLUSH)
+		return;
+
 	write = vreq->op == TD_OP_WRITE;
 
 	for (iov = &vreq->iov[0]; iov < &vreq->iov[vreq->iovcnt]; iov++)
@@ -1468,11 +1952,30 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 	tapdisk_stats_val(st, "llu", vbd->secs.wr);
 	tapdisk_stats_leave(st, ']');
 
+	tapdisk_stats_field(st, "queue", "[");
+	tapdisk_stats_val(st, "u", vbd->queue_depth);
+	tapdisk_stats_val(st, "u", vbd->max_segments);
+	tapdisk_stats_leave(st, ']');
+
 	tapdisk_stats_field(st, "images", "[");
 	tapdisk_vbd_for_each_image(vbd, image, next)
 		tapdisk_image_stats(image, st);
 	tapdisk_stats_leave(st, ']');
 
+	tapdisk_stats_field(st, "resolve", "{");
+	tapdisk_stats_field(st, "depth", "d", vbd->resolve.depth);
+	tapdisk_stats_field(st, "hits", "llu", vbd->resolve.hits);
+	tapdisk_stats_field(st, "misses", "llu", vbd->resolve.misses);
+	tapdisk_stats_field(st, "hops", "llu", vbd->resolve.hops);
+	tapdisk_stats_field(st, "skipped", "llu", vbd->resolve.skipped);
+	tapdisk_stats_leave(st, '}');
+
+	if (vbd->readahead) {
+		tapdisk_stats_field(st, "readahead", "{");
+		tapdisk_readahead_stats(vbd->readahead, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
 	if (vbd->tap) {
 		tapdisk_stats_field(st, "tap", "{");
 		tapdisk_blktap_stats(vbd->tap, st);
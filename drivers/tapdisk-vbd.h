@@ -27,7 +27,8 @@
 
 #define TD_VBD_REQUEST_TIMEOUT      120
 #define TD_VBD_MAX_RETRIES          100
-#define TD_VBD_RETRY_INTERVAL       1
+#define TD_VBD_RETRY_INTERVAL       1000 /* ms */
+#define TD_VBD_BUSY_RETRY_INTERVAL  10   /* ms */
 
 #define TD_VBD_DEAD                 0x0001
 #define TD_VBD_CLOSED               0x0002
@@ -43,7 +44,34 @@
 #define TD_VBD_SECONDARY_MIRROR     1
 #define TD_VBD_SECONDARY_STANDBY    2
 
+#define TD_VBD_RESOLVE_SHIFT        3    /* 4k chunks */
+#define TD_VBD_RESOLVE_ENTRIES      8192
+
 struct td_nbdserver;
+struct td_readahead;
+
+/*
+ * Remembers which image in the chain last served a read of each chunk,
+ * so later reads can be queued there instead of walking the chain.
+ * Only parents are read-only, so an entry stays good until the leaf
+ * writes to that chunk.
+ */
+struct td_vbd_resolve_entry {
+	uint64_t                    tag;   /* chunk + 1, 0 if empty */
+	int                         depth;
+};
+
+struct td_vbd_resolve {
+	td_image_t                **chain;
+	int                         depth;
+	struct td_vbd_resolve_entry *map;
+	uint64_t                    gen;
+
+	uint64_t                    hits;
+	uint64_t                    misses;
+	uint64_t                    hops;
+	uint64_t                    skipped;
+};
 
 struct td_vbd_handle {
 	char                       *name;
@@ -81,10 +109,16 @@ struct td_vbd_handle {
 	struct list_head            failed_requests;
 	struct list_head            completed_requests;
 
-	td_vbd_request_t            request_list[MAX_REQUESTS]; /* XXX */
-
 	struct list_head            next;
 
+	unsigned int                queue_depth;
+	unsigned int                max_segments;
+	int                         tiocbs;     /* reserved while open */
+	size_t                      cache_size; /* per image */
+	unsigned int                prealloc;   /* blocks */
+	unsigned int                prealloc_low;
+	uint64_t                    lcache_size; /* bytes, 0 for unbounded */
+
 	uint16_t                    req_timeout; /* in seconds */
 	struct timeval              ts;
 
@@ -97,6 +131,10 @@ struct td_vbd_handle {
 	td_sector_count_t           secs;
 
 	struct td_nbdserver        *nbdserver;
+
+	struct td_vbd_resolve       resolve;
+	struct td_readahead        *readahead;
+	td_driver_t                *lcache;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -157,6 +195,7 @@ int tapdisk_vbd_close(td_vbd_t *);
 
 int tapdisk_vbd_open_vdi(td_vbd_t *, const char *, td_flag_t, int);
 void tapdisk_vbd_close_vdi(td_vbd_t *);
+int tapdisk_vbd_set_queue_limits(td_vbd_t *, unsigned int, size_t);
 
 int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
 void tapdisk_vbd_detach(td_vbd_t *);
@@ -165,7 +204,8 @@ int tapdisk_vbd_queue_request(td_vbd_t *, td_vbd_request_t *);
 void tapdisk_vbd_forward_request(td_request_t);
 
 int tapdisk_vbd_get_disk_info(td_vbd_t *, td_disk_info_t *);
-int tapdisk_vbd_retry_needed(td_vbd_t *);
+int tapdisk_vbd_op_supported(td_vbd_t *, int);
+int tapdisk_vbd_retry_timeout(td_vbd_t *);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
 int tapdisk_vbd_start_queue(td_vbd_t *);
 int tapdisk_vbd_issue_requests(td_vbd_t *);
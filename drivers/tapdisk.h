@@ -34,6 +34,16 @@
  * the resulting iocbs to tapdisk using td_prep_[read,write]() and 
  * td_queue_tiocb().
  *
+ * Disks able to deallocate storage may also implement td_queue_discard(),
+ * and disks with a volatile write cache td_queue_flush(). Neither request
+ * carries a data buffer; a disk without the hook fails them with
+ * -EOPNOTSUPP. A flush addresses sector 0, count 1, which only serves as
+ * its reference count below.
+ *
+ * Disks holding writes back from their parents implement td_drain(),
+ * returning -EAGAIN until they wrote them out. A VBD pauses only once
+ * all its images drained.
+ *
  * NOTE: tapdisk uses the number of sectors submitted per request as a 
  * ref count.  Plugins must use the callback function to communicate the
  * completion -- or error -- of every sector submitted to them.
@@ -63,6 +73,14 @@
 
 #define TAPDISK_DATA_REQUESTS       (MAX_REQUESTS * MAX_SEGMENTS_PER_REQ)
 
+/*
+ * MAX_REQUESTS and MAX_SEGMENTS_PER_REQ are the per-VBD defaults. A
+ * VBD may be opened with a deeper queue, up to 256 requests. Requests
+ * may be made smaller, but not larger than a blktap ring slot.
+ */
+#define TD_MAX_QUEUE_DEPTH           256U
+#define TD_MAX_SEGMENTS_PER_REQ      MAX_SEGMENTS_PER_REQ
+
 //#define BLK_NOT_ALLOCATED            (-99)
 #define TD_NO_PARENT                 1
 
@@ -70,6 +88,8 @@
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
+#define TD_OP_DISCARD                2
+#define TD_OP_FLUSH                  3
 
 #define TD_OPEN_QUIET                0x00001
 #define TD_OPEN_QUERY                0x00002
@@ -84,6 +104,9 @@
 #define TD_OPEN_SECONDARY            0x00400
 #define TD_OPEN_STANDBY              0x00800
 #define TD_IGNORE_ENOSPC             0x01000
+#define TD_OPEN_LAZY_BAT             0x02000
+#define TD_OPEN_META_LOG             0x04000
+#define TD_OPEN_WRITE_BACK           0x08000
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
@@ -145,6 +168,7 @@ struct td_vbd_request {
 	int                         num_retries;
 	struct timeval		    ts;
 	struct timeval              last_try;
+	uint64_t                    resolve_gen;
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -181,8 +205,11 @@ struct tap_disk {
 	int (*td_validate_parent)    (td_driver_t *, td_driver_t *, td_flag_t);
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
+	void (*td_queue_discard)     (td_driver_t *, td_request_t);
+	void (*td_queue_flush)       (td_driver_t *, td_request_t);
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
+	int (*td_drain)              (td_driver_t *, td_vbd_t *);
 };
 
 struct td_sector_count {
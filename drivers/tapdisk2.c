@@ -29,6 +29,7 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-server.h"
 #include "tapdisk-control.h"
+#include "tapdisk-blktap.h"
 
 void tdnbd_fdreceiver_start();
 void tdnbd_fdreceiver_stop();
@@ -36,7 +37,9 @@ void tdnbd_fdreceiver_stop();
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s <-u uuid> <-c control socket> "
+		"[-t worker threads] [-a cpu list] "
+		"[-m coalesce usecs[:batch]]\n", app);
 	exit(err);
 }
 
@@ -68,18 +71,30 @@ fail:
 int
 main(int argc, char *argv[])
 {
-	char *control;
-	int c, err, nodaemon;
+	char *control, *cpus, *coalesce;
+	int c, err, nodaemon, workers;
 	FILE *out;
 
 	control  = NULL;
+	cpus     = NULL;
+	coalesce = NULL;
 	nodaemon = 0;
+	workers  = 0;
 
-	while ((c = getopt(argc, argv, "Dh")) != -1) {
+	while ((c = getopt(argc, argv, "Dht:a:m:")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 't':
+			workers = atoi(optarg);
+			break;
+		case 'a':
+			cpus = optarg;
+			break;
+		case 'm':
+			coalesce = optarg;
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -97,6 +112,24 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	err = tapdisk_server_set_workers(workers, cpus);
+	if (err) {
+		DPRINTF("bad worker configuration: %d\n", err);
+		goto out;
+	}
+
+	if (coalesce) {
+		unsigned int usecs = 0, batch = 0;
+
+		sscanf(coalesce, "%u:%u", &usecs, &batch);
+
+		err = tapdisk_blktap_set_moderation(usecs, batch);
+		if (err) {
+			DPRINTF("bad coalescing parameters: %d\n", err);
+			goto out;
+		}
+	}
+
 	out = fdup(stdout, "w");
 	if (!out) {
 		err = -errno;
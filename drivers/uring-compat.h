@@ -0,0 +1,66 @@
+/* 
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __URING_COMPAT
+#define __URING_COMPAT
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Thin wrappers for the io_uring syscalls, so we don't depend on
+ * liburing. The kernel headers are enough to get the ABI.
+ */
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup    __NR_io_uring_setup
+#endif
+#ifndef SYS_io_uring_enter
+#define SYS_io_uring_enter    __NR_io_uring_enter
+#endif
+#ifndef SYS_io_uring_register
+#define SYS_io_uring_register __NR_io_uring_register
+#endif
+
+static inline int
+__io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static inline int
+__io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		 unsigned flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, _NSIG / 8);
+}
+
+static inline int
+__io_uring_register(int fd, unsigned opcode, const void *arg,
+		    unsigned nr_args)
+{
+	return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#define __uring_load_acquire(_p)       __atomic_load_n(_p, __ATOMIC_ACQUIRE)
+#define __uring_store_release(_p, _v)  __atomic_store_n(_p, _v, __ATOMIC_RELEASE)
+
+#endif /* __URING_COMPAT */
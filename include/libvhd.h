@@ -63,6 +63,7 @@
 #define VHD_OPEN_IGNORE_DISABLED   0x00010
 #define VHD_OPEN_CACHED            0x00020
 #define VHD_OPEN_IO_WRITE_SPARSE   0x00040
+#define VHD_OPEN_META_LOG          0x00080
 
 #define VHD_FLAG_CREAT_FILE_SIZE_FIXED   0x00001
 #define VHD_FLAG_CREAT_PARENT_RAW        0x00002
@@ -296,6 +297,8 @@ int vhd_set_virt_size(vhd_context_t *, uint64_t);
 int vhd_bitmap_test(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_set(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_clear(vhd_context_t *, char *, uint32_t);
+uint32_t vhd_bitmap_run(vhd_context_t *, const char *,
+			uint32_t start, uint32_t end, int value);
 
 int vhd_initialize_header_parent_name(vhd_context_t *, const char *);
 int vhd_write_parent_locators(vhd_context_t *, const char *);
@@ -36,11 +36,15 @@
 #define TAPDISK_MESSAGE_FLAG_REUSE_PRT   0x040
 #define TAPDISK_MESSAGE_FLAG_SECONDARY   0x080
 #define TAPDISK_MESSAGE_FLAG_STANDBY     0x100
+#define TAPDISK_MESSAGE_FLAG_LAZY_BAT    0x200
+#define TAPDISK_MESSAGE_FLAG_META_LOG    0x400
+#define TAPDISK_MESSAGE_FLAG_WRITE_BACK  0x800
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint32_t                         tapdisk_message_flag_t;
 typedef struct tapdisk_message_image     tapdisk_message_image_t;
 typedef struct tapdisk_message_params    tapdisk_message_params_t;
+typedef struct tapdisk_message_tune      tapdisk_message_tune_t;
 typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
@@ -58,6 +62,22 @@ struct tapdisk_message_params {
 	char                             secondary[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+/*
+ * Sent ahead of OPEN, only if any field is set. Zero keeps the
+ * default. Applies to the next open of the vbd and is dropped on
+ * close.
+ */
+struct tapdisk_message_tune {
+	uint16_t                         queue_depth;
+	uint16_t                         prealloc; /* blocks, leaf only */
+	uint16_t                         prealloc_low;
+	uint16_t                         __pad;
+	uint32_t                         max_request_size; /* bytes */
+	uint32_t                         cache_size; /* bytes, per image */
+	uint32_t                         lcache_size; /* MiB, read cache
+						       * in the leaf */
+};
+
 struct tapdisk_message_image {
 	uint64_t                         sectors;
 	uint32_t                         sector_size;
@@ -100,6 +120,7 @@ struct tapdisk_message {
 		pid_t                    tapdisk_pid;
 		tapdisk_message_image_t  image;
 		tapdisk_message_params_t params;
+		tapdisk_message_tune_t   tune;
 		tapdisk_message_string_t string;
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
@@ -133,9 +154,11 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_STATS_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_TUNE,
+	TAPDISK_MESSAGE_TUNE_RSP,
 };
 
-#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_EXIT
+#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_TUNE_RSP
 
 static inline char *
 tapdisk_message_name(enum tapdisk_message_id id)
@@ -210,6 +233,12 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_TUNE:
+		return "tune";
+
+	case TAPDISK_MESSAGE_TUNE_RSP:
+		return "tune response";
+
 	default:
 		return "unknown";
 	}
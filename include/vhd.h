@@ -129,7 +129,8 @@ struct dd_hdr {
   uint32_t    res1;            /* Reserved.                                    */
   char        prt_name[512];   /* Parent unicode name.                         */
   struct prt_loc loc[8];  /* Parent locator entries.                      */
-  char        res2[256];       /* Reserved.                                    */
+  char        meta_log;        /* tapdisk-specific field: metadata log pending?*/
+  char        res2[255];       /* Reserved.                                    */
 };
 
 /* VHD cookie string. */
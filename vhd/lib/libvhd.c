@@ -588,6 +588,86 @@ vhd_bitmap_clear(vhd_context_t *ctx, char *map, uint32_t block)
 	return clear_bit(map, block);
 }
 
+/*
+ * Bit runs, a word at a time. Current bitmaps number bits from the most
+ * significant bit of each byte, so reading 8 bytes as a big-endian word
+ * keeps bit order, and the first differing bit is the leading set bit
+ * once the run's value is xor'ed out. Words are loaded from the byte
+ * holding the first bit; the tail that no longer fills a word is done
+ * a byte at a time, so nothing past the map is read.
+ */
+static uint32_t
+__bitmap_run(const char *map, uint32_t start, uint32_t end, int value)
+{
+	const uint8_t *p = (const uint8_t *)map;
+	uint64_t flip = value ? ~0ULL : 0, w;
+	uint32_t bit = start, shift;
+	uint8_t c;
+
+	while (bit < end) {
+		shift = bit & 7;
+
+		if (((end + 7) >> 3) - (bit >> 3) >= sizeof(w)) {
+			memcpy(&w, p + (bit >> 3), sizeof(w));
+			w = (be64toh(w) ^ flip) << shift;
+			if (w) {
+				bit += __builtin_clzll(w);
+				break;
+			}
+			bit += 64 - shift;
+		} else {
+			c = (uint8_t)((p[bit >> 3] ^ (uint8_t)flip) << shift);
+			if (c) {
+				bit += __builtin_clz(c) - 24;
+				break;
+			}
+			bit += 8 - shift;
+		}
+	}
+
+	return MIN(bit, end) - start;
+}
+
+/*
+ * Version 0.1 bitmaps count from the least significant bit of host
+ * order 32 bit words.
+ */
+static uint32_t
+__old_bitmap_run(const char *map, uint32_t start, uint32_t end, int value)
+{
+	const uint32_t *p = (const uint32_t *)map;
+	uint32_t flip = value ? ~0U : 0, bit = start, w;
+
+	while (bit < end) {
+		w = (p[bit >> 5] ^ flip) >> (bit & 31);
+		if (w) {
+			bit += __builtin_ctz(w);
+			break;
+		}
+		bit = (bit | 31) + 1;
+	}
+
+	return MIN(bit, end) - start;
+}
+
+/*
+ * Number of consecutive bits equal to @value, starting at bit @start
+ * and not going past @end.
+ */
+uint32_t
+vhd_bitmap_run(vhd_context_t *ctx, const char *map,
+	       uint32_t start, uint32_t end, int value)
+{
+	if (start >= end)
+		return 0;
+
+	if (vhd_creator_tapdisk(ctx) &&
+	    ctx->footer.crtr_ver == 0x00000001)
+		return __old_bitmap_run(map, start, end, !!value);
+
+	return __bitmap_run(map, start, end, !!value);
+}
+
 /*
  * returns absolute offset of the first 
  * byte of the file which is not vhd metadata
@@ -2478,6 +2558,26 @@ out:
 	return err;
 }
 
+/*
+ * tapdisk may log bat and bitmap updates next to a dynamic image, and
+ * flags the header while it does. Until the log is replayed, metadata
+ * on disk may be stale. Only opens that deal with the log themselves,
+ * or that inspect images in any state, get through.
+ */
+static int
+vhd_check_meta_log(vhd_context_t *ctx, int flags)
+{
+	if (!vhd_type_dynamic(ctx) || !ctx->header.meta_log)
+		return 0;
+
+	if (flags & (VHD_OPEN_META_LOG | VHD_OPEN_IGNORE_DISABLED))
+		return 0;
+
+	VHDLOG("%s: metadata log pending, open it with tapdisk first\n",
+	       ctx->file);
+	return -EBUSY;
+}
+
 int
 vhd_open(vhd_context_t *ctx, const char *file, int flags)
 {
@@ -2520,6 +2620,10 @@ vhd_open(vhd_context_t *ctx, const char *file, int flags)
 		if (err)
 			goto fail;
 
+		err = vhd_check_meta_log(ctx, flags);
+		if (err)
+			goto fail;
+
 		return 0;
 	}
 
@@ -2545,6 +2649,10 @@ vhd_open(vhd_context_t *ctx, const char *file, int flags)
 
 		ctx->spb     = ctx->header.block_size >> VHD_SECTOR_SHIFT;
 		ctx->bm_secs = secs_round_up_no_zero(ctx->spb >> 3);
+
+		err = vhd_check_meta_log(ctx, flags);
+		if (err)
+			goto fail;
 	}
 
 	err = vhd_cache_load(ctx);
@@ -342,6 +342,9 @@ vhd_util_check_validate_header(int fd, vhd_header_t *header)
 	if (header->res1)
 		return "invalid reserved bits";
 
+	if (header->meta_log)
+		return "metadata log pending";
+
 	if (vhd_util_check_zeros(header->res2, sizeof(header->res2)))
 		return "invalid reserved bits";
 
@@ -686,7 +689,7 @@ static int
 vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 		      vhd_context_t *vhd, uint32_t block)
 {
-	int err, i;
+	int err, i, j, n;
 	uint64_t sector;
 	char *bitmap, *data;
 
@@ -708,21 +711,29 @@ vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 		}
 	}
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (ctx->opts.collect_stats &&
-		    vhd_bitmap_test(vhd, bitmap, i)) {
-			ctx_cur_stats(ctx)->secs_written++;
-			set_bit_u64(ctx_cur_stats(ctx)->bitmap, sector + i);
+	/* alternate runs of written and unwritten sectors */
+	for (i = 0; i < vhd->spb; i += n) {
+		n = vhd_bitmap_run(vhd, bitmap, i, vhd->spb, 1);
+
+		if (ctx->opts.collect_stats) {
+			ctx_cur_stats(ctx)->secs_written += n;
+			for (j = i; j < i + n; j++)
+				set_bit_u64(ctx_cur_stats(ctx)->bitmap,
+					    sector + j);
 		}
 
-		if (ctx->opts.check_data) {
-			char *buf = data + (i << VHD_SECTOR_SHIFT);
-			int set   = vhd_util_check_zeros(buf, VHD_SECTOR_SIZE);
-			int map   = vhd_bitmap_test(vhd, bitmap, i);
+		i += n;
+		n  = vhd_bitmap_run(vhd, bitmap, i, vhd->spb, 0);
+
+		if (!ctx->opts.check_data)
+			continue;
+
+		for (j = i; j < i + n; j++) {
+			char *buf = data + (j << VHD_SECTOR_SHIFT);
 
-			if (set && !map) {
+			if (vhd_util_check_zeros(buf, VHD_SECTOR_SIZE)) {
 				printf("sector 0x%x of block 0x%x has data "
-				       "where bitmap is clear\n", i, block);
+				       "where bitmap is clear\n", j, block);
 				err = -EINVAL;
 			}
 		}
@@ -91,13 +91,12 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 	if (err)
 		goto done;
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+	for (i = 0; i < vhd->spb; i += secs) {
+		i += vhd_bitmap_run(vhd, map, i, vhd->spb, 0);
+		if (i >= vhd->spb)
+			break;
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
-				break;
+		secs = vhd_bitmap_run(vhd, map, i, vhd->spb, 1);
 
 		if (parent->file)
 			err = vhd_io_write(parent,
@@ -109,8 +108,6 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 					     sec + i, secs);
 		if (err)
 			goto done;
-
-		i += secs;
 	}
 
 	err = 0;
@@ -388,7 +385,7 @@ vhd_util_coalesce_clear_bitmap(vhd_context_t *child, char *cmap,
 			       vhd_context_t *ancestor, const uint64_t block)
 {
 	char *amap = NULL;
-	int i, dirty, err;
+	int i, j, n, dirty, err;
 
 	if (child->spb != ancestor->spb) {
 		err = -EINVAL;
@@ -405,13 +402,15 @@ vhd_util_coalesce_clear_bitmap(vhd_context_t *child, char *cmap,
 	if (err)
 		goto out;
 
-	for (i = 0; i < child->spb; i++) {
-		if (vhd_bitmap_test(child, cmap, i)) {
-			if (vhd_bitmap_test(ancestor, amap, i)) {
+	for (i = 0; i < child->spb; i += n) {
+		i += vhd_bitmap_run(child, cmap, i, child->spb, 0);
+		n  = vhd_bitmap_run(child, cmap, i, child->spb, 1);
+
+		for (j = i; j < i + n; j++)
+			if (vhd_bitmap_test(ancestor, amap, j)) {
 				dirty = 1;
-				vhd_bitmap_clear(ancestor, amap, i);
+				vhd_bitmap_clear(ancestor, amap, j);
 			}
-		}
 	}
 
 	if (dirty) {
@@ -504,9 +504,9 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 			 int hex)
 {
 	char *buf;
-	uint64_t cur;
-	int i, err, bit;
-	uint32_t blk, bm_blk, sec;
+	uint64_t cur, last;
+	int err, bit;
+	uint32_t blk, bm_blk, sec, end, n;
 	int64_t s, r;
 
 	if (vhd_sectors_to_bytes(sector + count) > vhd->footer.curr_size) {
@@ -518,11 +518,12 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 	buf    = NULL;
 	s = -1;
 	r = 0;
+	last = sector + count;
 
-	for (i = 0; i < count; i++) {
-		cur = sector + i;
+	for (cur = sector; cur < last; cur += n) {
 		blk = cur / vhd->spb;
 		sec = cur % vhd->spb;
+		end = MIN(vhd->spb, sec + (last - cur));
 
 		if (blk != bm_blk) {
 			bm_blk = blk;
@@ -536,15 +537,18 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 			}
 		}
 
-		if (vhd->bat.bat[blk] == DD_BLK_UNUSED)
+		if (vhd->bat.bat[blk] == DD_BLK_UNUSED) {
 			bit = 0;
-		else
+			n   = end - sec;
+		} else {
 			bit = vhd_bitmap_test(vhd, buf, sec);
+			n   = vhd_bitmap_run(vhd, buf, sec, end, bit);
+		}
 
 		if (bit) {
 			if (r == 0)
 				s = cur;
-			r++;
+			r += n;
 		} else {
 			if (r > 0) {
 				printf("%s ", conv(hex, s));
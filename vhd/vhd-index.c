@@ -284,8 +284,9 @@ vhd_index_clone_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
 		goto out;
 
 	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+		i += vhd_bitmap_run(vhd, map, i, vhd->spb, 0);
+		if (i >= vhd->spb)
+			break;
 
 		err = vhd_offset(vhd, (uint64_t)block * vhd->spb + i, &off);
 		if (err)
@@ -345,8 +346,9 @@ vhd_index_update_bat_entry(vhdi_name_t *name, vhdi_context_t *vhdi,
 		goto out;
 
 	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+		i += vhd_bitmap_run(vhd, map, i, vhd->spb, 0);
+		if (i >= vhd->spb)
+			break;
 
 		err = vhd_offset(vhd, (uint64_t)block * vhd->spb + i, &off);
 		if (err)